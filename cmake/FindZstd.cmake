@@ -0,0 +1,48 @@
+# Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+#
+# This file is part of the Trojita Qt IMAP e-mail client,
+# http://trojita.flaska.net/
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation; either version 2 of
+# the License or (at your option) version 3 or any later version
+# accepted by the membership of KDE e.V. (or its successor approved
+# by the membership of KDE e.V.), which shall act as a proxy
+# defined in Section 14 of version 3 of the license.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# - Try to find the zstd library
+# Once done this will define
+#  ZSTD_FOUND - System has zstd
+#  ZSTD_INCLUDE_DIRS - The zstd include directories
+#  ZSTD_LIBRARIES - The libraries needed to use zstd
+
+find_package(PkgConfig)
+pkg_check_modules(PC_ZSTD QUIET libzstd)
+
+find_path(ZSTD_INCLUDE_DIR zstd.h
+          HINTS ${PC_ZSTD_INCLUDEDIR} ${PC_ZSTD_INCLUDE_DIRS})
+
+find_library(ZSTD_LIBRARY NAMES zstd libzstd
+             HINTS ${PC_ZSTD_LIBDIR} ${PC_ZSTD_LIBRARY_DIRS})
+
+set(ZSTD_LIBRARIES ${ZSTD_LIBRARY})
+set(ZSTD_INCLUDE_DIRS ${ZSTD_INCLUDE_DIR})
+
+include(FindPackageHandleStandardArgs)
+# handle the QUIETLY and REQUIRED arguments and set ZSTD_FOUND to TRUE
+# if all listed variables are TRUE
+find_package_handle_standard_args(Zstd DEFAULT_MSG
+                                  ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
+
+set(Zstd_FOUND ${ZSTD_FOUND})
+
+mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
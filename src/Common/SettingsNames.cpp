@@ -68,6 +68,11 @@ const QString SettingsNames::obsImapStartOffline = QStringLiteral("imap.offline"
 const QString SettingsNames::obsImapSslPemCertificate = QStringLiteral("imap.ssl.pemCertificate");
 const QString SettingsNames::imapSslPemPubKey = QStringLiteral("imap.ssl.pemPubKey");
 const QString SettingsNames::imapBlacklistedCapabilities = QStringLiteral("imap.capabilities.blacklist");
+const QString SettingsNames::imapMaxConnections = QStringLiteral("imap.maxConnections");
+const QString SettingsNames::imapFastReconnect = QStringLiteral("imap.fastReconnect");
+const QString SettingsNames::imapRememberedCapsServer = QStringLiteral("imap.capabilities.remembered.server");
+const QString SettingsNames::imapRememberedCapsPreAuth = QStringLiteral("imap.capabilities.remembered.preauth");
+const QString SettingsNames::imapRememberedCapsPostAuth = QStringLiteral("imap.capabilities.remembered.postauth");
 const QString SettingsNames::imapUseSystemProxy = QStringLiteral("imap.proxy.system");
 const QString SettingsNames::imapNeedsNetwork = QStringLiteral("imap.needsNetwork");
 const QString SettingsNames::imapNumberRefreshInterval = QStringLiteral("imap.numberRefreshInterval");
@@ -83,6 +88,8 @@ const QString SettingsNames::cacheOfflineNone = QStringLiteral("memory");
 const QString SettingsNames::cacheOfflineXDays = QStringLiteral("days");
 const QString SettingsNames::cacheOfflineAll = QStringLiteral("all");
 const QString SettingsNames::cacheOfflineNumberDaysKey = QStringLiteral("offline.cache.numDays");
+const QString SettingsNames::cacheOfflineSizeBudgetKey = QStringLiteral("offline.cache.sizeBudget");
+const QString SettingsNames::cacheMemoryPartBudgetKey = QStringLiteral("offline.memoryCache.partBudget");
 const QString SettingsNames::watchedFoldersKey = QStringLiteral("watchFolders");
 const QString SettingsNames::watchOnlyInbox = QStringLiteral("INBOX");
 const QString SettingsNames::watchSubscribed = QStringLiteral("subscribed");
@@ -117,6 +124,8 @@ const QString SettingsNames::spellcheckerPlugin = QStringLiteral("plugin/spellch
 const QString SettingsNames::imapIdleRenewal = QStringLiteral("imapIdleRenewal");
 const QString SettingsNames::autoMarkReadEnabled = QStringLiteral("autoMarkRead/enabled");
 const QString SettingsNames::autoMarkReadSeconds = QStringLiteral("autoMarkRead/seconds");
+const QString SettingsNames::prefetchMessagesCount = QStringLiteral("prefetch/messages");
+const QString SettingsNames::prefetchByteBudget = QStringLiteral("prefetch/byteBudget");
 const QString SettingsNames::interopRevealVersions = QStringLiteral("interoperability/revealVersions");
 const QString SettingsNames::completeMessageWidgetGeometry = QStringLiteral("gui/completeMessageWidgetGeometry");
 const QString SettingsNames::mboxDropAction = QStringLiteral("gui/mboxList.dropAction");
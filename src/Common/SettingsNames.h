@@ -37,11 +37,13 @@ struct SettingsNames {
     static const QString imapMethodKey, methodTCP, methodSSL, methodProcess, imapHostKey,
            imapPortKey, imapStartTlsKey, imapUserKey, imapProcessKey, imapStartMode, netOffline, netExpensive, netOnline,
            obsImapStartOffline, obsImapSslPemCertificate, imapSslPemPubKey,
-           imapBlacklistedCapabilities, imapUseSystemProxy, imapNeedsNetwork, imapNumberRefreshInterval,
+           imapBlacklistedCapabilities, imapMaxConnections, imapFastReconnect, imapRememberedCapsServer,
+           imapRememberedCapsPreAuth, imapRememberedCapsPostAuth, imapUseSystemProxy, imapNeedsNetwork, imapNumberRefreshInterval,
            imapAccountIcon, imapArchiveFolderName, imapDefaultArchiveFolderName;
     static const QString composerSaveToImapKey, composerImapSentKey, smtpUseBurlKey;
     static const QString cacheMetadataKey, cacheMetadataMemory,
-           cacheOfflineKey, cacheOfflineNone, cacheOfflineXDays, cacheOfflineAll, cacheOfflineNumberDaysKey;
+           cacheOfflineKey, cacheOfflineNone, cacheOfflineXDays, cacheOfflineAll, cacheOfflineNumberDaysKey,
+           cacheOfflineSizeBudgetKey, cacheMemoryPartBudgetKey;
     static const QString watchedFoldersKey, watchOnlyInbox, watchSubscribed, watchAll;
     static const QString xtConnectCacheDirectory, xtSyncMailboxList, xtDbHost, xtDbPort,
            xtDbDbName, xtDbUser;
@@ -59,6 +61,7 @@ struct SettingsNames {
     static const QString addressbookPlugin, passwordPlugin, spellcheckerPlugin;
     static const QString imapIdleRenewal;
     static const QString autoMarkReadEnabled, autoMarkReadSeconds;
+    static const QString prefetchMessagesCount, prefetchByteBudget;
     static const QString interopRevealVersions;
     static const QString completeMessageWidgetGeometry;
     static const QString mboxDropAction;
@@ -25,6 +25,7 @@
 #include <QApplication>
 #include <QCheckBox>
 #include <QFrame>
+#include <QLabel>
 #include <QMenu>
 #include <QTimer>
 #include <QToolButton>
@@ -55,6 +56,11 @@ MessageListWidget::MessageListWidget(QWidget *parent, Imap::Mailbox::FavoriteTag
                                      "Experts who have read RFC3501 can use the <code>:=</code> prefix and switch to a raw IMAP mode."));
     m_queryPlaceholder = tr("<query>");
 
+    // The messages stay usable as a flat list while the threads of a big mailbox are being built
+    m_threadingIndicator = new QLabel(tr("Threading..."), this);
+    m_threadingIndicator->setToolTip(tr("The messages will be arranged into threads as soon as possible."));
+    m_threadingIndicator->setVisible(false);
+
     connect(m_quickSearchText, &QLineEdit::returnPressed, this, &MessageListWidget::slotApplySearch);
     connect(m_quickSearchText, &QLineEdit::textChanged, this, &MessageListWidget::slotConditionalSearchReset);
     connect(m_quickSearchText, &QLineEdit::cursorPositionChanged, this, &MessageListWidget::slotUpdateSearchCursor);
@@ -115,6 +121,7 @@ MessageListWidget::MessageListWidget(QWidget *parent, Imap::Mailbox::FavoriteTag
     layout->setSpacing(0);
     layout->setContentsMargins(0, 0, 0, 0);
     layout->addWidget(m_quickSearchText);
+    layout->addWidget(m_threadingIndicator);
     layout->addWidget(tree);
 
     m_searchResetTimer = new QTimer(this);
@@ -143,6 +150,8 @@ void MessageListWidget::focusRawSearch()
 
 void MessageListWidget::slotApplySearch()
 {
+    // The server's answer is authoritative, the local preview would only hide some of its results
+    emit quickFilterChanged(QString());
     emit requestingSearch(searchConditions());
 }
 
@@ -176,12 +185,22 @@ void MessageListWidget::slotResetSortingFailed()
     m_quickSearchText->setPalette(QPalette());
 }
 
+void MessageListWidget::slotThreadingInProgressChanged(bool inProgress)
+{
+    m_threadingIndicator->setVisible(inProgress);
+}
+
 void MessageListWidget::slotConditionalSearchReset()
 {
     if (m_quickSearchText->text().isEmpty())
         m_searchResetTimer->start(250);
     else
         m_searchResetTimer->stop();
+
+    if (m_rawSearch->isChecked() && m_quickSearchText->text().startsWith(QLatin1String(":=")))
+        emit quickFilterChanged(QString());
+    else
+        emit quickFilterChanged(m_quickSearchText->text());
 }
 
 void MessageListWidget::slotUpdateSearchCursor()
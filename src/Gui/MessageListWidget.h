@@ -27,6 +27,7 @@
 #include "Imap/Model/FavoriteTagsModel.h"
 
 class LineEdit;
+class QLabel;
 class QTimer;
 class QToolButton;
 
@@ -56,11 +57,14 @@ public slots:
 signals:
     void requestingSearch(const QStringList &conditions);
     void rawSearchSettingChanged(bool enabled);
+    /** @short The text which can be matched against the already known messages while the user is still typing */
+    void quickFilterChanged(const QString &text);
 
 protected slots:
     void slotApplySearch();
     void slotAutoEnableDisableSearch();
     void slotSortingFailed();
+    void slotThreadingInProgressChanged(bool inProgress);
 
 private slots:
     void slotComplexSearchInput(QAction*);
@@ -71,6 +75,7 @@ private slots:
 
 private:
     LineEdit *m_quickSearchText;
+    QLabel *m_threadingIndicator;
     QAction *m_searchOptions;
     QAction *m_searchInSubject;
     QAction *m_searchInBody;
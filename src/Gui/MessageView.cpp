@@ -45,6 +45,7 @@
 #include "Gui/UserAgentWebPage.h"
 #include "Gui/Window.h"
 #include "Imap/Model/MailboxTree.h"
+#include "Imap/Model/MessagePrefetcher.h"
 #include "Imap/Model/MsgListModel.h"
 #include "Imap/Model/NetworkWatcher.h"
 #include "Imap/Model/Utils.h"
@@ -61,6 +62,7 @@ MessageView::MessageView(QWidget *parent, QSettings *settings, Plugins::PluginMa
     , m_stack(new QStackedLayout(this))
     , messageModel(0)
     , netAccess(new Imap::Network::MsgPartNetAccessManager(this))
+    , m_prefetcher(new Imap::Mailbox::MessagePrefetcher(this))
     , factory(new PartWidgetFactory(netAccess, this,
                                     std::unique_ptr<PartWidgetFactoryVisitor>(new PartWidgetFactoryVisitor())))
     , m_settings(settings)
@@ -68,6 +70,8 @@ MessageView::MessageView(QWidget *parent, QSettings *settings, Plugins::PluginMa
 {
     connect(netAccess, &Imap::Network::MsgPartNetAccessManager::requestingExternal, this, &MessageView::externalsRequested);
 
+    m_prefetcher->setLookahead(m_settings->value(Common::SettingsNames::prefetchMessagesCount, QVariant(3)).toInt());
+    m_prefetcher->setByteBudget(m_settings->value(Common::SettingsNames::prefetchByteBudget, QVariant(512 * 1024)).toULongLong());
 
     setBackgroundRole(QPalette::Base);
     setForegroundRole(QPalette::Text);
@@ -199,6 +203,9 @@ void MessageView::setMessage(const QModelIndex &index)
 
     unsetPreviousMessage();
 
+    // This has to see the proxy index so that it walks the messages in the same order as the user does
+    m_prefetcher->messageOpened(index);
+
     message = messageIndex;
     messageModel = new Cryptography::MessageModel(this, message);
     messageModel->setObjectName(QStringLiteral("cryptoMessageModel-%1-%2")
@@ -518,6 +525,11 @@ Plugins::PluginManager *MessageView::pluginManager() const
     return m_pluginManager;
 }
 
+Imap::Mailbox::MessagePrefetcher *MessageView::prefetcher() const
+{
+    return m_prefetcher;
+}
+
 /** @short Callback for AbstractPartWidget */
 void MessageView::triggerSearchDialogBy(EmbeddedWebView *w)
 {
@@ -52,6 +52,7 @@ namespace Message {
 class Envelope;
 }
 namespace Mailbox {
+class MessagePrefetcher;
 class NetworkWatcher;
 }
 }
@@ -89,6 +90,7 @@ public:
     void forward(MainWindow *mainWindow, const Composer::ForwardMode mode);
     QModelIndex currentMessage() const;
     Plugins::PluginManager *pluginManager() const;
+    Imap::Mailbox::MessagePrefetcher *prefetcher() const;
 public slots:
     void setMessage(const QModelIndex &index);
     void setEmpty();
@@ -138,6 +140,7 @@ private:
     QPersistentModelIndex message;
     Cryptography::MessageModel *messageModel;
     Imap::Network::MsgPartNetAccessManager *netAccess;
+    Imap::Mailbox::MessagePrefetcher *m_prefetcher;
     QPointer<Imap::Mailbox::NetworkWatcher> m_netWatcher;
     QTimer *markAsReadTimer;
     QWidget *m_bodyWidget;
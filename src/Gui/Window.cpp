@@ -63,6 +63,7 @@
 #endif
 #include "Imap/Model/ImapAccess.h"
 #include "Imap/Model/MailboxTree.h"
+#include "Imap/Model/MessagePrefetcher.h"
 #include "Imap/Model/Model.h"
 #include "Imap/Model/ModelWatcher.h"
 #include "Imap/Model/MsgListModel.h"
@@ -888,6 +889,8 @@ void MainWindow::setupModels()
     prettyMboxModel->setObjectName(QStringLiteral("prettyMboxModel"));
     connect(realThreadingModel, &Imap::Mailbox::ThreadingMsgListModel::sortingFailed,
             msgListWidget, &MessageListWidget::slotSortingFailed);
+    connect(realThreadingModel, &Imap::Mailbox::ThreadingMsgListModel::threadingInProgressChanged,
+            msgListWidget, &MessageListWidget::slotThreadingInProgressChanged);
     prettyMsgListModel = new Imap::Mailbox::PrettyMsgListModel(this);
     prettyMsgListModel->setSourceModel(m_imapAccess->threadingMsgListModel());
     prettyMsgListModel->setObjectName(QStringLiteral("prettyMsgListModel"));
@@ -951,6 +954,7 @@ void MainWindow::setupModels()
     connect(imapModel(), &Imap::Mailbox::Model::messageCountPossiblyChanged, this, &MainWindow::slotUpdateWindowTitle);
 
     connect(prettyMsgListModel, &Imap::Mailbox::PrettyMsgListModel::sortingPreferenceChanged, this, &MainWindow::slotSortingConfirmed);
+    connect(msgListWidget, &MessageListWidget::quickFilterChanged, prettyMsgListModel, &Imap::Mailbox::PrettyMsgListModel::setQuickFilter);
 
     //Imap::Mailbox::ModelWatcher* w = new Imap::Mailbox::ModelWatcher( this );
     //w->setModel( imapModel() );
@@ -1140,26 +1144,6 @@ bool MainWindow::eventFilter(QObject *o, QEvent *e)
         }
         return false;
     }
-    if (msgListWidget && msgListWidget->tree && o == msgListWidget->tree->header()->viewport()) {
-        // installed if sorting is not really possible.
-        QWidget *header = static_cast<QWidget*>(o);
-        QMouseEvent *mouse = static_cast<QMouseEvent*>(e);
-        if (e->type() == QEvent::MouseButtonPress) {
-            if (mouse->button() == Qt::LeftButton && header->cursor().shape() == Qt::ArrowCursor) {
-                m_headerDragStart = mouse->pos();
-            }
-            return false;
-        }
-        if (e->type() == QEvent::MouseButtonRelease) {
-            if (mouse->button() == Qt::LeftButton && header->cursor().shape() == Qt::ArrowCursor &&
-               (m_headerDragStart - mouse->pos()).manhattanLength() < QApplication::startDragDistance()) {
-                    m_actionSortDescending->toggle();
-                    Qt::SortOrder order = m_actionSortDescending->isChecked() ? Qt::DescendingOrder : Qt::AscendingOrder;
-                    msgListWidget->tree->header()->setSortIndicator(-1, order);
-                    return true; // prevent regular click
-            }
-        }
-    }
     return false;
 }
 
@@ -1555,6 +1539,7 @@ void MainWindow::handleMarkAsRead(bool value)
 void MainWindow::slotNextUnread()
 {
     QModelIndex current = msgListWidget->tree->currentIndex();
+    m_messageWidget->messageView->prefetcher()->setDirection(Imap::Mailbox::MessagePrefetcher::Direction::FORWARD);
 
     UiUtils::gotoNext(msgListWidget->tree->model(), current,
     [](const QModelIndex &idx) { return !idx.data(Imap::Mailbox::RoleMessageIsMarkedRead).toBool(); },
@@ -1571,6 +1556,7 @@ void MainWindow::slotNextUnread()
 void MainWindow::slotPreviousUnread()
 {
     QModelIndex current = msgListWidget->tree->currentIndex();
+    m_messageWidget->messageView->prefetcher()->setDirection(Imap::Mailbox::MessagePrefetcher::Direction::BACKWARD);
 
     UiUtils::gotoPrevious(msgListWidget->tree->model(), current,
     [](const QModelIndex &idx) { return !idx.data(Imap::Mailbox::RoleMessageIsMarkedRead).toBool(); },
@@ -1994,15 +1980,17 @@ MSA::MSAFactory *MainWindow::msaFactory()
     QString method = m_settings->value(SettingsNames::msaMethodKey).toString();
     MSA::MSAFactory *msaFactory = 0;
     if (method == SettingsNames::methodSMTP || method == SettingsNames::methodSSMTP) {
-        msaFactory = new MSA::SMTPFactory(m_settings->value(SettingsNames::smtpHostKey).toString(),
-                                          m_settings->value(SettingsNames::smtpPortKey).toInt(),
-                                          (method == SettingsNames::methodSSMTP),
-                                          (method == SettingsNames::methodSMTP)
-                                          && m_settings->value(SettingsNames::smtpStartTlsKey).toBool(),
-                                          m_settings->value(SettingsNames::smtpAuthKey).toBool(),
-                                          m_settings->value(SettingsNames::smtpAuthReuseImapCredsKey, false).toBool() ?
-                                              m_settings->value(SettingsNames::imapUserKey).toString() :
-                                              m_settings->value(SettingsNames::smtpUserKey).toString());
+        auto smtpFactory = new MSA::SMTPFactory(m_settings->value(SettingsNames::smtpHostKey).toString(),
+                                                m_settings->value(SettingsNames::smtpPortKey).toInt(),
+                                                (method == SettingsNames::methodSSMTP),
+                                                (method == SettingsNames::methodSMTP)
+                                                && m_settings->value(SettingsNames::smtpStartTlsKey).toBool(),
+                                                m_settings->value(SettingsNames::smtpAuthKey).toBool(),
+                                                m_settings->value(SettingsNames::smtpAuthReuseImapCredsKey, false).toBool() ?
+                                                    m_settings->value(SettingsNames::imapUserKey).toString() :
+                                                    m_settings->value(SettingsNames::smtpUserKey).toString());
+        smtpFactory->setTlsSessionCache(m_imapAccess->tlsSessionCache());
+        msaFactory = smtpFactory;
     } else if (method == SettingsNames::methodSENDMAIL) {
         QStringList args = m_settings->value(SettingsNames::sendmailKey, SettingsNames::sendmailDefaultCmd).toString().split(QLatin1Char(' '));
         if (args.isEmpty()) {
@@ -2449,13 +2437,8 @@ void MainWindow::slotHideRead()
 
 void MainWindow::slotCapabilitiesUpdated(const QStringList &capabilities)
 {
-    msgListWidget->tree->header()->viewport()->removeEventFilter(this);
-    if (capabilities.contains(QStringLiteral("SORT"))) {
-        m_actionSortByDate->actionGroup()->setEnabled(true);
-    } else {
-        m_actionSortByDate->actionGroup()->setEnabled(false);
-        msgListWidget->tree->header()->viewport()->installEventFilter(this);
-    }
+    // Without SORT, the ThreadingMsgListModel sorts the cached envelopes locally
+    m_actionSortByDate->actionGroup()->setEnabled(true);
 
     msgListWidget->setFuzzySearchSupported(capabilities.contains(QStringLiteral("SEARCH=FUZZY")));
 
@@ -2465,16 +2448,10 @@ void MainWindow::slotCapabilitiesUpdated(const QStringList &capabilities)
                                                Common::SettingsNames::guiMailboxListShowOnlySubscribed, false).toBool());
     m_actionSubscribeMailbox->setEnabled(m_actionShowOnlySubscribed->isEnabled());
 
-    const QStringList supportedCapabilities = Imap::Mailbox::ThreadingMsgListModel::supportedCapabilities();
-    Q_FOREACH(const QString &capability, capabilities) {
-        if (supportedCapabilities.contains(capability)) {
-            actionThreadMsgList->setEnabled(true);
-            if (actionThreadMsgList->isChecked())
-                slotThreadMsgList();
-            return;
-        }
-    }
-    actionThreadMsgList->setEnabled(false);
+    // Without any of the ThreadingMsgListModel::supportedCapabilities(), the threads are computed locally
+    actionThreadMsgList->setEnabled(true);
+    if (actionThreadMsgList->isChecked())
+        slotThreadMsgList();
 }
 
 void MainWindow::slotShowImapInfo()
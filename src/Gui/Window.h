@@ -381,7 +381,6 @@ private:
     MainWindow &operator=(const MainWindow &); // don't implement
 
     QSystemTrayIcon *m_trayIcon;
-    QPoint m_headerDragStart;
 };
 
 }
@@ -0,0 +1,112 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QThread>
+#include "BackgroundWorker.h"
+
+namespace {
+
+/** @short Return the thread which is shared by all workers, start it if there's none
+
+This is only ever called from the GUI thread.
+*/
+std::shared_ptr<QThread> sharedThread()
+{
+    static std::weak_ptr<QThread> instance;
+    std::shared_ptr<QThread> thread = instance.lock();
+    if (!thread) {
+        thread.reset(new QThread(), [](QThread *t) {
+            // The runners which were deleteLater()-ed get deleted once the event loop finishes
+            t->quit();
+            t->wait();
+            delete t;
+        });
+        thread->setObjectName(QStringLiteral("BackgroundWorker"));
+        thread->start(QThread::LowPriority);
+        instance = thread;
+    }
+    return thread;
+}
+
+}
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+BackgroundWorker::BackgroundWorker(const QString &name, QObject *parent)
+    : QObject(parent)
+    , m_name(name)
+    , m_runner(nullptr)
+    , m_generation(0)
+{
+    qRegisterMetaType<Imap::Mailbox::BackgroundWorker::Job>("Imap::Mailbox::BackgroundWorker::Job");
+    qRegisterMetaType<Imap::Mailbox::BackgroundWorker::Result>("Imap::Mailbox::BackgroundWorker::Result");
+}
+
+BackgroundWorker::~BackgroundWorker()
+{
+    if (m_runner) {
+        // Whatever is still queued runs to completion, but nobody is going to hear about it
+        disconnect(m_runner, nullptr, this, nullptr);
+        m_runner->deleteLater();
+    }
+}
+
+void BackgroundWorker::invalidate()
+{
+    ++m_generation;
+}
+
+void BackgroundWorker::enqueue(const Job &job)
+{
+    if (!m_runner) {
+        m_thread = sharedThread();
+        auto runner = new BackgroundJobRunner();
+        runner->setObjectName(m_name);
+        runner->moveToThread(m_thread.get());
+        connect(this, &BackgroundWorker::requested, runner, &BackgroundJobRunner::run);
+        connect(runner, &BackgroundJobRunner::finished, this, &BackgroundWorker::deliver);
+        m_runner = runner;
+    }
+    emit requested(++m_generation, job);
+}
+
+void BackgroundWorker::deliver(quint64 generation, const Result &result)
+{
+    if (generation != m_generation) {
+        // There's a newer request, or the caller is no longer interested
+        return;
+    }
+    result();
+}
+
+void BackgroundJobRunner::run(quint64 generation, const BackgroundWorker::Job &job)
+{
+    emit finished(generation, job());
+}
+
+}
+
+}
@@ -0,0 +1,99 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAP_MODEL_BACKGROUNDWORKER_H
+#define IMAP_MODEL_BACKGROUNDWORKER_H
+
+#include <functional>
+#include <memory>
+#include <QObject>
+
+class QThread;
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+/** @short Run the expensive parts of the message list models on a background thread
+
+All workers share a single low-priority thread which is started on the first request and stopped once the last worker is
+gone. The jobs of one worker run in the order in which they were enqueued, so they can keep their state in between. Only
+the result of the latest job is ever delivered; whatever was enqueued before it, or before an invalidate(), is computed
+but thrown away.
+*/
+class BackgroundWorker : public QObject
+{
+    Q_OBJECT
+public:
+    /** @short Deliver a result, called on the thread of the worker */
+    typedef std::function<void()> Result;
+    /** @short The work to do on the background thread */
+    typedef std::function<Result()> Job;
+
+    explicit BackgroundWorker(const QString &name, QObject *parent = nullptr);
+    virtual ~BackgroundWorker();
+
+    /** @short Make sure that no result of the jobs which are in flight is delivered */
+    void invalidate();
+
+protected:
+    /** @short Run the @arg job on the background thread
+
+    The job must not touch anything but what it has captured, and it should not capture anything but values and
+    state which only the jobs access. Its result, on the other hand, runs on the thread of the worker.
+    */
+    void enqueue(const Job &job);
+
+signals:
+    /** @short Internal: pass the job to the background thread */
+    void requested(quint64 generation, const Imap::Mailbox::BackgroundWorker::Job &job);
+
+private slots:
+    void deliver(quint64 generation, const Imap::Mailbox::BackgroundWorker::Result &result);
+
+private:
+    QString m_name;
+    std::shared_ptr<QThread> m_thread;
+    QObject *m_runner;
+    quint64 m_generation;
+};
+
+/** @short The part of the BackgroundWorker which lives on the background thread */
+class BackgroundJobRunner : public QObject
+{
+    Q_OBJECT
+public slots:
+    void run(quint64 generation, const Imap::Mailbox::BackgroundWorker::Job &job);
+signals:
+    void finished(quint64 generation, const Imap::Mailbox::BackgroundWorker::Result &result);
+};
+
+}
+
+}
+
+Q_DECLARE_METATYPE(Imap::Mailbox::BackgroundWorker::Job)
+Q_DECLARE_METATYPE(Imap::Mailbox::BackgroundWorker::Result)
+
+#endif /* IMAP_MODEL_BACKGROUNDWORKER_H */
@@ -0,0 +1,300 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "BlobCodec.h"
+#include <limits>
+#include <vector>
+#include <QMutex>
+#include <QtEndian>
+#include "configure.cmake.h"
+
+#ifdef TROJITA_HAVE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
+namespace
+{
+
+/** @short First byte of all blobs with a header
+
+The blobs from qCompress() start with the big-endian size of the uncompressed data. Nothing in the cache is anywhere
+near 3 GB, so their first byte can never have this value.
+*/
+const uchar blobMagic = 0xcb;
+/** @short Version of the header layout */
+const uchar blobVersion = 1;
+/** @short Size of the magic, version and codec bytes */
+const int blobHeaderSize = 3;
+
+#ifdef TROJITA_HAVE_ZSTD
+const int zstdLevel = 3;
+/** @short Upper bound of the dictionary size; the envelopes do not have that much in common anyway */
+const size_t maxDictionarySize = 32 * 1024;
+#endif
+
+QByteArray blobHeader(const Imap::Mailbox::BlobCodec codec)
+{
+    QByteArray res;
+    res.reserve(blobHeaderSize);
+    res.append(static_cast<char>(blobMagic));
+    res.append(static_cast<char>(blobVersion));
+    res.append(static_cast<char>(codec));
+    return res;
+}
+
+#ifdef TROJITA_HAVE_ZSTD
+/** @short Decompress a zstd frame which records its decompressed size */
+template<typename Decompressor>
+QByteArray zstdDecompress(const char *data, const size_t size, Decompressor decompressor)
+{
+    const unsigned long long decodedSize = ZSTD_getFrameContentSize(data, size);
+    if (decodedSize == ZSTD_CONTENTSIZE_UNKNOWN || decodedSize == ZSTD_CONTENTSIZE_ERROR
+            || decodedSize > static_cast<unsigned long long>(std::numeric_limits<int>::max())) {
+        return QByteArray();
+    }
+    QByteArray res(static_cast<int>(decodedSize), Qt::Uninitialized);
+    const size_t written = decompressor(res.data(), res.size(), data, size);
+    if (ZSTD_isError(written) || written != decodedSize)
+        return QByteArray();
+    return res;
+}
+#endif
+
+}
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+struct BlobDictionary::Private
+{
+    quint32 id;
+    QByteArray data;
+#ifdef TROJITA_HAVE_ZSTD
+    ZSTD_CDict *compressionDictionary;
+    ZSTD_DDict *decompressionDictionary;
+    /** @short The contexts are reused because setting them up is more expensive than processing an envelope */
+    QMutex compressionMutex;
+    ZSTD_CCtx *compressionContext;
+    QMutex decompressionMutex;
+    ZSTD_DCtx *decompressionContext;
+#endif
+};
+
+BlobDictionary::BlobDictionary(const quint32 id, const QByteArray &data)
+    : d(new Private)
+{
+    d->id = id;
+    d->data = data;
+#ifdef TROJITA_HAVE_ZSTD
+    d->compressionDictionary = ZSTD_createCDict(data.constData(), data.size(), zstdLevel);
+    d->decompressionDictionary = ZSTD_createDDict(data.constData(), data.size());
+    d->compressionContext = ZSTD_createCCtx();
+    d->decompressionContext = ZSTD_createDCtx();
+#endif
+}
+
+BlobDictionary::~BlobDictionary()
+{
+#ifdef TROJITA_HAVE_ZSTD
+    ZSTD_freeCDict(d->compressionDictionary);
+    ZSTD_freeDDict(d->decompressionDictionary);
+    ZSTD_freeCCtx(d->compressionContext);
+    ZSTD_freeDCtx(d->decompressionContext);
+#endif
+}
+
+std::shared_ptr<BlobDictionary> BlobDictionary::train(const quint32 id, const QVector<QByteArray> &samples)
+{
+#ifdef TROJITA_HAVE_ZSTD
+    QByteArray buf;
+    std::vector<size_t> sizes;
+    sizes.reserve(samples.size());
+    for (const QByteArray &sample : samples) {
+        buf.append(sample);
+        sizes.push_back(sample.size());
+    }
+    QByteArray dictionary(static_cast<int>(maxDictionarySize), Qt::Uninitialized);
+    const size_t size = ZDICT_trainFromBuffer(dictionary.data(), maxDictionarySize, buf.constData(), sizes.data(),
+                                              static_cast<unsigned>(sizes.size()));
+    if (ZDICT_isError(size))
+        return nullptr;
+    dictionary.truncate(static_cast<int>(size));
+    return load(id, dictionary);
+#else
+    Q_UNUSED(id);
+    Q_UNUSED(samples);
+    return nullptr;
+#endif
+}
+
+std::shared_ptr<BlobDictionary> BlobDictionary::load(const quint32 id, const QByteArray &data)
+{
+#ifdef TROJITA_HAVE_ZSTD
+    std::shared_ptr<BlobDictionary> res(new BlobDictionary(id, data));
+    if (!res->d->compressionDictionary || !res->d->decompressionDictionary
+            || !res->d->compressionContext || !res->d->decompressionContext) {
+        return nullptr;
+    }
+    return res;
+#else
+    Q_UNUSED(id);
+    Q_UNUSED(data);
+    return nullptr;
+#endif
+}
+
+quint32 BlobDictionary::id() const
+{
+    return d->id;
+}
+
+QByteArray BlobDictionary::data() const
+{
+    return d->data;
+}
+
+BlobCodec defaultBlobCodec()
+{
+#ifdef TROJITA_HAVE_ZSTD
+    return BlobCodec::ZSTD;
+#else
+    return BlobCodec::ZLIB;
+#endif
+}
+
+BlobCodec blobCodec(const QByteArray &blob)
+{
+    if (blob.size() < blobHeaderSize || static_cast<uchar>(blob[0]) != blobMagic)
+        return BlobCodec::ZLIB;
+    return static_cast<BlobCodec>(blob[2]);
+}
+
+QByteArray encodeBlob(const QByteArray &data, const BlobCodec codec)
+{
+    switch (codec) {
+    case BlobCodec::NONE:
+        return blobHeader(codec) + data;
+    case BlobCodec::ZLIB:
+        return blobHeader(codec) + qCompress(data);
+    case BlobCodec::ZSTD:
+    {
+#ifdef TROJITA_HAVE_ZSTD
+        QByteArray res = blobHeader(codec);
+        res.resize(blobHeaderSize + static_cast<int>(ZSTD_compressBound(data.size())));
+        const size_t size = ZSTD_compress(res.data() + blobHeaderSize, res.size() - blobHeaderSize,
+                                          data.constData(), data.size(), zstdLevel);
+        if (!ZSTD_isError(size)) {
+            res.truncate(blobHeaderSize + static_cast<int>(size));
+            return res;
+        }
+#endif
+        // Fall back to something which always works
+        return encodeBlob(data, BlobCodec::ZLIB);
+    }
+    case BlobCodec::ZSTD_DICTIONARY:
+        // There's no dictionary to use
+        return encodeBlob(data, BlobCodec::ZSTD);
+    }
+    Q_ASSERT(false);
+    return QByteArray();
+}
+
+QByteArray encodeBlob(const QByteArray &data, const BlobDictionary &dictionary)
+{
+#ifdef TROJITA_HAVE_ZSTD
+    // The header is followed by the ID of the dictionary
+    QByteArray res = blobHeader(BlobCodec::ZSTD_DICTIONARY);
+    const int offset = blobHeaderSize + sizeof(quint32);
+    res.resize(offset + static_cast<int>(ZSTD_compressBound(data.size())));
+    qToBigEndian(dictionary.id(), reinterpret_cast<uchar *>(res.data() + blobHeaderSize));
+    size_t size;
+    {
+        QMutexLocker locker(&dictionary.d->compressionMutex);
+        size = ZSTD_compress_usingCDict(dictionary.d->compressionContext, res.data() + offset, res.size() - offset,
+                                        data.constData(), data.size(), dictionary.d->compressionDictionary);
+    }
+    if (!ZSTD_isError(size)) {
+        res.truncate(offset + static_cast<int>(size));
+        return res;
+    }
+#else
+    Q_UNUSED(dictionary);
+#endif
+    return encodeBlob(data);
+}
+
+QByteArray decodeBlob(const QByteArray &blob, const BlobDictionary *dictionary)
+{
+    if (blob.isEmpty())
+        return QByteArray();
+
+    if (static_cast<uchar>(blob[0]) != blobMagic) {
+        // A legacy blob straight from qCompress()
+        return qUncompress(blob);
+    }
+
+    if (blob.size() < blobHeaderSize || static_cast<uchar>(blob[1]) != blobVersion)
+        return QByteArray();
+
+    const char *payload = blob.constData() + blobHeaderSize;
+    const int payloadSize = blob.size() - blobHeaderSize;
+    switch (static_cast<BlobCodec>(blob[2])) {
+    case BlobCodec::NONE:
+        return QByteArray(payload, payloadSize);
+    case BlobCodec::ZLIB:
+        return qUncompress(reinterpret_cast<const uchar *>(payload), payloadSize);
+    case BlobCodec::ZSTD:
+#ifdef TROJITA_HAVE_ZSTD
+        return zstdDecompress(payload, payloadSize, [](void *dst, size_t dstSize, const void *src, size_t srcSize) {
+            return ZSTD_decompress(dst, dstSize, src, srcSize);
+        });
+#else
+        return QByteArray();
+#endif
+    case BlobCodec::ZSTD_DICTIONARY:
+    {
+        if (!dictionary || payloadSize < static_cast<int>(sizeof(quint32)))
+            return QByteArray();
+        if (qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(payload)) != dictionary->id())
+            return QByteArray();
+#ifdef TROJITA_HAVE_ZSTD
+        QMutexLocker locker(&dictionary->d->decompressionMutex);
+        return zstdDecompress(payload + sizeof(quint32), payloadSize - sizeof(quint32),
+                              [dictionary](void *dst, size_t dstSize, const void *src, size_t srcSize) {
+            return ZSTD_decompress_usingDDict(dictionary->d->decompressionContext, dst, dstSize, src, srcSize,
+                                              dictionary->d->decompressionDictionary);
+        });
+#else
+        return QByteArray();
+#endif
+    }
+    }
+    return QByteArray();
+}
+
+}
+
+}
@@ -0,0 +1,95 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAP_MODEL_BLOBCODEC_H
+#define IMAP_MODEL_BLOBCODEC_H
+
+#include <memory>
+#include <QByteArray>
+#include <QVector>
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+/** @short A compression dictionary which was trained on similar blobs, like the envelopes of a single account
+
+The dictionary is immutable once created, so it can be shared by the GUI and the writer thread.
+*/
+class BlobDictionary
+{
+public:
+    ~BlobDictionary();
+
+    /** @short Train a new dictionary from the @arg samples, or return nullptr if that is not possible */
+    static std::shared_ptr<BlobDictionary> train(const quint32 id, const QVector<QByteArray> &samples);
+    /** @short Restore a dictionary which was trained before, or return nullptr if this build cannot use it */
+    static std::shared_ptr<BlobDictionary> load(const quint32 id, const QByteArray &data);
+
+    /** @short Identification of the dictionary which is stored in each blob compressed by it */
+    quint32 id() const;
+    /** @short The dictionary itself, as it should be stored */
+    QByteArray data() const;
+
+private:
+    BlobDictionary(const quint32 id, const QByteArray &data);
+
+    struct Private;
+    std::unique_ptr<Private> d;
+
+    friend QByteArray encodeBlob(const QByteArray &data, const BlobDictionary &dictionary);
+    friend QByteArray decodeBlob(const QByteArray &blob, const BlobDictionary *dictionary);
+};
+
+/** @short Algorithms which can be used for compressing the cached blobs
+
+The compressed blobs start with a short header which identifies the format version and the codec. Blobs without such
+a header were produced by qCompress() in older versions and remain readable.
+*/
+enum class BlobCodec : uchar {
+    NONE = 0,
+    ZLIB = 1,
+    ZSTD = 2,
+    ZSTD_DICTIONARY = 3,
+};
+
+/** @short The best general-purpose codec which is available in this build */
+BlobCodec defaultBlobCodec();
+/** @short Which codec was used for the @arg blob */
+BlobCodec blobCodec(const QByteArray &blob);
+/** @short Compress the @arg data through the given @arg codec; dictionaries are only used through the other overload */
+QByteArray encodeBlob(const QByteArray &data, const BlobCodec codec = defaultBlobCodec());
+/** @short Compress the @arg data through a trained @arg dictionary */
+QByteArray encodeBlob(const QByteArray &data, const BlobDictionary &dictionary);
+/** @short Decompress the @arg blob, returning a null QByteArray when it cannot be decoded
+
+The @arg dictionary is needed for blobs which were compressed with one.
+*/
+QByteArray decodeBlob(const QByteArray &blob, const BlobDictionary *dictionary = nullptr);
+
+}
+
+}
+
+#endif /* IMAP_MODEL_BLOBCODEC_H */
@@ -35,6 +35,92 @@ void AbstractCache::setErrorHandler(const std::function<void(const QString &)> &
     m_errorHandler = handler;
 }
 
+QMap<uint, AbstractCache::MessageDataBundle> AbstractCache::messageMetadataBatch(const QString &mailbox, const Imap::Uids &uids) const
+{
+    QMap<uint, MessageDataBundle> res;
+    for (const uint uid : uids) {
+        MessageDataBundle data = messageMetadata(mailbox, uid);
+        if (data.uid == uid)
+            res[uid] = data;
+    }
+    return res;
+}
+
+QMap<uint, QStringList> AbstractCache::msgFlagsBatch(const QString &mailbox, const Imap::Uids &uids) const
+{
+    QMap<uint, QStringList> res;
+    for (const uint uid : uids) {
+        res[uid] = msgFlags(mailbox, uid);
+    }
+    return res;
+}
+
+std::shared_ptr<MappedPart> AbstractCache::mappedMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const
+{
+    Q_UNUSED(mailbox);
+    Q_UNUSED(uid);
+    Q_UNUSED(partId);
+    return nullptr;
+}
+
+void AbstractCache::setMessageText(const QString &mailbox, const uint uid, const QByteArray &partId, const QString &text)
+{
+    Q_UNUSED(mailbox);
+    Q_UNUSED(uid);
+    Q_UNUSED(partId);
+    Q_UNUSED(text);
+}
+
+bool AbstractCache::searchMessages(const QString &mailbox, const QStringList &conditions, Imap::Uids &uids) const
+{
+    Q_UNUSED(mailbox);
+    Q_UNUSED(conditions);
+    Q_UNUSED(uids);
+    return false;
+}
+
+bool AbstractCache::searchResult(const QString &mailbox, const QString &criteria, SearchResult &result) const
+{
+    Q_UNUSED(mailbox);
+    Q_UNUSED(criteria);
+    Q_UNUSED(result);
+    return false;
+}
+
+void AbstractCache::setSearchResult(const QString &mailbox, const QString &criteria, const SearchResult &result)
+{
+    Q_UNUSED(mailbox);
+    Q_UNUSED(criteria);
+    Q_UNUSED(result);
+}
+
+QByteArray AbstractCache::partialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkSize) const
+{
+    Q_UNUSED(mailbox);
+    Q_UNUSED(uid);
+    Q_UNUSED(partId);
+    Q_UNUSED(chunkSize);
+    return QByteArray();
+}
+
+void AbstractCache::setMsgPartChunk(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkNumber,
+                                    const uint chunkSize, const QByteArray &data)
+{
+    Q_UNUSED(mailbox);
+    Q_UNUSED(uid);
+    Q_UNUSED(partId);
+    Q_UNUSED(chunkNumber);
+    Q_UNUSED(chunkSize);
+    Q_UNUSED(data);
+}
+
+void AbstractCache::forgetPartialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId)
+{
+    Q_UNUSED(mailbox);
+    Q_UNUSED(uid);
+    Q_UNUSED(partId);
+}
+
 AbstractCache::MessageDataBundle::MessageDataBundle(
         const uint uid, const Message::Envelope &envelope, const QDateTime &internalDate, const quint64 size,
         const QByteArray &serializedBodyStructure, const QList<QByteArray> &hdrReferences,
@@ -24,6 +24,8 @@
 #define IMAP_MODEL_CACHE_H
 
 #include <functional>
+#include <memory>
+#include <QMap>
 #include <QUrl>
 #include "MailboxMetadata.h"
 #include "Imap/Parser/Message.h"
@@ -38,6 +40,8 @@ namespace Imap
 namespace Mailbox
 {
 
+class MappedPart;
+
 /** @short An abstract parent for all IMAP cache implementations */
 class AbstractCache
 {
@@ -84,6 +88,20 @@ public:
         }
     };
 
+    /** @short Result of a UID SEARCH or UID SORT along with the state of the mailbox which it describes */
+    struct SearchResult {
+        /** @short UIDs of the matching messages, in the order of the sort criteria if there were any */
+        Imap::Uids uids;
+        /** @short The HIGHESTMODSEQ of the mailbox when the command was sent */
+        quint64 highestModSeq;
+        /** @short The UIDNEXT of the mailbox when the command was sent */
+        uint uidNext;
+        /** @short The UIDVALIDITY which the UIDs belong to */
+        uint uidValidity;
+
+        SearchResult(): highestModSeq(0), uidNext(0), uidValidity(0) {}
+    };
+
     virtual ~AbstractCache();
 
     /** @short Return a list of all known child mailboxes */
@@ -113,24 +131,76 @@ public:
     /** @short Returns all known data for a message in the given mailbox (except real parts data) */
     virtual MessageDataBundle messageMetadata(const QString &mailbox, uint uid) const = 0;
     virtual void setMessageMetadata(const QString &mailbox, const uint uid, const MessageDataBundle &metadata) = 0;
+    /** @short Return metadata of all listed messages which are available in the cache
+
+    Messages which are not cached are simply missing from the result. The default implementation calls messageMetadata()
+    for each UID; backends which can do better (like a range scan over an index) should override it.
+    */
+    virtual QMap<uint, MessageDataBundle> messageMetadataBatch(const QString &mailbox, const Imap::Uids &uids) const;
 
     /** @short Retrieve flags for one message in a mailbox */
     virtual QStringList msgFlags(const QString &mailbox, const uint uid) const = 0;
     /** @short Save flags for one message in mailbox */
     virtual void setMsgFlags(const QString &mailbox, const uint uid, const QStringList &flags) = 0;
+    /** @short Retrieve flags of all listed messages; a missing entry means that no flags are known */
+    virtual QMap<uint, QStringList> msgFlagsBatch(const QString &mailbox, const Imap::Uids &uids) const;
 
     /** @short Return part data or a null QByteArray if none available */
     virtual QByteArray messagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const = 0;
+    /** @short Return a read-only view of the part data which are mapped straight from the disk, or nullptr
+
+    The data can be accessed without copying them into the process' private memory for as long as the returned object
+    is kept around. The default implementation has nothing to map.
+    */
+    virtual std::shared_ptr<MappedPart> mappedMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const;
     /** @short Save data for one message part */
     virtual void setMsgPart(const QString &mailbox, const uint uid, const QByteArray &partId, const QByteArray &data) = 0;
     /** @short Drop the data for a message part which is no longer needed */
     virtual void forgetMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId) = 0;
 
+    /** @short Return the leading, contiguous chunks of a part whose download has not finished yet
+
+    Large message parts are fetched piece by piece through partial FETCHes. This function returns the concatenation
+    of all chunks starting at offset zero up to the first chunk which has not arrived yet, or a null QByteArray if there
+    is nothing to resume from. Data which were stored using a different @arg chunkSize are ignored.
+
+    The default implementation does not support resuming at all.
+    */
+    virtual QByteArray partialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkSize) const;
+    /** @short Remember one chunk of a message part which is being downloaded piece by piece */
+    virtual void setMsgPartChunk(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkNumber,
+                                 const uint chunkSize, const QByteArray &data);
+    /** @short Drop all chunks of a partially downloaded message part */
+    virtual void forgetPartialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId);
+
     /** @short Return cached threading info for a given mailbox */
     virtual QVector<Imap::Responses::ThreadingNode> messageThreading(const QString &mailbox) = 0;
     /** @short Save information about how messages are threaded */
     virtual void setMessageThreading(const QString &mailbox, const QVector<Imap::Responses::ThreadingNode> &threading) = 0;
 
+    /** @short Remember the decoded text of a message part for the local full-text search
+
+    All text parts of a message are indexed together as its body. Indexing a @arg partId for the second time does not
+    change anything. The default implementation does not maintain any index.
+    */
+    virtual void setMessageText(const QString &mailbox, const uint uid, const QByteArray &partId, const QString &text);
+    /** @short Evaluate a search of the quick search bar against the locally cached messages
+
+    The @arg conditions use the syntax of the IMAP SEARCH command as produced by the message list's quick search, i.e.
+    a disjunction of SUBJECT, BODY, FROM, TO, CC or BCC keys with an optional FUZZY modifier. The UIDs of matching
+    messages are stored into @arg uids in an ascending order. Returns false when the conditions cannot be evaluated
+    locally, for example when they contain other keys or when the cache does not have any index.
+    */
+    virtual bool searchMessages(const QString &mailbox, const QStringList &conditions, Imap::Uids &uids) const;
+
+    /** @short Look up what the server answered the last time it was asked for the search identified by @arg criteria
+
+    Returns false if no such result is known. The default implementation does not remember anything.
+    */
+    virtual bool searchResult(const QString &mailbox, const QString &criteria, SearchResult &result) const;
+    /** @short Remember a result of UID SEARCH or UID SORT; the result is forgotten along with the mailbox' messages */
+    virtual void setSearchResult(const QString &mailbox, const QString &criteria, const SearchResult &result);
+
     /** @short How many days is it OK not to mark entries as accessed? */
     virtual void setRenewalThreshold(const int days) = 0;
 
@@ -20,10 +20,25 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <QMap>
+#include <QTimer>
 #include "CombinedCache.h"
 #include "DiskPartCache.h"
 #include "SQLCache.h"
 
+namespace {
+
+/** @short How many messages to expire in one go */
+const int gcBatchSize = 50;
+/** @short Pause between two batches, in milliseconds */
+const int gcBatchInterval = 250;
+/** @short Delay before the first pass, in milliseconds -- the application startup is busy enough already */
+const int gcInitialDelay = 2 * 60 * 1000;
+/** @short Pause between two complete passes, in milliseconds */
+const int gcPassInterval = 6 * 60 * 60 * 1000;
+
+}
+
 namespace Imap
 {
 namespace Mailbox
@@ -34,6 +49,12 @@ CombinedCache::CombinedCache(const QString &name, const QString &cacheDir)
     , cacheDir(cacheDir)
     , sqlCache(new SQLCache())
     , diskPartCache(new DiskPartCache(cacheDir))
+    , m_gcPhase(GcPhase::IDLE)
+    , m_gcMaxAgeDays(0)
+    , m_gcSizeBudget(0)
+    , m_gcReclaimed(0)
+    , m_gcExpiredMessages(0)
+    , m_gcBatchSequence(0)
 {
     sqlCache->setErrorHandler([this](const QString &e) { this->m_errorHandler(e); });
     diskPartCache->setErrorHandler([this](const QString &e) { this->m_errorHandler(e); });
@@ -41,6 +62,10 @@ CombinedCache::CombinedCache(const QString &name, const QString &cacheDir)
 
 CombinedCache::~CombinedCache()
 {
+    if (m_gcBatch) {
+        sqlCache->waitForPendingWrites();
+        finishExpiry();
+    }
 }
 
 bool CombinedCache::open()
@@ -105,6 +130,11 @@ QStringList CombinedCache::msgFlags(const QString &mailbox, const uint uid) cons
     return sqlCache->msgFlags(mailbox, uid);
 }
 
+QMap<uint, QStringList> CombinedCache::msgFlagsBatch(const QString &mailbox, const Imap::Uids &uids) const
+{
+    return sqlCache->msgFlagsBatch(mailbox, uids);
+}
+
 void CombinedCache::setMsgFlags(const QString &mailbox, const uint uid, const QStringList &flags)
 {
     sqlCache->setMsgFlags(mailbox, uid, flags);
@@ -115,6 +145,11 @@ AbstractCache::MessageDataBundle CombinedCache::messageMetadata(const QString &m
     return sqlCache->messageMetadata(mailbox, uid);
 }
 
+QMap<uint, AbstractCache::MessageDataBundle> CombinedCache::messageMetadataBatch(const QString &mailbox, const Imap::Uids &uids) const
+{
+    return sqlCache->messageMetadataBatch(mailbox, uids);
+}
+
 void CombinedCache::setMessageMetadata(const QString &mailbox, const uint uid, const MessageDataBundle &metadata)
 {
     sqlCache->setMessageMetadata(mailbox, uid, metadata);
@@ -129,6 +164,12 @@ QByteArray CombinedCache::messagePart(const QString &mailbox, const uint uid, co
     return res;
 }
 
+std::shared_ptr<MappedPart> CombinedCache::mappedMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const
+{
+    // Only the big parts which live on the disk can be mapped
+    return diskPartCache->mappedMessagePart(mailbox, uid, partId);
+}
+
 void CombinedCache::setMsgPart(const QString &mailbox, const uint uid, const QByteArray &partId, const QByteArray &data)
 {
     if (data.size() < 1024 * 1024) {
@@ -144,6 +185,23 @@ void CombinedCache::forgetMessagePart(const QString &mailbox, const uint uid, co
     diskPartCache->forgetMessagePart(mailbox, uid, partId);
 }
 
+QByteArray CombinedCache::partialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkSize) const
+{
+    return diskPartCache->partialMessagePart(mailbox, uid, partId, chunkSize);
+}
+
+void CombinedCache::setMsgPartChunk(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkNumber,
+                                    const uint chunkSize, const QByteArray &data)
+{
+    // Only large parts are ever fetched in chunks, so these always go to the disk
+    diskPartCache->setMsgPartChunk(mailbox, uid, partId, chunkNumber, chunkSize, data);
+}
+
+void CombinedCache::forgetPartialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId)
+{
+    diskPartCache->forgetPartialMessagePart(mailbox, uid, partId);
+}
+
 QVector<Imap::Responses::ThreadingNode> CombinedCache::messageThreading(const QString &mailbox)
 {
     return sqlCache->messageThreading(mailbox);
@@ -154,10 +212,128 @@ void CombinedCache::setMessageThreading(const QString &mailbox, const QVector<Im
     sqlCache->setMessageThreading(mailbox, threading);
 }
 
+void CombinedCache::setMessageText(const QString &mailbox, const uint uid, const QByteArray &partId, const QString &text)
+{
+    sqlCache->setMessageText(mailbox, uid, partId, text);
+}
+
+bool CombinedCache::searchMessages(const QString &mailbox, const QStringList &conditions, Imap::Uids &uids) const
+{
+    return sqlCache->searchMessages(mailbox, conditions, uids);
+}
+
+bool CombinedCache::searchResult(const QString &mailbox, const QString &criteria, SearchResult &result) const
+{
+    return sqlCache->searchResult(mailbox, criteria, result);
+}
+
+void CombinedCache::setSearchResult(const QString &mailbox, const QString &criteria, const SearchResult &result)
+{
+    sqlCache->setSearchResult(mailbox, criteria, result);
+}
+
 void CombinedCache::setRenewalThreshold(const int days)
 {
     sqlCache->setRenewalThreshold(days);
 }
 
+void CombinedCache::setGarbageCollection(const int maxAgeDays, const quint64 sizeBudget,
+                                         const std::function<void(const quint64, const uint)> &reporter)
+{
+    m_gcMaxAgeDays = maxAgeDays;
+    m_gcSizeBudget = sizeBudget;
+    m_gcReporter = reporter;
+    m_gcPhase = GcPhase::IDLE;
+
+    if (!m_gcMaxAgeDays && !m_gcSizeBudget) {
+        if (m_gcBatch) {
+            // Don't leave the big parts of the already expired messages behind
+            sqlCache->waitForPendingWrites();
+            finishExpiry();
+        }
+        m_gcTimer.reset();
+        return;
+    }
+
+    if (!m_gcTimer) {
+        m_gcTimer.reset(new QTimer());
+        m_gcTimer->setSingleShot(true);
+        m_gcTimer->setObjectName(QStringLiteral("cacheGarbageCollection"));
+        QObject::connect(m_gcTimer.get(), &QTimer::timeout, m_gcTimer.get(), [this](){ this->collectGarbage(); });
+    }
+    m_gcTimer->start(gcInitialDelay);
+}
+
+void CombinedCache::collectGarbage()
+{
+    bool exhausted = false;
+    if (m_gcBatch) {
+        if (!sqlCache->isCommitted(m_gcBatchSequence)) {
+            // The writer has not got to the previous batch yet
+            m_gcTimer->start(gcBatchInterval);
+            return;
+        }
+        exhausted = m_gcBatch->messages.isEmpty();
+        finishExpiry();
+    }
+
+    if (m_gcPhase == GcPhase::IDLE) {
+        m_gcReclaimed = 0;
+        m_gcExpiredMessages = 0;
+        m_gcPhase = GcPhase::AGE;
+        exhausted = !m_gcMaxAgeDays;
+    }
+
+    if (m_gcPhase == GcPhase::AGE) {
+        if (!exhausted) {
+            // The access date is only refreshed once it is older than the renewal threshold, which is the same number
+            // of days, so a message which is in active use can appear up to twice as old.
+            startExpiry(2 * m_gcMaxAgeDays);
+            return;
+        }
+        m_gcPhase = GcPhase::SIZE;
+        exhausted = false;
+    }
+
+    Q_ASSERT(m_gcPhase == GcPhase::SIZE);
+    if (!exhausted && m_gcSizeBudget && sqlCache->usedSize() + diskPartCache->totalSize() > m_gcSizeBudget) {
+        startExpiry(-1);
+        return;
+    }
+
+    // This pass is done
+    m_gcPhase = GcPhase::IDLE;
+    if (m_gcExpiredMessages) {
+        sqlCache->reclaimFreeSpace();
+    }
+    if (m_gcReporter) {
+        m_gcReporter(m_gcReclaimed, m_gcExpiredMessages);
+    }
+    m_gcTimer->start(gcPassInterval);
+}
+
+void CombinedCache::startExpiry(const int days)
+{
+    m_gcBatch = std::make_shared<ExpiredMessages>();
+    m_gcBatchSequence = sqlCache->expireMessages(days, gcBatchSize, m_gcBatch);
+    m_gcTimer->start(gcBatchInterval);
+}
+
+void CombinedCache::finishExpiry()
+{
+    // The big parts are removed only after the writer has committed the removal of the rest of the message's data
+    QMap<QString, Imap::Uids> byMailbox;
+    for (auto it = m_gcBatch->messages.constBegin(); it != m_gcBatch->messages.constEnd(); ++it) {
+        byMailbox[it->first] << it->second;
+    }
+    quint64 freed = m_gcBatch->reclaimed;
+    for (auto it = byMailbox.constBegin(); it != byMailbox.constEnd(); ++it) {
+        freed += diskPartCache->clearMessages(it.key(), *it);
+    }
+    m_gcReclaimed += freed;
+    m_gcExpiredMessages += m_gcBatch->messages.size();
+    m_gcBatch.reset();
+}
+
 }
 }
@@ -23,9 +23,12 @@
 #ifndef IMAP_MODEL_COMBINEDCACHE_H
 #define IMAP_MODEL_COMBINEDCACHE_H
 
+#include <functional>
 #include <memory>
 #include "Cache.h"
 
+class QTimer;
+
 namespace Imap
 {
 
@@ -33,6 +36,7 @@ namespace Mailbox
 {
 
 class SQLCache;
+struct ExpiredMessages;
 class DiskPartCache;
 
 
@@ -76,23 +80,54 @@ public:
 
     virtual MessageDataBundle messageMetadata(const QString &mailbox, const uint uid) const;
     virtual void setMessageMetadata(const QString &mailbox, const uint uid, const MessageDataBundle &metadata);
+    virtual QMap<uint, MessageDataBundle> messageMetadataBatch(const QString &mailbox, const Imap::Uids &uids) const;
 
     virtual QStringList msgFlags(const QString &mailbox, const uint uid) const;
     virtual void setMsgFlags(const QString &mailbox, const uint uid, const QStringList &flags);
+    virtual QMap<uint, QStringList> msgFlagsBatch(const QString &mailbox, const Imap::Uids &uids) const;
 
     virtual QByteArray messagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const;
+    virtual std::shared_ptr<MappedPart> mappedMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const;
     virtual void setMsgPart(const QString &mailbox, const uint uid, const QByteArray &partId, const QByteArray &data);
     virtual void forgetMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId);
 
+    virtual QByteArray partialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkSize) const;
+    virtual void setMsgPartChunk(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkNumber,
+                                 const uint chunkSize, const QByteArray &data);
+    virtual void forgetPartialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId);
+
     virtual QVector<Imap::Responses::ThreadingNode> messageThreading(const QString &mailbox);
     virtual void setMessageThreading(const QString &mailbox, const QVector<Imap::Responses::ThreadingNode> &threading);
 
+    virtual void setMessageText(const QString &mailbox, const uint uid, const QByteArray &partId, const QString &text);
+    virtual bool searchMessages(const QString &mailbox, const QStringList &conditions, Imap::Uids &uids) const;
+    virtual bool searchResult(const QString &mailbox, const QString &criteria, SearchResult &result) const;
+    virtual void setSearchResult(const QString &mailbox, const QString &criteria, const SearchResult &result);
+
     virtual void setRenewalThreshold(const int days);
 
     /** @short Open a connection to the cache */
     bool open();
 
+    /** @short Periodically expire old data in the background
+
+    Each pass at first removes messages which were not accessed during the last @arg maxAgeDays days, then it removes
+    the least recently accessed messages until the cache fits into @arg sizeBudget bytes. Either of these limits can be
+    disabled by passing zero. The work is split into small batches which the SQL cache's writer thread picks and removes,
+    so that the event loop is never blocked for long. The @arg reporter is called after each pass with the number of
+    reclaimed bytes and the number of messages whose data were removed.
+    */
+    void setGarbageCollection(const int maxAgeDays, const quint64 sizeBudget,
+                              const std::function<void(const quint64 reclaimed, const uint messages)> &reporter);
+
 private:
+    /** @short Perform one batch of the garbage collection */
+    void collectGarbage();
+    /** @short Let the SQL cache's writer remove the next batch of messages */
+    void startExpiry(const int days);
+    /** @short Remove the big parts of the messages from the last batch and account for the freed space */
+    void finishExpiry();
+
     /** @short Name of the DB connection */
     QString name;
     /** @short Directory to serve as a cache root */
@@ -101,6 +136,22 @@ private:
     std::unique_ptr<SQLCache> sqlCache;
     /** @short Cache for bigger message parts */
     std::unique_ptr<DiskPartCache> diskPartCache;
+
+    enum class GcPhase {
+        IDLE, /**< @short Waiting for the next pass */
+        AGE, /**< @short Removing messages which were not accessed for too long */
+        SIZE, /**< @short Removing the least recently accessed messages until we're below the size budget */
+    };
+    std::unique_ptr<QTimer> m_gcTimer;
+    GcPhase m_gcPhase;
+    int m_gcMaxAgeDays;
+    quint64 m_gcSizeBudget;
+    quint64 m_gcReclaimed;
+    uint m_gcExpiredMessages;
+    /** @short The batch which the SQL cache's writer is working on, if any */
+    std::shared_ptr<ExpiredMessages> m_gcBatch;
+    quint64 m_gcBatchSequence;
+    std::function<void(const quint64, const uint)> m_gcReporter;
 };
 
 }
@@ -0,0 +1,215 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "CrossMailboxSearchModel.h"
+#include "Imap/Model/ItemRoles.h"
+#include "Imap/Model/MailboxTree.h"
+#include "Imap/Model/Model.h"
+#include "Imap/Model/TaskFactory.h"
+#include "Imap/Tasks/ExamineSearchTask.h"
+#include "Imap/Tasks/MultiSearchTask.h"
+
+namespace Imap
+{
+namespace Mailbox
+{
+
+CrossMailboxSearchModel::CrossMailboxSearchModel(QObject *parent, Model *model):
+    QAbstractListModel(parent), m_model(model), m_concurrency(0)
+{
+}
+
+int CrossMailboxSearchModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : m_matches.size();
+}
+
+QVariant CrossMailboxSearchModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.model() != this || index.row() >= m_matches.size())
+        return QVariant();
+
+    const Match &match = m_matches[index.row()];
+    switch (role) {
+    case RoleMailboxName:
+        return match.mailbox;
+    case RoleMailboxUidValidity:
+        return match.uidValidity;
+    case RoleMessageUid:
+        return match.uid;
+    default:
+        // Everything else comes from the real message, provided that it's already known
+        return messageIndex(index.row()).data(role);
+    }
+}
+
+QModelIndex CrossMailboxSearchModel::messageIndex(const int row) const
+{
+    if (!m_model || row < 0 || row >= m_matches.size())
+        return QModelIndex();
+
+    const Match &match = m_matches[row];
+    TreeItemMailbox *mailbox = m_model->findMailboxByName(match.mailbox);
+    if (!mailbox)
+        return QModelIndex();
+    if (match.uidValidity && mailbox->syncState.uidValidity() && match.uidValidity != mailbox->syncState.uidValidity())
+        return QModelIndex();
+
+    QList<TreeItemMessage *> messages = m_model->findMessagesByUids(mailbox, Imap::Uids() << match.uid);
+    return messages.isEmpty() ? QModelIndex() : messages.front()->toIndex(m_model);
+}
+
+bool CrossMailboxSearchModel::isSearching() const
+{
+    return m_multiSearch || !m_examineSearches.isEmpty();
+}
+
+void CrossMailboxSearchModel::search(const QStringList &mailboxes, const QStringList &searchConditions)
+{
+    cancel();
+
+    beginResetModel();
+    m_matches.clear();
+    endResetModel();
+
+    if (!m_model)
+        return;
+
+    m_concurrency = 0;
+    m_timer.start();
+
+    // Both ways of searching keep their hands off the connections which have a mailbox selected
+    if (m_model->isMultiSearchSupported()) {
+        m_concurrency = 1;
+        m_multiSearch = m_model->m_taskFactory->createMultiSearchTask(m_model, mailboxes, searchConditions);
+        connect(m_multiSearch.data(), &MultiSearchTask::mailboxSearchResult, this, &CrossMailboxSearchModel::slotMailboxSearchResult);
+        connect(m_multiSearch.data(), &MultiSearchTask::searchFinished, this, &CrossMailboxSearchModel::slotSearchFinished);
+        connect(m_multiSearch.data(), &MultiSearchTask::searchFailed, this, &CrossMailboxSearchModel::slotSearchFailed);
+    } else {
+        QStringList selectable;
+        Q_FOREACH(const QString &name, mailboxes) {
+            TreeItemMailbox *mailbox = m_model->findMailboxByName(name);
+            if (mailbox && mailbox->isSelectable()) {
+                selectable << name;
+            } else {
+                emit searchFailed(name);
+            }
+        }
+        if (selectable.isEmpty()) {
+            finishIfDone();
+            return;
+        }
+
+        // Each connection gets every n-th mailbox, so that the results from the beginning of the list arrive first
+        m_concurrency = qMin(m_model->m_maxParsers, selectable.size());
+        QVector<QStringList> shares(m_concurrency);
+        for (int i = 0; i < selectable.size(); ++i) {
+            shares[i % m_concurrency] << selectable[i];
+        }
+        Q_FOREACH(const QStringList &share, shares) {
+            ExamineSearchTask *task = m_model->m_taskFactory->createExamineSearchTask(m_model, share, searchConditions);
+            connect(task, &ExamineSearchTask::mailboxSearchResult, this, &CrossMailboxSearchModel::slotMailboxSearchResult);
+            connect(task, &ExamineSearchTask::mailboxSearchFailed, this, &CrossMailboxSearchModel::searchFailed);
+            connect(task, &ExamineSearchTask::searchFinished, this, &CrossMailboxSearchModel::slotSearchFinished);
+            connect(task, &ExamineSearchTask::searchFailed, this, &CrossMailboxSearchModel::slotSearchFailed);
+            m_examineSearches << task;
+        }
+    }
+}
+
+void CrossMailboxSearchModel::cancel()
+{
+    // The tasks are one-shot, so they will finish on their own; we just have to stop listening to them
+    if (m_multiSearch) {
+        disconnect(m_multiSearch.data(), nullptr, this, nullptr);
+        m_multiSearch.clear();
+    }
+    Q_FOREACH(const QPointer<ExamineSearchTask> &task, m_examineSearches) {
+        if (task)
+            disconnect(task.data(), nullptr, this, nullptr);
+    }
+    m_examineSearches.clear();
+}
+
+void CrossMailboxSearchModel::appendMatches(const QString &mailbox, const uint uidValidity, const Imap::Uids &uids)
+{
+    if (!uids.isEmpty()) {
+        beginInsertRows(QModelIndex(), m_matches.size(), m_matches.size() + uids.size() - 1);
+        m_matches.reserve(m_matches.size() + uids.size());
+        Q_FOREACH(const uint uid, uids) {
+            Match match;
+            match.mailbox = mailbox;
+            match.uidValidity = uidValidity;
+            match.uid = uid;
+            m_matches.append(match);
+        }
+        endInsertRows();
+    }
+    emit mailboxSearched(mailbox, uids.size());
+}
+
+void CrossMailboxSearchModel::slotMailboxSearchResult(const QString &mailbox, const uint uidValidity, const Imap::Uids &uids)
+{
+    appendMatches(mailbox, uidValidity, uids);
+}
+
+void CrossMailboxSearchModel::slotSearchFinished()
+{
+    forgetSearch(sender());
+    finishIfDone();
+}
+
+void CrossMailboxSearchModel::slotSearchFailed()
+{
+    forgetSearch(sender());
+    emit searchFailed(QString());
+    finishIfDone();
+}
+
+/** @short The @arg task will not report anything else */
+void CrossMailboxSearchModel::forgetSearch(QObject *task)
+{
+    if (task == m_multiSearch.data()) {
+        m_multiSearch.clear();
+        return;
+    }
+    for (auto it = m_examineSearches.begin(); it != m_examineSearches.end(); ) {
+        // A task which has been deleted already is not going to finish anymore
+        if (!*it || it->data() == task) {
+            it = m_examineSearches.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void CrossMailboxSearchModel::finishIfDone()
+{
+    if (isSearching() || !m_timer.isValid())
+        return;
+    qint64 elapsed = m_timer.elapsed();
+    m_timer.invalidate();
+    emit searchFinished(m_concurrency, elapsed);
+}
+
+}
+}
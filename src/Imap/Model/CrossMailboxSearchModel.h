@@ -0,0 +1,118 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAP_MODEL_CROSSMAILBOXSEARCHMODEL_H
+#define IMAP_MODEL_CROSSMAILBOXSEARCHMODEL_H
+
+#include <QAbstractListModel>
+#include <QElapsedTimer>
+#include <QList>
+#include <QPointer>
+#include <QStringList>
+#include <QVector>
+#include "Imap/Parser/Response.h"
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+class ExamineSearchTask;
+class Model;
+class MultiSearchTask;
+
+/** @short Search through several mailboxes and present the matching messages as a single flat list
+
+When the server supports MULTISEARCH (RFC 7377), a single ESEARCH command covers all requested mailboxes. Otherwise, the
+mailboxes are split among up to Model::setMaxConnections() ExamineSearchTasks which run in parallel. Each of them opens a
+separate connection and EXAMINEs its share of mailboxes one after another, so that the connection which keeps the user's
+current mailbox selected is never disturbed. Matches are appended as soon as each mailbox answers, so
+the view does not have to wait for the slowest one.
+
+Each row represents one message identified by its mailbox name and UID. The message might not be known to the Model
+yet -- neither way of searching syncs the mailbox -- which is why messageIndex() can return an invalid index.
+*/
+class CrossMailboxSearchModel : public QAbstractListModel
+{
+    Q_OBJECT
+public:
+    CrossMailboxSearchModel(QObject *parent, Model *model);
+
+    virtual int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    virtual QVariant data(const QModelIndex &index, int role) const;
+
+    /** @short Find the message in the main Model, if it has been loaded already */
+    QModelIndex messageIndex(const int row) const;
+
+    bool isSearching() const;
+
+public slots:
+    /** @short Forget previous results and search through the given mailboxes */
+    void search(const QStringList &mailboxes, const QStringList &searchConditions);
+    /** @short Stop listening for any further results */
+    void cancel();
+
+signals:
+    /** @short One more mailbox has been searched */
+    void mailboxSearched(const QString &mailbox, const int matches);
+    /** @short All mailboxes have been searched
+
+    The @arg concurrency is the number of connections which were searching in parallel, or zero if nothing was sent.
+    The @arg elapsedMs is the wall-clock time spent since the search() was called.
+    */
+    void searchFinished(const int concurrency, const qint64 elapsedMs);
+    /** @short Search in the given mailbox has failed; other mailboxes continue to be searched
+
+    The mailbox name is empty when the whole MULTISEARCH command or one of the EXAMINE connections has failed.
+    */
+    void searchFailed(const QString &mailbox);
+
+private slots:
+    void slotMailboxSearchResult(const QString &mailbox, const uint uidValidity, const Imap::Uids &uids);
+    void slotSearchFinished();
+    void slotSearchFailed();
+
+private:
+    struct Match {
+        QString mailbox;
+        uint uidValidity;
+        uint uid;
+    };
+
+    void appendMatches(const QString &mailbox, const uint uidValidity, const Imap::Uids &uids);
+    void forgetSearch(QObject *task);
+    void finishIfDone();
+
+    QPointer<Model> m_model;
+    QVector<Match> m_matches;
+    QPointer<MultiSearchTask> m_multiSearch;
+    QList<QPointer<ExamineSearchTask>> m_examineSearches;
+    int m_concurrency;
+    QElapsedTimer m_timer;
+};
+
+}
+
+}
+
+#endif /* IMAP_MODEL_CROSSMAILBOXSEARCHMODEL_H */
@@ -21,8 +21,14 @@
 */
 
 #include "DiskPartCache.h"
+#include <QCryptographicHash>
+#include <QDataStream>
 #include <QDebug>
 #include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QSet>
 
 namespace
 {
@@ -63,6 +69,9 @@ QString fileErrorToString(const QFile::FileError e)
     }
     return QObject::tr("Unrecognized QFile error");
 }
+
+/** @short Length of the hex-encoded SHA-256 hash which names the blobs */
+const int blobHashLength = 64;
 }
 
 namespace Imap
@@ -70,8 +79,49 @@ namespace Imap
 namespace Mailbox
 {
 
+MappedPart::MappedPart(const QString &fileName)
+    : m_file(fileName)
+    , m_data(0)
+    , m_size(0)
+{
+}
+
+MappedPart::~MappedPart()
+{
+    if (m_data)
+        m_file.unmap(m_data);
+}
+
+std::shared_ptr<MappedPart> MappedPart::map(const QString &fileName)
+{
+    std::shared_ptr<MappedPart> res(new MappedPart(fileName));
+    if (!res->m_file.open(QIODevice::ReadOnly))
+        return nullptr;
+    res->m_size = res->m_file.size();
+    if (!res->m_size)
+        return nullptr;
+    res->m_data = res->m_file.map(0, res->m_size);
+    if (!res->m_data)
+        return nullptr;
+    return res;
+}
+
+QByteArray MappedPart::data() const
+{
+    return QByteArray::fromRawData(reinterpret_cast<const char *>(m_data), m_size);
+}
+
+DiskPartCache::DeduplicationStatistics::DeduplicationStatistics()
+    : blobs(0)
+    , references(0)
+    , storedBytes(0)
+    , savedBytes(0)
+{
+}
+
 DiskPartCache::DiskPartCache(const QString &cacheDir_)
     : cacheDir(cacheDir_)
+    , m_totalSize(-1)
 {
     if (!cacheDir.endsWith(QLatin1Char('/')))
         cacheDir.append(QLatin1Char('/'));
@@ -80,25 +130,93 @@ DiskPartCache::DiskPartCache(const QString &cacheDir_)
 void DiskPartCache::clearAllMessages(const QString &mailbox)
 {
     QDir dir(dirForMailbox(mailbox));
-    Q_FOREACH(const QString& fname, dir.entryList(QStringList() << QLatin1String("*.cache"))) {
-        if (! dir.remove(fname)) {
-            m_errorHandler(QObject::tr("Couldn't remove file %1 for mailbox %2").arg(fname, mailbox));
+    Q_FOREACH(const QString &fname, dir.entryList(QStringList() << QStringLiteral("*.ref"), QDir::Files)) {
+        releaseRef(dir.filePath(fname));
+    }
+    Q_FOREACH(const QFileInfo &file, dir.entryInfoList(QStringList() << QLatin1String("*.cache"))) {
+        if (! dir.remove(file.fileName())) {
+            m_errorHandler(QObject::tr("Couldn't remove file %1 for mailbox %2").arg(file.fileName(), mailbox));
+        } else {
+            accountFor(-file.size());
         }
     }
 }
 
-void DiskPartCache::clearMessage(const QString mailbox, const uint uid)
+quint64 DiskPartCache::clearMessage(const QString mailbox, const uint uid)
 {
+    return clearMessages(mailbox, Imap::Uids() << uid);
+}
+
+quint64 DiskPartCache::clearMessages(const QString &mailbox, const Imap::Uids &uids)
+{
+    quint64 freed = 0;
+    QSet<uint> wanted;
+    wanted.reserve(uids.size());
+    Q_FOREACH(const uint uid, uids) {
+        wanted.insert(uid);
+    }
     QDir dir(dirForMailbox(mailbox));
-    Q_FOREACH(const QString& fname, dir.entryList(QStringList() << QString::fromUtf8("%1_*.cache").arg(QString::number(uid)))) {
-        if (! dir.remove(fname)) {
-            m_errorHandler(QObject::tr("Couldn't remove file %1 for message %2, mailbox %3").arg(fname, QString::number(uid), mailbox));
+    Q_FOREACH(const QFileInfo &file, dir.entryInfoList(QStringList() << QStringLiteral("*.ref") << QStringLiteral("*.cache"),
+                                                         QDir::Files)) {
+        // The file names start with the UID of the message
+        const QString fileName = file.fileName();
+        const int separator = fileName.indexOf(QLatin1Char('_'));
+        bool ok;
+        const uint uid = fileName.left(separator).toUInt(&ok);
+        if (separator <= 0 || !ok || !wanted.contains(uid))
+            continue;
+        if (fileName.endsWith(QLatin1String(".ref"))) {
+            freed += releaseRef(file.filePath());
+        } else if (! dir.remove(fileName)) {
+            m_errorHandler(QObject::tr("Couldn't remove file %1 for message %2, mailbox %3").arg(fileName, QString::number(uid), mailbox));
+        } else {
+            freed += file.size();
+            accountFor(-file.size());
+        }
+    }
+    return freed;
+}
+
+quint64 DiskPartCache::totalSize() const
+{
+    if (m_totalSize < 0) {
+        qint64 size = 0;
+        QDirIterator it(cacheDir, QStringList() << QStringLiteral("*.cache"), QDir::Files, QDirIterator::Subdirectories);
+        while (it.hasNext()) {
+            it.next();
+            size += it.fileInfo().size();
         }
+        m_totalSize = size;
     }
+    return m_totalSize;
+}
+
+void DiskPartCache::accountFor(const qint64 delta)
+{
+    if (m_totalSize >= 0)
+        m_totalSize = qMax<qint64>(0, m_totalSize + delta);
+}
+
+quint64 DiskPartCache::removeDataFile(const QString &fileName)
+{
+    QFile file(fileName);
+    const qint64 size = file.size();
+    if (!file.remove())
+        return 0;
+    accountFor(-size);
+    return size;
 }
 
 QByteArray DiskPartCache::messagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const
 {
+    const QByteArray hash = readRef(fileForPartRef(mailbox, uid, partId));
+    if (!hash.isEmpty()) {
+        QFile blob(fileForBlob(hash));
+        if (!blob.open(QIODevice::ReadOnly))
+            return QByteArray();
+        return blob.readAll();
+    }
+
     QFile buf(fileForPart(mailbox, uid, partId));
     if (! buf.open(QIODevice::ReadOnly)) {
         return QByteArray();
@@ -106,24 +224,245 @@ QByteArray DiskPartCache::messagePart(const QString &mailbox, const uint uid, co
     return qUncompress(buf.readAll());
 }
 
+std::shared_ptr<MappedPart> DiskPartCache::mappedMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const
+{
+    const QByteArray hash = readRef(fileForPartRef(mailbox, uid, partId));
+    if (hash.isEmpty()) {
+        // The legacy files are compressed
+        return nullptr;
+    }
+    return MappedPart::map(fileForBlob(hash));
+}
+
 void DiskPartCache::setMsgPart(const QString &mailbox, const uint uid, const QByteArray &partId, const QByteArray &data)
 {
     QString myPath = dirForMailbox(mailbox);
     QDir dir(myPath);
     dir.mkpath(myPath);
-    QString fileName(fileForPart(mailbox, uid, partId));
+
+    const QByteArray hash = QCryptographicHash::hash(data, QCryptographicHash::Sha256).toHex();
+    const QString refFileName = fileForPartRef(mailbox, uid, partId);
+    const QByteArray oldHash = readRef(refFileName);
+    if (oldHash == hash)
+        return;
+    if (!oldHash.isEmpty())
+        releaseRef(refFileName);
+    removeDataFile(fileForPart(mailbox, uid, partId));
+
+    const int count = refCount(hash);
+    if (!count) {
+        QString fileName = fileForBlob(hash);
+        dir.mkpath(QFileInfo(fileName).path());
+        QSaveFile blob(fileName);
+        if (!blob.open(QIODevice::WriteOnly) || blob.write(data) != data.size() || !blob.commit()) {
+            m_errorHandler(QObject::tr("Couldn't save the part %1 of message %2 (mailbox %3) into file %4: %5 (%6)").arg(
+                               QString::fromUtf8(partId), QString::number(uid), mailbox, fileName, blob.errorString(),
+                               fileErrorToString(blob.error())));
+            return;
+        }
+        accountFor(data.size());
+    }
+    if (!writeRefCount(hash, count + 1))
+        return;
+
+    QSaveFile ref(refFileName);
+    if (!ref.open(QIODevice::WriteOnly) || ref.write(hash) < 0 || !ref.commit()) {
+        m_errorHandler(QObject::tr("Couldn't save the reference to part %1 of message %2 (mailbox %3) into file %4: %5 (%6)").arg(
+                           QString::fromUtf8(partId), QString::number(uid), mailbox, refFileName, ref.errorString(),
+                           fileErrorToString(ref.error())));
+        // Don't leak the reference which we have just counted
+        writeRefCount(hash, count);
+    }
+}
+
+void DiskPartCache::forgetMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId)
+{
+    const QString refFileName = fileForPartRef(mailbox, uid, partId);
+    if (QFile::exists(refFileName))
+        releaseRef(refFileName);
+    removeDataFile(fileForPart(mailbox, uid, partId));
+}
+
+QByteArray DiskPartCache::partialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkSize) const
+{
+    uint storedChunkSize;
+    QBitArray completed;
+    if (!readChunkBitmap(fileForChunkBitmap(mailbox, uid, partId), storedChunkSize, completed) || storedChunkSize != chunkSize)
+        return QByteArray();
+
+    int contiguous = 0;
+    while (contiguous < completed.size() && completed.testBit(contiguous))
+        ++contiguous;
+    if (!contiguous)
+        return QByteArray();
+
+    QFile buf(fileForPartialPart(mailbox, uid, partId));
+    if (!buf.open(QIODevice::ReadOnly))
+        return QByteArray();
+    return buf.read(static_cast<qint64>(contiguous) * chunkSize);
+}
+
+void DiskPartCache::setMsgPartChunk(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkNumber,
+                                    const uint chunkSize, const QByteArray &data)
+{
+    QString myPath = dirForMailbox(mailbox);
+    QDir dir(myPath);
+    dir.mkpath(myPath);
+
+    QString bitmapFileName = fileForChunkBitmap(mailbox, uid, partId);
+    uint storedChunkSize;
+    QBitArray completed;
+    if (!readChunkBitmap(bitmapFileName, storedChunkSize, completed) || storedChunkSize != chunkSize) {
+        // Either there's nothing yet, or the chunks were written with a different granularity and are useless now
+        completed.clear();
+        removeDataFile(fileForPartialPart(mailbox, uid, partId));
+    }
+
+    QString fileName = fileForPartialPart(mailbox, uid, partId);
     QFile buf(fileName);
-    if (! buf.open(QIODevice::WriteOnly)) {
-        m_errorHandler(QObject::tr("Couldn't save the part %1 of message %2 (mailbox %3) into file %4: %5 (%6)").arg(
+    const qint64 oldSize = buf.size();
+    if (!buf.open(QIODevice::ReadWrite)) {
+        m_errorHandler(QObject::tr("Couldn't save a chunk of part %1 of message %2 (mailbox %3) into file %4: %5 (%6)").arg(
+                           QString::fromUtf8(partId), QString::number(uid), mailbox, fileName, buf.errorString(),
+                           fileErrorToString(buf.error())));
+        return;
+    }
+    const bool written = buf.seek(static_cast<qint64>(chunkNumber) * chunkSize) && buf.write(data) == data.size();
+    buf.close();
+    accountFor(buf.size() - oldSize);
+    if (!written) {
+        m_errorHandler(QObject::tr("Couldn't write a chunk of part %1 of message %2 (mailbox %3) into file %4: %5 (%6)").arg(
                            QString::fromUtf8(partId), QString::number(uid), mailbox, fileName, buf.errorString(),
                            fileErrorToString(buf.error())));
+        return;
     }
-    buf.write(qCompress(data));
+
+    // The bitmap is only updated once the data is safely out, so that an interrupted write never marks a chunk as complete
+    if (completed.size() <= static_cast<int>(chunkNumber))
+        completed.resize(chunkNumber + 1);
+    completed.setBit(chunkNumber);
+    QFile bitmap(bitmapFileName);
+    const qint64 oldBitmapSize = bitmap.size();
+    if (!bitmap.open(QIODevice::WriteOnly)) {
+        m_errorHandler(QObject::tr("Couldn't save the chunk bitmap of part %1 of message %2 (mailbox %3) into file %4: %5 (%6)").arg(
+                           QString::fromUtf8(partId), QString::number(uid), mailbox, bitmapFileName, bitmap.errorString(),
+                           fileErrorToString(bitmap.error())));
+        return;
+    }
+    QDataStream stream(&bitmap);
+    stream.setVersion(QDataStream::Qt_4_6);
+    stream << static_cast<quint32>(chunkSize) << completed;
+    bitmap.close();
+    accountFor(bitmap.size() - oldBitmapSize);
 }
 
-void DiskPartCache::forgetMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId)
+void DiskPartCache::forgetPartialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId)
+{
+    removeDataFile(fileForChunkBitmap(mailbox, uid, partId));
+    removeDataFile(fileForPartialPart(mailbox, uid, partId));
+}
+
+bool DiskPartCache::readChunkBitmap(const QString &fileName, uint &chunkSize, QBitArray &completed) const
+{
+    QFile bitmap(fileName);
+    if (!bitmap.open(QIODevice::ReadOnly))
+        return false;
+    QDataStream stream(&bitmap);
+    stream.setVersion(QDataStream::Qt_4_6);
+    quint32 storedChunkSize;
+    stream >> storedChunkSize >> completed;
+    if (stream.status() != QDataStream::Ok)
+        return false;
+    chunkSize = storedChunkSize;
+    return true;
+}
+
+QByteArray DiskPartCache::readRef(const QString &refFileName) const
+{
+    QFile ref(refFileName);
+    if (!ref.open(QIODevice::ReadOnly))
+        return QByteArray();
+    QByteArray hash = ref.read(blobHashLength + 1);
+    // The hash becomes a part of a file name, so it'd better be what we expect
+    if (hash.size() != blobHashLength)
+        return QByteArray();
+    for (const char c : hash) {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+            return QByteArray();
+    }
+    return hash;
+}
+
+int DiskPartCache::refCount(const QByteArray &hash) const
+{
+    QFile counter(fileForRefCount(hash));
+    if (!counter.open(QIODevice::ReadOnly))
+        return 0;
+    bool ok;
+    const int count = counter.readAll().trimmed().toInt(&ok);
+    return ok && count > 0 ? count : 0;
+}
+
+bool DiskPartCache::writeRefCount(const QByteArray &hash, const int count)
+{
+    QString fileName = fileForRefCount(hash);
+    QSaveFile counter(fileName);
+    if (!counter.open(QIODevice::WriteOnly) || counter.write(QByteArray::number(count)) < 0 || !counter.commit()) {
+        m_errorHandler(QObject::tr("Couldn't update the reference count in file %1: %2 (%3)").arg(
+                           fileName, counter.errorString(), fileErrorToString(counter.error())));
+        return false;
+    }
+    return true;
+}
+
+quint64 DiskPartCache::releaseRef(const QString &refFileName)
+{
+    const QByteArray hash = readRef(refFileName);
+    QFile ref(refFileName);
+    quint64 freed = ref.size();
+    if (!ref.remove()) {
+        m_errorHandler(QObject::tr("Couldn't remove file %1: %2 (%3)").arg(refFileName, ref.errorString(),
+                                                                          fileErrorToString(ref.error())));
+        return 0;
+    }
+    if (hash.isEmpty())
+        return freed;
+
+    const int count = refCount(hash) - 1;
+    if (count > 0) {
+        writeRefCount(hash, count);
+        return freed;
+    }
+    QFile blob(fileForBlob(hash));
+    const quint64 blobSize = blob.size();
+    if (blob.remove()) {
+        freed += blobSize;
+        accountFor(-static_cast<qint64>(blobSize));
+    } else if (blob.exists()) {
+        m_errorHandler(QObject::tr("Couldn't remove file %1: %2 (%3)").arg(blob.fileName(), blob.errorString(),
+                                                                          fileErrorToString(blob.error())));
+    }
+    QFile(fileForRefCount(hash)).remove();
+    return freed;
+}
+
+DiskPartCache::DeduplicationStatistics DiskPartCache::deduplicationStatistics() const
 {
-    QFile(fileForPart(mailbox, uid, partId)).remove();
+    DeduplicationStatistics stats;
+    QDirIterator it(cacheDir + QLatin1String("blobs"), QStringList() << QStringLiteral("*.refcount"), QDir::Files,
+                    QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        it.next();
+        const QByteArray hash = it.fileInfo().completeBaseName().toLatin1();
+        const int count = refCount(hash);
+        const quint64 size = QFileInfo(fileForBlob(hash)).size();
+        ++stats.blobs;
+        stats.references += count;
+        stats.storedBytes += size;
+        if (count > 1)
+            stats.savedBytes += (count - 1) * size;
+    }
+    return stats;
 }
 
 QString DiskPartCache::dirForMailbox(const QString &mailbox) const
@@ -136,6 +475,32 @@ QString DiskPartCache::fileForPart(const QString &mailbox, const uint uid, const
     return QStringLiteral("%1/%2_%3.cache").arg(dirForMailbox(mailbox), QString::number(uid), QString::fromUtf8(partId));
 }
 
+QString DiskPartCache::fileForPartRef(const QString &mailbox, const uint uid, const QByteArray &partId) const
+{
+    return QStringLiteral("%1/%2_%3.ref").arg(dirForMailbox(mailbox), QString::number(uid), QString::fromUtf8(partId));
+}
+
+QString DiskPartCache::fileForBlob(const QByteArray &hash) const
+{
+    // Mailbox directories are named in base64 whose length is always a multiple of four, so they cannot clash with this one
+    return QStringLiteral("%1blobs/%2/%3.cache").arg(cacheDir, QString::fromLatin1(hash.left(2)), QString::fromLatin1(hash));
+}
+
+QString DiskPartCache::fileForRefCount(const QByteArray &hash) const
+{
+    return QStringLiteral("%1blobs/%2/%3.refcount").arg(cacheDir, QString::fromLatin1(hash.left(2)), QString::fromLatin1(hash));
+}
+
+QString DiskPartCache::fileForPartialPart(const QString &mailbox, const uint uid, const QByteArray &partId) const
+{
+    return QStringLiteral("%1/%2_%3.partial.cache").arg(dirForMailbox(mailbox), QString::number(uid), QString::fromUtf8(partId));
+}
+
+QString DiskPartCache::fileForChunkBitmap(const QString &mailbox, const uint uid, const QByteArray &partId) const
+{
+    return QStringLiteral("%1/%2_%3.chunks.cache").arg(dirForMailbox(mailbox), QString::number(uid), QString::fromUtf8(partId));
+}
+
 void DiskPartCache::setErrorHandler(const std::function<void(const QString &)> &handler)
 {
     m_errorHandler = handler;
@@ -24,7 +24,12 @@
 #define IMAP_MODEL_DISKPARTCACHE_H
 
 #include <functional>
+#include <memory>
+#include <QBitArray>
+#include <QByteArray>
+#include <QFile>
 #include <QString>
+#include "Imap/Parser/Uids.h"
 
 namespace Imap
 {
@@ -32,29 +37,101 @@ namespace Imap
 namespace Mailbox
 {
 
+/** @short Read-only memory mapping of a file from the DiskPartCache
+
+The mapped pages are backed by the file itself, so reading them does not increase the amount of the process' private
+memory. The data are unmapped once this object is destroyed.
+*/
+class MappedPart
+{
+public:
+    /** @short Map the whole file, return nullptr when it cannot be mapped */
+    static std::shared_ptr<MappedPart> map(const QString &fileName);
+    ~MappedPart();
+
+    /** @short Access the data without copying them
+
+    The returned QByteArray and all of its copies point directly to the mapping, so they can only be used for as long as
+    this object lives.
+    */
+    QByteArray data() const;
+
+private:
+    explicit MappedPart(const QString &fileName);
+    MappedPart(const MappedPart &); // don't implement
+    MappedPart &operator=(const MappedPart &); // don't implement
+
+    QFile m_file;
+    uchar *m_data;
+    qint64 m_size;
+};
+
 /** @short Cache for storing big message parts using plain files on the disk
 
 The API is designed to be "similar" to the AbstractCache, but because certain
 operations do not really make much sense (like working with a list of mailboxes),
 we do not inherit from that abstract base class.
+
+The data are stored just once no matter how many messages contain them, which
+helps with big attachments which are forwarded around or copied among mailboxes.
+Each blob is named after a SHA-256 hash of its content and it keeps a count of
+references which point to it. A message part is represented by a tiny reference
+file in its mailbox's directory which holds the hash of the blob.
+
+The blobs are not compressed because big parts are usually in some compressed
+format already, and because it allows mapping them into memory directly.
 */
 class DiskPartCache
 {
 public:
+    /** @short How much space the deduplication has saved */
+    struct DeduplicationStatistics {
+        /** @short Number of distinct blobs */
+        quint64 blobs;
+        /** @short Number of message parts which point to these blobs */
+        quint64 references;
+        /** @short Bytes which are actually occupied by the blobs */
+        quint64 storedBytes;
+        /** @short Bytes which would have been needed for storing each message part separately */
+        quint64 savedBytes;
+
+        DeduplicationStatistics();
+    };
+
     /** @short Create the cache occupying the @arg cacheDir directory */
     explicit DiskPartCache(const QString &cacheDir);
 
     /** @short Delete all data of message parts which belongs to that particular mailbox */
     void clearAllMessages(const QString &mailbox);
-    /** @short Delete all data for a particular message in the given mailbox */
-    void clearMessage(const QString mailbox, const uint uid);
+    /** @short Delete all data for a particular message in the given mailbox, return the number of bytes freed */
+    quint64 clearMessage(const QString mailbox, const uint uid);
+    /** @short Delete all data of the listed messages, reading the mailbox' directory just once */
+    quint64 clearMessages(const QString &mailbox, const Imap::Uids &uids);
+    /** @short Number of bytes occupied by all data files of this cache
+
+    The directory is only scanned on the first call; the changes made through this object are accounted for as they happen.
+    */
+    quint64 totalSize() const;
 
     /** @short Return data for some message part, or a null QByteArray if not found */
     QByteArray messagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const;
+    /** @short Map the data of a message part into memory, or return nullptr if not possible */
+    std::shared_ptr<MappedPart> mappedMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const;
     /** @short Store the data for a specified message part */
     void setMsgPart(const QString &mailbox, const uint uid, const QByteArray &partId, const QByteArray &data);
     void forgetMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId);
 
+    /** @short Return the leading contiguous chunks of a partially downloaded part, or a null QByteArray */
+    QByteArray partialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkSize) const;
+    /** @short Write one chunk of a partially downloaded part and mark it as complete */
+    void setMsgPartChunk(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkNumber,
+                         const uint chunkSize, const QByteArray &data);
+    /** @short Remove the chunks of a partially downloaded part along with its completion bitmap */
+    void forgetPartialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId);
+
+    /** @short Scan the blob store and report how much the deduplication helps */
+    DeduplicationStatistics deduplicationStatistics() const;
+
     /** @short Inform about runtime failures */
     void setErrorHandler(const std::function<void(const QString &)> &handler);
 
@@ -62,10 +139,36 @@ private:
     /** @short Return the directory which should be used as a storage dir for a particular mailbox */
     QString dirForMailbox(const QString &mailbox) const;
 
+    /** @short File with the data of a part as written by older versions which did not deduplicate anything */
     QString fileForPart(const QString &mailbox, const uint uid, const QByteArray &partId) const;
+    /** @short File holding the hash of the blob with the part's data */
+    QString fileForPartRef(const QString &mailbox, const uint uid, const QByteArray &partId) const;
+    /** @short File with the compressed data of a blob */
+    QString fileForBlob(const QByteArray &hash) const;
+    /** @short File with the number of references to a blob */
+    QString fileForRefCount(const QByteArray &hash) const;
+    /** @short File holding the raw, uncompressed chunks of a part which is still being downloaded */
+    QString fileForPartialPart(const QString &mailbox, const uint uid, const QByteArray &partId) const;
+    /** @short File holding the chunk size and a bitmap of chunks which have already been written */
+    QString fileForChunkBitmap(const QString &mailbox, const uint uid, const QByteArray &partId) const;
+
+    bool readChunkBitmap(const QString &fileName, uint &chunkSize, QBitArray &completed) const;
+
+    /** @short Return the hash of the blob referenced from the @arg refFileName, or a null QByteArray */
+    QByteArray readRef(const QString &refFileName) const;
+    int refCount(const QByteArray &hash) const;
+    bool writeRefCount(const QByteArray &hash, const int count);
+    /** @short Remove a reference file and drop the blob when nobody needs it anymore, return the number of bytes freed */
+    quint64 releaseRef(const QString &refFileName);
+    /** @short Remove a data file and return its size, or zero if it could not be removed */
+    quint64 removeDataFile(const QString &fileName);
+    /** @short Update the running total of the data files' sizes */
+    void accountFor(const qint64 delta);
 
     /** @short The root directory for all caching */
     QString cacheDir;
+    /** @short Running total of the sizes of the data files, or -1 when the directory was not scanned yet */
+    mutable qint64 m_totalSize;
 
 protected:
     std::function<void(const QString&)> m_errorHandler;
@@ -44,6 +44,7 @@
 #include "Imap/Model/VisibleTasksModel.h"
 #include "Imap/Network/MsgPartNetAccessManager.h"
 #include "Streams/SocketFactory.h"
+#include "Streams/TlsSessionCache.h"
 #include "UiUtils/PasswordWatcher.h"
 
 namespace Imap {
@@ -54,7 +55,7 @@ ImapAccess::ImapAccess(QObject *parent, QSettings *settings, Plugins::PluginMana
     m_pluginManager(pluginManager), m_passwordWatcher(0), m_port(0),
     m_connectionMethod(Common::ConnectionMethod::Invalid),
     m_sslInfoIcon(UiUtils::Formatting::IconType::NoIcon),
-    m_accountName(accountName)
+    m_accountName(accountName), m_tlsSessionCache(std::make_shared<Streams::TlsSessionCache>())
 {
     Imap::migrateSettings(m_settings);
     reloadConfiguration();
@@ -294,10 +295,12 @@ void ImapAccess::doConnect()
         factory.reset(new Streams::TlsAbleSocketFactory(server(), port()));
         factory->setStartTlsRequired(m_connectionMethod == Common::ConnectionMethod::NetStartTls);
         factory->setProxySettings(proxySettings, QStringLiteral("imap"));
+        factory->setTlsSessionCache(m_tlsSessionCache);
         break;
     case Common::ConnectionMethod::NetDedicatedTls:
         factory.reset(new Streams::SslSocketFactory(server(), port()));
         factory->setProxySettings(proxySettings, QStringLiteral("imap"));
+        factory->setTlsSessionCache(m_tlsSessionCache);
         break;
     case Common::ConnectionMethod::Process:
         QStringList args = m_settings->value(Common::SettingsNames::imapProcessKey).toString().split(QLatin1Char(' '));
@@ -333,16 +336,20 @@ void ImapAccess::doConnect()
     std::shared_ptr<Imap::Mailbox::AbstractCache> cache;
 
     if (!shouldUsePersistentCache) {
-        cache.reset(new Imap::Mailbox::MemoryCache());
+        cache = createMemoryCache();
     } else {
         cache.reset(new Imap::Mailbox::CombinedCache(QStringLiteral("trojita-imap-cache"), m_cacheDir));
         cache->setErrorHandler([this](const QString &e) { this->onCacheError(e); });
         if (! static_cast<Imap::Mailbox::CombinedCache *>(cache.get())->open()) {
             // Error message was already shown by the cacheError() slot
-            cache.reset(new Imap::Mailbox::MemoryCache());
+            cache = createMemoryCache();
         } else {
+            // In MiB; when keeping everything, there's no limit unless the user asks for one
+            int sizeBudget = 0;
+            int maxAge = 0;
             if (m_settings->value(Common::SettingsNames::cacheOfflineKey).toString() == Common::SettingsNames::cacheOfflineAll) {
                 cache->setRenewalThreshold(0);
+                sizeBudget = m_settings->value(Common::SettingsNames::cacheOfflineSizeBudgetKey, 0).toInt();
             } else {
                 const int defaultCacheLifetime = 30;
                 bool ok;
@@ -350,7 +357,18 @@ void ImapAccess::doConnect()
                 if (!ok)
                     num = defaultCacheLifetime;
                 cache->setRenewalThreshold(num);
+                maxAge = num;
+                sizeBudget = m_settings->value(Common::SettingsNames::cacheOfflineSizeBudgetKey, 2048).toInt();
             }
+            static_cast<Imap::Mailbox::CombinedCache *>(cache.get())->setGarbageCollection(
+                        maxAge, static_cast<quint64>(qMax(0, sizeBudget)) * 1024 * 1024,
+                        [this](const quint64 reclaimed, const uint messages) {
+                if (m_imapModel) {
+                    m_imapModel->logTrace(0, Common::LOG_OTHER, QStringLiteral("Cache"),
+                                          tr("Expired cached data of %n message(s), reclaimed %1", "", messages)
+                                          .arg(UiUtils::Formatting::prettySize(reclaimed)));
+                }
+            });
         }
     }
 
@@ -359,6 +377,17 @@ void ImapAccess::doConnect()
     m_imapModel->setCapabilitiesBlacklist(m_settings->value(Common::SettingsNames::imapBlacklistedCapabilities).toStringList());
     m_imapModel->setProperty("trojita-imap-id-no-versions", !m_settings->value(Common::SettingsNames::interopRevealVersions, true).toBool());
     m_imapModel->setProperty("trojita-imap-idle-renewal", m_settings->value(Common::SettingsNames::imapIdleRenewal).toUInt() * 60 * 1000);
+    // Keeping a few recently used mailboxes selected makes switching between them instant. Most servers allow at least
+    // ten connections per user, so let's stay well below that by default.
+    m_imapModel->setMaxConnections(m_settings->value(Common::SettingsNames::imapMaxConnections, 3).toInt());
+    if (m_settings->value(Common::SettingsNames::imapFastReconnect, true).toBool()) {
+        // Only trust what we have seen previously when talking to the very same server
+        if (m_settings->value(Common::SettingsNames::imapRememberedCapsServer).toString() == rememberedCapabilitiesTag()) {
+            m_imapModel->setRememberedCapabilities(m_settings->value(Common::SettingsNames::imapRememberedCapsPreAuth).toStringList(),
+                                                   m_settings->value(Common::SettingsNames::imapRememberedCapsPostAuth).toStringList());
+        }
+        connect(m_imapModel, &Mailbox::Model::capabilitiesRemembered, this, &ImapAccess::onCapabilitiesRemembered);
+    }
     m_imapModel->setNumberRefreshInterval(numberRefreshInterval());
     connect(m_imapModel, &Mailbox::Model::alertReceived, this, &ImapAccess::alertReceived);
     connect(m_imapModel, &Mailbox::Model::imapError, this, &ImapAccess::imapError);
@@ -411,10 +440,19 @@ void ImapAccess::doConnect()
     emit modelsChanged();
 }
 
+std::shared_ptr<Imap::Mailbox::AbstractCache> ImapAccess::createMemoryCache()
+{
+    auto cache = std::make_shared<Imap::Mailbox::MemoryCache>();
+    // In MiB, zero means no limit
+    const int partBudget = m_settings->value(Common::SettingsNames::cacheMemoryPartBudgetKey, 0).toInt();
+    cache->setPartBudget(static_cast<quint64>(qMax(0, partBudget)) * 1024 * 1024);
+    return cache;
+}
+
 void ImapAccess::onCacheError(const QString &message)
 {
     if (m_imapModel) {
-        m_imapModel->setCache(std::make_shared<Imap::Mailbox::MemoryCache>());
+        m_imapModel->setCache(createMemoryCache());
     }
     emit cacheError(message);
 }
@@ -449,6 +487,11 @@ QObject *ImapAccess::networkWatcher() const
     return m_netWatcher;
 }
 
+std::shared_ptr<Streams::TlsSessionCache> ImapAccess::tlsSessionCache() const
+{
+    return m_tlsSessionCache;
+}
+
 QObject *ImapAccess::msgQNAM() const
 {
     return m_msgQNAM;
@@ -501,6 +544,23 @@ void ImapAccess::onRequireStartTlsInFuture()
     }
 }
 
+/** @short Identification of the server endpoint for which the remembered capabilities are valid */
+QString ImapAccess::rememberedCapabilitiesTag() const
+{
+    if (m_connectionMethod == Common::ConnectionMethod::Process) {
+        return QLatin1String("process:") + m_settings->value(Common::SettingsNames::imapProcessKey).toString();
+    }
+    return QStringLiteral("%1:%2:%3").arg(m_server, QString::number(m_port), sslMode());
+}
+
+void ImapAccess::onCapabilitiesRemembered(const QStringList &preAuth, const QStringList &postAuth)
+{
+    m_settings->setValue(Common::SettingsNames::imapRememberedCapsServer, rememberedCapabilitiesTag());
+    m_settings->setValue(Common::SettingsNames::imapRememberedCapsPreAuth, preAuth);
+    m_settings->setValue(Common::SettingsNames::imapRememberedCapsPostAuth, postAuth);
+    m_imapModel->setRememberedCapabilities(preAuth, postAuth);
+}
+
 void ImapAccess::desiredNetworkPolicyChanged(const Mailbox::NetworkPolicy policy)
 {
     switch (policy) {
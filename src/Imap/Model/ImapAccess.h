@@ -23,6 +23,7 @@
 #ifndef TROJITA_IMAPACCESS_H
 #define TROJITA_IMAPACCESS_H
 
+#include <memory>
 #include <QObject>
 #include <QSslError>
 
@@ -39,6 +40,10 @@ namespace Plugins {
 class PluginManager;
 }
 
+namespace Streams {
+class TlsSessionCache;
+}
+
 namespace UiUtils {
 class PasswordWatcher;
 }
@@ -46,6 +51,7 @@ class PasswordWatcher;
 namespace Imap {
 
 namespace Mailbox {
+class AbstractCache;
 class MailboxModel;
 class Model;
 class MsgListModel;
@@ -92,6 +98,8 @@ public:
     QAbstractItemModel *threadingMsgListModel() const;
     QObject *msgQNAM() const;
     UiUtils::PasswordWatcher *passwordWatcher() const;
+    /** @short TLS sessions of this account, suitable for sharing with the SMTP connections */
+    std::shared_ptr<Streams::TlsSessionCache> tlsSessionCache() const;
 
     QString server() const;
     void setServer(const QString &server);
@@ -155,8 +163,13 @@ public slots:
 private slots:
     void onRequireStartTlsInFuture();
     void desiredNetworkPolicyChanged(const Imap::Mailbox::NetworkPolicy policy);
+    void onCapabilitiesRemembered(const QStringList &preAuth, const QStringList &postAuth);
 
 private:
+    QString rememberedCapabilitiesTag() const;
+    /** @short Create the cache which is used when the data must not be stored on the disk */
+    std::shared_ptr<Imap::Mailbox::AbstractCache> createMemoryCache();
+
     QSettings *m_settings;
     Imap::Mailbox::Model *m_imapModel;
     Imap::Mailbox::MailboxModel *m_mailboxModel;
@@ -184,6 +197,7 @@ private:
 
     QString m_accountName;
     QString m_cacheDir;
+    std::shared_ptr<Streams::TlsSessionCache> m_tlsSessionCache;
 };
 
 }
@@ -122,6 +122,14 @@ enum {
     RoleThreadRootWithUnreadMessages,
     /** @short Aggregated flags from the thread */
     RoleThreadAggregatedFlags,
+    /** @short Number of messages in the subtree rooted at this message, including the message itself */
+    RoleThreadMessageCount,
+    /** @short Number of unread messages in the subtree rooted at this message */
+    RoleThreadUnreadCount,
+    /** @short Number of messages marked as \\Flagged in the subtree rooted at this message */
+    RoleThreadFlaggedCount,
+    /** @short Date of the newest message in the subtree rooted at this message */
+    RoleThreadNewestDate,
     /** @short Fuzzy date of a particular message; useful for rough navigation */
     RoleMessageFuzzyDate,
     /** @short List of message IDs from the message's References header */
@@ -173,7 +181,11 @@ enum {
 
     /** @short Fetch a part from the cache if it's available, but do not request it from the server */
     RolePartForceFetchFromCache,
-    /** @short Pointer to the internal buffer */
+    /** @short Pointer to the internal buffer, requesting its data if they are not available yet
+
+    Unlike the RolePartData, this keeps the parts which are mapped from the disk cache out of memory. The pointer is
+    only valid for as long as the part exists.
+    */
     RolePartBufferPtr,
 
     /** @short QModelIndex of the message a part is associated to */
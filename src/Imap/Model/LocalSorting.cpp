@@ -0,0 +1,229 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <future>
+#include <QSet>
+#include <QThread>
+#include "LocalSorting.h"
+#include "LocalThreading.h"
+
+namespace {
+
+/** @short Chunks smaller than this are not worth a thread of their own */
+const int minimalParallelChunk = 16384;
+
+/** @short Sort the range using all available cores, merging the sorted chunks afterwards */
+template<typename Iterator, typename Compare>
+void parallelSort(Iterator begin, Iterator end, Compare compare)
+{
+    const auto size = end - begin;
+    const int chunks = qBound(1, static_cast<int>(size / minimalParallelChunk), QThread::idealThreadCount());
+    if (chunks == 1) {
+        std::sort(begin, end, compare);
+        return;
+    }
+
+    std::vector<Iterator> bounds;
+    for (int i = 0; i <= chunks; ++i)
+        bounds.push_back(begin + size * i / chunks);
+    std::vector<std::future<void>> jobs;
+    for (int i = 0; i < chunks; ++i) {
+        jobs.push_back(std::async(std::launch::async, [&bounds, &compare, i]() {
+            std::sort(bounds[i], bounds[i + 1], compare);
+        }));
+    }
+    for (auto &job : jobs)
+        job.get();
+    for (int step = 1; step < chunks; step *= 2) {
+        for (int i = 0; i + step < chunks; i += 2 * step)
+            std::inplace_merge(bounds[i], bounds[i + step], bounds[std::min(i + 2 * step, chunks)], compare);
+    }
+}
+
+/** @short The key for sorting by an address, i.e. the display name of the first address, or its e-mail if there is no name */
+QString addressKey(const QList<Imap::Message::MailAddress> &addresses)
+{
+    if (addresses.isEmpty())
+        return QString();
+    return addresses.first().prettyName(Imap::Message::MailAddress::FORMAT_JUST_NAME).toCaseFolded();
+}
+
+}
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+LocalSortingMessage::LocalSortingMessage(): uid(0), size(0)
+{
+}
+
+LocalSortingMessage::LocalSortingMessage(const uint uid): uid(uid), size(0)
+{
+}
+
+LocalSortingMessage::LocalSortingMessage(const uint uid, const Message::Envelope &envelope, const QDateTime &internalDate,
+                                         const quint64 size):
+    uid(uid), envelope(envelope), internalDate(internalDate), size(size)
+{
+}
+
+LocalSorter::LocalSorter(): m_criterium(ThreadingMsgListModel::SORT_NONE)
+{
+}
+
+void LocalSorter::clear()
+{
+    m_keys.clear();
+    m_criterium = ThreadingMsgListModel::SORT_NONE;
+}
+
+int LocalSorter::messageCount() const
+{
+    return m_keys.size();
+}
+
+LocalSorter::Keys LocalSorter::sortKeys(const LocalSortingMessage &message)
+{
+    Keys keys;
+    keys.uid = message.uid;
+    keys.arrival = message.internalDate.isValid() ? message.internalDate.toMSecsSinceEpoch() : 0;
+    // RFC 5256: the sent date falls back to the INTERNALDATE
+    keys.date = message.envelope.date.isValid() ? message.envelope.date.toMSecsSinceEpoch() : keys.arrival;
+    keys.size = message.size;
+    keys.from = addressKey(message.envelope.from);
+    keys.to = addressKey(message.envelope.to);
+    keys.cc = addressKey(message.envelope.cc);
+    keys.subject = baseSubject(message.envelope.subject).toCaseFolded();
+    return keys;
+}
+
+bool LocalSorter::lessThan(const ThreadingMsgListModel::SortCriterium criterium, const Keys &a, const Keys &b)
+{
+    int res = 0;
+    switch (criterium) {
+    case ThreadingMsgListModel::SORT_NONE:
+        break;
+    case ThreadingMsgListModel::SORT_ARRIVAL:
+        res = a.arrival < b.arrival ? -1 : a.arrival > b.arrival;
+        break;
+    case ThreadingMsgListModel::SORT_DATE:
+        res = a.date < b.date ? -1 : a.date > b.date;
+        break;
+    case ThreadingMsgListModel::SORT_SIZE:
+        res = a.size < b.size ? -1 : a.size > b.size;
+        break;
+    case ThreadingMsgListModel::SORT_FROM:
+        res = a.from.compare(b.from);
+        break;
+    case ThreadingMsgListModel::SORT_TO:
+        res = a.to.compare(b.to);
+        break;
+    case ThreadingMsgListModel::SORT_CC:
+        res = a.cc.compare(b.cc);
+        break;
+    case ThreadingMsgListModel::SORT_SUBJECT:
+        res = a.subject.compare(b.subject);
+        break;
+    }
+    return res ? res < 0 : a.uid < b.uid;
+}
+
+void LocalSorter::addMessages(const QVector<LocalSortingMessage> &messages)
+{
+    auto compare = [this](const Keys &a, const Keys &b) {
+        return lessThan(m_criterium, a, b);
+    };
+
+    if (messages.size() > 64) {
+        // Sorting everything once again is cheaper than moving the tail of the vector for each new message
+        m_keys.reserve(m_keys.size() + messages.size());
+        for (const auto &message : messages)
+            m_keys.push_back(sortKeys(message));
+        parallelSort(m_keys.begin(), m_keys.end(), compare);
+    } else {
+        for (const auto &message : messages) {
+            Keys keys = sortKeys(message);
+            m_keys.insert(std::lower_bound(m_keys.begin(), m_keys.end(), keys, compare), keys);
+        }
+    }
+}
+
+void LocalSorter::retainMessages(const Imap::Uids &uids)
+{
+    QSet<uint> present;
+    present.reserve(uids.size());
+    for (const uint uid : uids)
+        present.insert(uid);
+    m_keys.erase(std::remove_if(m_keys.begin(), m_keys.end(), [&present](const Keys &keys) {
+        return !present.contains(keys.uid);
+    }), m_keys.end());
+}
+
+Imap::Uids LocalSorter::sorted(const ThreadingMsgListModel::SortCriterium criterium)
+{
+    if (criterium != m_criterium) {
+        m_criterium = criterium;
+        parallelSort(m_keys.begin(), m_keys.end(), [criterium](const Keys &a, const Keys &b) {
+            return lessThan(criterium, a, b);
+        });
+    }
+
+    Imap::Uids res;
+    res.reserve(m_keys.size());
+    for (const auto &keys : m_keys)
+        res << keys.uid;
+    return res;
+}
+
+LocalSortingWorker::LocalSortingWorker(QObject *parent)
+    : BackgroundWorker(QStringLiteral("LocalSortingWorker"), parent)
+    , m_sorter(std::make_shared<LocalSorter>())
+{
+    qRegisterMetaType<Imap::Uids>("Imap::Uids");
+}
+
+void LocalSortingWorker::request(const ThreadingMsgListModel::SortCriterium criterium,
+                                 const QVector<LocalSortingMessage> &messages, const Imap::Uids &presentUids,
+                                 const bool incremental)
+{
+    auto sorter = m_sorter;
+    enqueue([this, sorter, criterium, messages, presentUids, incremental]() -> Result {
+        if (incremental) {
+            sorter->retainMessages(presentUids);
+        } else {
+            sorter->clear();
+        }
+        // The new messages are merged into the order of the previous request, so switch to the new criterium first
+        sorter->sorted(criterium);
+        sorter->addMessages(messages);
+        const Imap::Uids uids = sorter->sorted(criterium);
+        return [this, uids]() { emit sortingAvailable(uids); };
+    });
+}
+
+}
+
+}
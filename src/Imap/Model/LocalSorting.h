@@ -0,0 +1,125 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAP_MODEL_LOCALSORTING_H
+#define IMAP_MODEL_LOCALSORTING_H
+
+#include <memory>
+#include <vector>
+#include <QDateTime>
+#include "BackgroundWorker.h"
+#include "Imap/Parser/Message.h"
+#include "Imap/Parser/Uids.h"
+#include "ThreadingMsgListModel.h"
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+/** @short Everything which the client-side sorting needs to know about a single message */
+struct LocalSortingMessage
+{
+    uint uid;
+    Message::Envelope envelope;
+    QDateTime internalDate;
+    quint64 size;
+
+    LocalSortingMessage();
+    explicit LocalSortingMessage(const uint uid);
+    LocalSortingMessage(const uint uid, const Message::Envelope &envelope, const QDateTime &internalDate, const quint64 size);
+};
+
+/** @short Client-side implementation of the SORT command from RFC 5256
+
+The sort keys are computed once for each message. The addresses are compared by the displayed name as in the
+DISPLAYFROM and DISPLAYTO from RFC 5957, and the subjects by their base subject. Ties are broken by the UID.
+
+The messages are kept sorted by the last criterion which was used, so new arrivals and expunges are cheap.
+*/
+class LocalSorter
+{
+public:
+    LocalSorter();
+
+    void clear();
+    void addMessages(const QVector<LocalSortingMessage> &messages);
+    /** @short Forget about messages which are no longer in the mailbox */
+    void retainMessages(const Imap::Uids &uids);
+    int messageCount() const;
+
+    /** @short Return UIDs of all messages sorted in an ascending order according to the @arg criterium */
+    Imap::Uids sorted(const ThreadingMsgListModel::SortCriterium criterium);
+
+private:
+    struct Keys {
+        uint uid;
+        qint64 arrival;
+        qint64 date;
+        quint64 size;
+        QString from;
+        QString to;
+        QString cc;
+        QString subject;
+    };
+
+    static Keys sortKeys(const LocalSortingMessage &message);
+    static bool lessThan(const ThreadingMsgListModel::SortCriterium criterium, const Keys &a, const Keys &b);
+
+    /** @short All messages, sorted according to m_criterium */
+    std::vector<Keys> m_keys;
+    ThreadingMsgListModel::SortCriterium m_criterium;
+};
+
+/** @short Compute the client-side sorting on a background thread
+
+Each request() is eventually answered by a sortingAvailable(), unless another request() or an invalidate() comes first.
+An incremental request only carries the new arrivals and reuses the messages from the previous requests.
+*/
+class LocalSortingWorker : public BackgroundWorker
+{
+    Q_OBJECT
+public:
+    explicit LocalSortingWorker(QObject *parent = nullptr);
+
+    /** @short Sort the @arg messages
+
+    When @arg incremental is set, the messages are added to those from the previous request, and all messages which are
+    not mentioned in the @arg presentUids are forgotten.
+    */
+    void request(const ThreadingMsgListModel::SortCriterium criterium, const QVector<LocalSortingMessage> &messages,
+                 const Imap::Uids &presentUids, const bool incremental);
+
+signals:
+    void sortingAvailable(const Imap::Uids &uids);
+
+private:
+    /** @short The messages of the previous requests, only touched by the jobs */
+    std::shared_ptr<LocalSorter> m_sorter;
+};
+
+}
+
+}
+
+#endif /* IMAP_MODEL_LOCALSORTING_H */
@@ -0,0 +1,472 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <QSet>
+#include "LocalThreading.h"
+
+namespace {
+
+/** @short Message-IDs are compared without the angle brackets */
+QByteArray normalizedMessageId(const QByteArray &messageId)
+{
+    QByteArray res = messageId.trimmed();
+    if (res.startsWith('<'))
+        res = res.mid(1);
+    if (res.endsWith('>'))
+        res.chop(1);
+    return res;
+}
+
+/** @short Skip over the subj-blob from RFC 5256 which starts at @arg pos, including the whitespace which follows */
+bool skipBlob(const QString &subject, int &pos)
+{
+    if (pos >= subject.size() || subject[pos] != QLatin1Char('['))
+        return false;
+    int end = pos + 1;
+    while (end < subject.size() && subject[end] != QLatin1Char(']')) {
+        if (subject[end] == QLatin1Char('['))
+            return false;
+        ++end;
+    }
+    if (end == subject.size())
+        return false;
+    ++end;
+    while (end < subject.size() && subject[end].isSpace())
+        ++end;
+    pos = end;
+    return true;
+}
+
+/** @short Skip over the subj-refwd from RFC 5256 which starts at @arg pos */
+bool skipReFwd(const QString &subject, int &pos)
+{
+    int end = pos;
+    if (subject.midRef(end, 2).compare(QLatin1String("re"), Qt::CaseInsensitive) == 0) {
+        end += 2;
+    } else if (subject.midRef(end, 3).compare(QLatin1String("fwd"), Qt::CaseInsensitive) == 0) {
+        end += 3;
+    } else if (subject.midRef(end, 2).compare(QLatin1String("fw"), Qt::CaseInsensitive) == 0) {
+        end += 2;
+    } else {
+        return false;
+    }
+    while (end < subject.size() && subject[end].isSpace())
+        ++end;
+    skipBlob(subject, end);
+    if (end >= subject.size() || subject[end] != QLatin1Char(':'))
+        return false;
+    pos = end + 1;
+    return true;
+}
+
+}
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+LocalThreadingMessage::LocalThreadingMessage(): uid(0)
+{
+}
+
+LocalThreadingMessage::LocalThreadingMessage(const uint uid): uid(uid)
+{
+}
+
+LocalThreadingMessage::LocalThreadingMessage(const uint uid, const Message::Envelope &envelope,
+                                             const QList<QByteArray> &hdrReferences, const QDateTime &internalDate):
+    uid(uid), messageId(envelope.messageId), references(hdrReferences), subject(envelope.subject),
+    date(envelope.date.isValid() ? envelope.date : internalDate)
+{
+    if (references.isEmpty() && !envelope.inReplyTo.isEmpty())
+        references << envelope.inReplyTo.first();
+}
+
+QString baseSubject(const QString &subject, bool *isReplyOrForward)
+{
+    bool replyOrForward = false;
+    // (1) whitespace normalization
+    QString res = subject.simplified();
+
+    Q_FOREVER {
+        // (2) the subj-trailer
+        while (res.endsWith(QLatin1String("(fwd)"), Qt::CaseInsensitive)) {
+            res.chop(5);
+            res = res.trimmed();
+            replyOrForward = true;
+        }
+
+        // (3) the subj-leader, (4) a subj-blob in front of a non-empty subject, (5) repeat
+        Q_FOREVER {
+            int pos = 0;
+            while (skipBlob(res, pos)) {
+            }
+            if (skipReFwd(res, pos)) {
+                res = res.mid(pos).trimmed();
+                replyOrForward = true;
+                continue;
+            }
+            pos = 0;
+            if (skipBlob(res, pos) && pos < res.size()) {
+                res = res.mid(pos);
+                continue;
+            }
+            break;
+        }
+
+        // (6) the subj-fwd-hdr and subj-fwd-trl
+        if (res.startsWith(QLatin1String("[fwd:"), Qt::CaseInsensitive) && res.endsWith(QLatin1Char(']'))) {
+            res = res.mid(5, res.size() - 6).trimmed();
+            replyOrForward = true;
+            continue;
+        }
+        break;
+    }
+
+    if (isReplyOrForward)
+        *isReplyOrForward = replyOrForward;
+    return res;
+}
+
+LocalThreader::Container::Container(): uid(0), parent(-1)
+{
+}
+
+LocalThreader::LocalThreader(): m_messageCount(0)
+{
+}
+
+void LocalThreader::clear()
+{
+    m_containers.clear();
+    m_idTable.clear();
+    m_messageCount = 0;
+}
+
+int LocalThreader::messageCount() const
+{
+    return m_messageCount;
+}
+
+int LocalThreader::containerFor(const QByteArray &messageId)
+{
+    auto it = m_idTable.constFind(messageId);
+    if (it != m_idTable.constEnd())
+        return *it;
+    m_containers.push_back(Container());
+    int node = m_containers.size() - 1;
+    m_idTable.insert(messageId, node);
+    return node;
+}
+
+/** @short Is the @arg ancestor the same as the @arg node or one of its parents? */
+bool LocalThreader::isAncestor(const int ancestor, int node) const
+{
+    while (node != -1) {
+        if (node == ancestor)
+            return true;
+        node = m_containers[node].parent;
+    }
+    return false;
+}
+
+void LocalThreader::setParent(const int node, const int parent)
+{
+    Container &container = m_containers[node];
+    if (container.parent != -1)
+        m_containers[container.parent].children.removeOne(node);
+    container.parent = parent;
+    if (parent != -1)
+        m_containers[parent].children.push_back(node);
+}
+
+void LocalThreader::addMessages(const QVector<LocalThreadingMessage> &messages)
+{
+    // The result depends on the order in which the messages are processed; RFC 5256 uses the order within the mailbox
+    QVector<const LocalThreadingMessage *> sorted;
+    sorted.reserve(messages.size());
+    for (const auto &message : messages)
+        sorted << &message;
+    std::sort(sorted.begin(), sorted.end(), [](const LocalThreadingMessage *a, const LocalThreadingMessage *b) {
+        return a->uid < b->uid;
+    });
+
+    for (const LocalThreadingMessage *message : sorted) {
+        // (1A) find the container for this message; messages with duplicate or missing Message-IDs get a unique one
+        QByteArray messageId = normalizedMessageId(message->messageId);
+        int node = -1;
+        if (!messageId.isEmpty()) {
+            node = containerFor(messageId);
+            if (m_containers[node].uid)
+                node = -1;
+        }
+        if (node == -1)
+            node = containerFor(QByteArray(1, '\0') + QByteArray::number(message->uid));
+        Container &container = m_containers[node];
+        container.uid = message->uid;
+        container.subject = message->subject;
+        container.date = message->date;
+        ++m_messageCount;
+
+        // (1B) link the references together, without changing the existing links or creating loops
+        int previous = -1;
+        for (const QByteArray &reference : message->references) {
+            QByteArray referenceId = normalizedMessageId(reference);
+            if (referenceId.isEmpty())
+                continue;
+            int current = containerFor(referenceId);
+            if (previous != -1 && m_containers[current].parent == -1 && !isAncestor(current, previous))
+                setParent(current, previous);
+            previous = current;
+        }
+
+        // (1C) the last reference is the parent; this overrides whatever has been guessed from someone else's References
+        if (previous != -1 && isAncestor(node, previous))
+            previous = -1;
+        setParent(node, previous);
+    }
+}
+
+void LocalThreader::retainMessages(const Imap::Uids &uids)
+{
+    QSet<uint> present;
+    present.reserve(uids.size());
+    for (const uint uid : uids)
+        present.insert(uid);
+    for (Container &container : m_containers) {
+        if (container.uid && !present.contains(container.uid)) {
+            container.uid = 0;
+            container.subject.clear();
+            container.date = QDateTime();
+            --m_messageCount;
+        }
+    }
+}
+
+/** @short Return the @arg siblings and all their descendants so that the children always come before their parent
+
+The reply chains can be thousands of messages long, so this is done with an explicit stack instead of a recursion.
+*/
+std::vector<int> LocalThreader::descendantsFirst(const std::vector<Container> &nodes, const QVector<int> &siblings)
+{
+    std::vector<int> res;
+    std::vector<std::pair<int, bool>> stack;
+    for (const int node : siblings)
+        stack.emplace_back(node, false);
+    while (!stack.empty()) {
+        const int node = stack.back().first;
+        if (stack.back().second) {
+            stack.pop_back();
+            res.push_back(node);
+            continue;
+        }
+        stack.back().second = true;
+        for (const int child : nodes[node].children)
+            stack.emplace_back(child, false);
+    }
+    return res;
+}
+
+/** @short Remove the placeholders for messages which are not in the mailbox, step (3) of RFC 5256's REFERENCES */
+QVector<int> LocalThreader::pruneDummies(std::vector<Container> &nodes, const QVector<int> &siblings, const bool atRoot)
+{
+    // The children of a node have been pruned already by the time it gets its turn
+    auto prune = [&nodes](const QVector<int> &list, const bool isRoot) {
+        QVector<int> res;
+        for (const int node : list) {
+            const Container &container = nodes[node];
+            if (container.uid) {
+                res << node;
+            } else if (container.children.isEmpty()) {
+                // nothing to do, the dummy just goes away
+            } else if (!isRoot || container.children.size() == 1) {
+                res += container.children;
+            } else {
+                res << node;
+            }
+        }
+        return res;
+    };
+
+    for (const int node : descendantsFirst(nodes, siblings))
+        nodes[node].children = prune(nodes[node].children, false);
+    return prune(siblings, atRoot);
+}
+
+/** @short Sort all the @arg siblings and their descendants by the sent date
+
+A placeholder uses the date of its first child. Messages with the same date are sorted by their position in the mailbox.
+*/
+void LocalThreader::sortSiblings(std::vector<Container> &nodes, QVector<int> &siblings)
+{
+    auto sortKey = [&nodes](int node) {
+        while (!nodes[node].uid && !nodes[node].children.isEmpty())
+            node = nodes[node].children.first();
+        const Container &container = nodes[node];
+        return qMakePair(container.date.isValid() ? container.date.toMSecsSinceEpoch() : Q_INT64_C(0), container.uid);
+    };
+    auto sortList = [&sortKey](QVector<int> &list) {
+        std::stable_sort(list.begin(), list.end(), [&sortKey](const int a, const int b) {
+            return sortKey(a) < sortKey(b);
+        });
+    };
+
+    // A placeholder's position depends on its first child, so the children have to be sorted first
+    for (const int node : descendantsFirst(nodes, siblings))
+        sortList(nodes[node].children);
+    sortList(siblings);
+}
+
+QVector<Responses::ThreadingNode> LocalThreader::toThreadingNodes(const std::vector<Container> &nodes, const QVector<int> &roots)
+{
+    QVector<Responses::ThreadingNode> res;
+
+    // Each vector is filled in one go before its nodes are pushed, so the pointers to their children stay valid
+    std::vector<std::pair<const QVector<int> *, QVector<Responses::ThreadingNode> *>> stack;
+    stack.emplace_back(&roots, &res);
+    while (!stack.empty()) {
+        const QVector<int> &siblings = *stack.back().first;
+        QVector<Responses::ThreadingNode> &target = *stack.back().second;
+        stack.pop_back();
+
+        target.reserve(siblings.size());
+        for (const int node : siblings)
+            target << Responses::ThreadingNode(nodes[node].uid, QVector<Responses::ThreadingNode>());
+        for (int i = 0; i < siblings.size(); ++i) {
+            if (!nodes[siblings[i]].children.isEmpty())
+                stack.emplace_back(&nodes[siblings[i]].children, &target[i].children);
+        }
+    }
+    return res;
+}
+
+QVector<Responses::ThreadingNode> LocalThreader::threading() const
+{
+    // The pruning and merging would destroy the links which are needed for threading the future arrivals
+    std::vector<Container> nodes = m_containers;
+
+    // (2) the root set
+    QVector<int> roots;
+    for (int i = 0; i < static_cast<int>(nodes.size()); ++i) {
+        if (nodes[i].parent == -1)
+            roots << i;
+    }
+
+    // (3) placeholders, (4) sorting
+    roots = pruneDummies(nodes, roots, true);
+    sortSiblings(nodes, roots);
+
+    // (5) gather the threads which share the same base subject
+    auto threadSubject = [&nodes](const int node, bool *isReplyOrForward) {
+        const Container &container = nodes[node].uid ? nodes[node] : nodes[nodes[node].children.first()];
+        return baseSubject(container.subject, isReplyOrForward).toCaseFolded();
+    };
+
+    QHash<QString, int> subjectTable;
+    for (const int node : roots) {
+        bool isReplyOrForward;
+        QString subject = threadSubject(node, &isReplyOrForward);
+        if (subject.isEmpty())
+            continue;
+        auto it = subjectTable.find(subject);
+        if (it == subjectTable.end()) {
+            subjectTable.insert(subject, node);
+            continue;
+        }
+        if (nodes[*it].uid) {
+            bool tableIsReplyOrForward;
+            threadSubject(*it, &tableIsReplyOrForward);
+            if (!nodes[node].uid || (tableIsReplyOrForward && !isReplyOrForward))
+                *it = node;
+        }
+    }
+
+    QSet<int> merged;
+    QHash<int, int> replacedByDummy;
+    for (const int node : roots) {
+        bool isReplyOrForward;
+        QString subject = threadSubject(node, &isReplyOrForward);
+        if (subject.isEmpty() || replacedByDummy.contains(node))
+            continue;
+        auto it = subjectTable.find(subject);
+        Q_ASSERT(it != subjectTable.end());
+        const int other = *it;
+        if (other == node)
+            continue;
+        bool otherIsReplyOrForward;
+        threadSubject(other, &otherIsReplyOrForward);
+        if (!nodes[node].uid && !nodes[other].uid) {
+            nodes[other].children += nodes[node].children;
+        } else if (!nodes[other].uid || (isReplyOrForward && !otherIsReplyOrForward)) {
+            nodes[other].children << node;
+        } else {
+            Container dummy;
+            dummy.children << other << node;
+            nodes.push_back(dummy);
+            replacedByDummy[other] = nodes.size() - 1;
+            *it = nodes.size() - 1;
+        }
+        merged.insert(node);
+    }
+
+    QVector<int> groupedRoots;
+    groupedRoots.reserve(roots.size() - merged.size());
+    for (const int node : roots) {
+        if (!merged.contains(node))
+            groupedRoots << replacedByDummy.value(node, node);
+    }
+
+    // (6) sort everything once again, the merging has added new siblings
+    sortSiblings(nodes, groupedRoots);
+
+    return toThreadingNodes(nodes, groupedRoots);
+}
+
+LocalThreadingWorker::LocalThreadingWorker(QObject *parent)
+    : BackgroundWorker(QStringLiteral("LocalThreadingWorker"), parent)
+    , m_threader(std::make_shared<LocalThreader>())
+{
+    qRegisterMetaType<QVector<Imap::Responses::ThreadingNode>>("QVector<Imap::Responses::ThreadingNode>");
+}
+
+void LocalThreadingWorker::request(const QVector<LocalThreadingMessage> &messages, const Imap::Uids &presentUids,
+                                   const bool incremental)
+{
+    auto threader = m_threader;
+    enqueue([this, threader, messages, presentUids, incremental]() -> Result {
+        if (incremental) {
+            threader->retainMessages(presentUids);
+        } else {
+            threader->clear();
+        }
+        threader->addMessages(messages);
+        const QVector<Responses::ThreadingNode> mapping = threader->threading();
+        return [this, mapping]() { emit threadingAvailable(mapping); };
+    });
+}
+
+}
+
+}
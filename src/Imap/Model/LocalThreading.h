@@ -0,0 +1,151 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAP_MODEL_LOCALTHREADING_H
+#define IMAP_MODEL_LOCALTHREADING_H
+
+#include <memory>
+#include <vector>
+#include <QDateTime>
+#include <QHash>
+#include "BackgroundWorker.h"
+#include "Imap/Parser/Message.h"
+#include "Imap/Parser/ThreadingNode.h"
+#include "Imap/Parser/Uids.h"
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+/** @short Everything which the client-side threading needs to know about a single message */
+struct LocalThreadingMessage
+{
+    uint uid;
+    QByteArray messageId;
+    /** @short Message-IDs of the ancestors, oldest first
+
+    This comes from the References header. If that one is missing, the first Message-ID from In-Reply-To is used.
+    */
+    QList<QByteArray> references;
+    QString subject;
+    /** @short The "sent date" from RFC 5256, i.e. the Date header with a fallback to INTERNALDATE */
+    QDateTime date;
+
+    LocalThreadingMessage();
+    explicit LocalThreadingMessage(const uint uid);
+    LocalThreadingMessage(const uint uid, const Message::Envelope &envelope, const QList<QByteArray> &hdrReferences,
+                          const QDateTime &internalDate);
+};
+
+/** @short Extract the "base subject" as defined by RFC 5256, section 2.1
+
+The @arg isReplyOrForward is set when some "Re:", "Fwd:" or "(fwd)" had to be removed. Subjects should be compared
+case-insensitively.
+*/
+QString baseSubject(const QString &subject, bool *isReplyOrForward = nullptr);
+
+/** @short Client-side implementation of the REFERENCES threading algorithm from RFC 5256
+
+This is used when the server does not support the THREAD command. The result has the same form as the UID THREAD
+response.
+
+The threader is incremental; the links between Message-IDs are kept between calls to addMessages(), so that threading
+a few new arrivals does not need the data about all the older messages again.
+*/
+class LocalThreader
+{
+public:
+    LocalThreader();
+
+    void clear();
+    /** @short Link new messages into the threads */
+    void addMessages(const QVector<LocalThreadingMessage> &messages);
+    /** @short Forget about messages which are no longer in the mailbox
+
+    The messages are replaced by placeholders, so the threads which they were holding together stay intact.
+    */
+    void retainMessages(const Imap::Uids &uids);
+    /** @short Number of messages which are threaded */
+    int messageCount() const;
+
+    /** @short Build the threads, sorted by the sent date */
+    QVector<Responses::ThreadingNode> threading() const;
+
+private:
+    struct Container {
+        uint uid;
+        QString subject;
+        QDateTime date;
+        int parent;
+        QVector<int> children;
+        Container();
+    };
+
+    int containerFor(const QByteArray &messageId);
+    bool isAncestor(const int ancestor, int node) const;
+    void setParent(const int node, const int parent);
+
+    static std::vector<int> descendantsFirst(const std::vector<Container> &nodes, const QVector<int> &siblings);
+    static QVector<int> pruneDummies(std::vector<Container> &nodes, const QVector<int> &siblings, const bool atRoot);
+    static void sortSiblings(std::vector<Container> &nodes, QVector<int> &siblings);
+    static QVector<Responses::ThreadingNode> toThreadingNodes(const std::vector<Container> &nodes, const QVector<int> &roots);
+
+    std::vector<Container> m_containers;
+    QHash<QByteArray, int> m_idTable;
+    int m_messageCount;
+};
+
+/** @short Compute the client-side threading on a background thread
+
+Each request() is eventually answered by a threadingAvailable(), unless another request() or an invalidate() comes first.
+An incremental request only carries the new arrivals and reuses the state of the previous request.
+*/
+class LocalThreadingWorker : public BackgroundWorker
+{
+    Q_OBJECT
+public:
+    explicit LocalThreadingWorker(QObject *parent = nullptr);
+
+    /** @short Thread the @arg messages
+
+    When @arg incremental is set, the messages are added to those from the previous request, and all messages which are
+    not mentioned in the @arg presentUids are forgotten.
+    */
+    void request(const QVector<LocalThreadingMessage> &messages, const Imap::Uids &presentUids, const bool incremental);
+
+signals:
+    void threadingAvailable(const QVector<Imap::Responses::ThreadingNode> &mapping);
+
+private:
+    /** @short The threads of the previous requests, only touched by the jobs */
+    std::shared_ptr<LocalThreader> m_threader;
+};
+
+}
+
+}
+
+Q_DECLARE_METATYPE(Imap::Mailbox::LocalThreadingMessage)
+
+#endif /* IMAP_MODEL_LOCALTHREADING_H */
@@ -21,6 +21,7 @@
 */
 
 #include <algorithm>
+#include <QRegularExpression>
 #include <QTextStream>
 #include "Common/FindWithUnknown.h"
 #include "Common/InvokeMethod.h"
@@ -452,6 +453,19 @@ void TreeItemMailbox::handleFetchResponse(Model *const model,
             const QByteArray &rawHeaders = static_cast<const Responses::RespData<QByteArray>&>(*(it.value())).data;
             message->processAdditionalHeaders(model, rawHeaders);
             changedMessage = message;
+        } else if ((it.key().startsWith("BODY[") || it.key().startsWith("BINARY[")) && it.key().endsWith('>')) {
+            // One chunk of a large part which is being downloaded through a series of partial FETCHes
+            int originStart = it.key().lastIndexOf("]<") + 1;
+            bool ok = originStart > 0;
+            quint64 origin = ok ? it.key().mid(originStart + 1, it.key().size() - originStart - 2).toULongLong(&ok) : 0;
+            if (!ok)
+                throw UnknownMessageIndex("Can't parse the origin of a partial BODY[]/BINARY[]", response);
+            TreeItemPart *part = partIdToPtr(model, message, it.key().left(originStart));
+            if (! part)
+                throw UnknownMessageIndex("Got a partial BODY[]/BINARY[] fetch that did not resolve to any known part", response);
+            const QByteArray &data = static_cast<const Responses::RespData<QByteArray>&>(*(it.value())).data;
+            if (handlePartialPartFetch(model, message, part, origin, data))
+                changedParts.append(part);
         } else if (it.key().startsWith("BODY[") || it.key().startsWith("BINARY[")) {
             if (it.key()[ it.key().size() - 1 ] != ']')
                 throw UnknownMessageIndex("Can't parse such BODY[]/BINARY[]", response);
@@ -480,6 +494,7 @@ void TreeItemMailbox::handleFetchResponse(Model *const model,
                 if (part->loading()) {
                     // got to decode the part data by hand
                     Imap::decodeContentTransferEncoding(data, part->transferEncoding(), part->dataPtr());
+                    part->m_partialFetch.reset();
                     part->setFetchStatus(DONE);
                     changedParts.append(part);
                     if (message->uid()
@@ -487,6 +502,9 @@ void TreeItemMailbox::handleFetchResponse(Model *const model,
                         // Do not store the data into cache if the raw data are already there
                         model->cache()->setMsgPart(mailbox(), message->uid(), part->partId(), part->m_data);
                     }
+                    if (message->uid()) {
+                        cacheTextForSearch(model, message->uid(), part);
+                    }
                 }
 
             } else {
@@ -496,6 +514,7 @@ void TreeItemMailbox::handleFetchResponse(Model *const model,
                 changedParts.append(part);
                 if (message->uid()) {
                     model->cache()->setMsgPart(mailbox(), message->uid(), part->partId(), part->m_data);
+                    cacheTextForSearch(model, message->uid(), part);
                 }
             }
         } else if (it.key() == "INTERNALDATE") {
@@ -551,6 +570,31 @@ void TreeItemMailbox::saveSyncStateAndUids(Model * model)
     list->setFetchStatus(DONE);
 }
 
+void TreeItemMailbox::cacheTextForSearch(Model *const model, const uint uid, TreeItemPart *part)
+{
+    // Binary attachments would need a parser of their own, so only the textual parts get indexed
+    if (!part->mimeType().startsWith("text/") || part->m_data.isEmpty())
+        return;
+    QString text = decodeByteArray(part->m_data, part->charset());
+    if (part->mimeType() == "text/html") {
+        // The index shall not match on the names of tags or on stylesheets. This is nowhere near a real HTML parser, but
+        // good enough for looking up words.
+        static const QRegularExpression invisible(QStringLiteral("<(script|style)\\b.*</\\1\\s*>|<!--.*-->"),
+                                                  QRegularExpression::CaseInsensitiveOption
+                                                  | QRegularExpression::DotMatchesEverythingOption
+                                                  | QRegularExpression::InvertedGreedinessOption);
+        static const QRegularExpression tag(QStringLiteral("<[^>]*>"));
+        text.remove(invisible);
+        text.replace(tag, QStringLiteral(" "));
+        text.replace(QLatin1String("&nbsp;"), QLatin1String(" "));
+        text.replace(QLatin1String("&lt;"), QLatin1String("<"));
+        text.replace(QLatin1String("&gt;"), QLatin1String(">"));
+        text.replace(QLatin1String("&quot;"), QLatin1String("\""));
+        text.replace(QLatin1String("&amp;"), QLatin1String("&"));
+    }
+    model->cache()->setMessageText(mailbox(), uid, part->partId(), text);
+}
+
 /** @short Process the EXPUNGE response when the UIDs are already synced */
 void TreeItemMailbox::handleExpunge(Model *const model, const Responses::NumberResponse &resp)
 {
@@ -750,8 +794,48 @@ void TreeItemMailbox::handleExists(Model *const model, const Responses::NumberRe
     model->emitMessageCountChanged(this);
 }
 
-TreeItemPart *TreeItemMailbox::partIdToPtr(Model *const model, TreeItemMessage *message, const QByteArray &msgId)
+/** @short Process one chunk of a part which is being fetched piece by piece
+
+Returns true if the part has changed, i.e. when there's new data for whoever is streaming them.
+*/
+bool TreeItemMailbox::handlePartialPartFetch(Model *const model, TreeItemMessage *message, TreeItemPart *part,
+                                             const quint64 origin, const QByteArray &data)
 {
+    TreeItemPart::PartialFetch *partial = part->m_partialFetch.get();
+    if (!partial || !part->loading() || origin != static_cast<quint64>(partial->nextChunk) * partial->chunkSize) {
+        qDebug() << "Ignoring an unexpected chunk of part" << part->partId() << "at offset" << origin;
+        return false;
+    }
+
+    if (message->uid()) {
+        model->cache()->setMsgPartChunk(mailbox(), message->uid(), partial->cacheKey, partial->nextChunk, partial->chunkSize, data);
+    }
+    if (partial->decodeAtEnd) {
+        partial->rawData.append(data);
+    } else {
+        part->m_data.append(data);
+    }
+    ++partial->nextChunk;
+
+    // A short chunk means that we have reached the end of the part
+    if (static_cast<uint>(data.size()) < partial->chunkSize) {
+        model->finishPartialFetch(this, part);
+    } else {
+        model->askForNextPartChunk(this, part);
+    }
+    return true;
+}
+
+TreeItemPart *TreeItemMailbox::partIdToPtr(Model *const model, TreeItemMessage *message, const QByteArray &fetchItem)
+{
+    // Partial fetches carry an extra <origin> or <origin.length> which is not relevant for locating the part
+    QByteArray msgId = fetchItem;
+    if (msgId.endsWith('>')) {
+        int originStart = msgId.lastIndexOf("]<");
+        if (originStart != -1)
+            msgId.truncate(originStart + 1);
+    }
+
     QByteArray partIdentification;
     if (msgId.startsWith("BODY[")) {
         partIdentification = msgId.mid(5, msgId.size() - 6);
@@ -1695,6 +1779,8 @@ QVariant TreeItemPart::data(Model *const model, int role)
         fetchFromCache(model);
         return QVariant();
     case RolePartBufferPtr:
+        // The consumers of the buffer are interested in its content, so let's make sure that it's going to arrive
+        fetch(model);
         return QVariant::fromValue(dataPtr());
     case RolePartBodyFldParam:
         return QVariant::fromValue(m_bodyFldParam);
@@ -1730,6 +1816,12 @@ QVariant TreeItemPart::data(Model *const model, int role)
     case Qt::ToolTipRole:
         return QStringLiteral("%1 bytes of data").arg(m_data.size());
     case RolePartData:
+        if (m_mappedData) {
+            // Nobody knows how long the callers keep the result around, so they cannot get a view of the mapping.
+            // Load the data into memory once and share that copy with everybody who asks afterwards.
+            m_data = QByteArray(m_data.constData(), m_data.size());
+            m_mappedData.reset();
+        }
         return m_data;
     case RolePartUnicodeText:
         if (m_mimeType.startsWith("text/")) {
@@ -1789,6 +1881,11 @@ QByteArray TreeItemPart::partIdForFetch(const PartFetchingMode mode) const
     return QByteArray(mode == FETCH_PART_BINARY ? "BINARY" : "BODY") + ".PEEK[" + partId() + "]";
 }
 
+QByteArray TreeItemPart::PartialFetch::currentFetchItem() const
+{
+    return fetchItem + '<' + QByteArray::number(static_cast<quint64>(nextChunk) * chunkSize) + '.' + QByteArray::number(chunkSize) + '>';
+}
+
 QByteArray TreeItemPart::pathToPart() const
 {
     TreeItemPart *part = dynamic_cast<TreeItemPart *>(parent());
@@ -1869,6 +1966,8 @@ void TreeItemPart::silentlyReleaseMemoryRecursive()
         m_partRaw = 0;
     }
     m_data.clear();
+    m_mappedData.reset();
+    m_partialFetch.reset();
     setFetchStatus(NONE);
     qDeleteAll(m_children);
     m_children.clear();
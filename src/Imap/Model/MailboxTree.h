@@ -40,6 +40,7 @@ namespace Mailbox
 
 class Model;
 class MailboxModel;
+class MappedPart;
 class KeepMailboxOpenTask;
 class ListChildMailboxesTask;
 
@@ -193,9 +194,13 @@ public:
     bool isSelectable() const;
 
     void saveSyncStateAndUids(Model *model);
+    /** @short Feed the decoded text of a freshly fetched part into the cache's full-text index */
+    void cacheTextForSearch(Model *const model, const uint uid, TreeItemPart *part);
 
 private:
-    TreeItemPart *partIdToPtr(Model *model, TreeItemMessage *message, const QByteArray &msgId);
+    TreeItemPart *partIdToPtr(Model *model, TreeItemMessage *message, const QByteArray &fetchItem);
+    bool handlePartialPartFetch(Model *const model, TreeItemMessage *message, TreeItemPart *part,
+                                const quint64 origin, const QByteArray &data);
 
     /** @short ImapTask which is currently responsible for well-being of this mailbox */
     QPointer<KeepMailboxOpenTask> maintainingTask;
@@ -346,12 +351,14 @@ class TreeItemPart: public TreeItem
     void operator=(const TreeItem &);  // don't implement
     friend class TreeItemMailbox; // needs access to m_data
     friend class Model; // dtto
-    friend class FetchMsgPartTask; // needs m_binaryCTEFailed
+    friend class FetchMsgPartTask; // needs m_binaryCTEFailed and m_partialFetch
     QByteArray m_mimeType;
     QByteArray m_charset;
     QByteArray m_contentFormat;
     QByteArray m_delSp;
     QByteArray m_transferEncoding;
+    /** @short Mapping of the cached data on the disk; m_data points into it until somebody asks for RolePartData */
+    std::shared_ptr<MappedPart> m_mappedData;
     QByteArray m_data;
     QByteArray m_bodyFldId;
     QByteArray m_bodyDisposition;
@@ -362,6 +369,24 @@ class TreeItemPart: public TreeItem
     mutable TreeItemPart *m_partMime;
     mutable TreeItemPart *m_partRaw;
     bool m_binaryCTEFailed;
+
+    /** @short Progress of a download which is split into several partial FETCHes */
+    struct PartialFetch {
+        /** @short The FETCH item without the <offset.length> suffix, like BINARY.PEEK[2] */
+        QByteArray fetchItem;
+        /** @short Key under which the chunks are kept in the cache */
+        QByteArray cacheKey;
+        uint chunkSize;
+        uint nextChunk;
+        /** @short Shall we undo the Content-Transfer-Encoding once everything has arrived? */
+        bool decodeAtEnd;
+        /** @short Undecoded data received so far, only used when decodeAtEnd is set */
+        QByteArray rawData;
+
+        /** @short The FETCH item for the chunk which is expected next */
+        QByteArray currentFetchItem() const;
+    };
+    std::unique_ptr<PartialFetch> m_partialFetch;
 public:
     TreeItemPart(TreeItem *parent, const QByteArray &mimeType);
     ~TreeItemPart();
@@ -422,6 +447,7 @@ public:
     virtual TreeItem *specialColumnPtr(int row, int column) const;
     virtual bool isTopLevelMultiPart() const;
 
+
     virtual void silentlyReleaseMemoryRecursive();
 protected:
     TreeItemPart(TreeItem *parent);
@@ -31,6 +31,21 @@ namespace Imap
 namespace Mailbox
 {
 
+MemoryCacheStatistics::MemoryCacheStatistics()
+    : messages(0)
+    , parts(0)
+    , partBytes(0)
+    , partialBytes(0)
+    , evictedParts(0)
+    , evictedBytes(0)
+{
+}
+
+MemoryCache::MemoryCache()
+    : m_partBudget(0)
+{
+}
+
 QList<MailboxMetadata> MemoryCache::childMailboxes(const QString &mailbox) const
 {
     return mailboxes[ mailbox ];
@@ -60,6 +75,19 @@ void MemoryCache::setMailboxSyncState(const QString &mailbox, const SyncState &s
     qDebug() << "setting mailbox sync state of" << mailbox << "to" << state;
 #endif
     syncState[mailbox] = state;
+    if (state.uidValidity()) {
+        auto results = m_searchResults.find(mailbox);
+        if (results != m_searchResults.end()) {
+            for (auto it = results->begin(); it != results->end(); ) {
+                if (it->uidValidity != state.uidValidity())
+                    it = results->erase(it);
+                else
+                    ++it;
+            }
+            if (results->isEmpty())
+                m_searchResults.erase(results);
+        }
+    }
 }
 
 void MemoryCache::setUidMapping(const QString &mailbox, const Imap::Uids &mapping)
@@ -78,15 +106,36 @@ void MemoryCache::clearUidMapping(const QString &mailbox)
     seqToUid.remove(mailbox);
 }
 
+uint MemoryCache::mailboxId(const QString &mailbox) const
+{
+    return m_mailboxIds.value(mailbox, 0);
+}
+
+uint MemoryCache::ensureMailboxId(const QString &mailbox)
+{
+    auto it = m_mailboxIds.constFind(mailbox);
+    if (it != m_mailboxIds.constEnd())
+        return *it;
+    const uint id = m_mailboxIds.size() + 1;
+    m_mailboxIds.insert(mailbox, id);
+    return id;
+}
+
 void MemoryCache::clearAllMessages(const QString &mailbox)
 {
 #ifdef CACHE_DEBUG
     qDebug() << "pruging all info for mailbox" << mailbox;
 #endif
-    flags.remove(mailbox);
-    msgMetadata.remove(mailbox);
-    parts.remove(mailbox);
     threads.remove(mailbox);
+    m_searchResults.remove(mailbox);
+    const uint id = mailboxId(mailbox);
+    if (!id)
+        return;
+
+    const QSet<uint> uids = m_uidsOfMailbox.take(id);
+    for (const uint uid : uids) {
+        forgetMessage(MessageKey{id, uid});
+    }
 }
 
 void MemoryCache::clearMessage(const QString mailbox, const uint uid)
@@ -94,12 +143,82 @@ void MemoryCache::clearMessage(const QString mailbox, const uint uid)
 #ifdef CACHE_DEBUG
     qDebug() << "pruging all info for message" << mailbox << uid;
 #endif
-    if (flags.contains(mailbox))
-        flags[mailbox].remove(uid);
-    if (msgMetadata.contains(mailbox))
-        msgMetadata[mailbox].remove(uid);
-    if (parts.contains(mailbox))
-        parts[mailbox].remove(uid);
+    const uint id = mailboxId(mailbox);
+    if (!id)
+        return;
+    auto uids = m_uidsOfMailbox.find(id);
+    if (uids == m_uidsOfMailbox.end() || !uids->remove(uid))
+        return;
+    if (uids->isEmpty())
+        m_uidsOfMailbox.erase(uids);
+    forgetMessage(MessageKey{id, uid});
+}
+
+void MemoryCache::forgetMessage(const MessageKey &key)
+{
+    m_flags.remove(key);
+    m_metadata.remove(key);
+    const auto partIds = m_partsOfMessage.take(key);
+    for (const QByteArray &partId : partIds) {
+        dropPart(m_parts.find(PartKey{key, partId}));
+    }
+    const auto partialPartIds = m_partialPartsOfMessage.take(key);
+    for (const QByteArray &partId : partialPartIds) {
+        dropPartialPart(m_partialParts.find(PartKey{key, partId}));
+    }
+}
+
+void MemoryCache::dropPart(QHash<PartKey, CachedPart>::iterator it)
+{
+    if (it == m_parts.end())
+        return;
+    m_statistics.partBytes -= it->data.size();
+    m_recentlyUsed.erase(it->recentlyUsed);
+    m_parts.erase(it);
+}
+
+void MemoryCache::dropPartialPart(QHash<PartKey, PartialPart>::iterator it)
+{
+    if (it == m_partialParts.end())
+        return;
+    for (const QByteArray &chunk : it->chunks) {
+        m_statistics.partialBytes -= chunk.size();
+    }
+    m_partialParts.erase(it);
+}
+
+void MemoryCache::enforcePartBudget()
+{
+    if (!m_partBudget)
+        return;
+    while (m_statistics.partBytes > m_partBudget && !m_recentlyUsed.empty()) {
+        const PartKey key = m_recentlyUsed.back();
+        auto it = m_parts.find(key);
+        Q_ASSERT(it != m_parts.end());
+        ++m_statistics.evictedParts;
+        m_statistics.evictedBytes += it->data.size();
+        dropPart(it);
+        auto partIds = m_partsOfMessage.find(key.message);
+        if (partIds != m_partsOfMessage.end()) {
+            partIds->removeOne(key.partId);
+            if (partIds->isEmpty())
+                m_partsOfMessage.erase(partIds);
+        }
+    }
+}
+
+void MemoryCache::setPartBudget(const quint64 bytes)
+{
+    m_partBudget = bytes;
+    enforcePartBudget();
+}
+
+MemoryCacheStatistics MemoryCache::statistics() const
+{
+    MemoryCacheStatistics res = m_statistics;
+    res.messages = m_metadata.size();
+    res.parts = m_parts.size();
+    return res;
 }
 
 void MemoryCache::setMsgPart(const QString &mailbox, const uint uid, const QByteArray &partId, const QByteArray &data)
@@ -107,7 +226,25 @@ void MemoryCache::setMsgPart(const QString &mailbox, const uint uid, const QByte
 #ifdef CACHE_DEBUG
     qDebug() << "set message part" << mailbox << uid << partId << data.size();
 #endif
-    parts[mailbox][uid][partId] = data;
+    const PartKey key{MessageKey{ensureMailboxId(mailbox), uid}, partId};
+    auto it = m_parts.find(key);
+    if (it != m_parts.end()) {
+        m_statistics.partBytes -= it->data.size();
+        m_statistics.partBytes += data.size();
+        it->data = data;
+        m_recentlyUsed.splice(m_recentlyUsed.begin(), m_recentlyUsed, it->recentlyUsed);
+    } else {
+        if (m_partBudget && static_cast<quint64>(data.size()) > m_partBudget) {
+            // It would only push everything else out of the cache, and then itself
+            return;
+        }
+        m_recentlyUsed.push_front(key);
+        m_parts.insert(key, CachedPart{data, m_recentlyUsed.begin()});
+        m_partsOfMessage[key.message].append(partId);
+        m_uidsOfMailbox[key.message.mailbox].insert(uid);
+        m_statistics.partBytes += data.size();
+    }
+    enforcePartBudget();
 }
 
 void MemoryCache::forgetMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId)
@@ -115,8 +252,68 @@ void MemoryCache::forgetMessagePart(const QString &mailbox, const uint uid, cons
 #ifdef CACHE_DEBUG
     qDebug() << "forget message part" << mailbox << uid << partId;
 #endif
-    parts[mailbox][uid].remove(partId);
+    const uint id = mailboxId(mailbox);
+    if (!id)
+        return;
+    const PartKey key{MessageKey{id, uid}, partId};
+    auto it = m_parts.find(key);
+    if (it == m_parts.end())
+        return;
+    dropPart(it);
+    auto partIds = m_partsOfMessage.find(key.message);
+    if (partIds != m_partsOfMessage.end()) {
+        partIds->removeOne(partId);
+        if (partIds->isEmpty())
+            m_partsOfMessage.erase(partIds);
+    }
+}
+
+void MemoryCache::setMsgPartChunk(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkNumber,
+                                  const uint chunkSize, const QByteArray &data)
+{
+#ifdef CACHE_DEBUG
+    qDebug() << "set message part chunk" << mailbox << uid << partId << chunkNumber << chunkSize << data.size();
+#endif
+    const PartKey key{MessageKey{ensureMailboxId(mailbox), uid}, partId};
+    auto it = m_partialParts.find(key);
+    if (it == m_partialParts.end()) {
+        it = m_partialParts.insert(key, PartialPart());
+        m_partialPartsOfMessage[key.message].append(partId);
+        m_uidsOfMailbox[key.message.mailbox].insert(uid);
+    }
+    PartialPart &partial = *it;
+    if (partial.chunkSize != chunkSize) {
+        for (const QByteArray &chunk : partial.chunks) {
+            m_statistics.partialBytes -= chunk.size();
+        }
+        partial.chunks.clear();
+        partial.chunkSize = chunkSize;
+    }
+    QByteArray &chunk = partial.chunks[chunkNumber];
+    m_statistics.partialBytes -= chunk.size();
+    m_statistics.partialBytes += data.size();
+    chunk = data;
+}
 
+void MemoryCache::forgetPartialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId)
+{
+#ifdef CACHE_DEBUG
+    qDebug() << "forget partial message part" << mailbox << uid << partId;
+#endif
+    const uint id = mailboxId(mailbox);
+    if (!id)
+        return;
+    const PartKey key{MessageKey{id, uid}, partId};
+    auto it = m_partialParts.find(key);
+    if (it == m_partialParts.end())
+        return;
+    dropPartialPart(it);
+    auto partIds = m_partialPartsOfMessage.find(key.message);
+    if (partIds != m_partialPartsOfMessage.end()) {
+        partIds->removeOne(partId);
+        if (partIds->isEmpty())
+            m_partialPartsOfMessage.erase(partIds);
+    }
 }
 
 void MemoryCache::setMsgFlags(const QString &mailbox, uint uid, const QStringList &newFlags)
@@ -124,12 +321,28 @@ void MemoryCache::setMsgFlags(const QString &mailbox, uint uid, const QStringLis
 #ifdef CACHE_DEBUG
     qDebug() << "set FLAGS for" << mailbox << uid << newFlags;
 #endif
-    flags[mailbox][uid] = newFlags;
+    const MessageKey key{ensureMailboxId(mailbox), uid};
+    m_flags[key] = newFlags;
+    m_uidsOfMailbox[key.mailbox].insert(uid);
 }
 
 QStringList MemoryCache::msgFlags(const QString &mailbox, const uint uid) const
 {
-    return flags[mailbox][uid];
+    return m_flags.value(MessageKey{mailboxId(mailbox), uid});
+}
+
+QMap<uint, QStringList> MemoryCache::msgFlagsBatch(const QString &mailbox, const Imap::Uids &uids) const
+{
+    QMap<uint, QStringList> res;
+    const uint id = mailboxId(mailbox);
+    if (!id)
+        return res;
+    for (const uint uid : uids) {
+        auto it = m_flags.constFind(MessageKey{id, uid});
+        if (it != m_flags.constEnd())
+            res.insert(uid, *it);
+    }
+    return res;
 }
 
 Imap::Uids MemoryCache::uidMapping(const QString &mailbox) const
@@ -139,30 +352,52 @@ Imap::Uids MemoryCache::uidMapping(const QString &mailbox) const
 
 void MemoryCache::setMessageMetadata(const QString &mailbox, const uint uid, const MessageDataBundle &metadata)
 {
-    msgMetadata[mailbox][uid] = metadata;
+    const MessageKey key{ensureMailboxId(mailbox), uid};
+    m_metadata[key] = metadata;
+    m_uidsOfMailbox[key.mailbox].insert(uid);
 }
 
 MemoryCache::MessageDataBundle MemoryCache::messageMetadata(const QString &mailbox, const uint uid) const
 {
-    const QMap<uint, MessageDataBundle> &firstLevel = msgMetadata[ mailbox ];
-    QMap<uint, MessageDataBundle>::const_iterator it = firstLevel.find(uid);
-    if (it == firstLevel.end()) {
-        return MessageDataBundle();
+    return m_metadata.value(MessageKey{mailboxId(mailbox), uid});
+}
+
+QMap<uint, MemoryCache::MessageDataBundle> MemoryCache::messageMetadataBatch(const QString &mailbox, const Imap::Uids &uids) const
+{
+    QMap<uint, MessageDataBundle> res;
+    const uint id = mailboxId(mailbox);
+    if (!id)
+        return res;
+    for (const uint uid : uids) {
+        auto it = m_metadata.constFind(MessageKey{id, uid});
+        if (it != m_metadata.constEnd())
+            res.insert(uid, *it);
     }
-    return *it;
+    return res;
 }
 
 QByteArray MemoryCache::messagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const
 {
-    if (! parts.contains(mailbox))
+    auto it = m_parts.constFind(PartKey{MessageKey{mailboxId(mailbox), uid}, partId});
+    if (it == m_parts.constEnd())
         return QByteArray();
-    const auto & mailboxParts = parts[mailbox];
-    if (! mailboxParts.contains(uid))
-        return QByteArray();
-    const auto & messageParts = mailboxParts[uid];
-    if (! messageParts.contains(partId))
+    m_recentlyUsed.splice(m_recentlyUsed.begin(), m_recentlyUsed, it->recentlyUsed);
+    return it->data;
+}
+
+QByteArray MemoryCache::partialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkSize) const
+{
+    auto partIt = m_partialParts.constFind(PartKey{MessageKey{mailboxId(mailbox), uid}, partId});
+    if (partIt == m_partialParts.constEnd() || partIt->chunkSize != chunkSize)
         return QByteArray();
-    return messageParts[ partId ];
+
+    QByteArray res;
+    for (uint i = 0; partIt->chunks.contains(i); ++i) {
+        res.append(partIt->chunks[i]);
+        if (static_cast<uint>(partIt->chunks[i].size()) < chunkSize)
+            break;
+    }
+    return res;
 }
 
 QVector<Imap::Responses::ThreadingNode> MemoryCache::messageThreading(const QString &mailbox)
@@ -175,6 +410,23 @@ void MemoryCache::setMessageThreading(const QString &mailbox, const QVector<Imap
     threads[mailbox] = threading;
 }
 
+bool MemoryCache::searchResult(const QString &mailbox, const QString &criteria, SearchResult &result) const
+{
+    auto results = m_searchResults.constFind(mailbox);
+    if (results == m_searchResults.constEnd())
+        return false;
+    auto it = results->constFind(criteria);
+    if (it == results->constEnd())
+        return false;
+    result = *it;
+    return true;
+}
+
+void MemoryCache::setSearchResult(const QString &mailbox, const QString &criteria, const SearchResult &result)
+{
+    m_searchResults[mailbox][criteria] = result;
+}
+
 void MemoryCache::setRenewalThreshold(const int days)
 {
     Q_UNUSED(days);
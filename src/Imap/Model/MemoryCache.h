@@ -23,8 +23,11 @@
 #ifndef IMAP_MODEL_MEMORYCACHE_H
 #define IMAP_MODEL_MEMORYCACHE_H
 
-#include "Cache.h"
+#include <list>
+#include <QHash>
 #include <QMap>
+#include <QSet>
+#include "Cache.h"
 
 /** @short Namespace for IMAP interaction */
 namespace Imap
@@ -34,14 +37,38 @@ namespace Imap
 namespace Mailbox
 {
 
+/** @short Memory usage of the MemoryCache */
+struct MemoryCacheStatistics
+{
+    /** @short Number of messages whose metadata are cached */
+    int messages;
+    /** @short Number of cached message parts */
+    int parts;
+    /** @short Size of the data of all cached message parts */
+    quint64 partBytes;
+    /** @short Size of the chunks of parts whose download has not finished yet */
+    quint64 partialBytes;
+    /** @short Number of parts which were dropped because the budget got exceeded */
+    quint64 evictedParts;
+    /** @short Size of the parts which were dropped because the budget got exceeded */
+    quint64 evictedBytes;
+
+    MemoryCacheStatistics();
+};
+
 /** @short A cache implementation that uses in-memory cache
 
-    It also has an optional feature to dump the data to a local file and read
-    it back in. Is isn't suitable for real production use, but it's a good start.
+The per-message data are kept in flat hash tables which are keyed by a numeric ID of the mailbox and by the UID, so
+that each lookup is a single hash probe.
+
+The data of message parts can be limited by a byte budget, see setPartBudget(), which makes this cache usable for long
+sessions in deployments which cannot use the disk at all.
  */
 class MemoryCache : public AbstractCache
 {
 public:
+    MemoryCache();
+
     virtual QList<MailboxMetadata> childMailboxes(const QString &mailbox) const;
     virtual bool childMailboxesFresh(const QString &mailbox) const;
     virtual void setChildMailboxes(const QString &mailbox, const QList<MailboxMetadata> &data);
@@ -58,27 +85,117 @@ public:
 
     virtual MessageDataBundle messageMetadata(const QString &mailbox, const uint uid) const;
     virtual void setMessageMetadata(const QString &mailbox, const uint uid, const MessageDataBundle &metadata);
+    virtual QMap<uint, MessageDataBundle> messageMetadataBatch(const QString &mailbox, const Imap::Uids &uids) const;
 
     virtual QStringList msgFlags(const QString &mailbox, const uint uid) const;
     virtual void setMsgFlags(const QString &mailbox, const uint uid, const QStringList &newFlags);
+    virtual QMap<uint, QStringList> msgFlagsBatch(const QString &mailbox, const Imap::Uids &uids) const;
 
     virtual QByteArray messagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const;
     virtual void setMsgPart(const QString &mailbox, const uint uid, const QByteArray &partId, const QByteArray &data);
     virtual void forgetMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId);
 
+    virtual QByteArray partialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkSize) const;
+    virtual void setMsgPartChunk(const QString &mailbox, const uint uid, const QByteArray &partId, const uint chunkNumber,
+                                 const uint chunkSize, const QByteArray &data);
+    virtual void forgetPartialMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId);
+
     virtual QVector<Imap::Responses::ThreadingNode> messageThreading(const QString &mailbox);
     virtual void setMessageThreading(const QString &mailbox, const QVector<Imap::Responses::ThreadingNode> &threading);
 
+    virtual bool searchResult(const QString &mailbox, const QString &criteria, SearchResult &result) const;
+    virtual void setSearchResult(const QString &mailbox, const QString &criteria, const SearchResult &result);
+
     virtual void setRenewalThreshold(const int days);
 
+    /** @short Limit the size of the cached message parts to @arg bytes, or remove the limit by passing zero
+
+    Once the limit is exceeded, the parts which were accessed least recently are dropped. A part which is bigger than
+    the whole budget is not cached at all.
+    */
+    void setPartBudget(const quint64 bytes);
+    /** @short Report how much data is cached */
+    MemoryCacheStatistics statistics() const;
+
 private:
+    struct MessageKey {
+        uint mailbox;
+        uint uid;
+
+        bool operator==(const MessageKey &other) const
+        {
+            return mailbox == other.mailbox && uid == other.uid;
+        }
+        friend uint qHash(const MessageKey &key, uint seed = 0)
+        {
+            return ::qHash((static_cast<quint64>(key.mailbox) << 32) | key.uid, seed);
+        }
+    };
+
+    struct PartKey {
+        MessageKey message;
+        QByteArray partId;
+
+        bool operator==(const PartKey &other) const
+        {
+            return message == other.message && partId == other.partId;
+        }
+        friend uint qHash(const PartKey &key, uint seed = 0)
+        {
+            return qHash(key.message, seed) ^ ::qHash(key.partId, seed);
+        }
+    };
+
+    struct CachedPart {
+        QByteArray data;
+        /** @short Position of this part in the list of recently used parts */
+        std::list<PartKey>::iterator recentlyUsed;
+    };
+
+    /** @short Chunks of a message part whose download has not finished yet */
+    struct PartialPart {
+        uint chunkSize;
+        QMap<uint, QByteArray> chunks;
+        PartialPart(): chunkSize(0) {}
+    };
+
+    /** @short Return the numeric ID of a mailbox, or zero if nothing was ever stored for it */
+    uint mailboxId(const QString &mailbox) const;
+    /** @short Return the numeric ID of a mailbox, allocating a new one when needed */
+    uint ensureMailboxId(const QString &mailbox);
+
+    /** @short Remove everything which is known about a single message, except for the m_uidsOfMailbox */
+    void forgetMessage(const MessageKey &key);
+    /** @short Remove a cached part, including its bookkeeping */
+    void dropPart(QHash<PartKey, CachedPart>::iterator it);
+    /** @short Remove the chunks of a partially downloaded part, including its bookkeeping */
+    void dropPartialPart(QHash<PartKey, PartialPart>::iterator it);
+    /** @short Drop the least recently used parts until the budget is met */
+    void enforcePartBudget();
+
     QMap<QString, QList<MailboxMetadata> > mailboxes;
     QMap<QString, SyncState> syncState;
     QMap<QString, Imap::Uids> seqToUid;
-    QMap<QString, QMap<uint,QStringList> > flags;
-    QMap<QString, QMap<uint, MessageDataBundle> > msgMetadata;
-    QMap<QString, QMap<uint, QMap<QByteArray, QByteArray> > > parts;
     QMap<QString, QVector<Imap::Responses::ThreadingNode> > threads;
+    /** @short Cached search results, indexed by the mailbox and the search criteria */
+    QHash<QString, QHash<QString, SearchResult> > m_searchResults;
+
+    QHash<QString, uint> m_mailboxIds;
+    QHash<MessageKey, QStringList> m_flags;
+    QHash<MessageKey, MessageDataBundle> m_metadata;
+    QHash<PartKey, CachedPart> m_parts;
+    /** @short IDs of the cached parts of each message */
+    QHash<MessageKey, QVector<QByteArray> > m_partsOfMessage;
+    QHash<PartKey, PartialPart> m_partialParts;
+    /** @short IDs of the partially downloaded parts of each message */
+    QHash<MessageKey, QVector<QByteArray> > m_partialPartsOfMessage;
+    /** @short UIDs of all messages of each mailbox which might have anything cached */
+    QHash<uint, QSet<uint> > m_uidsOfMailbox;
+    /** @short Keys of the cached parts, the most recently used one goes first */
+    mutable std::list<PartKey> m_recentlyUsed;
+
+    quint64 m_partBudget;
+    MemoryCacheStatistics m_statistics;
 };
 
 }
@@ -0,0 +1,315 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QTimer>
+#include "Imap/Model/FindInterestingPart.h"
+#include "Imap/Model/ItemRoles.h"
+#include "Imap/Model/MessagePrefetcher.h"
+#include "Imap/Model/Model.h"
+#include "Imap/Model/Utils.h"
+#include "UiUtils/QaimDfsIterator.h"
+
+namespace {
+
+/** @short Don't remember more than this number of outstanding prefetched messages */
+const int maxRememberedPrefetches = 1000;
+
+}
+
+namespace Imap {
+
+namespace Mailbox {
+
+MessagePrefetcher::Statistics::Statistics()
+    : requestedParts(0)
+    , requestedBytes(0)
+    , hits(0)
+    , lateHits(0)
+    , misses(0)
+{
+}
+
+double MessagePrefetcher::Statistics::hitRate() const
+{
+    uint total = hits + lateHits + misses;
+    return total ? static_cast<double>(hits) / total : 0.0;
+}
+
+MessagePrefetcher::MessagePrefetcher(QObject *parent)
+    : QObject(parent)
+    , m_delayedStart(new QTimer(this))
+    , m_lookahead(3)
+    , m_byteBudget(512 * 1024)
+    , m_bytesInWindow(0)
+    , m_direction(Direction::FORWARD)
+    , m_directionRequested(false)
+{
+    // Give the requests for the message which is being opened right now a head start
+    m_delayedStart->setSingleShot(true);
+    m_delayedStart->setInterval(300);
+    connect(m_delayedStart, &QTimer::timeout, this, &MessagePrefetcher::startPrefetching);
+}
+
+void MessagePrefetcher::setLookahead(const int messages)
+{
+    m_lookahead = qMax(0, messages);
+}
+
+void MessagePrefetcher::setByteBudget(const quint64 bytes)
+{
+    m_byteBudget = bytes;
+}
+
+void MessagePrefetcher::setDirection(const Direction direction)
+{
+    m_direction = direction;
+    m_directionRequested = true;
+}
+
+MessagePrefetcher::Direction MessagePrefetcher::direction() const
+{
+    return m_direction;
+}
+
+const MessagePrefetcher::Statistics &MessagePrefetcher::statistics() const
+{
+    return m_stats;
+}
+
+void MessagePrefetcher::resetStatistics()
+{
+    m_stats = Statistics();
+    emit statisticsChanged();
+}
+
+MessagePrefetcher::MessageKey MessagePrefetcher::keyFor(const QModelIndex &message)
+{
+    return qMakePair(message.data(RoleMailboxName).toString(), message.data(RoleMessageUid).toUInt());
+}
+
+void MessagePrefetcher::messageOpened(const QModelIndex &index)
+{
+    m_delayedStart->stop();
+    m_waitingForStructure.clear();
+    m_bytesInWindow = 0;
+
+    const bool directionRequested = m_directionRequested;
+    m_directionRequested = false;
+
+    QModelIndex message = Imap::deproxifiedIndex(index);
+    if (!message.isValid())
+        return;
+
+    Model *model = qobject_cast<Model *>(const_cast<QAbstractItemModel *>(message.model()));
+    Q_ASSERT(model);
+    watchModel(model);
+
+    const QString mailbox = message.data(RoleMailboxName).toString();
+    if (mailbox != m_mailbox) {
+        // Whatever the user was doing in the previous mailbox doesn't say anything about this one
+        if (!directionRequested)
+            m_direction = Direction::FORWARD;
+        m_mailbox = mailbox;
+    }
+
+    // Walking the full Model would descend into the message parts and other mailboxes; we need a message listing
+    m_current = index.model() == model ? QModelIndex() : index;
+
+    bool available = false;
+    if (message.data(RoleIsFetched).toBool()) {
+        QModelIndex mainPart;
+        QString partMessage;
+        available = FindInterestingPart::findMainPartOfMessage(message, mainPart, partMessage, nullptr)
+                == FindInterestingPart::MAINPART_FOUND;
+    }
+
+    auto it = m_prefetched.find(keyFor(message));
+    if (it != m_prefetched.end()) {
+        m_prefetched.erase(it);
+        if (available) {
+            ++m_stats.hits;
+        } else {
+            ++m_stats.lateHits;
+        }
+        emit statisticsChanged();
+    } else if (!available) {
+        ++m_stats.misses;
+        emit statisticsChanged();
+    }
+
+    if (m_lookahead > 0 && networkAllowsPrefetching())
+        m_delayedStart->start();
+}
+
+void MessagePrefetcher::watchModel(Model *model)
+{
+    if (m_model == model)
+        return;
+    if (m_model)
+        disconnect(m_model, nullptr, this, nullptr);
+    m_model = model;
+    m_prefetched.clear();
+    m_mailbox.clear();
+    connect(m_model, &QAbstractItemModel::dataChanged, this, &MessagePrefetcher::slotDataChanged);
+    connect(m_model.data(), &Model::mailboxSyncingProgress, this,
+            [this](const QModelIndex &mailbox, const MailboxSyncingProgress state) {
+        if (state == STATE_SELECTING || state == STATE_DONE)
+            mailboxSynced(mailbox);
+    });
+}
+
+/** @short The @arg mailbox got selected again or synchronized, so the listing might have changed a lot */
+void MessagePrefetcher::mailboxSynced(const QModelIndex &mailbox)
+{
+    if (!m_mailbox.isEmpty() && mailbox.data(RoleMailboxName).toString() == m_mailbox)
+        m_direction = Direction::FORWARD;
+}
+
+bool MessagePrefetcher::networkAllowsPrefetching() const
+{
+    // Speculative downloads are only OK when the network is cheap
+    return m_model && m_model->isNetworkOnline();
+}
+
+/** @short Return the top-level item of a thread which contains the @arg index */
+QModelIndex MessagePrefetcher::threadRoot(const QModelIndex &index)
+{
+    QModelIndex root = index;
+    while (root.parent().isValid())
+        root = root.parent();
+    return root;
+}
+
+/** @short Walk the visible list of messages and find out what the user will likely read next */
+QList<QModelIndex> MessagePrefetcher::collectCandidates() const
+{
+    QList<QModelIndex> res;
+    if (!m_current.isValid())
+        return res;
+
+    const QAbstractItemModel *model = m_current.model();
+    const QModelIndex currentRoot = threadRoot(m_current);
+    // Do not walk through huge mailboxes full of read messages
+    int budget = m_lookahead * 20;
+
+    UiUtils::QaimDfsIterator it(m_current, model);
+    while (budget-- > 0 && res.size() < m_lookahead) {
+        if (m_direction == Direction::FORWARD) {
+            ++it;
+        } else {
+            --it;
+        }
+        if (!it->isValid())
+            break;
+        if (!it->data(RoleMessageIsMarkedRead).toBool() || threadRoot(*it) == currentRoot) {
+            res << *it;
+        }
+    }
+    return res;
+}
+
+void MessagePrefetcher::startPrefetching()
+{
+    if (!networkAllowsPrefetching())
+        return;
+
+    Q_FOREACH(const QModelIndex &candidate, collectCandidates()) {
+        QModelIndex message = Imap::deproxifiedIndex(candidate);
+        if (!message.isValid() || !message.data(RoleMessageUid).toUInt())
+            continue;
+        if (message.data(RoleIsFetched).toBool()) {
+            prefetchMainPart(message);
+        } else {
+            // Asking for any data of the message will load its ENVELOPE and BODYSTRUCTURE from the cache or the network.
+            // The actual part will be requested once these arrive.
+            message.data(RoleMessageSubject);
+            if (message.data(RoleIsFetched).toBool()) {
+                prefetchMainPart(message);
+            } else {
+                m_waitingForStructure << message;
+            }
+        }
+    }
+}
+
+void MessagePrefetcher::slotDataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight)
+{
+    Q_UNUSED(topLeft);
+    Q_UNUSED(bottomRight);
+    if (m_waitingForStructure.isEmpty())
+        return;
+
+    for (auto it = m_waitingForStructure.begin(); it != m_waitingForStructure.end(); /* nothing */) {
+        if (!it->isValid()) {
+            it = m_waitingForStructure.erase(it);
+        } else if (it->data(RoleIsFetched).toBool()) {
+            QModelIndex message = *it;
+            it = m_waitingForStructure.erase(it);
+            if (networkAllowsPrefetching())
+                prefetchMainPart(message);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void MessagePrefetcher::prefetchMainPart(const QModelIndex &message)
+{
+    QModelIndex mainPart;
+    QString partMessage;
+    if (FindInterestingPart::findMainPartOfMessage(message, mainPart, partMessage, nullptr)
+            != FindInterestingPart::MAINPART_PART_LOADING) {
+        // Either the data are available already, or there's nothing which we could show anyway
+        return;
+    }
+
+    const MessageKey key = keyFor(message);
+    if (m_prefetched.contains(key))
+        return;
+
+    quint64 octets = mainPart.data(RolePartOctets).toULongLong();
+    if (m_bytesInWindow + octets > m_byteBudget)
+        return;
+
+    if (m_prefetched.size() >= maxRememberedPrefetches) {
+        // The user is apparently not reading what we guessed; don't let this grow without bounds
+        m_prefetched.clear();
+    }
+
+    m_bytesInWindow += octets;
+    m_prefetched[key] = octets;
+    ++m_stats.requestedParts;
+    m_stats.requestedBytes += octets;
+
+    // This will take the data from the cache if possible, and queue a network request otherwise
+    mainPart.data(RolePartData);
+
+    m_model->logTrace(message, Common::LOG_MESSAGES, QStringLiteral("MessagePrefetcher"),
+                      QStringLiteral("Prefetching part %1 of UID %2 (%3 bytes); hits %4, late %5, misses %6")
+                      .arg(QString::fromUtf8(mainPart.data(RolePartId).toByteArray()), QString::number(key.second),
+                           QString::number(octets), QString::number(m_stats.hits), QString::number(m_stats.lateHits),
+                           QString::number(m_stats.misses)));
+    emit statisticsChanged();
+}
+
+}
+}
@@ -0,0 +1,146 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TROJITA_IMAP_MESSAGEPREFETCHER_H
+#define TROJITA_IMAP_MESSAGEPREFETCHER_H
+
+#include <QHash>
+#include <QPersistentModelIndex>
+#include <QPointer>
+
+class QTimer;
+
+namespace Imap {
+
+namespace Mailbox {
+
+class Model;
+
+/** @short Speculatively download the main text of messages which the user is likely to read next
+
+Whenever a message gets opened, this class walks the message listing (in the order in which it is presented to the user,
+i.e. through the proxy models) in the current direction of navigation. The next few unread messages and the siblings from
+the same thread as the current message are considered as candidates. For each of them, the main part as determined by
+FindInterestingPart is requested from the Model, which means that the data will come from the local cache if possible,
+and from the IMAP server otherwise.
+
+The prefetching respects the NetworkPolicy -- nothing is requested unless the network is in the NETWORK_ONLINE state.
+The amount of data which is requested on behalf of a single opened message is limited by a byte budget. The requests
+are delayed for a short while after the message is opened so that the data for the message which the user actually
+wants to see get queued first.
+
+The direction of navigation only applies to the mailbox in which it was chosen. Opening a message from another mailbox,
+or (re-)synchronizing the current one, makes the prefetching go forward again.
+
+The class works purely on the MVC layer and has no knowledge of the IMAP protocol besides the custom item roles.
+*/
+class MessagePrefetcher : public QObject
+{
+    Q_OBJECT
+public:
+    /** @short Which way is the user moving through the list of messages */
+    enum class Direction {
+        FORWARD,
+        BACKWARD,
+    };
+
+    /** @short Counters describing how useful the prefetching has been */
+    struct Statistics {
+        /** @short Number of message parts which were requested by the prefetcher */
+        uint requestedParts;
+        /** @short Sum of sizes of all requested parts, as reported by BODYSTRUCTURE */
+        quint64 requestedBytes;
+        /** @short The user opened a prefetched message and its data were ready */
+        uint hits;
+        /** @short The user opened a prefetched message, but the data were still being downloaded */
+        uint lateHits;
+        /** @short The user opened a message which was neither prefetched nor available locally */
+        uint misses;
+
+        Statistics();
+        /** @short Return the ratio of hits among all messages which had to be waited for, or were prefetched */
+        double hitRate() const;
+    };
+
+    explicit MessagePrefetcher(QObject *parent);
+
+    /** @short How many messages to prefetch after opening a message */
+    void setLookahead(const int messages);
+    /** @short Maximal amount of data to request after a message gets opened */
+    void setByteBudget(const quint64 bytes);
+    /** @short Set the direction in which the user navigates through the message list
+
+    This is meant to be called right before the messageOpened() of the message which was navigated to.
+    */
+    void setDirection(const Direction direction);
+    Direction direction() const;
+
+    /** @short The user has just opened the message at @arg index
+
+    The @arg index shall come from the model which the user sees, i.e. it is expected to be a proxy index.
+    */
+    void messageOpened(const QModelIndex &index);
+
+    const Statistics &statistics() const;
+    void resetStatistics();
+
+signals:
+    void statisticsChanged();
+
+private slots:
+    void startPrefetching();
+    void slotDataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight);
+
+private:
+    typedef QPair<QString, uint> MessageKey;
+
+    static MessageKey keyFor(const QModelIndex &message);
+    static QModelIndex threadRoot(const QModelIndex &index);
+    QList<QModelIndex> collectCandidates() const;
+    bool networkAllowsPrefetching() const;
+    void prefetchMainPart(const QModelIndex &message);
+    void watchModel(Model *model);
+    void mailboxSynced(const QModelIndex &mailbox);
+
+    /** @short The message which the user is reading now, as an index into the visible model */
+    QPersistentModelIndex m_current;
+    /** @short Candidates whose BODYSTRUCTURE has been requested, but hasn't arrived yet */
+    QList<QPersistentModelIndex> m_waitingForStructure;
+    /** @short Messages which we have requested data for and which have not been opened yet */
+    QHash<MessageKey, quint64> m_prefetched;
+    QPointer<Model> m_model;
+    /** @short Name of the mailbox which contains the current message */
+    QString m_mailbox;
+    QTimer *m_delayedStart;
+    int m_lookahead;
+    quint64 m_byteBudget;
+    quint64 m_bytesInWindow;
+    Direction m_direction;
+    /** @short Has the direction been set explicitly for the message which is going to be opened next? */
+    bool m_directionRequested;
+    Statistics m_stats;
+};
+
+}
+}
+
+#endif
@@ -30,6 +30,7 @@
 #include "Common/FindWithUnknown.h"
 #include "Common/InvokeMethod.h"
 #include "Imap/Encoders.h"
+#include "Imap/Model/DiskPartCache.h"
 #include "Imap/Model/ItemRoles.h"
 #include "Imap/Model/MailboxTree.h"
 #include "Imap/Model/SpecialFlagNames.h"
@@ -108,7 +109,8 @@ Model::Model(QObject *parent, std::shared_ptr<AbstractCache> cache, SocketFactor
     , m_cache(cache)
     , m_socketFactory(std::move(socketFactory))
     , m_taskFactory(std::move(taskFactory))
-    , m_maxParsers(4)
+    , m_maxParsers(1)
+    , m_mailboxUseCounter(0)
     , m_mailboxes(nullptr)
     , m_netPolicy(NETWORK_OFFLINE)
     , m_taskModel(nullptr)
@@ -840,13 +842,15 @@ void Model::askForMessagesInMailbox(TreeItemMsgList *item)
         Q_ASSERT(item->accessFetchStatus() == TreeItem::LOADING);
         QModelIndex listIndex = item->toIndex(this);
         if (uidMapping.size()) {
+            // Reading the flags in one go is much faster than issuing one query per message
+            const auto cachedFlags = cache()->msgFlagsBatch(mailbox, uidMapping);
             beginInsertRows(listIndex, 0, uidMapping.size() - 1);
             for (uint seq = 0; seq < static_cast<uint>(uidMapping.size()); ++seq) {
                 TreeItemMessage *message = new TreeItemMessage(item);
                 message->m_offset = seq;
                 message->m_uid = uidMapping[seq];
                 item->m_children << message;
-                QStringList flags = cache()->msgFlags(mailbox, message->m_uid);
+                QStringList flags = cachedFlags.value(message->m_uid);
                 flags.removeOne(QStringLiteral("\\Recent"));
                 message->m_flags = normalizeFlags(flags);
             }
@@ -897,39 +901,8 @@ void Model::askForMsgMetadata(TreeItemMessage *item, const PreloadingMode preloa
 
     if (item->uid()) {
         AbstractCache::MessageDataBundle data = cache()->messageMetadata(mailboxPtr->mailbox(), item->uid());
-        if (data.uid == item->uid()) {
-            item->data()->setEnvelope(data.envelope);
-            item->data()->setSize(data.size);
-            item->data()->setHdrReferences(data.hdrReferences);
-            item->data()->setHdrListPost(data.hdrListPost);
-            item->data()->setHdrListPostNo(data.hdrListPostNo);
-            QDataStream stream(&data.serializedBodyStructure, QIODevice::ReadOnly);
-            stream.setVersion(QDataStream::Qt_4_6);
-            QVariantList unserialized;
-            stream >> unserialized;
-            QSharedPointer<Message::AbstractMessage> abstractMessage;
-            try {
-                abstractMessage = Message::AbstractMessage::fromList(unserialized, QByteArray(), 0);
-            } catch (Imap::ParserException &e) {
-                qDebug() << "Error when parsing cached BODYSTRUCTURE" << e.what();
-            }
-            if (! abstractMessage) {
-                item->setFetchStatus(TreeItem::UNAVAILABLE);
-            } else {
-                auto newChildren = abstractMessage->createTreeItems(item);
-                if (item->m_children.isEmpty()) {
-                    TreeItemChildrenList oldChildren = item->setChildren(newChildren);
-                    Q_ASSERT(oldChildren.size() == 0);
-                } else {
-                    // The following assert guards against that crazy signal emitting we had when various askFor*()
-                    // functions were not delayed. If it gets hit, it means that someone tried to call this function
-                    // on an item which was already loaded.
-                    Q_ASSERT(item->m_children.isEmpty());
-                    item->setChildren(newChildren);
-                }
-                item->setFetchStatus(TreeItem::DONE);
-            }
-        }
+        if (data.uid == item->uid())
+            applyCachedMsgMetadata(item, data);
     }
 
     switch (networkPolicy()) {
@@ -958,15 +931,29 @@ void Model::askForMsgMetadata(TreeItemMessage *item, const PreloadingMode preloa
         if (! ok)
             preload = 50;
         int order = item->row();
+        QVector<TreeItemMessage *> preloaded;
+        Imap::Uids preloadedUids;
         for (int i = qMax(0, order - preload); i < qMin(list->m_children.size(), order + preload); ++i) {
             TreeItemMessage *message = dynamic_cast<TreeItemMessage *>(list->m_children[i]);
             Q_ASSERT(message);
             if (item != message && !message->fetched() && !message->loading() && message->uid()) {
                 message->setFetchStatus(TreeItem::LOADING);
-                // cannot ask the KeepTask directly, that'd completely ignore the cache
-                // but we absolutely have to block the preload :)
-                askForMsgMetadata(message, PRELOAD_DISABLED);
+                preloaded << message;
+                preloadedUids << message->uid();
+            }
+        }
+        // Cannot ask the KeepTask directly, that'd completely ignore the cache. Load whatever the cache has for the
+        // whole window at once, and only then ask for the rest.
+        const auto cached = cache()->messageMetadataBatch(mailboxPtr->mailbox(), preloadedUids);
+        Q_FOREACH(TreeItemMessage *message, preloaded) {
+            auto it = cached.constFind(message->uid());
+            if (it != cached.constEnd())
+                applyCachedMsgMetadata(message, *it);
+            if (message->accessFetchStatus() != TreeItem::DONE) {
+                message->setFetchStatus(TreeItem::LOADING);
+                findTaskResponsibleFor(mailboxPtr)->requestEnvelopeDownload(message->uid());
             }
+            EMIT_LATER(this, dataChanged, Q_ARG(QModelIndex, message->toIndex(this)), Q_ARG(QModelIndex, message->toIndex(this)));
         }
     }
     break;
@@ -974,6 +961,43 @@ void Model::askForMsgMetadata(TreeItemMessage *item, const PreloadingMode preloa
     EMIT_LATER(this, dataChanged, Q_ARG(QModelIndex, item->toIndex(this)), Q_ARG(QModelIndex, item->toIndex(this)));
 }
 
+/** @short Fill the message with metadata which were previously stored in the cache */
+void Model::applyCachedMsgMetadata(TreeItemMessage *item, const AbstractCache::MessageDataBundle &data)
+{
+    Q_ASSERT(data.uid == item->uid());
+    item->data()->setEnvelope(data.envelope);
+    item->data()->setSize(data.size);
+    item->data()->setHdrReferences(data.hdrReferences);
+    item->data()->setHdrListPost(data.hdrListPost);
+    item->data()->setHdrListPostNo(data.hdrListPostNo);
+    QDataStream stream(data.serializedBodyStructure);
+    stream.setVersion(QDataStream::Qt_4_6);
+    QVariantList unserialized;
+    stream >> unserialized;
+    QSharedPointer<Message::AbstractMessage> abstractMessage;
+    try {
+        abstractMessage = Message::AbstractMessage::fromList(unserialized, QByteArray(), 0);
+    } catch (Imap::ParserException &e) {
+        qDebug() << "Error when parsing cached BODYSTRUCTURE" << e.what();
+    }
+    if (! abstractMessage) {
+        item->setFetchStatus(TreeItem::UNAVAILABLE);
+    } else {
+        auto newChildren = abstractMessage->createTreeItems(item);
+        if (item->m_children.isEmpty()) {
+            TreeItemChildrenList oldChildren = item->setChildren(newChildren);
+            Q_ASSERT(oldChildren.size() == 0);
+        } else {
+            // The following assert guards against that crazy signal emitting we had when various askFor*()
+            // functions were not delayed. If it gets hit, it means that someone tried to call this function
+            // on an item which was already loaded.
+            Q_ASSERT(item->m_children.isEmpty());
+            item->setChildren(newChildren);
+        }
+        item->setFetchStatus(TreeItem::DONE);
+    }
+}
+
 void Model::askForMsgPart(TreeItemPart *item, bool onlyFromCache)
 {
     Q_ASSERT(item->message());   // TreeItemMessage
@@ -996,10 +1020,16 @@ void Model::askForMsgPart(TreeItemPart *item, bool onlyFromCache)
         Q_ASSERT(itemForFetchOperation);
     }
 
-    const QByteArray &data = cache()->messagePart(mailboxPtr->mailbox(), uid,
-                                                  isSpecialRawPart ?
-                                                      itemForFetchOperation->partId() + ".X-RAW"
-                                                    : item->partId());
+    const QByteArray cacheKey = isSpecialRawPart ? itemForFetchOperation->partId() + ".X-RAW" : item->partId();
+    if (auto mapped = cache()->mappedMessagePart(mailboxPtr->mailbox(), uid, cacheKey)) {
+        // Big parts are served straight from the disk without copying them into memory
+        item->m_mappedData = mapped;
+        item->m_data = mapped->data();
+        item->setFetchStatus(TreeItem::DONE);
+        return;
+    }
+
+    const QByteArray &data = cache()->messagePart(mailboxPtr->mailbox(), uid, cacheKey);
     if (! data.isNull()) {
         item->m_data = data;
         item->setFetchStatus(TreeItem::DONE);
@@ -1027,7 +1057,7 @@ void Model::askForMsgPart(TreeItemPart *item, bool onlyFromCache)
         if (item->accessFetchStatus() != TreeItem::DONE)
             item->setFetchStatus(TreeItem::UNAVAILABLE);
     } else if (! onlyFromCache) {
-        KeepMailboxOpenTask *keepTask = findTaskResponsibleFor(mailboxPtr);
+        KeepMailboxOpenTask *keepTask = markMailboxUsed(findTaskResponsibleFor(mailboxPtr));
         TreeItemPart::PartFetchingMode fetchingMode = TreeItemPart::FETCH_PART_IMAP;
         if (!isSpecialRawPart && keepTask->parser && accessParser(keepTask->parser).capabilitiesFresh &&
                 accessParser(keepTask->parser).capabilities.contains(QStringLiteral("BINARY"))) {
@@ -1036,10 +1066,86 @@ void Model::askForMsgPart(TreeItemPart *item, bool onlyFromCache)
                 fetchingMode = TreeItemPart::FETCH_PART_BINARY;
             }
         }
+
+        // Huge parts are downloaded piece by piece so that they can be streamed and so that a dropped connection
+        // does not throw away everything which has arrived so far
+        bool ok;
+        uint chunkSize = property("trojita-imap-partial-fetch-chunk").toUInt(&ok);
+        if (!ok) {
+            // Parts above this size end up in the DiskPartCache anyway
+            chunkSize = 1024 * 1024;
+        }
+        if (!isSpecialRawPart && chunkSize && item->octets() > chunkSize) {
+            startPartialFetch(mailboxPtr, item, fetchingMode == TreeItemPart::FETCH_PART_BINARY, chunkSize);
+            return;
+        }
+
         keepTask->requestPartDownload(item->message()->m_uid, itemForFetchOperation->partIdForFetch(fetchingMode), item->octets());
     }
 }
 
+/** @short Start or resume downloading of a message part through a series of partial FETCHes */
+void Model::startPartialFetch(TreeItemMailbox *mailboxPtr, TreeItemPart *item, const bool useBinary, const uint chunkSize)
+{
+    std::unique_ptr<TreeItemPart::PartialFetch> partial(new TreeItemPart::PartialFetch());
+    partial->fetchItem = item->partIdForFetch(useBinary ? TreeItemPart::FETCH_PART_BINARY : TreeItemPart::FETCH_PART_IMAP);
+    // BINARY delivers data which are already decoded, so these cannot be mixed with chunks of the raw data
+    partial->cacheKey = useBinary ? item->partId() : item->partId() + ".X-RAW";
+    partial->chunkSize = chunkSize;
+    partial->nextChunk = 0;
+    const QByteArray &cte = item->transferEncoding();
+    partial->decodeAtEnd = !useBinary && !(cte.isEmpty() || cte == "7bit" || cte == "8bit" || cte == "binary");
+
+    const uint uid = item->message()->uid();
+    QByteArray resumed = cache()->partialMessagePart(mailboxPtr->mailbox(), uid, partial->cacheKey, chunkSize);
+    partial->nextChunk = resumed.size() / chunkSize;
+    item->m_data.clear();
+    if (partial->decodeAtEnd) {
+        partial->rawData = resumed;
+    } else {
+        item->m_data = resumed;
+    }
+    item->m_partialFetch = std::move(partial);
+    item->setFetchStatus(TreeItem::LOADING);
+
+    if (!resumed.isEmpty()) {
+        logTrace(item->toIndex(this), Common::LOG_MESSAGES, QStringLiteral("Model"),
+                 QStringLiteral("Resuming download of part %1 of UID %2 in %3 at offset %4")
+                 .arg(QString::fromUtf8(item->partId()), QString::number(uid), mailboxPtr->mailbox(), QString::number(resumed.size())));
+    }
+
+    if (resumed.size() % chunkSize) {
+        // The final, short chunk has already arrived, we were just interrupted before saving the complete part
+        finishPartialFetch(mailboxPtr, item);
+        return;
+    }
+    askForNextPartChunk(mailboxPtr, item);
+}
+
+/** @short Request the next chunk of a part which is being downloaded piece by piece */
+void Model::askForNextPartChunk(TreeItemMailbox *mailboxPtr, TreeItemPart *item)
+{
+    Q_ASSERT(item->m_partialFetch);
+    markMailboxUsed(findTaskResponsibleFor(mailboxPtr))->requestPartDownload(item->message()->uid(),
+                                                                            item->m_partialFetch->currentFetchItem(),
+                                                                            item->m_partialFetch->chunkSize);
+}
+
+/** @short All chunks of a part have arrived, make it available as any other part */
+void Model::finishPartialFetch(TreeItemMailbox *mailboxPtr, TreeItemPart *item)
+{
+    std::unique_ptr<TreeItemPart::PartialFetch> partial = std::move(item->m_partialFetch);
+    Q_ASSERT(partial);
+    if (partial->decodeAtEnd) {
+        Imap::decodeContentTransferEncoding(partial->rawData, item->transferEncoding(), item->dataPtr());
+    }
+    item->setFetchStatus(TreeItem::DONE);
+    const uint uid = item->message()->uid();
+    cache()->setMsgPart(mailboxPtr->mailbox(), uid, item->partId(), item->m_data);
+    mailboxPtr->cacheTextForSearch(this, uid, item);
+    cache()->forgetPartialMessagePart(mailboxPtr->mailbox(), uid, partial->cacheKey);
+}
+
 void Model::resyncMailbox(const QModelIndex &mbox)
 {
     findTaskResponsibleFor(mbox)->resynchronizeMailbox();
@@ -1167,7 +1273,7 @@ void Model::switchToMailbox(const QModelIndex &mbox)
     if (m_netPolicy == NETWORK_OFFLINE)
         return;
 
-    findTaskResponsibleFor(mbox);
+    markMailboxUsed(findTaskResponsibleFor(mbox));
 }
 
 void Model::updateCapabilities(Parser *parser, const QStringList capabilities)
@@ -1547,35 +1653,64 @@ KeepMailboxOpenTask *Model::findTaskResponsibleFor(const QModelIndex &mailbox)
 KeepMailboxOpenTask *Model::findTaskResponsibleFor(TreeItemMailbox *mailboxPtr)
 {
     Q_ASSERT(mailboxPtr);
-    bool canCreateParallelConn = m_parsers.isEmpty(); // FIXME: multiple connections
+    KeepMailboxOpenTask *task = 0;
 
-    if (mailboxPtr->maintainingTask) {
-        // The requested mailbox already has the maintaining task associated
-        if (accessParser(mailboxPtr->maintainingTask->parser).connState == CONN_STATE_LOGOUT) {
-            // The connection is currently getting closed, so we have to create another one
-            return m_taskFactory->createKeepMailboxOpenTask(this, mailboxPtr->toIndex(this), 0);
-        } else {
-            // it's usable as-is
-            return mailboxPtr->maintainingTask;
-        }
-    } else if (canCreateParallelConn) {
-        // The mailbox is not being maintained, but we can create a new connection
-        return m_taskFactory->createKeepMailboxOpenTask(this, mailboxPtr->toIndex(this), 0);
+    if (mailboxPtr->maintainingTask && accessParser(mailboxPtr->maintainingTask->parser).connState != CONN_STATE_LOGOUT) {
+        // The requested mailbox already has the maintaining task associated, and it's usable as-is
+        task = mailboxPtr->maintainingTask;
     } else {
-        // Too bad, we have to re-use an existing parser. That will probably lead to
-        // stealing it from some mailbox, but there's no other way.
-        Q_ASSERT(!m_parsers.isEmpty());
-
+        // We have to pick a connection for this mailbox. A connection which doesn't have any mailbox selected is the best
+        // choice, followed by a brand new connection. When too many of them are open already, we will steal the one whose
+        // mailbox was not needed for the longest time.
+        Parser *freeParser = 0;
+        Parser *leastRecentlyUsed = 0;
+        uint oldestUse = 0;
+        int liveConnections = 0;
         for (QMap<Parser *,ParserState>::const_iterator it = m_parsers.constBegin(); it != m_parsers.constEnd(); ++it) {
             if (it->connState == CONN_STATE_LOGOUT) {
                 // this one is not usable
                 continue;
             }
-            return m_taskFactory->createKeepMailboxOpenTask(this, mailboxPtr->toIndex(this), it.key());
+            ++liveConnections;
+            if (it->dedicated) {
+                // Somebody else's, but it still counts towards the limit
+                continue;
+            }
+            if (!it->maintainingTask && !freeParser) {
+                freeParser = it.key();
+            }
+            if (!leastRecentlyUsed || it->lastMailboxUse < oldestUse) {
+                leastRecentlyUsed = it.key();
+                oldestUse = it->lastMailboxUse;
+            }
+        }
+
+        if (freeParser) {
+            task = m_taskFactory->createKeepMailboxOpenTask(this, mailboxPtr->toIndex(this), freeParser);
+        } else if (liveConnections < m_maxParsers || !leastRecentlyUsed) {
+            // This will open a new connection
+            task = m_taskFactory->createKeepMailboxOpenTask(this, mailboxPtr->toIndex(this), 0);
+        } else {
+            // Too bad, we have to re-use an existing parser. That will lead to stealing it from some mailbox,
+            // but there's no other way.
+            task = m_taskFactory->createKeepMailboxOpenTask(this, mailboxPtr->toIndex(this), leastRecentlyUsed);
         }
-        // At this point, we have no other choice than to create a new connection
-        return m_taskFactory->createKeepMailboxOpenTask(this, mailboxPtr->toIndex(this), 0);
     }
+    return task;
+}
+
+/** @short Remember that the mailbox maintained by the @arg task was used just now
+
+Only the explicit mailbox switches and downloads of message parts count as a real use. Prefetching of the message
+metadata and flag updates are not tied to what the user is looking at, so they shall not keep a mailbox selected.
+*/
+KeepMailboxOpenTask *Model::markMailboxUsed(KeepMailboxOpenTask *task)
+{
+    QMap<Parser *,ParserState>::iterator it = m_parsers.find(task->parser);
+    if (it != m_parsers.end()) {
+        it->lastMailboxUse = ++m_mailboxUseCounter;
+    }
+    return task;
 }
 
 void Model::genericHandleFetch(TreeItemMailbox *mailbox, const Imap::Responses::Fetch *const resp)
@@ -2023,11 +2158,27 @@ void Model::setCapabilitiesBlacklist(const QStringList &blacklist)
     m_capabilitiesBlacklist = blacklist;
 }
 
+void Model::setMaxConnections(const int maxConnections)
+{
+    m_maxParsers = qMax(1, maxConnections);
+}
+
+void Model::setRememberedCapabilities(const QStringList &preAuth, const QStringList &postAuth)
+{
+    m_rememberedPreAuthCapabilities = preAuth;
+    m_rememberedPostAuthCapabilities = postAuth;
+}
+
 bool Model::isCatenateSupported() const
 {
     return capabilities().contains(QStringLiteral("CATENATE"));
 }
 
+bool Model::isMultiSearchSupported() const
+{
+    return capabilities().contains(QStringLiteral("MULTISEARCH"));
+}
+
 bool Model::isGenUrlAuthSupported() const
 {
     return capabilities().contains(QStringLiteral("URLAUTH"));
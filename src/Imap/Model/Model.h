@@ -111,7 +111,10 @@ class Model: public QAbstractItemModel
     mutable SocketFactoryPtr m_socketFactory;
     TaskFactoryPtr m_taskFactory;
     mutable QMap<Parser *,ParserState> m_parsers;
+    /** @short How many connections may be kept open at once, each of them with a different mailbox selected */
     int m_maxParsers;
+    /** @short Source of ParserState::lastMailboxUse */
+    uint m_mailboxUseCounter;
     mutable TreeItemMailbox *m_mailboxes;
     mutable NetworkPolicy m_netPolicy;
     bool m_startTls;
@@ -283,9 +286,26 @@ public:
     */
     void setCapabilitiesBlacklist(const QStringList &blacklist);
 
+    /** @short Seed the fast reconnect path with capabilities seen during a previous session
+
+    The @arg preAuth lists what the server advertised right before we logged in, @arg postAuth is what was valid after
+    a successful LOGIN. When the server keeps advertising the very same @arg preAuth set, the OpenConnectionTask trusts
+    @arg postAuth instead of asking for it, and pipelines the post-login commands right behind LOGIN. Pass empty lists
+    to disable this shortcut.
+    */
+    void setRememberedCapabilities(const QStringList &preAuth, const QStringList &postAuth);
+
+    /** @short Limit the number of parallel connections
+
+    Each connection keeps one of the recently used mailboxes selected, so that switching back to it doesn't require
+    a resync. When the limit is reached, the connection whose mailbox was used least recently gets reused.
+    */
+    void setMaxConnections(const int maxConnections);
+
     bool isCatenateSupported() const;
     bool isGenUrlAuthSupported() const;
     bool isImapSubmissionSupported() const;
+    bool isMultiSearchSupported() const;
 
     void setNumberRefreshInterval(const int interval);
 
@@ -417,6 +437,8 @@ signals:
     void threadingFailed(const QModelIndex &mailbox, const QByteArray &algorithm, const QStringList &searchCriteria);
 
     void capabilitiesUpdated(const QStringList &capabilities);
+    /** @short A fresh set of capabilities suitable for setRememberedCapabilities() is available */
+    void capabilitiesRemembered(const QStringList &preAuth, const QStringList &postAuth);
 
     void logged(uint parserId, const Common::LogMessage &message);
 
@@ -436,6 +458,7 @@ private:
     friend class MsgListModel; // needs access to createIndex()
     friend class MailboxModel; // needs access to createIndex()
     friend class ThreadingMsgListModel; // needs access to taskFactory
+    friend class CrossMailboxSearchModel; // needs access to taskFactory and findMailboxByName
     friend class SubtreeClassSpecificItem<Model>; // needs access to createIndex()
 
     friend class IdleLauncher;
@@ -464,6 +487,8 @@ private:
     friend class UnSelectTask;
     friend class OfflineConnectionTask;
     friend class SortTask;
+    friend class MultiSearchTask;
+    friend class ExamineSearchTask;
     friend class AppendTask;
     friend class SubscribeUnsubscribeTask;
     friend class GenUrlAuthTask;
@@ -490,7 +515,11 @@ private:
     typedef enum {PRELOAD_PER_POLICY, PRELOAD_DISABLED} PreloadingMode;
 
     void askForMsgMetadata(TreeItemMessage *item, PreloadingMode preloadMode);
+    void applyCachedMsgMetadata(TreeItemMessage *item, const AbstractCache::MessageDataBundle &data);
     void askForMsgPart(TreeItemPart *item, bool onlyFromCache=false);
+    void startPartialFetch(TreeItemMailbox *mailboxPtr, TreeItemPart *item, const bool useBinary, const uint chunkSize);
+    void askForNextPartChunk(TreeItemMailbox *mailboxPtr, TreeItemPart *item);
+    void finishPartialFetch(TreeItemMailbox *mailboxPtr, TreeItemPart *item);
 
     void finalizeList(Parser *parser, TreeItemMailbox *const mailboxPtr);
     void finalizeIncrementalList(Parser *parser, const QString &parentMailboxName);
@@ -516,6 +545,7 @@ private:
     /** @short Return a corresponding KeepMailboxOpenTask for a given mailbox */
     KeepMailboxOpenTask *findTaskResponsibleFor(const QModelIndex &mailbox);
     KeepMailboxOpenTask *findTaskResponsibleFor(TreeItemMailbox *mailboxPtr);
+    KeepMailboxOpenTask *markMailboxUsed(KeepMailboxOpenTask *task);
 
     /** @short Find a mailbox which is expected to be common for all passed items
 
@@ -580,6 +610,8 @@ private:
     QTimer *m_periodicMailboxNumbersRefresh;
 
     QStringList m_capabilitiesBlacklist;
+    QStringList m_rememberedPreAuthCapabilities;
+    QStringList m_rememberedPostAuthCapabilities;
 
 protected slots:
     void responseReceived();
@@ -27,12 +27,14 @@ namespace Imap {
 namespace Mailbox {
 
 ParserState::ParserState(Parser *_parser):
-    parser(_parser), connState(CONN_STATE_NONE), maintainingTask(0), capabilitiesFresh(false), processingDepth(false)
+    parser(_parser), connState(CONN_STATE_NONE), maintainingTask(0), capabilitiesFresh(false), processingDepth(false),
+    lastMailboxUse(0), dedicated(false)
 {
 }
 
 ParserState::ParserState():
-    connState(CONN_STATE_NONE), maintainingTask(0), capabilitiesFresh(false), processingDepth(false)
+    connState(CONN_STATE_NONE), maintainingTask(0), capabilitiesFresh(false), processingDepth(false),
+    lastMailboxUse(0), dedicated(false)
 {
 }
 
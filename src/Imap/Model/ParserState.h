@@ -55,6 +55,12 @@ struct ParserState {
     /** @short Is the connection currently being processed? */
     int processingDepth;
 
+    /** @short When was the mailbox on this connection really used for the last time, see Model::markMailboxUsed() */
+    uint lastMailboxUse;
+
+    /** @short Was this connection opened for a single task which does not want to share it with anybody else? */
+    bool dedicated;
+
     ParserState(Parser *parser);
     ParserState();
 };
@@ -19,9 +19,12 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
+#include <QTimer>
 #include "PrettyMsgListModel.h"
 #include "ItemRoles.h"
 #include "MsgListModel.h"
+#include "QuickFilter.h"
 #include "ThreadingMsgListModel.h"
 #include "UiUtils/Formatting.h"
 #include "UiUtils/IconLoader.h"
@@ -34,9 +37,50 @@ namespace Mailbox
 {
 
 PrettyMsgListModel::PrettyMsgListModel(QObject *parent):
-    QSortFilterProxyModel(parent), m_hideRead(false)
+    QSortFilterProxyModel(parent), m_hideRead(false), m_quickFilterWorker(new QuickFilterWorker(this)),
+    m_quickFilterHighestUid(0), m_quickFilterResetPending(false), m_quickFilterActive(false), m_quickFilterVisibleDirty(false)
 {
     setDynamicSortFilter(true);
+
+    m_quickFilterRefresh = new QTimer(this);
+    m_quickFilterRefresh->setSingleShot(true);
+    m_quickFilterRefresh->setInterval(100);
+    connect(m_quickFilterRefresh, &QTimer::timeout, this, &PrettyMsgListModel::requestQuickFilter);
+
+    connect(m_quickFilterWorker, &QuickFilterWorker::matchesAvailable, this, &PrettyMsgListModel::slotQuickFilterMatchesAvailable);
+}
+
+void PrettyMsgListModel::setSourceModel(QAbstractItemModel *sourceModel)
+{
+    if (this->sourceModel()) {
+        disconnect(this->sourceModel(), &QAbstractItemModel::modelReset, this, &PrettyMsgListModel::slotQuickFilterSourceReset);
+        disconnect(this->sourceModel(), nullptr, m_quickFilterRefresh, nullptr);
+        disconnect(this->sourceModel(), &QAbstractItemModel::layoutAboutToBeChanged,
+                   this, &PrettyMsgListModel::slotQuickFilterLayoutAboutToChange);
+        disconnect(this->sourceModel(), &QAbstractItemModel::rowsAboutToBeInserted,
+                   this, &PrettyMsgListModel::slotQuickFilterLayoutAboutToChange);
+        disconnect(this->sourceModel(), &QAbstractItemModel::rowsAboutToBeRemoved,
+                   this, &PrettyMsgListModel::slotQuickFilterLayoutAboutToChange);
+        disconnect(this->sourceModel(), &QAbstractItemModel::rowsAboutToBeMoved,
+                   this, &PrettyMsgListModel::slotQuickFilterLayoutAboutToChange);
+        disconnect(this->sourceModel(), &QAbstractItemModel::rowsMoved, this, &PrettyMsgListModel::slotQuickFilterRowsMoved);
+    }
+
+    QSortFilterProxyModel::setSourceModel(sourceModel);
+
+    if (sourceModel) {
+        connect(sourceModel, &QAbstractItemModel::modelReset, this, &PrettyMsgListModel::slotQuickFilterSourceReset);
+        // The timeout is a no-op unless the quick filter is active
+        connect(sourceModel, &QAbstractItemModel::rowsInserted, m_quickFilterRefresh, static_cast<void (QTimer::*)()>(&QTimer::start));
+        // The QSortFilterProxyModel re-filters right after these, so the stale internal IDs have to be dropped before that
+        connect(sourceModel, &QAbstractItemModel::layoutAboutToBeChanged, this, &PrettyMsgListModel::slotQuickFilterLayoutAboutToChange);
+        connect(sourceModel, &QAbstractItemModel::rowsAboutToBeInserted, this, &PrettyMsgListModel::slotQuickFilterLayoutAboutToChange);
+        connect(sourceModel, &QAbstractItemModel::rowsAboutToBeRemoved, this, &PrettyMsgListModel::slotQuickFilterLayoutAboutToChange);
+        // A moved thread node has different ancestors now
+        connect(sourceModel, &QAbstractItemModel::rowsAboutToBeMoved, this, &PrettyMsgListModel::slotQuickFilterLayoutAboutToChange);
+        connect(sourceModel, &QAbstractItemModel::rowsMoved, this, &PrettyMsgListModel::slotQuickFilterRowsMoved);
+    }
+    slotQuickFilterSourceReset();
 }
 
 QVariant PrettyMsgListModel::data(const QModelIndex &index, int role) const
@@ -185,11 +229,14 @@ void PrettyMsgListModel::setHideRead(bool value)
 
 bool PrettyMsgListModel::filterAcceptsRow(int source_row, const QModelIndex &source_parent) const
 {
+    QModelIndex source_index = sourceModel()->index(source_row, 0, source_parent);
+
+    if (m_quickFilterActive && !quickFilterAccepts(source_index))
+        return false;
+
     if (!m_hideRead)
         return true;
 
-    QModelIndex source_index = sourceModel()->index(source_row, 0, source_parent);
-
     for (QModelIndex test = source_index; test.isValid(); test = test.parent())
         if (test.data(RoleThreadRootWithUnreadMessages).toBool() || test.data(RoleMessageWasUnread).toBool())
             return true;
@@ -197,6 +244,132 @@ bool PrettyMsgListModel::filterAcceptsRow(int source_row, const QModelIndex &sou
     return false;
 }
 
+/** @short Does the message or any message in the thread below it match the quick filter?
+
+The ancestors of a matching message have to stay visible, otherwise the QSortFilterProxyModel would hide the whole subtree.
+They are found in a single pass over the threading whenever the matches or the layout change, so that this is a plain lookup.
+*/
+bool PrettyMsgListModel::quickFilterAccepts(const QModelIndex &sourceIndex) const
+{
+    if (m_quickFilterVisibleDirty) {
+        ThreadingMsgListModel *threadingModel = qobject_cast<ThreadingMsgListModel*>(sourceModel());
+        m_quickFilterVisible = threadingModel ? threadingModel->threadNodesWithAncestors(m_quickFilterMatchedUids) : QSet<uint>();
+        m_quickFilterVisibleDirty = false;
+    }
+    return m_quickFilterVisible.contains(sourceIndex.internalId());
+}
+
+void PrettyMsgListModel::setQuickFilter(const QString &text)
+{
+    QString folded = foldForQuickFilter(text.simplified());
+    if (folded == m_quickFilter)
+        return;
+
+    m_quickFilter = folded;
+    if (m_quickFilter.isEmpty()) {
+        // Results which are still on their way are no longer interesting
+        m_quickFilterWorker->invalidate();
+        m_quickFilterRefresh->stop();
+        m_quickFilterMatchedUids.clear();
+        m_quickFilterVisible.clear();
+        if (m_quickFilterActive) {
+            m_quickFilterActive = false;
+            invalidateFilter();
+        }
+        return;
+    }
+
+    requestQuickFilter();
+}
+
+/** @short Send the new messages along with the current text to the worker */
+void PrettyMsgListModel::requestQuickFilter()
+{
+    if (m_quickFilter.isEmpty())
+        return;
+
+    ThreadingMsgListModel *threadingModel = qobject_cast<ThreadingMsgListModel*>(sourceModel());
+    if (!threadingModel)
+        return;
+
+    // Only the new arrivals and the messages whose envelopes were missing the last time are looked at
+    bool sawUnknownUids;
+    const auto metadata = threadingModel->cachedMessageMetadata(m_quickFilterHighestUid, m_quickFilterMissing, &sawUnknownUids);
+    m_quickFilterMissing.clear();
+    uint highestUid = m_quickFilterHighestUid;
+    QVector<QuickFilterMessage> messages;
+    messages.reserve(metadata.size());
+    for (const auto &item : metadata) {
+        highestUid = qMax(highestUid, item.uid);
+        const Message::Envelope &envelope = item.envelope;
+        if (envelope.subject.isEmpty() && envelope.from.isEmpty() && envelope.to.isEmpty()) {
+            // Nothing is known about this one yet, there's no point in sending it
+            if (m_quickFilterPositions.value(item.uid, -1) == -1) {
+                m_quickFilterPositions[item.uid] = -1;
+                m_quickFilterMissing << item.uid;
+            }
+            continue;
+        }
+        auto position = m_quickFilterPositions.find(item.uid);
+        if (position != m_quickFilterPositions.end() && *position != -1)
+            continue;
+        m_quickFilterPositions[item.uid] = m_quickFilterUids.size();
+        m_quickFilterUids << item.uid;
+        messages << QuickFilterMessage(item.uid, envelope);
+    }
+    std::sort(m_quickFilterMissing.begin(), m_quickFilterMissing.end());
+    // A message without UID might get one which is lower than the new arrivals, so the tail has to be visited again
+    if (!sawUnknownUids)
+        m_quickFilterHighestUid = highestUid;
+
+    m_quickFilterWorker->request(m_quickFilterResetPending, messages, m_quickFilter);
+    m_quickFilterResetPending = false;
+}
+
+void PrettyMsgListModel::slotQuickFilterMatchesAvailable(const QBitArray &matches)
+{
+    m_quickFilterMatchedUids.clear();
+    for (int i = 0; i < matches.size() && i < m_quickFilterUids.size(); ++i) {
+        if (matches.testBit(i))
+            m_quickFilterMatchedUids.insert(m_quickFilterUids[i]);
+    }
+    m_quickFilterVisibleDirty = true;
+    m_quickFilterActive = true;
+    invalidateFilter();
+}
+
+/** @short Another mailbox got opened, the worker shall forget about the old messages */
+void PrettyMsgListModel::slotQuickFilterSourceReset()
+{
+    // Whatever is being computed now refers to the old messages
+    m_quickFilterWorker->invalidate();
+    m_quickFilterPositions.clear();
+    m_quickFilterUids.clear();
+    m_quickFilterMissing.clear();
+    m_quickFilterHighestUid = 0;
+    m_quickFilterMatchedUids.clear();
+    m_quickFilterVisible.clear();
+    m_quickFilterVisibleDirty = false;
+    m_quickFilterResetPending = true;
+    if (!m_quickFilter.isEmpty())
+        m_quickFilterRefresh->start();
+}
+
+/** @short The threading is about to change, so the internal IDs of the visible rows have to be looked up again */
+void PrettyMsgListModel::slotQuickFilterLayoutAboutToChange()
+{
+    if (m_quickFilterActive)
+        m_quickFilterVisibleDirty = true;
+}
+
+/** @short A thread node has been moved, so the rows which were kept visible as its ancestors might have to change */
+void PrettyMsgListModel::slotQuickFilterRowsMoved()
+{
+    if (!m_quickFilterActive)
+        return;
+    m_quickFilterVisibleDirty = true;
+    invalidateFilter();
+}
 
 void PrettyMsgListModel::sort(int column, Qt::SortOrder order)
 {
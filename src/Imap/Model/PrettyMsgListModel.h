@@ -22,9 +22,14 @@
 #ifndef PRETTYMSGLISTMODEL_H
 #define PRETTYMSGLISTMODEL_H
 
+#include <QBitArray>
+#include <QSet>
 #include <QSortFilterProxyModel>
 #include "Imap/Model/MailboxModel.h"
 #include "Imap/Model/FavoriteTagsModel.h"
+#include "Imap/Parser/Uids.h"
+
+class QTimer;
 
 namespace Imap
 {
@@ -32,22 +37,66 @@ namespace Imap
 namespace Mailbox
 {
 
+class QuickFilterWorker;
+
 /** @short A pretty proxy model which increases sexiness of the (Threaded)MsgListModel */
 class PrettyMsgListModel: public QSortFilterProxyModel
 {
     Q_OBJECT
 public:
     explicit PrettyMsgListModel(QObject *parent);
+    virtual void setSourceModel(QAbstractItemModel *sourceModel);
     virtual QVariant data(const QModelIndex &index, int role) const;
     void setHideRead(bool value);
     virtual bool filterAcceptsRow(int source_row, const QModelIndex &source_parent) const;
     virtual void sort(int column, Qt::SortOrder order);
 
+public slots:
+    /** @short Show only the threads with a message whose subject or addresses contain the @arg text
+
+    This is a local preview based on the envelopes which are already known, the authoritative search is still up to the
+    server. An empty @arg text shows everything again.
+    */
+    void setQuickFilter(const QString &text);
+
 signals:
     void sortingPreferenceChanged(int column, Qt::SortOrder order);
 
+private slots:
+    void requestQuickFilter();
+    void slotQuickFilterMatchesAvailable(const QBitArray &matches);
+    void slotQuickFilterSourceReset();
+    void slotQuickFilterLayoutAboutToChange();
+    void slotQuickFilterRowsMoved();
+
 private:
+    bool quickFilterAccepts(const QModelIndex &sourceIndex) const;
+
     bool m_hideRead;
+
+    /** @short The folded text of the quick filter, empty when it is not active */
+    QString m_quickFilter;
+    QuickFilterWorker *m_quickFilterWorker;
+    /** @short Position of each message's bit in m_quickFilterMatches, or -1 if its envelope was not known when asked */
+    QHash<uint, int> m_quickFilterPositions;
+    /** @short UID of the message at each position of m_quickFilterMatches */
+    QVector<uint> m_quickFilterUids;
+    /** @short Messages whose envelopes were not known when asked, sorted */
+    Imap::Uids m_quickFilterMissing;
+    /** @short All messages up to this UID have been passed to the worker already */
+    uint m_quickFilterHighestUid;
+    /** @short Shall the worker forget the messages from the previous mailbox? */
+    bool m_quickFilterResetPending;
+    /** @short Has the worker answered since the quick filter got activated? */
+    bool m_quickFilterActive;
+    /** @short UIDs of the messages which match the quick filter */
+    QSet<uint> m_quickFilterMatchedUids;
+    /** @short Internal IDs of the source rows which pass the quick filter, i.e. the matches and their ancestors */
+    mutable QSet<uint> m_quickFilterVisible;
+    /** @short Shall the m_quickFilterVisible be recomputed because the threading has changed? */
+    mutable bool m_quickFilterVisibleDirty;
+    /** @short Send the new arrivals to the worker in batches */
+    QTimer *m_quickFilterRefresh;
 };
 
 }
@@ -0,0 +1,129 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <QStringList>
+#include <QStringMatcher>
+#include "QuickFilter.h"
+
+namespace {
+
+/** @short Separates the fields and the messages in the haystack; it is removed from the needle */
+const QChar separator(0);
+
+}
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+QString foldForQuickFilter(const QString &text)
+{
+    const QString decomposed = text.normalized(QString::NormalizationForm_KD);
+    QString res;
+    res.reserve(decomposed.size());
+    for (const QChar c : decomposed) {
+        if (c.category() == QChar::Mark_NonSpacing || c == separator)
+            continue;
+        res.append(c);
+    }
+    return res.toCaseFolded();
+}
+
+QuickFilterMessage::QuickFilterMessage(): uid(0)
+{
+}
+
+QuickFilterMessage::QuickFilterMessage(const uint uid, const Message::Envelope &envelope): uid(uid)
+{
+    QStringList fields;
+    fields << envelope.subject;
+    for (const auto &list : {envelope.from, envelope.sender, envelope.to, envelope.cc, envelope.bcc}) {
+        for (const auto &address : list)
+            fields << address.prettyName(Message::MailAddress::FORMAT_READABLE);
+    }
+    text = fields.join(separator);
+}
+
+void QuickFilterIndex::clear()
+{
+    m_haystack.clear();
+    m_offsets.clear();
+}
+
+void QuickFilterIndex::addMessages(const QVector<QuickFilterMessage> &messages)
+{
+    m_offsets.reserve(m_offsets.size() + messages.size());
+    for (const auto &message : messages) {
+        m_offsets.push_back(m_haystack.size());
+        m_haystack += foldForQuickFilter(message.text);
+        m_haystack += separator;
+    }
+}
+
+int QuickFilterIndex::messageCount() const
+{
+    return static_cast<int>(m_offsets.size());
+}
+
+QBitArray QuickFilterIndex::matches(const QString &needle) const
+{
+    QBitArray res(messageCount(), needle.isEmpty());
+    if (needle.isEmpty())
+        return res;
+
+    QStringMatcher matcher(needle, Qt::CaseSensitive);
+    int from = 0;
+    while ((from = matcher.indexIn(m_haystack, from)) != -1) {
+        const auto next = std::upper_bound(m_offsets.begin(), m_offsets.end(), from);
+        res.setBit(next - m_offsets.begin() - 1);
+        // There's no point in looking at the rest of this message
+        if (next == m_offsets.end())
+            break;
+        from = *next;
+    }
+    return res;
+}
+
+QuickFilterWorker::QuickFilterWorker(QObject *parent)
+    : BackgroundWorker(QStringLiteral("QuickFilterWorker"), parent)
+    , m_index(std::make_shared<QuickFilterIndex>())
+{
+}
+
+void QuickFilterWorker::request(const bool reset, const QVector<QuickFilterMessage> &messages, const QString &needle)
+{
+    auto index = m_index;
+    enqueue([this, index, reset, messages, needle]() -> Result {
+        if (reset)
+            index->clear();
+        index->addMessages(messages);
+        const QBitArray matches = index->matches(needle);
+        return [this, matches]() { emit matchesAvailable(matches); };
+    });
+}
+
+}
+
+}
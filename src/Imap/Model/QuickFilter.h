@@ -0,0 +1,108 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAP_MODEL_QUICKFILTER_H
+#define IMAP_MODEL_QUICKFILTER_H
+
+#include <memory>
+#include <vector>
+#include <QBitArray>
+#include <QVector>
+#include "BackgroundWorker.h"
+#include "Imap/Parser/Message.h"
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+/** @short Fold the case and strip the diacritics, so that "Ú" in the subject is found by typing "u" */
+QString foldForQuickFilter(const QString &text);
+
+/** @short The texts of a single message which the quick filter looks at */
+struct QuickFilterMessage
+{
+    uint uid;
+    /** @short The subject and all addresses of the sender and the recipients, not folded yet */
+    QString text;
+
+    QuickFilterMessage();
+    QuickFilterMessage(const uint uid, const Message::Envelope &envelope);
+};
+
+/** @short Substring search through the subjects and addresses of many messages
+
+All folded texts are kept in a single buffer, separated by a character which never occurs in the searched string. A search
+is therefore a single pass of QStringMatcher through contiguous memory rather than a call to QString::contains() for each
+message.
+*/
+class QuickFilterIndex
+{
+public:
+    void clear();
+    void addMessages(const QVector<QuickFilterMessage> &messages);
+    int messageCount() const;
+
+    /** @short Return one bit per message, in the order in which they were added, telling whether it contains the @arg needle
+
+    The @arg needle is expected to be folded already.
+    */
+    QBitArray matches(const QString &needle) const;
+
+private:
+    QString m_haystack;
+    /** @short Position of each message's text within the m_haystack */
+    std::vector<int> m_offsets;
+};
+
+/** @short Evaluate the quick filter on a background thread
+
+The worker remembers all messages from the previous requests, so each request() only has to carry the messages which were
+not sent before. They get their bits in the result in the order in which they were passed. Only the latest request() is
+answered by a matchesAvailable().
+*/
+class QuickFilterWorker : public BackgroundWorker
+{
+    Q_OBJECT
+public:
+    explicit QuickFilterWorker(QObject *parent = nullptr);
+
+    /** @short Add the @arg messages and look for the @arg needle in all of them
+
+    When @arg reset is set, the messages from the previous requests are forgotten first.
+    */
+    void request(const bool reset, const QVector<QuickFilterMessage> &messages, const QString &needle);
+
+signals:
+    void matchesAvailable(const QBitArray &matches);
+
+private:
+    /** @short The messages of the previous requests, only touched by the jobs */
+    std::shared_ptr<QuickFilterIndex> m_index;
+};
+
+}
+
+}
+
+#endif /* IMAP_MODEL_QUICKFILTER_H */
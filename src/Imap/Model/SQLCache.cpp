@@ -21,16 +21,330 @@
 */
 
 #include "SQLCache.h"
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <QSet>
 #include <QSqlError>
 #include <QSqlRecord>
 #include <QTimer>
 #include "Common/SqlTransactionAutoAborter.h"
+#include "BlobCodec.h"
+#include "SQLCacheLog.h"
 
 //#define CACHE_DEBUG
 
 namespace
 {
 static int streamVersion = QDataStream::Qt_4_6;
+
+/** @short Split the UIDs into ranges which are cheap to read through a range scan over the (mailbox, uid) key
+
+Gaps which are larger than this many UIDs get a range of their own so that we do not end up walking over too many rows
+which nobody asked for.
+*/
+const uint maxUidGapInRange = 64;
+
+QVector<QPair<uint, uint> > uidRanges(Imap::Uids uids)
+{
+    QVector<QPair<uint, uint> > res;
+    std::sort(uids.begin(), uids.end());
+    for (const uint uid : uids) {
+        if (!res.isEmpty() && uid - res.last().second <= maxUidGapInRange) {
+            res.last().second = uid;
+        } else {
+            res.append(qMakePair(uid, uid));
+        }
+    }
+    return res;
+}
+
+/** @short Sequence number of an entry in the write-behind overlay */
+template<typename T>
+quint64 pendingSequence(const T &item)
+{
+    return item.sequence;
+}
+
+quint64 pendingSequence(const quint64 sequence)
+{
+    return sequence;
+}
+
+/** @short Remove those entries from the overlay which are already present in the DB */
+template<typename Hash>
+void dropCommitted(Hash &hash, const quint64 sequence)
+{
+    for (auto it = hash.begin(); it != hash.end(); ) {
+        if (pendingSequence(*it) <= sequence)
+            it = hash.erase(it);
+        else
+            ++it;
+    }
+}
+
+typedef std::function<void(const QString &, const QSqlQuery &)> QueryErrorHandler;
+
+/** @short The envelopes use a single dictionary per cache, i.e. per account */
+const quint32 envelopeDictionaryId = 1;
+/** @short A dictionary trained on fewer envelopes would not help much */
+const int minEnvelopesForDictionary = 1000;
+/** @short How many envelopes to train the dictionary on */
+const int maxEnvelopeSamples = 5000;
+
+/** @short Rewrite the snapshot once the log has this many entries, no matter how small they are */
+const int maxLogEntries = 64;
+
+/** @short Compact the DB file once at least one page in this many is free */
+const quint64 minFreeFractionForVacuum = 4;
+
+/** @short How many search results to keep; the least recently used ones are thrown away */
+const int maxSearchResults = 100;
+
+/** @short What we know about a vector which is stored as a snapshot and a log of changes */
+struct LogState {
+    bool hasSnapshot;
+    int snapshotSize;
+    int logEntries;
+    int logSize;
+    qint64 lastSeq;
+
+    LogState(): hasSnapshot(false), snapshotSize(0), logEntries(0), logSize(0), lastSeq(0) {}
+};
+
+/** @short Reconstruct a vector from its snapshot and from the changes which were logged since then */
+template<typename T>
+bool loadLogged(QSqlQuery &snapshotQuery, QSqlQuery &logQuery, const qint64 id, QVector<T> &items, LogState &state,
+                const QueryErrorHandler &errorHandler)
+{
+    snapshotQuery.bindValue(0, id);
+    if (!snapshotQuery.exec()) {
+        errorHandler(QObject::tr("Failed to read a snapshot"), snapshotQuery);
+        return false;
+    }
+    if (!snapshotQuery.first()) {
+        // "No data present" doesn't necessarily imply a problem -- it simply might not be there yet :)
+        return true;
+    }
+    const QByteArray snapshot = snapshotQuery.value(0).toByteArray();
+    snapshotQuery.finish();
+    state.hasSnapshot = true;
+    state.snapshotSize = snapshot.size();
+    if (!Imap::Mailbox::AppendLog::decodeSnapshot(snapshot, items)) {
+        errorHandler(QObject::tr("Corrupted snapshot"), snapshotQuery);
+        items.clear();
+        return false;
+    }
+
+    logQuery.bindValue(0, id);
+    if (!logQuery.exec()) {
+        errorHandler(QObject::tr("Failed to read the log of changes"), logQuery);
+        return false;
+    }
+    while (logQuery.next()) {
+        const QByteArray delta = logQuery.value(1).toByteArray();
+        state.lastSeq = logQuery.value(0).toLongLong();
+        ++state.logEntries;
+        state.logSize += delta.size();
+        if (!Imap::Mailbox::AppendLog::applyDelta(delta, items)) {
+            errorHandler(QObject::tr("Corrupted log of changes"), logQuery);
+            items.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+/** @short The version of a vector which is in the DB, as remembered by the writer */
+template<typename T>
+struct StoredLogged {
+    QVector<T> items;
+    LogState state;
+};
+
+/** @short Key of the writer's scratch slot with the StoredLogged for a vector */
+QString loggedScratchKey(const QString &table, const qint64 id)
+{
+    return QStringLiteral("%1/%2").arg(table, QString::number(id));
+}
+
+/** @short Store a new version of a vector, either as a difference against the stored one, or as a fresh snapshot
+
+The writer remembers what it has stored, so the previous version is only reconstructed from the DB the first time a vector
+is written. Afterwards, an update costs a diff and a single INSERT of the delta. The log is compacted into a new snapshot
+once it has too many entries or once it grows larger than the snapshot itself.
+*/
+template<typename T>
+void storeLogged(Imap::Mailbox::SqlWriteContext &ctx, const QString &table, const QString &column, const qint64 id,
+                 const QVector<T> &items)
+{
+    const QString key = loggedScratchKey(table, id);
+    std::shared_ptr<void> &slot = ctx.scratch(key);
+    if (!slot) {
+        const QueryErrorHandler errorHandler = [&ctx](const QString &message, const QSqlQuery &query) {
+            ctx.emitError(message, query);
+        };
+        QSqlQuery &querySnapshot = ctx.prepared(QStringLiteral("SELECT %1 FROM %2 WHERE mailbox_id = ?").arg(column, table));
+        QSqlQuery &queryLog = ctx.prepared(QStringLiteral("SELECT seq, delta FROM %1_log WHERE mailbox_id = ? ORDER BY seq").arg(table));
+        auto loaded = std::make_shared<StoredLogged<T> >();
+        if (!loadLogged(querySnapshot, queryLog, id, loaded->items, loaded->state, errorHandler)) {
+            // A broken log gets replaced by a new snapshot
+            loaded->state.hasSnapshot = false;
+        }
+        queryLog.finish();
+        slot = loaded;
+    }
+    // The slot might go away when something fails, but this keeps the data alive
+    const std::shared_ptr<StoredLogged<T> > stored = std::static_pointer_cast<StoredLogged<T> >(slot);
+
+    if (stored->state.hasSnapshot) {
+        const auto splices = Imap::Mailbox::AppendLog::diff(stored->items, items);
+        if (splices.isEmpty())
+            return;
+        const QByteArray delta = Imap::Mailbox::AppendLog::encodeDelta(splices);
+        if (stored->state.logEntries < maxLogEntries && stored->state.logSize + delta.size() <= stored->state.snapshotSize) {
+            QSqlQuery &queryAppend = ctx.prepared(QStringLiteral("INSERT INTO %1_log (mailbox_id, seq, delta) VALUES (?, ?, ?)").arg(table));
+            queryAppend.bindValue(0, id);
+            queryAppend.bindValue(1, stored->state.lastSeq + 1);
+            queryAppend.bindValue(2, delta);
+            if (!queryAppend.exec()) {
+                ctx.emitError(QObject::tr("Failed to log a change of %1").arg(table), queryAppend);
+                ctx.forgetScratch(key);
+                return;
+            }
+            stored->items = items;
+            ++stored->state.lastSeq;
+            ++stored->state.logEntries;
+            stored->state.logSize += delta.size();
+            return;
+        }
+    }
+
+    // Compact the log into a new snapshot
+    const QByteArray snapshot = Imap::Mailbox::AppendLog::encodeSnapshot(items);
+    QSqlQuery &queryStore = ctx.prepared(QStringLiteral("INSERT OR REPLACE INTO %1 (mailbox_id, %2) VALUES (?, ?)").arg(table, column));
+    queryStore.bindValue(0, id);
+    queryStore.bindValue(1, snapshot);
+    if (!queryStore.exec()) {
+        ctx.emitError(QObject::tr("Failed to store a snapshot of %1").arg(table), queryStore);
+        ctx.forgetScratch(key);
+        return;
+    }
+    QSqlQuery &queryForgetLog = ctx.prepared(QStringLiteral("DELETE FROM %1_log WHERE mailbox_id = ?").arg(table));
+    queryForgetLog.bindValue(0, id);
+    if (!queryForgetLog.exec()) {
+        ctx.emitError(QObject::tr("Failed to compact the log of %1").arg(table), queryForgetLog);
+        ctx.forgetScratch(key);
+        return;
+    }
+    stored->items = items;
+    stored->state = LogState();
+    stored->state.hasSnapshot = true;
+    stored->state.snapshotSize = snapshot.size();
+}
+
+/** @short Convert the whole-vector blobs of the v8 cache into the chunked snapshots */
+template<typename T>
+bool convertToSnapshots(const QSqlDatabase &db, const QString &table, const QString &column, const QueryErrorHandler &errorHandler)
+{
+    QSqlQuery q(QString(), db);
+    if (!q.exec(QStringLiteral("SELECT mailbox_id, %1 FROM %2").arg(column, table))) {
+        errorHandler(QObject::tr("Failed to read table %1").arg(table), q);
+        return false;
+    }
+    QVector<QPair<qint64, QByteArray> > converted;
+    while (q.next()) {
+        QVector<T> items;
+        QDataStream stream(qUncompress(q.value(1).toByteArray()));
+        stream.setVersion(streamVersion);
+        stream >> items;
+        converted << qMakePair(q.value(0).toLongLong(), Imap::Mailbox::AppendLog::encodeSnapshot(items));
+    }
+    if (!q.prepare(QStringLiteral("UPDATE %1 SET %2 = ? WHERE mailbox_id = ?").arg(table, column))) {
+        errorHandler(QObject::tr("Failed to convert table %1").arg(table), q);
+        return false;
+    }
+    for (const auto &item : converted) {
+        q.bindValue(0, item.second);
+        q.bindValue(1, item.first);
+        if (!q.exec()) {
+            errorHandler(QObject::tr("Failed to convert table %1").arg(table), q);
+            return false;
+        }
+    }
+    return true;
+}
+
+/** @short Key of a message in the full-text index
+
+FTS5 tables cannot have a composite primary key, so the mailbox ID and the UID are packed into the rowid. This keeps all
+messages of a mailbox in a single range of rowids.
+*/
+qint64 fullTextRowId(const qint64 mailboxId, const uint uid)
+{
+    return (mailboxId << 32) | uid;
+}
+
+QString indexedAddresses(const QList<Imap::Message::MailAddress> &addresses)
+{
+    QStringList res;
+    for (const auto &address : addresses) {
+        res << address.name << address.mailbox + QLatin1Char('@') + address.host;
+    }
+    return res.join(QLatin1Char(' '));
+}
+
+/** @short Translate one operand of the quick search conditions into an FTS5 query
+
+The text is matched as a phrase whose last word may be incomplete, which is the closest thing to the substring match of
+IMAP SEARCH that a word index can do.
+*/
+bool fullTextQuery(const QStringList &conditions, int &pos, QString &query)
+{
+    if (pos >= conditions.size())
+        return false;
+
+    if (conditions[pos] == QLatin1String("OR")) {
+        ++pos;
+        QString left, right;
+        if (!fullTextQuery(conditions, pos, left) || !fullTextQuery(conditions, pos, right))
+            return false;
+        query = QStringLiteral("(%1) OR (%2)").arg(left, right);
+        return true;
+    }
+
+    if (conditions[pos] == QLatin1String("FUZZY")) {
+        // Matching whole words and their prefixes is about as fuzzy as it gets here
+        ++pos;
+    }
+    if (pos + 1 >= conditions.size())
+        return false;
+
+    const QString key = conditions[pos].toUpper();
+    QString column;
+    if (key == QLatin1String("SUBJECT")) {
+        column = QStringLiteral("subject");
+    } else if (key == QLatin1String("BODY")) {
+        column = QStringLiteral("body");
+    } else if (key == QLatin1String("FROM")) {
+        column = QStringLiteral("sender");
+    } else if (key == QLatin1String("TO") || key == QLatin1String("CC") || key == QLatin1String("BCC")) {
+        column = QStringLiteral("recipients");
+    } else {
+        return false;
+    }
+
+    QString text = conditions[pos + 1];
+    if (std::none_of(text.constBegin(), text.constEnd(), [](const QChar c) { return c.isLetterOrNumber(); })) {
+        // There would be no words to look for
+        return false;
+    }
+    pos += 2;
+    query = QStringLiteral("%1 : \"%2\" *").arg(column, text.replace(QLatin1Char('"'), QStringLiteral("\"\"")));
+    return true;
+}
+
 }
 
 namespace Imap
@@ -60,7 +374,12 @@ namespace Mailbox
 QDate SQLCache::accessingThresholdDate = QDate(2012, 11, 1);
 
 SQLCache::SQLCache()
-    : inTransaction(false)
+    : m_writeSequence(0)
+    , m_nextMailboxId(1)
+    , m_trainedEnvelopeDictionarySequence(0)
+    , m_committedSequence(0)
+    , m_fullTextIndex(false)
+    , inTransaction(false)
     , m_updateAccessIfOlder(0)
 {
 }
@@ -84,7 +403,10 @@ void SQLCache::init()
 
 SQLCache::~SQLCache()
 {
+    // The writer commits everything which is still queued before it quits
+    m_writer.reset();
     timeToCommit();
+    m_inlineWriter.reset();
     db.close();
 }
 
@@ -133,6 +455,16 @@ bool SQLCache::open(const QString &name, const QString &fileName)
         return false;
     }
 
+    {
+        // The WAL mode lets the writer thread commit while the GUI keeps reading through its own connection.
+        // This is a persistent property of the DB file; in-memory databases simply stay in their "memory" journal mode.
+        QSqlQuery q(db);
+        if (!q.exec(QStringLiteral("PRAGMA journal_mode = WAL"))) {
+            emitError(QObject::tr("Failed to switch to the WAL journal mode"), q);
+        }
+        q.exec(QStringLiteral("PRAGMA synchronous = NORMAL"));
+    }
+
     Common::SqlTransactionAutoAborter txn(&db);
 
     QSqlRecord trojitaNames = db.record(QStringLiteral("trojita"));
@@ -198,23 +530,413 @@ bool SQLCache::open(const QString &name, const QString &fileName)
         }
     }
 
-    if (version != 7) {
+    bool migrated = false;
+    if (version == 7) {
+        // V8 keys the per-message tables by an integer ID of the mailbox instead of repeating its full name in each row
+        if (!migrateToMailboxIds())
+            return false;
+        version = 8;
+        migrated = true;
+    }
+
+    if (version == 8) {
+        // V9 stores the UID maps and threading as snapshots with an append-only log of changes
+        if (!migrateToAppendLog())
+            return false;
+        version = 9;
+    }
+
+    if (version == 9) {
+        // V10 prefixes new blobs with a header which identifies their codec, and stores the dictionaries of these codecs.
+        // The old blobs from qCompress() remain readable, so they are left alone.
+        if (!q.exec(QStringLiteral("CREATE TABLE blob_dictionaries (id INTEGER PRIMARY KEY, dictionary BINARY)"))) {
+            emitError(QObject::tr("Can't create table blob_dictionaries"), q);
+            return false;
+        }
+        version = 10;
+        if (!q.exec(QStringLiteral("UPDATE trojita SET version = 10;"))) {
+            emitError(QObject::tr("Failed to update cache DB scheme from v9 to v10"), q);
+            return false;
+        }
+    }
+
+    if (version == 10) {
+        // V11 remembers the results of UID SEARCH and UID SORT along with the state of the mailbox they describe
+        if (!q.exec(QStringLiteral("CREATE TABLE search_results (mailbox_id INTEGER NOT NULL, criteria STRING NOT NULL, "
+                                   "highestmodseq INT, uidnext INT, uids BINARY, PRIMARY KEY (mailbox_id, criteria))"))) {
+            emitError(QObject::tr("Can't create table search_results"), q);
+            return false;
+        }
+        version = 11;
+        if (!q.exec(QStringLiteral("UPDATE trojita SET version = 11;"))) {
+            emitError(QObject::tr("Failed to update cache DB scheme from v10 to v11"), q);
+            return false;
+        }
+    }
+
+    if (version == 11) {
+        // V12 ties the search results to the UIDVALIDITY they were obtained under, and tracks how recently each of them
+        // was used so that the table does not grow without bounds
+        if (!q.exec(QStringLiteral("ALTER TABLE search_results ADD COLUMN uidvalidity INT"))
+                || !q.exec(QStringLiteral("ALTER TABLE search_results ADD COLUMN lastused INT"))
+                || !q.exec(QStringLiteral("CREATE INDEX search_results_lastused ON search_results (lastused)"))) {
+            emitError(QObject::tr("Can't extend table search_results"), q);
+            return false;
+        }
+        version = 12;
+        if (!q.exec(QStringLiteral("UPDATE trojita SET version = 12;"))) {
+            emitError(QObject::tr("Failed to update cache DB scheme from v11 to v12"), q);
+            return false;
+        }
+    }
+
+    if (version == 12) {
+        // V13 adds an index for finding the least recently accessed messages
+        if (!q.exec(QStringLiteral("CREATE INDEX msg_metadata_lastaccess ON msg_metadata (lastAccessDate)"))) {
+            emitError(QObject::tr("Can't create index msg_metadata_lastaccess"), q);
+            return false;
+        }
+        version = 13;
+        if (!q.exec(QStringLiteral("UPDATE trojita SET version = 13;"))) {
+            emitError(QObject::tr("Failed to update cache DB scheme from v12 to v13"), q);
+            return false;
+        }
+    }
+
+    if (version == 13) {
+        // V14 keeps the envelopes and bodystructures in a regular rowid table, they are too big for a WITHOUT ROWID one
+        if (!migrateMetadataToRowid())
+            return false;
+        version = 14;
+        migrated = true;
+    }
+
+    if (version != 14) {
         emitError(QObject::tr("Unknown version of sqlite cache"));
         return false;
     }
 
+    if (!loadMailboxIds())
+        return false;
+
+    m_fullTextIndex = createFullTextIndex();
+
+    if (!loadEnvelopeDictionary())
+        return false;
+
     txn.commit();
 
+    if (migrated) {
+        // Give the space occupied by the old mailbox names back to the filesystem
+        if (!q.exec(QStringLiteral("VACUUM"))) {
+            emitError(QObject::tr("Failed to compact the cache DB after an upgrade"), q);
+        }
+    }
+
     if (! prepareQueries()) {
         return false;
     }
     init();
+
+    // There's no way of sharing an in-memory DB among several connections
+    if (!fileName.isEmpty() && fileName != QLatin1String(":memory:")) {
+        m_writer.reset(new SQLCacheWriter(name + QLatin1String("-writer"), fileName));
+        // The writer object itself lives in this thread, so these are queued connections
+        QObject::connect(m_writer.get(), &SQLCacheWriter::committed, m_writer.get(), [this](quint64 sequence) {
+            forgetCommittedWrites(sequence);
+        });
+        QObject::connect(m_writer.get(), &SQLCacheWriter::error, m_writer.get(), [this](const QString &message) {
+            emitError(message);
+        });
+        if (!m_writer->startWriting()) {
+            emitError(QObject::tr("Cannot start the cache writer thread, falling back to synchronous writes"));
+            m_writer.reset();
+        }
+    }
+    if (!m_writer) {
+        m_inlineWriter.reset(new SqlWriteContext(db, [this](const QString &message) { emitError(message); }));
+    }
+    if (!m_envelopeDictionary)
+        trainEnvelopeDictionary();
 #ifdef CACHE_DEBUG
     qDebug() << "SQLCache::open() succeeded";
 #endif
     return true;
 }
 
+bool SQLCache::migrateToMailboxIds()
+{
+    QSqlQuery q(QString(), db);
+
+    if (!q.exec(QStringLiteral("CREATE TABLE mailboxes ("
+                               "id INTEGER PRIMARY KEY, "
+                               "name STRING NOT NULL UNIQUE, "
+                               "uidvalidity INT"
+                               ")"))) {
+        emitError(QObject::tr("Can't create table mailboxes"), q);
+        return false;
+    }
+
+    if (!q.exec(QStringLiteral("INSERT INTO mailboxes (name) "
+                               "SELECT mailbox FROM msg_metadata UNION SELECT mailbox FROM flags "
+                               "UNION SELECT mailbox FROM parts UNION SELECT mailbox FROM uid_mapping "
+                               "UNION SELECT mailbox FROM msg_threading"))) {
+        emitError(QObject::tr("Failed to populate table mailboxes"), q);
+        return false;
+    }
+
+    // The tables with one row per message are small, so they are stored in the primary key's B-tree directly. The parts
+    // are kept in a regular rowid table because their blobs are too big for that. V14 moves msg_metadata there as well.
+    struct Conversion {
+        const char *table;
+        const char *create;
+        const char *columns;
+    };
+    static const Conversion conversions[] = {
+        {"msg_metadata",
+         "CREATE TABLE msg_metadata (mailbox_id INTEGER NOT NULL, uid INT NOT NULL, data BINARY, lastAccessDate INT, "
+         "PRIMARY KEY (mailbox_id, uid)) WITHOUT ROWID",
+         "uid, data, lastAccessDate"},
+        {"flags",
+         "CREATE TABLE flags (mailbox_id INTEGER NOT NULL, uid INT NOT NULL, flags BINARY, "
+         "PRIMARY KEY (mailbox_id, uid)) WITHOUT ROWID",
+         "uid, flags"},
+        {"parts",
+         "CREATE TABLE parts (mailbox_id INTEGER NOT NULL, uid INT NOT NULL, part_id BINARY, data BINARY, "
+         "PRIMARY KEY (mailbox_id, uid, part_id))",
+         "uid, part_id, data"},
+        {"uid_mapping",
+         "CREATE TABLE uid_mapping (mailbox_id INTEGER PRIMARY KEY, mapping BINARY)",
+         "mapping"},
+        {"msg_threading",
+         "CREATE TABLE msg_threading (mailbox_id INTEGER PRIMARY KEY, threading BINARY)",
+         "threading"},
+    };
+
+    for (const Conversion &conversion : conversions) {
+        const QString table = QLatin1String(conversion.table);
+        const QString oldTable = table + QLatin1String("_v7");
+        const QString columns = QLatin1String(conversion.columns);
+        if (!q.exec(QStringLiteral("ALTER TABLE %1 RENAME TO %2").arg(table, oldTable))) {
+            emitError(QObject::tr("Failed to rename table %1").arg(table), q);
+            return false;
+        }
+        if (!q.exec(QLatin1String(conversion.create))) {
+            emitError(QObject::tr("Can't create table %1").arg(table), q);
+            return false;
+        }
+        QString oldColumns;
+        Q_FOREACH(const QString &column, columns.split(QStringLiteral(", "))) {
+            oldColumns += QStringLiteral(", %1.%2").arg(oldTable, column);
+        }
+        if (!q.exec(QStringLiteral("INSERT INTO %1 (mailbox_id, %2) SELECT mailboxes.id%3 FROM %4 "
+                                   "JOIN mailboxes ON mailboxes.name = %4.mailbox").arg(table, columns, oldColumns, oldTable))) {
+            emitError(QObject::tr("Failed to convert table %1").arg(table), q);
+            return false;
+        }
+        if (!q.exec(QStringLiteral("DROP TABLE %1").arg(oldTable))) {
+            emitError(QObject::tr("Failed to drop old table %1").arg(oldTable), q);
+            return false;
+        }
+    }
+
+    if (!q.exec(QStringLiteral("UPDATE trojita SET version = 8;"))) {
+        emitError(QObject::tr("Failed to update cache DB scheme from v7 to v8"), q);
+        return false;
+    }
+    return true;
+}
+
+bool SQLCache::migrateToAppendLog()
+{
+    QSqlQuery q(QString(), db);
+    if (!q.exec(QStringLiteral("CREATE TABLE uid_mapping_log (mailbox_id INTEGER NOT NULL, seq INTEGER NOT NULL, delta BINARY, "
+                               "PRIMARY KEY (mailbox_id, seq)) WITHOUT ROWID"))) {
+        emitError(QObject::tr("Can't create table uid_mapping_log"), q);
+        return false;
+    }
+    if (!q.exec(QStringLiteral("CREATE TABLE msg_threading_log (mailbox_id INTEGER NOT NULL, seq INTEGER NOT NULL, delta BINARY, "
+                               "PRIMARY KEY (mailbox_id, seq)) WITHOUT ROWID"))) {
+        emitError(QObject::tr("Can't create table msg_threading_log"), q);
+        return false;
+    }
+
+    const QueryErrorHandler errorHandler = [this](const QString &message, const QSqlQuery &query) {
+        emitError(message, query);
+    };
+    if (!convertToSnapshots<uint>(db, QStringLiteral("uid_mapping"), QStringLiteral("mapping"), errorHandler))
+        return false;
+    if (!convertToSnapshots<Imap::Responses::ThreadingNode>(db, QStringLiteral("msg_threading"), QStringLiteral("threading"),
+                                                           errorHandler))
+        return false;
+
+    if (!q.exec(QStringLiteral("UPDATE trojita SET version = 9;"))) {
+        emitError(QObject::tr("Failed to update cache DB scheme from v8 to v9"), q);
+        return false;
+    }
+    return true;
+}
+
+bool SQLCache::migrateMetadataToRowid()
+{
+    // A WITHOUT ROWID table stores whole rows in the B-tree of its primary key. With blobs of several kilobytes that means
+    // a few rows per page and lots of overflow pages, which makes each lookup and each insert much more expensive.
+    QSqlQuery q(QString(), db);
+    if (!q.exec(QStringLiteral("ALTER TABLE msg_metadata RENAME TO msg_metadata_v13"))) {
+        emitError(QObject::tr("Failed to rename table msg_metadata"), q);
+        return false;
+    }
+    if (!q.exec(QStringLiteral("CREATE TABLE msg_metadata (mailbox_id INTEGER NOT NULL, uid INT NOT NULL, data BINARY, "
+                               "lastAccessDate INT)"))) {
+        emitError(QObject::tr("Can't create table msg_metadata"), q);
+        return false;
+    }
+    if (!q.exec(QStringLiteral("INSERT INTO msg_metadata (mailbox_id, uid, data, lastAccessDate) "
+                               "SELECT mailbox_id, uid, data, lastAccessDate FROM msg_metadata_v13"))) {
+        emitError(QObject::tr("Failed to convert table msg_metadata"), q);
+        return false;
+    }
+    // The old lastAccessDate index goes away along with the old table, so it has to be dropped before its name is reused
+    if (!q.exec(QStringLiteral("DROP TABLE msg_metadata_v13"))) {
+        emitError(QObject::tr("Failed to drop old table msg_metadata_v13"), q);
+        return false;
+    }
+    if (!q.exec(QStringLiteral("CREATE UNIQUE INDEX msg_metadata_uid ON msg_metadata (mailbox_id, uid)"))) {
+        emitError(QObject::tr("Can't create index msg_metadata_uid"), q);
+        return false;
+    }
+    if (!q.exec(QStringLiteral("CREATE INDEX msg_metadata_lastaccess ON msg_metadata (lastAccessDate)"))) {
+        emitError(QObject::tr("Can't create index msg_metadata_lastaccess"), q);
+        return false;
+    }
+
+    if (!q.exec(QStringLiteral("UPDATE trojita SET version = 14;"))) {
+        emitError(QObject::tr("Failed to update cache DB scheme from v13 to v14"), q);
+        return false;
+    }
+    return true;
+}
+
+bool SQLCache::createFullTextIndex()
+{
+    // The index is not versioned along with the rest of the DB because it is optional. Builds of sqlite without FTS5
+    // simply do not get any local search.
+    QSqlQuery q(QString(), db);
+    return q.exec(QStringLiteral("CREATE VIRTUAL TABLE IF NOT EXISTS fulltext USING fts5(subject, sender, recipients, body)"))
+            && q.exec(QStringLiteral("CREATE TABLE IF NOT EXISTS fulltext_parts ( "
+                                     "fulltext_id INT NOT NULL, "
+                                     "part_id BINARY NOT NULL, "
+                                     "PRIMARY KEY (fulltext_id, part_id)"
+                                     ")"));
+}
+
+bool SQLCache::loadEnvelopeDictionary()
+{
+    QSqlQuery q(QString(), db);
+    if (!q.exec(QStringLiteral("SELECT dictionary FROM blob_dictionaries WHERE id = %1").arg(envelopeDictionaryId))) {
+        emitError(QObject::tr("Failed to load the envelope dictionary"), q);
+        return false;
+    }
+    if (q.first()) {
+        // A build without zstd cannot use it, and the envelopes compressed with it will look like cache misses
+        m_envelopeDictionary = BlobDictionary::load(envelopeDictionaryId, q.value(0).toByteArray());
+    }
+    return true;
+}
+
+void SQLCache::trainEnvelopeDictionary()
+{
+    // The envelopes of a single account are very similar to each other, which is something that a generic compression
+    // cannot take advantage of in blobs this small. Only new envelopes are going to use the dictionary.
+    // Reading thousands of envelopes and training on them takes a while, so it is done by the writer. The result is picked
+    // up once the writer commits, see forgetCommittedWrites().
+    auto trained = std::make_shared<std::shared_ptr<BlobDictionary> >();
+    const quint64 sequence = ++m_writeSequence;
+    m_trainedEnvelopeDictionary = trained;
+    m_trainedEnvelopeDictionarySequence = sequence;
+    write(sequence, [trained](SqlWriteContext &ctx) {
+        QSqlQuery &queryCountEnvelopes = ctx.prepared(QStringLiteral("SELECT COUNT(*) FROM msg_metadata"));
+        if (!queryCountEnvelopes.exec() || !queryCountEnvelopes.first()) {
+            ctx.emitError(QObject::tr("Failed to count the cached envelopes"), queryCountEnvelopes);
+            return;
+        }
+        const int envelopes = queryCountEnvelopes.value(0).toInt();
+        queryCountEnvelopes.finish();
+        if (envelopes < minEnvelopesForDictionary)
+            return;
+
+        QSqlQuery &querySamples = ctx.prepared(QStringLiteral("SELECT data FROM msg_metadata ORDER BY lastAccessDate DESC LIMIT %1")
+                                               .arg(maxEnvelopeSamples));
+        if (!querySamples.exec()) {
+            ctx.emitError(QObject::tr("Failed to read the envelopes for training a dictionary"), querySamples);
+            return;
+        }
+        QVector<QByteArray> samples;
+        while (querySamples.next()) {
+            QByteArray sample = decodeBlob(querySamples.value(0).toByteArray());
+            if (!sample.isEmpty())
+                samples << sample;
+        }
+        querySamples.finish();
+        std::shared_ptr<BlobDictionary> dictionary = BlobDictionary::train(envelopeDictionaryId, samples);
+        if (!dictionary)
+            return;
+
+        QSqlQuery &queryStoreDictionary = ctx.prepared(QStringLiteral("INSERT OR REPLACE INTO blob_dictionaries (id, dictionary) VALUES (?, ?)"));
+        queryStoreDictionary.bindValue(0, envelopeDictionaryId);
+        queryStoreDictionary.bindValue(1, dictionary->data());
+        if (!queryStoreDictionary.exec()) {
+            ctx.emitError(QObject::tr("Failed to store the envelope dictionary"), queryStoreDictionary);
+            return;
+        }
+        *trained = dictionary;
+    });
+}
+
+bool SQLCache::loadMailboxIds()
+{
+    QSqlQuery q(QString(), db);
+    if (!q.exec(QStringLiteral("SELECT id, name FROM mailboxes"))) {
+        emitError(QObject::tr("Failed to load the mailbox IDs"), q);
+        return false;
+    }
+    m_mailboxIds.clear();
+    m_nextMailboxId = 1;
+    while (q.next()) {
+        const qint64 id = q.value(0).toLongLong();
+        m_mailboxIds[q.value(1).toString()] = id;
+        m_nextMailboxId = qMax(m_nextMailboxId, id + 1);
+    }
+    return true;
+}
+
+qint64 SQLCache::mailboxId(const QString &mailbox) const
+{
+    return m_mailboxIds.value(mailboxName(mailbox), -1);
+}
+
+qint64 SQLCache::ensureMailboxId(const QString &mailbox)
+{
+    const QString name = mailboxName(mailbox);
+    auto it = m_mailboxIds.constFind(name);
+    if (it != m_mailboxIds.constEnd())
+        return *it;
+
+    // The IDs are handed out here so that the callers do not have to wait for the writer
+    const qint64 id = m_nextMailboxId++;
+    m_mailboxIds[name] = id;
+    const quint64 sequence = ++m_writeSequence;
+    write(sequence, [id, name](SqlWriteContext &ctx) {
+        QSqlQuery &queryAddMailbox = ctx.prepared(QStringLiteral("INSERT INTO mailboxes (id, name) VALUES (?, ?)"));
+        queryAddMailbox.bindValue(0, id);
+        queryAddMailbox.bindValue(1, name);
+        if (!queryAddMailbox.exec()) {
+            ctx.emitError(QObject::tr("Query queryAddMailbox failed"), queryAddMailbox);
+        }
+    });
+    return id;
+}
+
 bool SQLCache::createTables()
 {
     QSqlQuery q(QString(), db);
@@ -288,150 +1010,81 @@ bool SQLCache::prepareQueries()
         return false;
     }
 
-    queryRemoveChildMailboxes = QSqlQuery(db);
-    if (!queryRemoveChildMailboxes.prepare(QStringLiteral("DELETE FROM child_mailboxes WHERE parent = ?"))) {
-        emitError(QObject::tr("Failed to prepare queryRemoveChildMailboxes"), queryRemoveChildMailboxes);
-        return false;
-    }
-
-    querySetChildMailboxes = QSqlQuery(db);
-    if (! querySetChildMailboxes.prepare(QStringLiteral("INSERT OR REPLACE INTO child_mailboxes ( mailbox, parent, separator, flags ) VALUES (?, ?, ?, ?)"))) {
-        emitError(QObject::tr("Failed to prepare querySetChildMailboxes"), querySetChildMailboxes);
-        return false;
-    }
-
     queryMailboxSyncState = QSqlQuery(db);
     if (! queryMailboxSyncState.prepare(QStringLiteral("SELECT sync_state FROM mailbox_sync_state WHERE mailbox = ?"))) {
         emitError(QObject::tr("Failed to prepare queryMailboxSyncState"), queryMailboxSyncState);
         return false;
     }
 
-    querySetMailboxSyncState = QSqlQuery(db);
-    if (! querySetMailboxSyncState.prepare(QStringLiteral("INSERT OR REPLACE INTO mailbox_sync_state "
-                                           "( mailbox, sync_state ) "
-                                           "VALUES ( ?, ? )"))) {
-        emitError(QObject::tr("Failed to prepare querySetMailboxSyncState"), querySetMailboxSyncState);
-        return false;
-    }
-
     queryUidMapping = QSqlQuery(db);
-    if (! queryUidMapping.prepare(QStringLiteral("SELECT mapping FROM uid_mapping WHERE mailbox = ?"))) {
+    if (! queryUidMapping.prepare(QStringLiteral("SELECT mapping FROM uid_mapping WHERE mailbox_id = ?"))) {
         emitError(QObject::tr("Failed to prepare queryUidMapping"), queryUidMapping);
         return false;
     }
 
-    querySetUidMapping = QSqlQuery(db);
-    if (! querySetUidMapping.prepare(QStringLiteral("INSERT OR REPLACE INTO uid_mapping (mailbox, mapping) VALUES  ( ?, ? )"))) {
-        emitError(QObject::tr("Failed to prepare querySetUidMapping"), querySetUidMapping);
-        return false;
-    }
-
-    queryClearUidMapping = QSqlQuery(db);
-    if (! queryClearUidMapping.prepare(QStringLiteral("DELETE FROM uid_mapping WHERE mailbox = ?"))) {
-        emitError(QObject::tr("Failed to prepare queryClearUidMapping"), queryClearUidMapping);
+    queryUidMappingLog = QSqlQuery(db);
+    if (!queryUidMappingLog.prepare(QStringLiteral("SELECT seq, delta FROM uid_mapping_log WHERE mailbox_id = ? ORDER BY seq"))) {
+        emitError(QObject::tr("Failed to prepare queryUidMappingLog"), queryUidMappingLog);
         return false;
     }
 
     queryMessageMetadata = QSqlQuery(db);
-    if (! queryMessageMetadata.prepare(QStringLiteral("SELECT data, lastAccessDate FROM msg_metadata WHERE mailbox = ? AND uid = ?"))) {
+    if (! queryMessageMetadata.prepare(QStringLiteral("SELECT data, lastAccessDate FROM msg_metadata WHERE mailbox_id = ? AND uid = ?"))) {
         emitError(QObject::tr("Failed to prepare queryMessageMetadata"), queryMessageMetadata);
         return false;
     }
 
-    queryAccessMessageMetadata = QSqlQuery(db);
-    if (!queryAccessMessageMetadata.prepare(QStringLiteral("UPDATE msg_metadata SET lastAccessDate = ? WHERE mailbox = ? AND uid = ?"))) {
-        emitError(QObject::tr("Failed to prepare queryAccssMessageMetadata"), queryAccessMessageMetadata);
-        return false;
-    }
-
-    querySetMessageMetadata = QSqlQuery(db);
-    if (! querySetMessageMetadata.prepare(QStringLiteral("INSERT OR REPLACE INTO msg_metadata ( mailbox, uid, data, lastAccessDate ) VALUES ( ?, ?, ?, ? )"))) {
-        emitError(QObject::tr("Failed to prepare querySetMessageMetadata"), querySetMessageMetadata);
+    queryMessageMetadataRange = QSqlQuery(db);
+    if (!queryMessageMetadataRange.prepare(QStringLiteral("SELECT uid, data, lastAccessDate FROM msg_metadata "
+                                                          "WHERE mailbox_id = ? AND uid BETWEEN ? AND ?"))) {
+        emitError(QObject::tr("Failed to prepare queryMessageMetadataRange"), queryMessageMetadataRange);
         return false;
     }
 
     queryMessageFlags = QSqlQuery(db);
-    if (! queryMessageFlags.prepare(QStringLiteral("SELECT flags FROM flags WHERE mailbox = ? AND uid = ?"))) {
+    if (! queryMessageFlags.prepare(QStringLiteral("SELECT flags FROM flags WHERE mailbox_id = ? AND uid = ?"))) {
         emitError(QObject::tr("Failed to prepare queryMessageFlags"), queryMessageFlags);
         return false;
     }
 
-    querySetMessageFlags = QSqlQuery(db);
-    if (! querySetMessageFlags.prepare(QStringLiteral("INSERT OR REPLACE INTO flags ( mailbox, uid, flags ) VALUES ( ?, ?, ? )"))) {
-        emitError(QObject::tr("Failed to prepare querySetMessageFlags"), querySetMessageFlags);
-        return false;
-    }
-
-    queryClearAllMessages1 = QSqlQuery(db);
-    if (! queryClearAllMessages1.prepare(QStringLiteral("DELETE FROM msg_metadata WHERE mailbox = ?"))) {
-        emitError(QObject::tr("Failed to prepare queryClearAllMessages1"), queryClearAllMessages1);
-        return false;
-    }
-
-    queryClearAllMessages2 = QSqlQuery(db);
-    if (! queryClearAllMessages2.prepare(QStringLiteral("DELETE FROM flags WHERE mailbox = ?"))) {
-        emitError(QObject::tr("Failed to prepare queryClearAllMessages2"), queryClearAllMessages2);
-        return false;
-    }
-
-    queryClearAllMessages3 = QSqlQuery(db);
-    if (! queryClearAllMessages3.prepare(QStringLiteral("DELETE FROM parts WHERE mailbox = ?"))) {
-        emitError(QObject::tr("Failed to prepare queryClearAllMessages3"), queryClearAllMessages3);
-        return false;
-    }
-
-    queryClearAllMessages4 = QSqlQuery(db);
-    if (! queryClearAllMessages4.prepare(QStringLiteral("DELETE FROM msg_threading WHERE mailbox = ?"))) {
-        emitError(QObject::tr("Failed to prepare queryClearAllMessages4"), queryClearAllMessages4);
-        return false;
-    }
-
-    queryClearMessage1 = QSqlQuery(db);
-    if (! queryClearMessage1.prepare(QStringLiteral("DELETE FROM msg_metadata WHERE mailbox = ? AND uid = ?"))) {
-        emitError(QObject::tr("Failed to prepare queryClearMessage1"), queryClearMessage1);
-        return false;
-    }
-
-    queryClearMessage2 = QSqlQuery(db);
-    if (! queryClearMessage2.prepare(QStringLiteral("DELETE FROM flags WHERE mailbox = ? AND uid = ?"))) {
-        emitError(QObject::tr("Failed to prepare queryClearMessage2"), queryClearMessage2);
-        return false;
-    }
-
-    queryClearMessage3 = QSqlQuery(db);
-    if (! queryClearMessage3.prepare(QStringLiteral("DELETE FROM parts WHERE mailbox = ? AND uid = ?"))) {
-        emitError(QObject::tr("Failed to prepare queryClearMessage3"), queryClearMessage3);
+    queryMessageFlagsRange = QSqlQuery(db);
+    if (!queryMessageFlagsRange.prepare(QStringLiteral("SELECT uid, flags FROM flags WHERE mailbox_id = ? AND uid BETWEEN ? AND ?"))) {
+        emitError(QObject::tr("Failed to prepare queryMessageFlagsRange"), queryMessageFlagsRange);
         return false;
     }
 
     queryMessagePart = QSqlQuery(db);
-    if (! queryMessagePart.prepare(QStringLiteral("SELECT data FROM parts WHERE mailbox = ? AND uid = ? AND part_id = ?"))) {
+    if (! queryMessagePart.prepare(QStringLiteral("SELECT data FROM parts WHERE mailbox_id = ? AND uid = ? AND part_id = ?"))) {
         emitError(QObject::tr("Failed to prepare queryMessagePart"), queryMessagePart);
         return false;
     }
 
-    querySetMessagePart = QSqlQuery(db);
-    if (! querySetMessagePart.prepare(QStringLiteral("INSERT OR REPLACE INTO parts ( mailbox, uid, part_id, data ) VALUES (?, ?, ?, ?)"))) {
-        emitError(QObject::tr("Failed to prepare querySetMessagePart"), querySetMessagePart);
+    queryMessageThreading = QSqlQuery(db);
+    if (! queryMessageThreading.prepare(QStringLiteral("SELECT threading FROM msg_threading WHERE mailbox_id = ?"))) {
+        emitError(QObject::tr("Failed to prepare queryMessageThreading"), queryMessageThreading);
         return false;
     }
 
-    queryForgetMessagePart = QSqlQuery(db);
-    if (! queryForgetMessagePart.prepare(QStringLiteral("DELETE FROM parts WHERE mailbox = ? AND uid = ? AND part_id = ?"))) {
-        emitError(QObject::tr("Failed to prepare queryForgetMessagePart"), queryForgetMessagePart);
+    queryMessageThreadingLog = QSqlQuery(db);
+    if (!queryMessageThreadingLog.prepare(QStringLiteral("SELECT seq, delta FROM msg_threading_log WHERE mailbox_id = ? ORDER BY seq"))) {
+        emitError(QObject::tr("Failed to prepare queryMessageThreadingLog"), queryMessageThreadingLog);
         return false;
     }
 
-    queryMessageThreading = QSqlQuery(db);
-    if (! queryMessageThreading.prepare(QStringLiteral("SELECT threading FROM msg_threading WHERE mailbox = ?"))) {
-        emitError(QObject::tr("Failed to prepare queryMessageThreading"), queryMessageThreading);
+    querySearchResult = QSqlQuery(db);
+    if (!querySearchResult.prepare(QStringLiteral("SELECT highestmodseq, uidnext, uids, uidvalidity FROM search_results "
+                                                  "WHERE mailbox_id = ? AND criteria = ?"))) {
+        emitError(QObject::tr("Failed to prepare querySearchResult"), querySearchResult);
         return false;
     }
 
-    querySetMessageThreading = QSqlQuery(db);
-    if (! querySetMessageThreading.prepare(QStringLiteral("INSERT OR REPLACE INTO msg_threading (mailbox, threading) VALUES  ( ?, ? )"))) {
-        emitError(QObject::tr("Failed to prepare querySetMessageThreading"), querySetMessageThreading);
-        return false;
+    if (m_fullTextIndex) {
+        querySearchMessages = QSqlQuery(db);
+        if (!querySearchMessages.prepare(QStringLiteral("SELECT rowid FROM fulltext WHERE fulltext MATCH ? AND rowid BETWEEN ? AND ? "
+                                                        "ORDER BY rowid"))) {
+            emitError(QObject::tr("Failed to prepare querySearchMessages"), querySearchMessages);
+            return false;
+        }
     }
 
 #ifdef CACHE_DEBUG
@@ -458,6 +1111,10 @@ void SQLCache::emitError(const QString &message) const
 
 QList<MailboxMetadata> SQLCache::childMailboxes(const QString &mailbox) const
 {
+    auto pending = m_pending.childMailboxes.constFind(mailbox);
+    if (pending != m_pending.childMailboxes.constEnd())
+        return pending->value;
+
     QList<MailboxMetadata> res;
     queryChildMailboxes.bindValue(0, mailboxName(mailbox));
     if (! queryChildMailboxes.exec()) {
@@ -482,12 +1139,19 @@ QList<MailboxMetadata> SQLCache::childMailboxes(const QString &mailbox) const
 
 bool SQLCache::childMailboxesFresh(const QString &mailbox) const
 {
+    auto pending = m_pending.childMailboxes.constFind(mailbox);
+    if (pending != m_pending.childMailboxes.constEnd())
+        return !pending->value.isEmpty();
+
     queryChildMailboxesFresh.bindValue(0, mailboxName(mailbox));
     if (! queryChildMailboxesFresh.exec()) {
         emitError(QObject::tr("Query queryChildMailboxesFresh failed"), queryChildMailboxesFresh);
         return false;
     }
-    return queryChildMailboxesFresh.first();
+    const bool res = queryChildMailboxesFresh.first();
+    // Do not keep the read transaction open, it would pin an old snapshot of the WAL
+    queryChildMailboxesFresh.finish();
+    return res;
 }
 
 void SQLCache::setChildMailboxes(const QString &mailbox, const QList<MailboxMetadata> &data)
@@ -495,35 +1159,45 @@ void SQLCache::setChildMailboxes(const QString &mailbox, const QList<MailboxMeta
 #ifdef CACHE_DEBUG
     qDebug() << "Setting child mailboxes for" << mailbox;
 #endif
-    touchingDB();
-    QVariantList mailboxFields, parentFields, separatorFields, flagsFelds;
-    Q_FOREACH(const MailboxMetadata& item, data) {
-        mailboxFields << item.mailbox;
-        parentFields << mailboxName(mailbox);
-        separatorFields << item.separator;
-        QByteArray buf;
-        QDataStream stream(&buf, QIODevice::ReadWrite);
-        stream.setVersion(streamVersion);
-        stream << item.flags;
-        flagsFelds << buf;
-    }
-    queryRemoveChildMailboxes.bindValue(0, mailboxName(mailbox));
-    if (!queryRemoveChildMailboxes.exec()) {
-        emitError(QObject::tr("Query queryRemoveChildMailboxes failed"), queryRemoveChildMailboxes);
-        return;
-    }
-    querySetChildMailboxes.bindValue(0, mailboxFields);
-    querySetChildMailboxes.bindValue(1, parentFields);
-    querySetChildMailboxes.bindValue(2, separatorFields);
-    querySetChildMailboxes.bindValue(3, flagsFelds);
-    if (! querySetChildMailboxes.execBatch()) {
-        emitError(QObject::tr("Query querySetChildMailboxes failed"), querySetChildMailboxes);
-        return;
-    }
+    const quint64 sequence = ++m_writeSequence;
+    m_pending.childMailboxes[mailbox] = Pending<QList<MailboxMetadata> >{sequence, false, data};
+    write(sequence, [mailbox, data](SqlWriteContext &ctx) {
+        QVariantList mailboxFields, parentFields, separatorFields, flagsFelds;
+        Q_FOREACH(const MailboxMetadata& item, data) {
+            mailboxFields << item.mailbox;
+            parentFields << mailboxName(mailbox);
+            separatorFields << item.separator;
+            QByteArray buf;
+            QDataStream stream(&buf, QIODevice::ReadWrite);
+            stream.setVersion(streamVersion);
+            stream << item.flags;
+            flagsFelds << buf;
+        }
+        QSqlQuery &queryRemoveChildMailboxes = ctx.prepared(QStringLiteral("DELETE FROM child_mailboxes WHERE parent = ?"));
+        queryRemoveChildMailboxes.bindValue(0, mailboxName(mailbox));
+        if (!queryRemoveChildMailboxes.exec()) {
+            ctx.emitError(QObject::tr("Query queryRemoveChildMailboxes failed"), queryRemoveChildMailboxes);
+            return;
+        }
+        QSqlQuery &querySetChildMailboxes = ctx.prepared(QStringLiteral("INSERT OR REPLACE INTO child_mailboxes "
+                                                                        "( mailbox, parent, separator, flags ) VALUES (?, ?, ?, ?)"));
+        querySetChildMailboxes.bindValue(0, mailboxFields);
+        querySetChildMailboxes.bindValue(1, parentFields);
+        querySetChildMailboxes.bindValue(2, separatorFields);
+        querySetChildMailboxes.bindValue(3, flagsFelds);
+        if (! querySetChildMailboxes.execBatch()) {
+            ctx.emitError(QObject::tr("Query querySetChildMailboxes failed"), querySetChildMailboxes);
+            return;
+        }
+    });
 }
 
 SyncState SQLCache::mailboxSyncState(const QString &mailbox) const
 {
+    auto pending = m_pending.syncState.constFind(mailbox);
+    if (pending != m_pending.syncState.constEnd())
+        return pending->value;
+
     SyncState res;
     queryMailboxSyncState.bindValue(0, mailboxName(mailbox));
     if (! queryMailboxSyncState.exec()) {
@@ -535,6 +1209,7 @@ SyncState SQLCache::mailboxSyncState(const QString &mailbox) const
         stream.setVersion(streamVersion);
         stream >> res;
     }
+    queryMailboxSyncState.finish();
     // "No data present" doesn't necessarily imply a problem -- it simply might not be there yet :)
     return res;
 }
@@ -544,33 +1219,63 @@ void SQLCache::setMailboxSyncState(const QString &mailbox, const SyncState &stat
 #ifdef CACHE_DEBUG
     qDebug() << "Setting sync state for" << mailbox;
 #endif
-    touchingDB();
-    querySetMailboxSyncState.bindValue(0, mailboxName(mailbox));
-    QByteArray buf;
-    QDataStream stream(&buf, QIODevice::ReadWrite);
-    stream.setVersion(streamVersion);
-    stream << state;
-    querySetMailboxSyncState.bindValue(1, buf);
-    if (! querySetMailboxSyncState.exec()) {
-        emitError(QObject::tr("Query querySetMailboxSyncState failed"), querySetMailboxSyncState);
-        return;
+    const qint64 id = ensureMailboxId(mailbox);
+    const quint64 sequence = ++m_writeSequence;
+    m_pending.syncState[mailbox] = Pending<SyncState>{sequence, false, state};
+    const uint uidValidity = state.uidValidity();
+    if (uidValidity) {
+        // The UIDs in the search results are meaningless once the UIDVALIDITY changes
+        for (auto it = m_pending.searchResults.begin(); it != m_pending.searchResults.end(); ) {
+            if (it.key().first == mailbox && it->value.uidValidity != uidValidity)
+                it = m_pending.searchResults.erase(it);
+            else
+                ++it;
+        }
     }
+    write(sequence, [id, mailbox, state, uidValidity](SqlWriteContext &ctx) {
+        QSqlQuery &querySetMailboxSyncState = ctx.prepared(QStringLiteral("INSERT OR REPLACE INTO mailbox_sync_state "
+                                                                          "( mailbox, sync_state ) VALUES ( ?, ? )"));
+        querySetMailboxSyncState.bindValue(0, mailboxName(mailbox));
+        QByteArray buf;
+        QDataStream stream(&buf, QIODevice::ReadWrite);
+        stream.setVersion(streamVersion);
+        stream << state;
+        querySetMailboxSyncState.bindValue(1, buf);
+        if (! querySetMailboxSyncState.exec()) {
+            ctx.emitError(QObject::tr("Query querySetMailboxSyncState failed"), querySetMailboxSyncState);
+        }
+        if (uidValidity) {
+            QSqlQuery &queryPurgeSearchResults = ctx.prepared(QStringLiteral("DELETE FROM search_results "
+                                                                             "WHERE mailbox_id = ? AND IFNULL(uidvalidity, 0) <> ?"));
+            queryPurgeSearchResults.bindValue(0, id);
+            queryPurgeSearchResults.bindValue(1, uidValidity);
+            if (!queryPurgeSearchResults.exec()) {
+                ctx.emitError(QObject::tr("Query queryPurgeSearchResults failed"), queryPurgeSearchResults);
+            }
+        }
+        QSqlQuery &querySetUidValidity = ctx.prepared(QStringLiteral("UPDATE mailboxes SET uidvalidity = ? WHERE id = ?"));
+        querySetUidValidity.bindValue(0, state.uidValidity());
+        querySetUidValidity.bindValue(1, id);
+        if (!querySetUidValidity.exec()) {
+            ctx.emitError(QObject::tr("Query querySetUidValidity failed"), querySetUidValidity);
+        }
+    });
 }
 
 Imap::Uids SQLCache::uidMapping(const QString &mailbox) const
 {
+    auto pending = m_pending.uidMapping.constFind(mailbox);
+    if (pending != m_pending.uidMapping.constEnd())
+        return pending->value;
+
     Imap::Uids res;
-    queryUidMapping.bindValue(0, mailboxName(mailbox));
-    if (! queryUidMapping.exec()) {
-        emitError(QObject::tr("Query queryUidMapping failed"), queryUidMapping);
+    const qint64 id = mailboxId(mailbox);
+    if (id < 0)
         return res;
-    }
-    if (queryUidMapping.first()) {
-        QDataStream stream(qUncompress(queryUidMapping.value(0).toByteArray()));
-        stream.setVersion(streamVersion);
-        stream >> res;
-    }
-    // "No data present" doesn't necessarily imply a problem -- it simply might not be there yet :)
+    LogState state;
+    loadLogged(queryUidMapping, queryUidMappingLog, id, res, state, [this](const QString &message, const QSqlQuery &query) {
+        emitError(message, query);
+    });
     return res;
 }
 
@@ -579,16 +1284,12 @@ void SQLCache::setUidMapping(const QString &mailbox, const Imap::Uids &seqToUid)
 #ifdef CACHE_DEBUG
     qDebug() << "Setting UID mapping for" << mailbox;
 #endif
-    touchingDB();
-    querySetUidMapping.bindValue(0, mailboxName(mailbox));
-    QByteArray buf;
-    QDataStream stream(&buf, QIODevice::ReadWrite);
-    stream.setVersion(streamVersion);
-    stream << seqToUid;
-    querySetUidMapping.bindValue(1, qCompress(buf));
-    if (! querySetUidMapping.exec()) {
-        emitError(QObject::tr("Query querySetUidMapping failed"), querySetUidMapping);
-    }
+    const qint64 id = ensureMailboxId(mailbox);
+    const quint64 sequence = ++m_writeSequence;
+    m_pending.uidMapping[mailbox] = Pending<Imap::Uids>{sequence, false, seqToUid};
+    write(sequence, [id, seqToUid](SqlWriteContext &ctx) {
+        storeLogged(ctx, QStringLiteral("uid_mapping"), QStringLiteral("mapping"), id, seqToUid);
+    });
 }
 
 void SQLCache::clearUidMapping(const QString &mailbox)
@@ -596,11 +1297,24 @@ void SQLCache::clearUidMapping(const QString &mailbox)
 #ifdef CACHE_DEBUG
     qDebug() << "Clearing UID mapping for" << mailbox;
 #endif
-    touchingDB();
-    queryClearUidMapping.bindValue(0, mailboxName(mailbox));
-    if (! queryClearUidMapping.exec()) {
-        emitError(QObject::tr("Query queryClearUidMapping failed"), queryClearUidMapping);
-    }
+    const qint64 id = mailboxId(mailbox);
+    if (id < 0)
+        return;
+    const quint64 sequence = ++m_writeSequence;
+    m_pending.uidMapping[mailbox] = Pending<Imap::Uids>{sequence, true, Imap::Uids()};
+    write(sequence, [id](SqlWriteContext &ctx) {
+        QSqlQuery &queryClearUidMapping = ctx.prepared(QStringLiteral("DELETE FROM uid_mapping WHERE mailbox_id = ?"));
+        queryClearUidMapping.bindValue(0, id);
+        if (! queryClearUidMapping.exec()) {
+            ctx.emitError(QObject::tr("Query queryClearUidMapping failed"), queryClearUidMapping);
+        }
+        QSqlQuery &queryClearUidMappingLog = ctx.prepared(QStringLiteral("DELETE FROM uid_mapping_log WHERE mailbox_id = ?"));
+        queryClearUidMappingLog.bindValue(0, id);
+        if (!queryClearUidMappingLog.exec()) {
+            ctx.emitError(QObject::tr("Query queryClearUidMappingLog failed"), queryClearUidMappingLog);
+        }
+        ctx.forgetScratch(loggedScratchKey(QStringLiteral("uid_mapping"), id));
+    });
 }
 
 void SQLCache::clearAllMessages(const QString &mailbox)
@@ -608,23 +1322,91 @@ void SQLCache::clearAllMessages(const QString &mailbox)
 #ifdef CACHE_DEBUG
     qDebug() << "Clearing all messages from" << mailbox;
 #endif
-    touchingDB();
-    queryClearAllMessages1.bindValue(0, mailboxName(mailbox));
-    queryClearAllMessages2.bindValue(0, mailboxName(mailbox));
-    queryClearAllMessages3.bindValue(0, mailboxName(mailbox));
-    queryClearAllMessages4.bindValue(0, mailboxName(mailbox));
-    if (! queryClearAllMessages1.exec()) {
-        emitError(QObject::tr("Query queryClearAllMessages1 failed"), queryClearAllMessages1);
-    }
-    if (! queryClearAllMessages2.exec()) {
-        emitError(QObject::tr("Query queryClearAllMessages2 failed"), queryClearAllMessages2);
-    }
-    if (! queryClearAllMessages3.exec()) {
-        emitError(QObject::tr("Query queryClearAllMessages3 failed"), queryClearAllMessages3);
-    }
-    if (! queryClearAllMessages4.exec()) {
-        emitError(QObject::tr("Query queryClearAllMessages4 failed"), queryClearAllMessages4);
-    }
+    const qint64 id = mailboxId(mailbox);
+    if (id < 0)
+        return;
+    const quint64 sequence = ++m_writeSequence;
+    for (auto it = m_pending.metadata.begin(); it != m_pending.metadata.end(); ) {
+        if (it.key().first == mailbox)
+            it = m_pending.metadata.erase(it);
+        else
+            ++it;
+    }
+    for (auto it = m_pending.flags.begin(); it != m_pending.flags.end(); ) {
+        if (it.key().first == mailbox)
+            it = m_pending.flags.erase(it);
+        else
+            ++it;
+    }
+    for (auto it = m_pending.parts.begin(); it != m_pending.parts.end(); ) {
+        if (it.key().first.first == mailbox)
+            it = m_pending.parts.erase(it);
+        else
+            ++it;
+    }
+    for (auto it = m_pending.expiredMessages.begin(); it != m_pending.expiredMessages.end(); ) {
+        if (it.key().first == mailbox)
+            it = m_pending.expiredMessages.erase(it);
+        else
+            ++it;
+    }
+    for (auto it = m_pending.searchResults.begin(); it != m_pending.searchResults.end(); ) {
+        if (it.key().first == mailbox)
+            it = m_pending.searchResults.erase(it);
+        else
+            ++it;
+    }
+    m_pending.clearedMailboxes[mailbox] = sequence;
+    m_pending.threading[mailbox] = Pending<QVector<Imap::Responses::ThreadingNode> >{
+            sequence, true, QVector<Imap::Responses::ThreadingNode>()};
+    const bool fullText = m_fullTextIndex;
+    write(sequence, [id, fullText](SqlWriteContext &ctx) {
+        QSqlQuery &queryClearAllMessages1 = ctx.prepared(QStringLiteral("DELETE FROM msg_metadata WHERE mailbox_id = ?"));
+        QSqlQuery &queryClearAllMessages2 = ctx.prepared(QStringLiteral("DELETE FROM flags WHERE mailbox_id = ?"));
+        QSqlQuery &queryClearAllMessages3 = ctx.prepared(QStringLiteral("DELETE FROM parts WHERE mailbox_id = ?"));
+        QSqlQuery &queryClearAllMessages4 = ctx.prepared(QStringLiteral("DELETE FROM msg_threading WHERE mailbox_id = ?"));
+        QSqlQuery &queryClearAllMessages5 = ctx.prepared(QStringLiteral("DELETE FROM msg_threading_log WHERE mailbox_id = ?"));
+        queryClearAllMessages1.bindValue(0, id);
+        queryClearAllMessages2.bindValue(0, id);
+        queryClearAllMessages3.bindValue(0, id);
+        queryClearAllMessages4.bindValue(0, id);
+        queryClearAllMessages5.bindValue(0, id);
+        if (! queryClearAllMessages1.exec()) {
+            ctx.emitError(QObject::tr("Query queryClearAllMessages1 failed"), queryClearAllMessages1);
+        }
+        if (! queryClearAllMessages2.exec()) {
+            ctx.emitError(QObject::tr("Query queryClearAllMessages2 failed"), queryClearAllMessages2);
+        }
+        if (! queryClearAllMessages3.exec()) {
+            ctx.emitError(QObject::tr("Query queryClearAllMessages3 failed"), queryClearAllMessages3);
+        }
+        if (! queryClearAllMessages4.exec()) {
+            ctx.emitError(QObject::tr("Query queryClearAllMessages4 failed"), queryClearAllMessages4);
+        }
+        if (!queryClearAllMessages5.exec()) {
+            ctx.emitError(QObject::tr("Query queryClearAllMessages5 failed"), queryClearAllMessages5);
+        }
+        ctx.forgetScratch(loggedScratchKey(QStringLiteral("msg_threading"), id));
+        QSqlQuery &queryClearSearchResults = ctx.prepared(QStringLiteral("DELETE FROM search_results WHERE mailbox_id = ?"));
+        queryClearSearchResults.bindValue(0, id);
+        if (!queryClearSearchResults.exec()) {
+            ctx.emitError(QObject::tr("Query queryClearSearchResults failed"), queryClearSearchResults);
+        }
+        if (fullText) {
+            QSqlQuery &queryClearAllMessages6 = ctx.prepared(QStringLiteral("DELETE FROM fulltext WHERE rowid BETWEEN ? AND ?"));
+            queryClearAllMessages6.bindValue(0, fullTextRowId(id, 0));
+            queryClearAllMessages6.bindValue(1, fullTextRowId(id, std::numeric_limits<uint>::max()));
+            if (!queryClearAllMessages6.exec()) {
+                ctx.emitError(QObject::tr("Query queryClearAllMessages6 failed"), queryClearAllMessages6);
+            }
+            QSqlQuery &queryClearAllMessages7 = ctx.prepared(QStringLiteral("DELETE FROM fulltext_parts WHERE fulltext_id BETWEEN ? AND ?"));
+            queryClearAllMessages7.bindValue(0, fullTextRowId(id, 0));
+            queryClearAllMessages7.bindValue(1, fullTextRowId(id, std::numeric_limits<uint>::max()));
+            if (!queryClearAllMessages7.exec()) {
+                ctx.emitError(QObject::tr("Query queryClearAllMessages7 failed"), queryClearAllMessages7);
+            }
+        }
+    });
     clearUidMapping(mailbox);
 }
 
@@ -633,28 +1415,60 @@ void SQLCache::clearMessage(const QString mailbox, uint uid)
 #ifdef CACHE_DEBUG
     qDebug() << "Clearing message" << uid << "from" << mailbox;
 #endif
-    touchingDB();
-    queryClearMessage1.bindValue(0, mailboxName(mailbox));
-    queryClearMessage1.bindValue(1, uid);
-    queryClearMessage2.bindValue(0, mailboxName(mailbox));
-    queryClearMessage2.bindValue(1, uid);
-    queryClearMessage3.bindValue(0, mailboxName(mailbox));
-    queryClearMessage3.bindValue(1, uid);
-    if (! queryClearMessage1.exec()) {
-        emitError(QObject::tr("Query queryClearMessage1 failed"), queryClearMessage1);
-    }
-    if (! queryClearMessage2.exec()) {
-        emitError(QObject::tr("Query queryClearMessage2 failed"), queryClearMessage2);
-    }
-    if (! queryClearMessage3.exec()) {
-        emitError(QObject::tr("Query queryClearMessage3 failed"), queryClearMessage3);
-    }
+    const qint64 id = mailboxId(mailbox);
+    if (id < 0)
+        return;
+    const quint64 sequence = ++m_writeSequence;
+    forgetPendingMessage(mailbox, uid, sequence);
+    m_pending.flags[qMakePair(mailbox, uid)] = Pending<QStringList>{sequence, true, QStringList()};
+    const bool fullText = m_fullTextIndex;
+    write(sequence, [id, uid, fullText](SqlWriteContext &ctx) {
+        QSqlQuery &queryClearMessage1 = ctx.prepared(QStringLiteral("DELETE FROM msg_metadata WHERE mailbox_id = ? AND uid = ?"));
+        QSqlQuery &queryClearMessage2 = ctx.prepared(QStringLiteral("DELETE FROM flags WHERE mailbox_id = ? AND uid = ?"));
+        QSqlQuery &queryClearMessage3 = ctx.prepared(QStringLiteral("DELETE FROM parts WHERE mailbox_id = ? AND uid = ?"));
+        queryClearMessage1.bindValue(0, id);
+        queryClearMessage1.bindValue(1, uid);
+        queryClearMessage2.bindValue(0, id);
+        queryClearMessage2.bindValue(1, uid);
+        queryClearMessage3.bindValue(0, id);
+        queryClearMessage3.bindValue(1, uid);
+        if (! queryClearMessage1.exec()) {
+            ctx.emitError(QObject::tr("Query queryClearMessage1 failed"), queryClearMessage1);
+        }
+        if (! queryClearMessage2.exec()) {
+            ctx.emitError(QObject::tr("Query queryClearMessage2 failed"), queryClearMessage2);
+        }
+        if (! queryClearMessage3.exec()) {
+            ctx.emitError(QObject::tr("Query queryClearMessage3 failed"), queryClearMessage3);
+        }
+        if (fullText) {
+            QSqlQuery &queryClearMessage4 = ctx.prepared(QStringLiteral("DELETE FROM fulltext WHERE rowid = ?"));
+            queryClearMessage4.bindValue(0, fullTextRowId(id, uid));
+            if (!queryClearMessage4.exec()) {
+                ctx.emitError(QObject::tr("Query queryClearMessage4 failed"), queryClearMessage4);
+            }
+            QSqlQuery &queryClearMessage5 = ctx.prepared(QStringLiteral("DELETE FROM fulltext_parts WHERE fulltext_id = ?"));
+            queryClearMessage5.bindValue(0, fullTextRowId(id, uid));
+            if (!queryClearMessage5.exec()) {
+                ctx.emitError(QObject::tr("Query queryClearMessage5 failed"), queryClearMessage5);
+            }
+        }
+    });
 }
 
 QStringList SQLCache::msgFlags(const QString &mailbox, const uint uid) const
 {
+    auto pending = m_pending.flags.constFind(qMakePair(mailbox, uid));
+    if (pending != m_pending.flags.constEnd())
+        return pending->value;
+    if (m_pending.clearedMailboxes.contains(mailbox))
+        return QStringList();
+
     QStringList res;
-    queryMessageFlags.bindValue(0, mailboxName(mailbox));
+    const qint64 id = mailboxId(mailbox);
+    if (id < 0)
+        return res;
+    queryMessageFlags.bindValue(0, id);
     queryMessageFlags.bindValue(1, uid);
     if (! queryMessageFlags.exec()) {
         emitError(QObject::tr("Query queryMessageFlags failed"), queryMessageFlags);
@@ -665,86 +1479,326 @@ QStringList SQLCache::msgFlags(const QString &mailbox, const uint uid) const
         stream.setVersion(streamVersion);
         stream >> res;
     }
+    queryMessageFlags.finish();
     // "Not found" is not an error here
     return res;
 }
 
+QMap<uint, QStringList> SQLCache::msgFlagsBatch(const QString &mailbox, const Imap::Uids &uids) const
+{
+    QMap<uint, QStringList> res;
+    const QSet<uint> wanted = uids.toList().toSet();
+    const qint64 id = mailboxId(mailbox);
+    if (id >= 0 && !m_pending.clearedMailboxes.contains(mailbox)) {
+        Q_FOREACH(const auto &range, uidRanges(uids)) {
+            queryMessageFlagsRange.bindValue(0, id);
+            queryMessageFlagsRange.bindValue(1, range.first);
+            queryMessageFlagsRange.bindValue(2, range.second);
+            if (!queryMessageFlagsRange.exec()) {
+                emitError(QObject::tr("Query queryMessageFlagsRange failed"), queryMessageFlagsRange);
+                return res;
+            }
+            while (queryMessageFlagsRange.next()) {
+                uint uid = queryMessageFlagsRange.value(0).toUInt();
+                if (!wanted.contains(uid))
+                    continue;
+                QStringList flags;
+                QDataStream stream(queryMessageFlagsRange.value(1).toByteArray());
+                stream.setVersion(streamVersion);
+                stream >> flags;
+                res.insert(uid, flags);
+            }
+        }
+    }
+    if (!m_pending.flags.isEmpty()) {
+        for (const uint uid : uids) {
+            auto pending = m_pending.flags.constFind(qMakePair(mailbox, uid));
+            if (pending == m_pending.flags.constEnd())
+                continue;
+            if (pending->removed)
+                res.remove(uid);
+            else
+                res.insert(uid, pending->value);
+        }
+    }
+    return res;
+}
+
 void SQLCache::setMsgFlags(const QString &mailbox, const uint uid, const QStringList &flags)
 {
 #ifdef CACHE_DEBUG
     qDebug() << "Updating flags for" << mailbox << uid;
 #endif
-    touchingDB();
-    querySetMessageFlags.bindValue(0, mailboxName(mailbox));
-    querySetMessageFlags.bindValue(1, uid);
-    QByteArray buf;
-    QDataStream stream(&buf, QIODevice::ReadWrite);
-    stream.setVersion(streamVersion);
-    stream << flags;
-    querySetMessageFlags.bindValue(2, buf);
-    if (! querySetMessageFlags.exec()) {
-        emitError(QObject::tr("Query querySetMessageFlags failed"), querySetMessageFlags);
-    }
+    const qint64 id = ensureMailboxId(mailbox);
+    const quint64 sequence = ++m_writeSequence;
+    m_pending.flags[qMakePair(mailbox, uid)] = Pending<QStringList>{sequence, false, flags};
+    write(sequence, [id, uid, flags](SqlWriteContext &ctx) {
+        QSqlQuery &querySetMessageFlags = ctx.prepared(QStringLiteral("INSERT OR REPLACE INTO flags ( mailbox_id, uid, flags ) VALUES ( ?, ?, ? )"));
+        querySetMessageFlags.bindValue(0, id);
+        querySetMessageFlags.bindValue(1, uid);
+        QByteArray buf;
+        QDataStream stream(&buf, QIODevice::ReadWrite);
+        stream.setVersion(streamVersion);
+        stream << flags;
+        querySetMessageFlags.bindValue(2, buf);
+        if (! querySetMessageFlags.exec()) {
+            ctx.emitError(QObject::tr("Query querySetMessageFlags failed"), querySetMessageFlags);
+        }
+    });
 }
 
 AbstractCache::MessageDataBundle SQLCache::messageMetadata(const QString &mailbox, uint uid) const
 {
+    auto pending = m_pending.metadata.constFind(qMakePair(mailbox, uid));
+    if (pending != m_pending.metadata.constEnd())
+        return pending->value;
+    if (m_pending.messageGone(mailbox, uid))
+        return MessageDataBundle();
+
     AbstractCache::MessageDataBundle res;
-    queryMessageMetadata.bindValue(0, mailboxName(mailbox));
+    const qint64 id = mailboxId(mailbox);
+    if (id < 0)
+        return res;
+    queryMessageMetadata.bindValue(0, id);
     queryMessageMetadata.bindValue(1, uid);
     if (! queryMessageMetadata.exec()) {
         emitError(QObject::tr("Query queryMessageMetadata failed"), queryMessageMetadata);
         return res;
     }
     if (queryMessageMetadata.first()) {
+        const QByteArray blob = queryMessageMetadata.value(0).toByteArray();
+        const int lastAccess = queryMessageMetadata.value(1).toInt();
+        queryMessageMetadata.finish();
+        const QByteArray data = decodeBlob(blob, m_envelopeDictionary.get());
+        if (data.isEmpty()) {
+            // E.g. compressed by a codec which this build does not have; that's a cache miss
+            return res;
+        }
         res.uid = uid;
-        QDataStream stream(qUncompress(queryMessageMetadata.value(0).toByteArray()));
+        QDataStream stream(data);
         stream.setVersion(streamVersion);
         stream >> res.envelope >> res.internalDate >> res.size >> res.serializedBodyStructure >> res.hdrReferences
                   >> res.hdrListPost >> res.hdrListPostNo;
 
-        if (m_updateAccessIfOlder) {
-            int lastAccessTimestamp = queryMessageMetadata.value(1).toInt();
-            int currentDiff = accessingThresholdDate.daysTo(QDate::currentDate());
-            if (lastAccessTimestamp < currentDiff - m_updateAccessIfOlder) {
-                queryAccessMessageMetadata.bindValue(0, currentDiff);
-                queryAccessMessageMetadata.bindValue(1, mailboxName(mailbox));
-                queryAccessMessageMetadata.bindValue(2, uid);
-                if (!queryAccessMessageMetadata.exec()) {
-                    emitError(QObject::tr("Query queryAccessMessageMetadata failed"), queryAccessMessageMetadata);
-                }
+        renewMessageAccess(mailbox, uid, lastAccess);
+    } else {
+        queryMessageMetadata.finish();
+    }
+    // "Not found" is not an error here
+    return res;
+}
+
+QMap<uint, AbstractCache::MessageDataBundle> SQLCache::messageMetadataBatch(const QString &mailbox, const Imap::Uids &uids) const
+{
+    QMap<uint, MessageDataBundle> res;
+    const QSet<uint> wanted = uids.toList().toSet();
+    // The access stamps can only be updated once the SELECT is done with its rows
+    QVector<QPair<uint, int> > accessed;
+    const qint64 id = mailboxId(mailbox);
+    if (id >= 0) {
+        Q_FOREACH(const auto &range, uidRanges(uids)) {
+            queryMessageMetadataRange.bindValue(0, id);
+            queryMessageMetadataRange.bindValue(1, range.first);
+            queryMessageMetadataRange.bindValue(2, range.second);
+            if (!queryMessageMetadataRange.exec()) {
+                emitError(QObject::tr("Query queryMessageMetadataRange failed"), queryMessageMetadataRange);
+                return res;
+            }
+            while (queryMessageMetadataRange.next()) {
+                uint uid = queryMessageMetadataRange.value(0).toUInt();
+                if (!wanted.contains(uid) || m_pending.messageGone(mailbox, uid))
+                    continue;
+                const QByteArray data = decodeBlob(queryMessageMetadataRange.value(1).toByteArray(), m_envelopeDictionary.get());
+                if (data.isEmpty())
+                    continue;
+                MessageDataBundle item;
+                item.uid = uid;
+                QDataStream stream(data);
+                stream.setVersion(streamVersion);
+                stream >> item.envelope >> item.internalDate >> item.size >> item.serializedBodyStructure >> item.hdrReferences
+                          >> item.hdrListPost >> item.hdrListPostNo;
+                res.insert(uid, item);
+                accessed.append(qMakePair(uid, queryMessageMetadataRange.value(2).toInt()));
             }
+            queryMessageMetadataRange.finish();
+        }
+    }
+    for (const auto &item : accessed) {
+        renewMessageAccess(mailbox, item.first, item.second);
+    }
+    if (!m_pending.metadata.isEmpty()) {
+        for (const uint uid : uids) {
+            auto pending = m_pending.metadata.constFind(qMakePair(mailbox, uid));
+            if (pending == m_pending.metadata.constEnd())
+                continue;
+            if (pending->removed)
+                res.remove(uid);
+            else
+                res.insert(uid, pending->value);
         }
     }
-    // "Not found" is not an error here
     return res;
 }
 
+void SQLCache::renewMessageAccess(const QString &mailbox, const uint uid, const int lastAccessTimestamp) const
+{
+    if (!m_updateAccessIfOlder)
+        return;
+    int currentDiff = accessingThresholdDate.daysTo(QDate::currentDate());
+    if (lastAccessTimestamp < currentDiff - m_updateAccessIfOlder) {
+        // The access stamp is our own bookkeeping which is invisible through the AbstractCache interface, that's why
+        // we're fine with modifying it from a const method
+        const qint64 id = mailboxId(mailbox);
+        const quint64 sequence = ++m_writeSequence;
+        const_cast<SQLCache *>(this)->write(sequence, [id, uid, currentDiff](SqlWriteContext &ctx) {
+            QSqlQuery &queryAccessMessageMetadata = ctx.prepared(QStringLiteral("UPDATE msg_metadata SET lastAccessDate = ? "
+                                                                                "WHERE mailbox_id = ? AND uid = ?"));
+            queryAccessMessageMetadata.bindValue(0, currentDiff);
+            queryAccessMessageMetadata.bindValue(1, id);
+            queryAccessMessageMetadata.bindValue(2, uid);
+            if (!queryAccessMessageMetadata.exec()) {
+                ctx.emitError(QObject::tr("Query queryAccessMessageMetadata failed"), queryAccessMessageMetadata);
+            }
+        });
+    }
+}
+
 void SQLCache::setMessageMetadata(const QString &mailbox, const uint uid, const MessageDataBundle &metadata)
 {
 #ifdef CACHE_DEBUG
     qDebug() << "Setting message metadata for" << uid << mailbox;
 #endif
-    touchingDB();
-    // Order of values: mailbox, uid, data
-    querySetMessageMetadata.bindValue(0, mailboxName(mailbox));
-    querySetMessageMetadata.bindValue(1, uid);
-    QByteArray buf;
-    QDataStream stream(&buf, QIODevice::ReadWrite);
-    stream.setVersion(streamVersion);
-    stream << metadata.envelope << metadata.internalDate << metadata.size << metadata.serializedBodyStructure
-           << metadata.hdrReferences << metadata.hdrListPost << metadata.hdrListPostNo;
-    querySetMessageMetadata.bindValue(2, qCompress(buf));
-    querySetMessageMetadata.bindValue(3, accessingThresholdDate.daysTo(QDate::currentDate()));
-    if (! querySetMessageMetadata.exec()) {
-        emitError(QObject::tr("Query querySetMessageMetadata failed"), querySetMessageMetadata);
+    const qint64 id = ensureMailboxId(mailbox);
+    const quint64 sequence = ++m_writeSequence;
+    MessageDataBundle pendingData = metadata;
+    pendingData.uid = uid;
+    m_pending.metadata[qMakePair(mailbox, uid)] = Pending<MessageDataBundle>{sequence, false, pendingData};
+    const int lastAccessDate = accessingThresholdDate.daysTo(QDate::currentDate());
+    const bool fullText = m_fullTextIndex;
+    const std::shared_ptr<const BlobDictionary> dictionary = m_envelopeDictionary;
+    write(sequence, [id, uid, metadata, lastAccessDate, fullText, dictionary](SqlWriteContext &ctx) {
+        QSqlQuery &querySetMessageMetadata = ctx.prepared(QStringLiteral("INSERT OR REPLACE INTO msg_metadata "
+                                                                         "( mailbox_id, uid, data, lastAccessDate ) VALUES ( ?, ?, ?, ? )"));
+        // Order of values: mailbox, uid, data
+        querySetMessageMetadata.bindValue(0, id);
+        querySetMessageMetadata.bindValue(1, uid);
+        QByteArray buf;
+        QDataStream stream(&buf, QIODevice::ReadWrite);
+        stream.setVersion(streamVersion);
+        stream << metadata.envelope << metadata.internalDate << metadata.size << metadata.serializedBodyStructure
+               << metadata.hdrReferences << metadata.hdrListPost << metadata.hdrListPostNo;
+        querySetMessageMetadata.bindValue(2, dictionary ? encodeBlob(buf, *dictionary) : encodeBlob(buf));
+        querySetMessageMetadata.bindValue(3, lastAccessDate);
+        if (! querySetMessageMetadata.exec()) {
+            ctx.emitError(QObject::tr("Query querySetMessageMetadata failed"), querySetMessageMetadata);
+        }
+        if (fullText) {
+            // Keep the text of the body which might have been indexed already
+            QSqlQuery &queryIndexEnvelope = ctx.prepared(QStringLiteral("INSERT OR REPLACE INTO fulltext "
+                                                                        "( rowid, subject, sender, recipients, body ) VALUES "
+                                                                        "( ?, ?, ?, ?, (SELECT body FROM fulltext WHERE rowid = ?) )"));
+            const qint64 rowId = fullTextRowId(id, uid);
+            const auto &envelope = metadata.envelope;
+            queryIndexEnvelope.bindValue(0, rowId);
+            queryIndexEnvelope.bindValue(1, envelope.subject);
+            queryIndexEnvelope.bindValue(2, indexedAddresses(envelope.from));
+            queryIndexEnvelope.bindValue(3, indexedAddresses(envelope.to + envelope.cc + envelope.bcc));
+            queryIndexEnvelope.bindValue(4, rowId);
+            if (!queryIndexEnvelope.exec()) {
+                ctx.emitError(QObject::tr("Query queryIndexEnvelope failed"), queryIndexEnvelope);
+            }
+        }
+    });
+}
+
+void SQLCache::setMessageText(const QString &mailbox, const uint uid, const QByteArray &partId, const QString &text)
+{
+    if (!m_fullTextIndex)
+        return;
+    const qint64 id = ensureMailboxId(mailbox);
+    const quint64 sequence = ++m_writeSequence;
+    write(sequence, [id, uid, partId, text](SqlWriteContext &ctx) {
+        // The parts get appended to the body, so each of them shall be indexed just once
+        QSqlQuery &queryIndexPart = ctx.prepared(QStringLiteral("INSERT OR IGNORE INTO fulltext_parts ( fulltext_id, part_id ) "
+                                                                "VALUES ( ?, ? )"));
+        queryIndexPart.bindValue(0, fullTextRowId(id, uid));
+        queryIndexPart.bindValue(1, partId);
+        if (!queryIndexPart.exec()) {
+            ctx.emitError(QObject::tr("Query queryIndexPart failed"), queryIndexPart);
+            return;
+        }
+        if (queryIndexPart.numRowsAffected() == 0)
+            return;
+
+        QSqlQuery &queryIndexText = ctx.prepared(QStringLiteral("UPDATE fulltext SET body = coalesce(body || char(10), '') || ? "
+                                                                "WHERE rowid = ?"));
+        queryIndexText.bindValue(0, text);
+        queryIndexText.bindValue(1, fullTextRowId(id, uid));
+        if (!queryIndexText.exec()) {
+            ctx.emitError(QObject::tr("Query queryIndexText failed"), queryIndexText);
+            return;
+        }
+        if (queryIndexText.numRowsAffected() > 0)
+            return;
+        // The envelope is not known yet
+        QSqlQuery &queryIndexNewText = ctx.prepared(QStringLiteral("INSERT INTO fulltext ( rowid, body ) VALUES ( ?, ? )"));
+        queryIndexNewText.bindValue(0, fullTextRowId(id, uid));
+        queryIndexNewText.bindValue(1, text);
+        if (!queryIndexNewText.exec()) {
+            ctx.emitError(QObject::tr("Query queryIndexNewText failed"), queryIndexNewText);
+        }
+    });
+}
+
+bool SQLCache::searchMessages(const QString &mailbox, const QStringList &conditions, Imap::Uids &uids) const
+{
+    if (!m_fullTextIndex)
+        return false;
+
+    QString match;
+    int pos = 0;
+    if (!fullTextQuery(conditions, pos, match) || pos != conditions.size())
+        return false;
+
+    uids.clear();
+    const qint64 id = mailboxId(mailbox);
+    if (id < 0 || m_pending.clearedMailboxes.contains(mailbox)) {
+        // Whatever is in the index is already obsolete
+        return true;
+    }
+
+    querySearchMessages.bindValue(0, match);
+    querySearchMessages.bindValue(1, fullTextRowId(id, 0));
+    querySearchMessages.bindValue(2, fullTextRowId(id, std::numeric_limits<uint>::max()));
+    if (!querySearchMessages.exec()) {
+        emitError(QObject::tr("Query querySearchMessages failed"), querySearchMessages);
+        return false;
     }
+    while (querySearchMessages.next()) {
+        const uint uid = static_cast<uint>(querySearchMessages.value(0).toLongLong() & std::numeric_limits<uint>::max());
+        auto pending = m_pending.flags.constFind(qMakePair(mailbox, uid));
+        if (pending != m_pending.flags.constEnd() && pending->removed) {
+            // This one got expunged
+            continue;
+        }
+        uids.append(uid);
+    }
+    return true;
 }
 
 QByteArray SQLCache::messagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const
 {
+    auto pending = m_pending.parts.constFind(qMakePair(qMakePair(mailbox, uid), partId));
+    if (pending != m_pending.parts.constEnd())
+        return pending->value;
+    if (m_pending.messageGone(mailbox, uid))
+        return QByteArray();
+
     QByteArray res;
-    queryMessagePart.bindValue(0, mailboxName(mailbox));
+    const qint64 id = mailboxId(mailbox);
+    if (id < 0)
+        return res;
+    queryMessagePart.bindValue(0, id);
     queryMessagePart.bindValue(1, uid);
     queryMessagePart.bindValue(2, partId);
     if (! queryMessagePart.exec()) {
@@ -752,7 +1806,7 @@ QByteArray SQLCache::messagePart(const QString &mailbox, const uint uid, const Q
         return res;
     }
     if (queryMessagePart.first()) {
-        res = qUncompress(queryMessagePart.value(0).toByteArray());
+        res = decodeBlob(queryMessagePart.value(0).toByteArray());
         queryMessagePart.finish();
     }
     return res;
@@ -763,14 +1817,20 @@ void SQLCache::setMsgPart(const QString &mailbox, const uint uid, const QByteArr
 #ifdef CACHE_DEBUG
     qDebug() << "Saving message part" << partId << uid << mailbox;
 #endif
-    touchingDB();
-    querySetMessagePart.bindValue(0, mailboxName(mailbox));
-    querySetMessagePart.bindValue(1, uid);
-    querySetMessagePart.bindValue(2, partId);
-    querySetMessagePart.bindValue(3, qCompress(data));
-    if (! querySetMessagePart.exec()) {
-        emitError(QObject::tr("Query querySetMessagePart failed"), querySetMessagePart);
-    }
+    const qint64 id = ensureMailboxId(mailbox);
+    const quint64 sequence = ++m_writeSequence;
+    m_pending.parts[qMakePair(qMakePair(mailbox, uid), partId)] = Pending<QByteArray>{sequence, false, data};
+    write(sequence, [id, uid, partId, data](SqlWriteContext &ctx) {
+        QSqlQuery &querySetMessagePart = ctx.prepared(QStringLiteral("INSERT OR REPLACE INTO parts "
+                                                                     "( mailbox_id, uid, part_id, data ) VALUES ( ?, ?, ?, ? )"));
+        querySetMessagePart.bindValue(0, id);
+        querySetMessagePart.bindValue(1, uid);
+        querySetMessagePart.bindValue(2, partId);
+        querySetMessagePart.bindValue(3, encodeBlob(data));
+        if (! querySetMessagePart.exec()) {
+            ctx.emitError(QObject::tr("Query querySetMessagePart failed"), querySetMessagePart);
+        }
+    });
 }
 
 void SQLCache::forgetMessagePart(const QString &mailbox, const uint uid, const QByteArray &partId)
@@ -778,28 +1838,36 @@ void SQLCache::forgetMessagePart(const QString &mailbox, const uint uid, const Q
 #ifdef CACHE_DEBUG
     qDebug() << "Forgetting message part" << partId << uid << mailbox;
 #endif
-    touchingDB();
-    queryForgetMessagePart.bindValue(0, mailboxName(mailbox));
-    queryForgetMessagePart.bindValue(1, uid);
-    queryForgetMessagePart.bindValue(2, partId);
-    if (! queryForgetMessagePart.exec()) {
-        emitError(QObject::tr("Query queryForgetMessagePart failed"), queryForgetMessagePart);
-    }
+    const qint64 id = mailboxId(mailbox);
+    if (id < 0)
+        return;
+    const quint64 sequence = ++m_writeSequence;
+    m_pending.parts[qMakePair(qMakePair(mailbox, uid), partId)] = Pending<QByteArray>{sequence, true, QByteArray()};
+    write(sequence, [id, uid, partId](SqlWriteContext &ctx) {
+        QSqlQuery &queryForgetMessagePart = ctx.prepared(QStringLiteral("DELETE FROM parts WHERE mailbox_id = ? AND uid = ? AND part_id = ?"));
+        queryForgetMessagePart.bindValue(0, id);
+        queryForgetMessagePart.bindValue(1, uid);
+        queryForgetMessagePart.bindValue(2, partId);
+        if (! queryForgetMessagePart.exec()) {
+            ctx.emitError(QObject::tr("Query queryForgetMessagePart failed"), queryForgetMessagePart);
+        }
+    });
 }
 
 QVector<Imap::Responses::ThreadingNode> SQLCache::messageThreading(const QString &mailbox)
 {
+    auto pending = m_pending.threading.constFind(mailbox);
+    if (pending != m_pending.threading.constEnd())
+        return pending->value;
+
     QVector<Imap::Responses::ThreadingNode> res;
-    queryMessageThreading.bindValue(0, mailboxName(mailbox));
-    if (! queryMessageThreading.exec()) {
-        emitError(QObject::tr("Query queryMessageThreading failed"), queryMessageThreading);
+    const qint64 id = mailboxId(mailbox);
+    if (id < 0)
         return res;
-    }
-    if (queryMessageThreading.first()) {
-        QDataStream stream(qUncompress(queryMessageThreading.value(0).toByteArray()));
-        stream.setVersion(streamVersion);
-        stream >> res;
-    }
+    LogState state;
+    loadLogged(queryMessageThreading, queryMessageThreadingLog, id, res, state, [this](const QString &message, const QSqlQuery &query) {
+        emitError(message, query);
+    });
     return res;
 }
 
@@ -808,17 +1876,102 @@ void SQLCache::setMessageThreading(const QString &mailbox, const QVector<Imap::R
 #ifdef CACHE_DEBUG
     qDebug() << "Setting threading for" << mailbox;
 #endif
-    touchingDB();
-    querySetMessageThreading.bindValue(0, mailboxName(mailbox));
-    QByteArray buf;
-    QDataStream stream(&buf, QIODevice::ReadWrite);
+    const qint64 id = ensureMailboxId(mailbox);
+    const quint64 sequence = ++m_writeSequence;
+    m_pending.threading[mailbox] = Pending<QVector<Imap::Responses::ThreadingNode> >{sequence, false, threading};
+    write(sequence, [id, threading](SqlWriteContext &ctx) {
+        storeLogged(ctx, QStringLiteral("msg_threading"), QStringLiteral("threading"), id, threading);
+    });
+}
+
+bool SQLCache::searchResult(const QString &mailbox, const QString &criteria, SearchResult &result) const
+{
+    auto pending = m_pending.searchResults.constFind(qMakePair(mailbox, criteria));
+    if (pending != m_pending.searchResults.constEnd()) {
+        result = pending->value;
+        return true;
+    }
+    if (m_pending.clearedMailboxes.contains(mailbox))
+        return false;
+
+    const qint64 id = mailboxId(mailbox);
+    if (id < 0)
+        return false;
+    querySearchResult.bindValue(0, id);
+    querySearchResult.bindValue(1, criteria);
+    if (!querySearchResult.exec()) {
+        emitError(QObject::tr("Query querySearchResult failed"), querySearchResult);
+        return false;
+    }
+    if (!querySearchResult.first()) {
+        querySearchResult.finish();
+        return false;
+    }
+
+    result.highestModSeq = querySearchResult.value(0).toULongLong();
+    result.uidNext = querySearchResult.value(1).toUInt();
+    const QByteArray blob = querySearchResult.value(2).toByteArray();
+    result.uidValidity = querySearchResult.value(3).toUInt();
+    querySearchResult.finish();
+    QDataStream stream(decodeBlob(blob));
     stream.setVersion(streamVersion);
-    stream << threading;
-    querySetMessageThreading.bindValue(1, qCompress(buf));
-    if (! querySetMessageThreading.exec()) {
-        emitError(QObject::tr("Query querySetMessageThreading failed"), querySetMessageThreading);
+    stream >> result.uids;
+    if (stream.status() != QDataStream::Ok) {
+        emitError(QObject::tr("Corrupt data when reading a search result for mailbox %1").arg(mailbox));
+        return false;
     }
 
+    // Just like the access stamps of the messages, this is bookkeeping which is invisible through the AbstractCache
+    const quint64 sequence = ++m_writeSequence;
+    const_cast<SQLCache *>(this)->write(sequence, [id, criteria](SqlWriteContext &ctx) {
+        QSqlQuery &queryUseSearchResult = ctx.prepared(QStringLiteral("UPDATE search_results SET lastused = "
+                                                                      "(SELECT IFNULL(MAX(lastused), 0) + 1 FROM search_results) "
+                                                                      "WHERE mailbox_id = ? AND criteria = ?"));
+        queryUseSearchResult.bindValue(0, id);
+        queryUseSearchResult.bindValue(1, criteria);
+        if (!queryUseSearchResult.exec()) {
+            ctx.emitError(QObject::tr("Query queryUseSearchResult failed"), queryUseSearchResult);
+        }
+    });
+    return true;
+}
+
+void SQLCache::setSearchResult(const QString &mailbox, const QString &criteria, const SearchResult &result)
+{
+#ifdef CACHE_DEBUG
+    qDebug() << "Setting search result for" << mailbox << criteria;
+#endif
+    const qint64 id = ensureMailboxId(mailbox);
+    const quint64 sequence = ++m_writeSequence;
+    m_pending.searchResults[qMakePair(mailbox, criteria)] = Pending<SearchResult>{sequence, false, result};
+    write(sequence, [id, criteria, result](SqlWriteContext &ctx) {
+        // The "last used" stamp is a counter rather than a time so that it never goes backwards and never repeats
+        QSqlQuery &querySetSearchResult = ctx.prepared(QStringLiteral("INSERT OR REPLACE INTO search_results "
+                                                                      "(mailbox_id, criteria, highestmodseq, uidnext, uids, "
+                                                                      "uidvalidity, lastused) VALUES (?, ?, ?, ?, ?, ?, "
+                                                                      "(SELECT IFNULL(MAX(lastused), 0) + 1 FROM search_results))"));
+        QByteArray buf;
+        QDataStream stream(&buf, QIODevice::WriteOnly);
+        stream.setVersion(streamVersion);
+        stream << result.uids;
+        querySetSearchResult.bindValue(0, id);
+        querySetSearchResult.bindValue(1, criteria);
+        querySetSearchResult.bindValue(2, result.highestModSeq);
+        querySetSearchResult.bindValue(3, result.uidNext);
+        querySetSearchResult.bindValue(4, encodeBlob(buf));
+        querySetSearchResult.bindValue(5, result.uidValidity);
+        if (!querySetSearchResult.exec()) {
+            ctx.emitError(QObject::tr("Query querySetSearchResult failed"), querySetSearchResult);
+            return;
+        }
+        QSqlQuery &queryExpireSearchResults = ctx.prepared(QStringLiteral("DELETE FROM search_results WHERE rowid IN "
+                                                                          "(SELECT rowid FROM search_results "
+                                                                          "ORDER BY lastused DESC LIMIT -1 OFFSET ?)"));
+        queryExpireSearchResults.bindValue(0, maxSearchResults);
+        if (!queryExpireSearchResults.exec()) {
+            ctx.emitError(QObject::tr("Query queryExpireSearchResults failed"), queryExpireSearchResults);
+        }
+    });
 }
 
 void SQLCache::touchingDB()
@@ -850,6 +2003,175 @@ void SQLCache::setRenewalThreshold(const int days)
     m_updateAccessIfOlder = days;
 }
 
+quint64 SQLCache::expireMessages(const int days, const int limit, const std::shared_ptr<ExpiredMessages> &result)
+{
+#ifdef CACHE_DEBUG
+    qDebug() << "Expiring up to" << limit << "messages";
+#endif
+    const int threshold = days >= 0 ? accessingThresholdDate.daysTo(QDate::currentDate()) - days : std::numeric_limits<int>::max();
+    const quint64 sequence = ++m_writeSequence;
+    // The writer picks the messages by itself. Whatever got queued before is already in the DB by then, and anything newer
+    // is written afterwards, so there's nothing to adjust in the overlay of the pending writes.
+    write(sequence, [threshold, limit, result](SqlWriteContext &ctx) {
+        // A transaction which fails to commit is retried, so start from scratch
+        *result = ExpiredMessages();
+        QSqlQuery &queryExpiryCandidates = ctx.prepared(QStringLiteral("SELECT mailbox_id, mailboxes.name, uid FROM msg_metadata "
+                                                                       "JOIN mailboxes ON mailboxes.id = msg_metadata.mailbox_id "
+                                                                       "WHERE IFNULL(lastAccessDate, 0) < ? "
+                                                                       "ORDER BY lastAccessDate LIMIT ?"));
+        queryExpiryCandidates.bindValue(0, threshold);
+        queryExpiryCandidates.bindValue(1, limit);
+        if (!queryExpiryCandidates.exec()) {
+            ctx.emitError(QObject::tr("Query queryExpiryCandidates failed"), queryExpiryCandidates);
+            return;
+        }
+        QVector<QPair<qint64, uint> > expired;
+        while (queryExpiryCandidates.next()) {
+            expired << qMakePair(queryExpiryCandidates.value(0).toLongLong(), queryExpiryCandidates.value(2).toUInt());
+            result->messages << qMakePair(queryExpiryCandidates.value(1).toString(), expired.last().second);
+        }
+        queryExpiryCandidates.finish();
+
+        QSqlQuery &queryExpiredMessageSize = ctx.prepared(QStringLiteral("SELECT "
+                                                                         "(SELECT IFNULL(SUM(LENGTH(data)), 0) FROM msg_metadata "
+                                                                         "WHERE mailbox_id = ? AND uid = ?) + "
+                                                                         "(SELECT IFNULL(SUM(LENGTH(data)), 0) FROM parts "
+                                                                         "WHERE mailbox_id = ? AND uid = ?)"));
+        QSqlQuery &queryClearMessage1 = ctx.prepared(QStringLiteral("DELETE FROM msg_metadata WHERE mailbox_id = ? AND uid = ?"));
+        QSqlQuery &queryClearMessage3 = ctx.prepared(QStringLiteral("DELETE FROM parts WHERE mailbox_id = ? AND uid = ?"));
+        for (auto it = expired.constBegin(); it != expired.constEnd(); ++it) {
+            queryExpiredMessageSize.bindValue(0, it->first);
+            queryExpiredMessageSize.bindValue(1, it->second);
+            queryExpiredMessageSize.bindValue(2, it->first);
+            queryExpiredMessageSize.bindValue(3, it->second);
+            if (!queryExpiredMessageSize.exec()) {
+                ctx.emitError(QObject::tr("Query queryExpiredMessageSize failed"), queryExpiredMessageSize);
+            } else {
+                if (queryExpiredMessageSize.first())
+                    result->reclaimed += queryExpiredMessageSize.value(0).toULongLong();
+                queryExpiredMessageSize.finish();
+            }
+            queryClearMessage1.bindValue(0, it->first);
+            queryClearMessage1.bindValue(1, it->second);
+            if (!queryClearMessage1.exec()) {
+                ctx.emitError(QObject::tr("Query queryClearMessage1 failed"), queryClearMessage1);
+            }
+            queryClearMessage3.bindValue(0, it->first);
+            queryClearMessage3.bindValue(1, it->second);
+            if (!queryClearMessage3.exec()) {
+                ctx.emitError(QObject::tr("Query queryClearMessage3 failed"), queryClearMessage3);
+            }
+        }
+    });
+    return sequence;
+}
+
+bool SQLCache::isCommitted(const quint64 sequence) const
+{
+    return sequence <= m_committedSequence;
+}
+
+void SQLCache::reclaimFreeSpace()
+{
+    QSqlQuery q(db);
+    quint64 pageCount = 0, freePages = 0;
+    if (q.exec(QStringLiteral("PRAGMA page_count")) && q.first())
+        pageCount = q.value(0).toULongLong();
+    if (q.exec(QStringLiteral("PRAGMA freelist_count")) && q.first())
+        freePages = q.value(0).toULongLong();
+    q.finish();
+    if (!freePages || freePages * minFreeFractionForVacuum < pageCount)
+        return;
+
+    if (m_writer) {
+        m_writer->vacuum();
+    } else {
+        timeToCommit();
+        if (!q.exec(QStringLiteral("VACUUM"))) {
+            emitError(QObject::tr("Failed to compact the cache DB"), q);
+        }
+    }
+}
+
+quint64 SQLCache::usedSize() const
+{
+    QSqlQuery q(db);
+    quint64 pageSize = 0, pageCount = 0, freePages = 0;
+    if (q.exec(QStringLiteral("PRAGMA page_size")) && q.first())
+        pageSize = q.value(0).toULongLong();
+    if (q.exec(QStringLiteral("PRAGMA page_count")) && q.first())
+        pageCount = q.value(0).toULongLong();
+    if (q.exec(QStringLiteral("PRAGMA freelist_count")) && q.first())
+        freePages = q.value(0).toULongLong();
+    return pageSize * (pageCount - qMin(pageCount, freePages));
+}
+
+void SQLCache::write(const quint64 sequence, const SQLCacheWriter::Job &job)
+{
+    if (m_writer) {
+        m_writer->enqueue(sequence, job);
+    } else {
+        touchingDB();
+        job(*m_inlineWriter);
+        // Our own connection sees the modification right away
+        forgetCommittedWrites(sequence);
+    }
+}
+
+void SQLCache::forgetCommittedWrites(const quint64 sequence)
+{
+    m_committedSequence = sequence;
+    dropCommitted(m_pending.childMailboxes, sequence);
+    dropCommitted(m_pending.syncState, sequence);
+    dropCommitted(m_pending.uidMapping, sequence);
+    dropCommitted(m_pending.threading, sequence);
+    dropCommitted(m_pending.searchResults, sequence);
+    dropCommitted(m_pending.clearedMailboxes, sequence);
+    dropCommitted(m_pending.expiredMessages, sequence);
+    dropCommitted(m_pending.metadata, sequence);
+    dropCommitted(m_pending.flags, sequence);
+    dropCommitted(m_pending.parts, sequence);
+
+    if (m_trainedEnvelopeDictionary && sequence >= m_trainedEnvelopeDictionarySequence) {
+        // The writer is done with the training, and the dictionary is in the DB so the new envelopes can use it
+        if (*m_trainedEnvelopeDictionary)
+            m_envelopeDictionary = *m_trainedEnvelopeDictionary;
+        m_trainedEnvelopeDictionary.reset();
+    }
+}
+
+void SQLCache::forgetPendingMessage(const QString &mailbox, const uint uid, const quint64 sequence)
+{
+    const MessageKey key = qMakePair(mailbox, uid);
+    m_pending.metadata.remove(key);
+    for (auto it = m_pending.parts.begin(); it != m_pending.parts.end(); ) {
+        if (it.key().first == key)
+            it = m_pending.parts.erase(it);
+        else
+            ++it;
+    }
+    m_pending.expiredMessages[key] = sequence;
+}
+
+bool SQLCache::PendingWrites::messageGone(const QString &mailbox, const uint uid) const
+{
+    return clearedMailboxes.contains(mailbox) || expiredMessages.contains(qMakePair(mailbox, uid));
+}
+
+void SQLCache::waitForPendingWrites()
+{
+    if (m_writer) {
+        m_writer->flush();
+    } else {
+        timeToCommit();
+    }
+}
+
+SqlWriteQueueStatistics SQLCache::writeQueueStatistics() const
+{
+    return m_writer ? m_writer->statistics() : SqlWriteQueueStatistics();
+}
+
 /** @short Return a proper represenation of the mailbox name to be used in the SQL queries
 
 A null QString is represented as NIL, which makes our cache unhappy.
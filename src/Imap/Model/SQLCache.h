@@ -24,9 +24,12 @@
 #define IMAP_MODEL_SQLCACHE_H
 
 #include <memory>
+#include <QHash>
+#include <QPair>
 #include <QSqlDatabase>
 #include <QSqlQuery>
 #include "Cache.h"
+#include "SQLCacheWriter.h"
 
 class QTimer;
 
@@ -38,6 +41,8 @@ namespace Imap
 namespace Mailbox
 {
 
+class BlobDictionary;
+
 /** @short Wrapper around the braindead API of QSqlDatabase for auto-removing connections
 
 Because the QSqlDatabase really wants to operate over a global namespace of DB connections, it's important to remove them
@@ -50,6 +55,15 @@ struct DbConnectionCleanup
     QString name;
 };
 
+/** @short Messages whose data were removed by SQLCache::expireMessages() */
+struct ExpiredMessages {
+    QList<QPair<QString, uint> > messages;
+    /** @short Number of bytes which were occupied by the removed data */
+    quint64 reclaimed;
+
+    ExpiredMessages(): reclaimed(0) {}
+};
+
 /** @short A cache implementation using an sqlite database for the underlying storage
 
   This class should not be used on its own, as it simply puts everything into a database.
@@ -65,11 +79,25 @@ cache and is certainly *not* meant to be accessed by third-party applications. P
 consider it an opaque format.
 
 Some ideas for improvements:
-- Don't store full string mailbox names in each table, use another table for it
 - Merge uid_mapping with mailbox_sync_state, and also msg_metadata with flags
 - Serious embedded users might consider putting the database into a compressed filesystem,
   or using on-the-fly compression via sqlite's VFS subsystem
 
+All modifications are performed by a SQLCacheWriter on a dedicated thread so that the GUI does not have to wait for the
+compression and the disk I/O. Until the writer commits them, the pending changes are kept in an in-memory overlay which
+the read functions consult before asking the database. In-memory databases cannot be shared between connections, so
+they are modified directly from the calling thread.
+
+The UID maps and threading of big mailboxes change only a little with each update, so they are stored as a snapshot and
+an append-only log of differences which gets compacted into a new snapshot once it grows too large, see AppendLog.
+
+The blobs are compressed through encodeBlob(). Once enough envelopes are cached, a compression dictionary is trained on
+them, so that the envelopes which are stored later on take advantage of how similar they are to each other.
+
+When the sqlite library supports FTS5, the envelopes and the text of cached messages are also put into a full-text index
+so that the quick search works without talking to the server. Entries only become searchable once the writer commits
+them. The index survives the expiration of the cached data; only expunged messages are removed from it.
+
  */
 class SQLCache : public AbstractCache
 {
@@ -93,9 +121,11 @@ public:
 
     virtual MessageDataBundle messageMetadata(const QString &mailbox, uint uid) const;
     virtual void setMessageMetadata(const QString &mailbox, const uint uid, const MessageDataBundle &metadata);
+    virtual QMap<uint, MessageDataBundle> messageMetadataBatch(const QString &mailbox, const Imap::Uids &uids) const;
 
     virtual QStringList msgFlags(const QString &mailbox, const uint uid) const;
     virtual void setMsgFlags(const QString &mailbox, const uint uid, const QStringList &flags);
+    virtual QMap<uint, QStringList> msgFlagsBatch(const QString &mailbox, const Imap::Uids &uids) const;
 
     virtual QByteArray messagePart(const QString &mailbox, const uint uid, const QByteArray &partId) const;
     virtual void setMsgPart(const QString &mailbox, const uint uid, const QByteArray &partId, const QByteArray &data);
@@ -104,11 +134,35 @@ public:
     virtual QVector<Imap::Responses::ThreadingNode> messageThreading(const QString &mailbox);
     virtual void setMessageThreading(const QString &mailbox, const QVector<Imap::Responses::ThreadingNode> &threading);
 
+    virtual void setMessageText(const QString &mailbox, const uint uid, const QByteArray &partId, const QString &text);
+    virtual bool searchMessages(const QString &mailbox, const QStringList &conditions, Imap::Uids &uids) const;
+    virtual bool searchResult(const QString &mailbox, const QString &criteria, SearchResult &result) const;
+    virtual void setSearchResult(const QString &mailbox, const QString &criteria, const SearchResult &result);
+
     /** @short Open a connection to the cache */
     bool open(const QString &name, const QString &fileName);
 
     virtual void setRenewalThreshold(const int days);
 
+    /** @short Remove metadata and message parts of up to @arg limit least recently accessed messages
+
+    When @arg days is not negative, only the messages which were not accessed during the last @arg days days are removed.
+    The flags are kept because they are needed for a proper mailbox synchronization. The messages are picked and removed
+    by the writer in a single transaction. The @arg result is filled in once isCommitted() is true for the returned number.
+    */
+    quint64 expireMessages(const int days, const int limit, const std::shared_ptr<ExpiredMessages> &result);
+    /** @short Has the modification with the @arg sequence number, as returned by expireMessages(), been committed? */
+    bool isCommitted(const quint64 sequence) const;
+    /** @short Give the space of the removed data back to the filesystem if there's enough of it */
+    void reclaimFreeSpace();
+    /** @short Number of bytes occupied by the live data in the database */
+    quint64 usedSize() const;
+
+    /** @short Block until all modifications are committed to the database */
+    void waitForPendingWrites();
+    /** @short Statistics of the write-behind queue */
+    SqlWriteQueueStatistics writeQueueStatistics() const;
+
 private:
     /** @short Broadcast an error from the SQL query */
     void emitError(const QString &message, const QSqlQuery &query) const;
@@ -119,6 +173,8 @@ private:
 
     /** @short Blindly create all tables */
     bool createTables();
+    /** @short Create the full-text index if it is not there yet; returns false when sqlite cannot provide it */
+    bool createFullTextIndex();
     /** @short Initialize the prepared queries */
     bool prepareQueries();
 
@@ -130,6 +186,33 @@ private:
 
     static QString mailboxName(const QString &mailbox);
 
+    /** @short Convert the v7 tables keyed by mailbox names to the v8 ones keyed by integer IDs */
+    bool migrateToMailboxIds();
+    /** @short Convert the v8 UID maps and threading blobs to the v9 snapshots with a log of changes */
+    bool migrateToAppendLog();
+    /** @short Move the v13 message metadata out of the primary key's B-tree into a v14 rowid table */
+    bool migrateMetadataToRowid();
+    /** @short Load the compression dictionary of envelopes if there is one already */
+    bool loadEnvelopeDictionary();
+    /** @short Let the writer train a new dictionary once there are enough envelopes */
+    void trainEnvelopeDictionary();
+    /** @short Load the mailbox name -> ID mapping from the DB */
+    bool loadMailboxIds();
+    /** @short Return the numeric ID of a mailbox, or -1 if the DB has never heard about it */
+    qint64 mailboxId(const QString &mailbox) const;
+    /** @short Return the numeric ID of a mailbox, allocating a new one when needed */
+    qint64 ensureMailboxId(const QString &mailbox);
+
+    /** @short Refresh the "last accessed on" stamp of a message if it got too old */
+    void renewMessageAccess(const QString &mailbox, const uint uid, const int lastAccessTimestamp) const;
+
+    /** @short Queue a modification of the DB which was assigned the @arg sequence number */
+    void write(const quint64 sequence, const SQLCacheWriter::Job &job);
+    /** @short Drop all entries from the overlay which are already present in the DB */
+    void forgetCommittedWrites(const quint64 sequence);
+    /** @short Remove data and parts of a message from the overlay, and remember that they are gone */
+    void forgetPendingMessage(const QString &mailbox, const uint uid, const quint64 sequence);
+
 private slots:
     /** @short We haven't committed for a while */
     void timeToCommit();
@@ -142,30 +225,67 @@ private:
 
     mutable QSqlQuery queryChildMailboxes;
     mutable QSqlQuery queryChildMailboxesFresh;
-    mutable QSqlQuery queryRemoveChildMailboxes;
-    mutable QSqlQuery querySetChildMailboxes;
     mutable QSqlQuery queryMailboxSyncState;
-    mutable QSqlQuery querySetMailboxSyncState;
     mutable QSqlQuery queryUidMapping;
-    mutable QSqlQuery querySetUidMapping;
-    mutable QSqlQuery queryClearUidMapping;
+    mutable QSqlQuery queryUidMappingLog;
     mutable QSqlQuery queryMessageMetadata;
-    mutable QSqlQuery queryAccessMessageMetadata;
-    mutable QSqlQuery querySetMessageMetadata;
+    mutable QSqlQuery queryMessageMetadataRange;
     mutable QSqlQuery queryMessageFlags;
-    mutable QSqlQuery querySetMessageFlags;
-    mutable QSqlQuery queryClearAllMessages1;
-    mutable QSqlQuery queryClearAllMessages2;
-    mutable QSqlQuery queryClearAllMessages3;
-    mutable QSqlQuery queryClearAllMessages4;
-    mutable QSqlQuery queryClearMessage1;
-    mutable QSqlQuery queryClearMessage2;
-    mutable QSqlQuery queryClearMessage3;
+    mutable QSqlQuery queryMessageFlagsRange;
     mutable QSqlQuery queryMessagePart;
-    mutable QSqlQuery querySetMessagePart;
-    mutable QSqlQuery queryForgetMessagePart;
     mutable QSqlQuery queryMessageThreading;
-    mutable QSqlQuery querySetMessageThreading;
+    mutable QSqlQuery queryMessageThreadingLog;
+    mutable QSqlQuery querySearchMessages;
+    mutable QSqlQuery querySearchResult;
+
+    /** @short A modification which was queued for the writer, but which might not be committed yet */
+    template<typename T>
+    struct Pending {
+        quint64 sequence;
+        bool removed;
+        T value;
+    };
+    typedef QPair<QString, uint> MessageKey;
+    typedef QPair<MessageKey, QByteArray> PartKey;
+
+    /** @short The overlay with data which are on their way to the DB */
+    struct PendingWrites {
+        QHash<QString, Pending<QList<MailboxMetadata> > > childMailboxes;
+        QHash<QString, Pending<SyncState> > syncState;
+        QHash<QString, Pending<Imap::Uids> > uidMapping;
+        QHash<QString, Pending<QVector<Imap::Responses::ThreadingNode> > > threading;
+        QHash<QPair<QString, QString>, Pending<SearchResult> > searchResults;
+        /** @short Mailboxes whose messages got removed; the data in the DB are not valid anymore */
+        QHash<QString, quint64> clearedMailboxes;
+        /** @short Messages whose metadata and parts got removed; the data in the DB are not valid anymore */
+        QHash<MessageKey, quint64> expiredMessages;
+        QHash<MessageKey, Pending<MessageDataBundle> > metadata;
+        QHash<MessageKey, Pending<QStringList> > flags;
+        QHash<PartKey, Pending<QByteArray> > parts;
+
+        /** @short Is the DB content for the message already obsolete? */
+        bool messageGone(const QString &mailbox, const uint uid) const;
+    };
+    PendingWrites m_pending;
+    mutable quint64 m_writeSequence;
+
+    /** @short Numeric IDs of mailboxes which are used as keys of the per-message tables */
+    QHash<QString, qint64> m_mailboxIds;
+    qint64 m_nextMailboxId;
+
+    /** @short Dictionary for compressing the envelopes; null when none was trained yet or when zstd is not available */
+    std::shared_ptr<BlobDictionary> m_envelopeDictionary;
+    /** @short Where the writer puts the dictionary which it is training, to be used once m_trainedEnvelopeDictionarySequence is committed */
+    std::shared_ptr<std::shared_ptr<BlobDictionary> > m_trainedEnvelopeDictionary;
+    quint64 m_trainedEnvelopeDictionarySequence;
+    /** @short Sequence number of the last modification which has been committed */
+    quint64 m_committedSequence;
+
+    /** @short Is the full-text index available? */
+    bool m_fullTextIndex;
+
+    std::unique_ptr<SQLCacheWriter> m_writer;
+    std::unique_ptr<SqlWriteContext> m_inlineWriter;
 
     std::unique_ptr<QTimer> delayedCommit;
     std::unique_ptr<QTimer> tooMuchTimeWithoutCommit;
@@ -0,0 +1,219 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAP_MODEL_SQLCACHELOG_H
+#define IMAP_MODEL_SQLCACHELOG_H
+
+#include <algorithm>
+#include <QByteArray>
+#include <QDataStream>
+#include <QVector>
+#include "BlobCodec.h"
+
+namespace Imap
+{
+namespace Mailbox
+{
+
+/** @short Storage of big vectors as a snapshot and an append-only log of subsequent modifications
+
+Some data in the cache, like the UID map or the threading of a mailbox, are large vectors which only change a little
+between two updates. Instead of serializing the whole vector on each update, the SQLCache stores just the difference
+against the previous version and rewrites the full snapshot only once the log grows too big.
+
+The snapshot is split into separately compressed chunks so that loading it never needs a second copy of the whole data.
+*/
+namespace AppendLog
+{
+
+/** @short Version of the QDataStream format; it cannot change without bumping the DB version */
+const QDataStream::Version logStreamVersion = QDataStream::Qt_4_6;
+
+/** @short Number of items in one compressed chunk of a snapshot */
+const int snapshotChunkSize = 16384;
+
+/** @short Replace @arg removed items starting at @arg position with the @arg inserted ones */
+template<typename T>
+struct Splice {
+    quint32 position;
+    quint32 removed;
+    QVector<T> inserted;
+};
+
+template<typename T>
+QDataStream &operator<<(QDataStream &stream, const Splice<T> &splice)
+{
+    return stream << splice.position << splice.removed << splice.inserted;
+}
+
+template<typename T>
+QDataStream &operator>>(QDataStream &stream, Splice<T> &splice)
+{
+    return stream >> splice.position >> splice.removed >> splice.inserted;
+}
+
+template<typename T>
+QByteArray encodeSnapshot(const QVector<T> &items)
+{
+    QVector<QByteArray> chunks;
+    for (int i = 0; i < items.size(); i += snapshotChunkSize) {
+        QByteArray buf;
+        QDataStream stream(&buf, QIODevice::WriteOnly);
+        stream.setVersion(logStreamVersion);
+        stream << items.mid(i, snapshotChunkSize);
+        chunks << encodeBlob(buf);
+    }
+    QByteArray res;
+    QDataStream stream(&res, QIODevice::WriteOnly);
+    stream.setVersion(logStreamVersion);
+    stream << quint32(items.size()) << chunks;
+    return res;
+}
+
+template<typename T>
+bool decodeSnapshot(const QByteArray &snapshot, QVector<T> &items)
+{
+    QDataStream stream(snapshot);
+    stream.setVersion(logStreamVersion);
+    quint32 size;
+    quint32 chunkCount;
+    stream >> size >> chunkCount;
+    if (stream.status() != QDataStream::Ok)
+        return false;
+    items.clear();
+    items.reserve(size);
+    for (quint32 i = 0; i < chunkCount; ++i) {
+        // Reading the chunks one by one keeps just a single chunk decompressed at any time
+        QByteArray chunk;
+        stream >> chunk;
+        QDataStream chunkStream(decodeBlob(chunk));
+        chunkStream.setVersion(logStreamVersion);
+        QVector<T> piece;
+        chunkStream >> piece;
+        if (stream.status() != QDataStream::Ok || chunkStream.status() != QDataStream::Ok)
+            return false;
+        items += piece;
+    }
+    return static_cast<quint32>(items.size()) == size;
+}
+
+/** @short Turn @arg before into @arg after by a single splice of the part in which they differ */
+template<typename T>
+QVector<Splice<T> > diff(const QVector<T> &before, const QVector<T> &after)
+{
+    QVector<Splice<T> > res;
+    int prefix = 0;
+    while (prefix < before.size() && prefix < after.size() && before[prefix] == after[prefix])
+        ++prefix;
+    if (prefix == before.size() && prefix == after.size())
+        return res;
+    int suffix = 0;
+    while (suffix < before.size() - prefix && suffix < after.size() - prefix
+           && before[before.size() - 1 - suffix] == after[after.size() - 1 - suffix])
+        ++suffix;
+    res << Splice<T>{static_cast<quint32>(prefix), static_cast<quint32>(before.size() - prefix - suffix),
+                     after.mid(prefix, after.size() - prefix - suffix)};
+    return res;
+}
+
+/** @short Compare two UID maps
+
+Thanks to the UIDs growing along with the sequence numbers, expunges and arrivals anywhere in the mailbox can be found by
+a single merge of both maps. Maps which are not sorted (like those with some UIDs not known yet) are compared the generic
+way.
+*/
+inline QVector<Splice<uint> > diff(const QVector<uint> &before, const QVector<uint> &after)
+{
+    auto ascending = [](const QVector<uint> &uids) {
+        for (int i = 1; i < uids.size(); ++i) {
+            if (uids[i - 1] >= uids[i])
+                return false;
+        }
+        return true;
+    };
+    if (!ascending(before) || !ascending(after))
+        return diff<uint>(before, after);
+
+    QVector<Splice<uint> > res;
+    int i = 0, j = 0;
+    while (i < before.size() || j < after.size()) {
+        if (i < before.size() && j < after.size() && before[i] == after[j]) {
+            ++i;
+            ++j;
+            continue;
+        }
+        // The positions refer to the vector which already has all previous splices applied
+        Splice<uint> splice{static_cast<quint32>(j), 0, QVector<uint>()};
+        while ((i < before.size() || j < after.size()) && !(i < before.size() && j < after.size() && before[i] == after[j])) {
+            if (j == after.size() || (i < before.size() && before[i] < after[j])) {
+                ++splice.removed;
+                ++i;
+            } else {
+                splice.inserted << after[j];
+                ++j;
+            }
+        }
+        res << splice;
+    }
+    return res;
+}
+
+template<typename T>
+QByteArray encodeDelta(const QVector<Splice<T> > &splices)
+{
+    QByteArray buf;
+    QDataStream stream(&buf, QIODevice::WriteOnly);
+    stream.setVersion(logStreamVersion);
+    stream << splices;
+    return encodeBlob(buf);
+}
+
+template<typename T>
+bool applyDelta(const QByteArray &delta, QVector<T> &items)
+{
+    QDataStream stream(decodeBlob(delta));
+    stream.setVersion(logStreamVersion);
+    QVector<Splice<T> > splices;
+    stream >> splices;
+    if (stream.status() != QDataStream::Ok)
+        return false;
+    for (const auto &splice : splices) {
+        const int position = splice.position;
+        const int removed = splice.removed;
+        if (position < 0 || removed < 0 || position > items.size() || removed > items.size() - position)
+            return false;
+        if (splice.inserted.size() > removed) {
+            items.insert(position + removed, splice.inserted.size() - removed, T());
+        } else if (splice.inserted.size() < removed) {
+            items.remove(position + splice.inserted.size(), removed - splice.inserted.size());
+        }
+        std::copy(splice.inserted.constBegin(), splice.inserted.constEnd(), items.begin() + position);
+    }
+    return true;
+}
+
+}
+
+}
+}
+
+#endif /* IMAP_MODEL_SQLCACHELOG_H */
@@ -0,0 +1,309 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SQLCacheWriter.h"
+#include <QMutexLocker>
+#include <QSqlError>
+
+//#define CACHE_DEBUG
+
+namespace {
+
+/** @short How long to wait for more jobs before starting a transaction, in milliseconds */
+const unsigned long coalescingDelay = 100;
+
+/** @short Start working right away once this many jobs are waiting */
+const int batchSize = 500;
+
+/** @short Block the callers when the writer falls behind too much
+
+The queued jobs contain the data to be written, so the queue cannot grow without bounds.
+*/
+const int maxQueueDepth = 5000;
+
+/** @short How long to wait before retrying a transaction which failed to commit, in milliseconds */
+const unsigned long commitRetryDelay = 1000;
+
+/** @short Give up after this many commits have failed in a row */
+const int maxCommitAttempts = 3;
+
+}
+
+namespace Imap
+{
+namespace Mailbox
+{
+
+SqlWriteContext::SqlWriteContext(const QSqlDatabase &db, const std::function<void(const QString &)> &errorHandler)
+    : m_db(db)
+    , m_errorHandler(errorHandler)
+{
+}
+
+SqlWriteContext::~SqlWriteContext()
+{
+}
+
+QSqlQuery &SqlWriteContext::prepared(const QString &sql)
+{
+    auto it = m_queries.find(sql);
+    if (it == m_queries.end()) {
+        QSqlQuery query(m_db);
+        if (!query.prepare(sql)) {
+            emitError(QObject::tr("Failed to prepare query %1").arg(sql), query);
+        }
+        it = m_queries.insert(std::make_pair(sql, query)).first;
+    }
+    return it->second;
+}
+
+void SqlWriteContext::emitError(const QString &message, const QSqlQuery &query)
+{
+    m_errorHandler(QStringLiteral("SQLCache: Query Error: %1: %2").arg(message, query.lastError().text()));
+}
+
+std::shared_ptr<void> &SqlWriteContext::scratch(const QString &key)
+{
+    return m_scratch[key];
+}
+
+void SqlWriteContext::forgetScratch(const QString &key)
+{
+    m_scratch.erase(key);
+}
+
+void SqlWriteContext::forgetAllScratch()
+{
+    m_scratch.clear();
+}
+
+SqlWriteQueueStatistics::SqlWriteQueueStatistics()
+    : queueDepth(0)
+    , maxQueueDepth(0)
+    , jobs(0)
+    , commits(0)
+    , lastCommitLatency(0)
+    , maxCommitLatency(0)
+    , failedCommits(0)
+    , droppedJobs(0)
+{
+}
+
+SQLCacheWriter::SQLCacheWriter(const QString &connectionName, const QString &fileName)
+    : m_connectionName(connectionName)
+    , m_fileName(fileName)
+    , m_openOk(false)
+    , m_stopping(false)
+    , m_finished(false)
+    , m_commitFailing(false)
+    , m_givenUp(false)
+    , m_vacuumWanted(false)
+    , m_flushWaiters(0)
+    , m_lastQueued(0)
+    , m_lastCommitted(0)
+{
+    setObjectName(QStringLiteral("SQLCacheWriter"));
+    m_clock.start();
+}
+
+SQLCacheWriter::~SQLCacheWriter()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_wakeUp.wakeAll();
+    }
+    // The writer drains the queue before it quits
+    wait();
+}
+
+bool SQLCacheWriter::startWriting()
+{
+    start();
+    m_started.acquire();
+    return m_openOk;
+}
+
+void SQLCacheWriter::enqueue(const quint64 sequence, const Job &job)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_ASSERT(sequence > m_lastQueued);
+    if (m_givenUp) {
+        ++m_statistics.droppedJobs;
+        return;
+    }
+    // There's no point in throttling the GUI while the writer cannot make any progress; it will give up soon anyway
+    while (m_queue.size() >= maxQueueDepth && !m_stopping && !m_commitFailing && !m_givenUp) {
+        m_progress.wait(&m_mutex);
+    }
+    QueuedJob item = {sequence, m_clock.elapsed(), job};
+    m_queue.append(item);
+    m_lastQueued = sequence;
+    m_statistics.maxQueueDepth = qMax(m_statistics.maxQueueDepth, m_queue.size());
+    // A failed commit gets retried after a fixed delay, no matter how much has been queued in the meanwhile
+    if (!m_commitFailing && (m_queue.size() == 1 || m_queue.size() >= batchSize))
+        m_wakeUp.wakeOne();
+}
+
+void SQLCacheWriter::flush()
+{
+    QMutexLocker locker(&m_mutex);
+    ++m_flushWaiters;
+    m_wakeUp.wakeAll();
+    while (m_lastCommitted < m_lastQueued && !m_finished && !m_commitFailing && !m_givenUp) {
+        m_progress.wait(&m_mutex);
+    }
+    --m_flushWaiters;
+}
+
+void SQLCacheWriter::vacuum()
+{
+    QMutexLocker locker(&m_mutex);
+    m_vacuumWanted = true;
+    m_wakeUp.wakeOne();
+}
+
+SqlWriteQueueStatistics SQLCacheWriter::statistics() const
+{
+    QMutexLocker locker(&m_mutex);
+    SqlWriteQueueStatistics res = m_statistics;
+    res.queueDepth = m_queue.size();
+    return res;
+}
+
+void SQLCacheWriter::run()
+{
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), m_connectionName);
+        db.setDatabaseName(m_fileName);
+        m_openOk = db.open();
+        if (!m_openOk) {
+            emit error(QStringLiteral("SQLCache: DB Error: %1: %2").arg(tr("Can't open database for writing"), db.lastError().text()));
+            m_started.release();
+        } else {
+            {
+                QSqlQuery q(db);
+                // The journal is in the WAL mode already, so there's no risk of corruption with a relaxed syncing
+                q.exec(QStringLiteral("PRAGMA synchronous = NORMAL"));
+            }
+            SqlWriteContext context(db, [this](const QString &message) { emit error(message); });
+            m_started.release();
+            int failedAttempts = 0;
+
+            Q_FOREVER {
+                QVector<QueuedJob> batch;
+                bool vacuum = false;
+                {
+                    QMutexLocker locker(&m_mutex);
+                    while (m_queue.isEmpty() && !m_stopping && !m_vacuumWanted) {
+                        m_wakeUp.wait(&m_mutex);
+                    }
+                    if (m_queue.isEmpty() && m_stopping)
+                        break;
+                    if (m_queue.isEmpty()) {
+                        // VACUUM cannot be a part of a transaction, so it waits until there's nothing else to write
+                        vacuum = true;
+                        m_vacuumWanted = false;
+                    } else {
+                        if (!m_stopping && !m_flushWaiters && m_queue.size() < batchSize) {
+                            // Let the GUI queue more updates so that they share a single transaction
+                            m_wakeUp.wait(&m_mutex, coalescingDelay);
+                        }
+                        batch.swap(m_queue);
+                        m_progress.wakeAll();
+                    }
+                }
+
+                if (vacuum) {
+                    QSqlQuery q(db);
+                    if (!q.exec(QStringLiteral("VACUUM"))) {
+                        emit error(QStringLiteral("SQLCache: DB Error: %1: %2").arg(tr("Failed to compact the cache DB"),
+                                                                                    q.lastError().text()));
+                    }
+                    continue;
+                }
+
+                db.transaction();
+                for (const auto &item : batch) {
+                    item.job(context);
+                }
+                if (!db.commit()) {
+                    emit error(QStringLiteral("SQLCache: DB Error: %1: %2").arg(tr("Commit failed"), db.lastError().text()));
+                    db.rollback();
+                    context.forgetAllScratch();
+                    QMutexLocker locker(&m_mutex);
+                    if (m_stopping) {
+                        // There's nobody left to read the pending data, so give up
+                        break;
+                    }
+                    // The jobs are still needed, and so is the caller's view of the data which they were supposed to write.
+                    // Put them back in front of whatever got queued in the meanwhile and try again later.
+                    ++m_statistics.failedCommits;
+                    m_commitFailing = true;
+                    if (++failedAttempts >= maxCommitAttempts) {
+                        // Retrying forever would only keep the pending data in memory, so stop and let the owner know
+                        m_statistics.droppedJobs += batch.size() + m_queue.size();
+                        m_queue.clear();
+                        m_givenUp = true;
+                        m_progress.wakeAll();
+                        locker.unlock();
+                        emit error(QStringLiteral("SQLCache: DB Error: %1").arg(
+                                       tr("Giving up on writing to the cache after %n failed commits", "", failedAttempts)));
+                        continue;
+                    }
+                    batch += m_queue;
+                    m_queue.swap(batch);
+                    m_progress.wakeAll();
+                    m_wakeUp.wait(&m_mutex, commitRetryDelay);
+                    continue;
+                }
+                failedAttempts = 0;
+                const quint64 sequence = batch.last().sequence;
+                const qint64 latency = m_clock.elapsed() - batch.first().queuedAt;
+#ifdef CACHE_DEBUG
+                qDebug() << "SQLCacheWriter: committed" << batch.size() << "jobs in" << latency << "ms";
+#endif
+
+                {
+                    QMutexLocker locker(&m_mutex);
+                    m_lastCommitted = sequence;
+                    m_commitFailing = false;
+                    m_statistics.jobs += batch.size();
+                    ++m_statistics.commits;
+                    m_statistics.lastCommitLatency = latency;
+                    m_statistics.maxCommitLatency = qMax(m_statistics.maxCommitLatency, latency);
+                    m_progress.wakeAll();
+                }
+                emit committed(sequence);
+            }
+        }
+        db.close();
+    }
+    QSqlDatabase::removeDatabase(m_connectionName);
+
+    QMutexLocker locker(&m_mutex);
+    m_finished = true;
+    m_progress.wakeAll();
+}
+
+}
+}
@@ -0,0 +1,184 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAP_MODEL_SQLCACHEWRITER_H
+#define IMAP_MODEL_SQLCACHEWRITER_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QSemaphore>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+namespace Imap
+{
+namespace Mailbox
+{
+
+/** @short Prepared statements and error reporting for code which modifies the SQL cache
+
+Each DB connection needs its own set of prepared queries. The statements are prepared lazily, on their first use, and
+kept around for the lifetime of this object.
+*/
+class SqlWriteContext
+{
+public:
+    SqlWriteContext(const QSqlDatabase &db, const std::function<void(const QString &)> &errorHandler);
+    ~SqlWriteContext();
+
+    /** @short Return a prepared query for the given SQL statement */
+    QSqlQuery &prepared(const QString &sql);
+    /** @short Report a failure of a query */
+    void emitError(const QString &message, const QSqlQuery &query);
+
+    /** @short Data which the jobs keep around between the transactions, such as what they have written the last time
+
+    The slot is empty when nothing has been stored under the @arg key yet. Everything is forgotten when a transaction fails
+    to commit because it might describe changes which were rolled back.
+    */
+    std::shared_ptr<void> &scratch(const QString &key);
+    void forgetScratch(const QString &key);
+    void forgetAllScratch();
+
+private:
+    QSqlDatabase m_db;
+    std::map<QString, QSqlQuery> m_queries;
+    std::map<QString, std::shared_ptr<void> > m_scratch;
+    std::function<void(const QString &)> m_errorHandler;
+};
+
+/** @short Runtime statistics of the SQL cache's write-behind queue */
+struct SqlWriteQueueStatistics
+{
+    /** @short Number of modifications which are waiting for the writer right now */
+    int queueDepth;
+    /** @short The highest queueDepth seen so far */
+    int maxQueueDepth;
+    /** @short Number of modifications which have been committed */
+    quint64 jobs;
+    /** @short Number of transactions which have been committed */
+    quint64 commits;
+    /** @short Time between queueing the oldest modification of the last transaction and its commit, in milliseconds */
+    qint64 lastCommitLatency;
+    /** @short The highest commit latency seen so far */
+    qint64 maxCommitLatency;
+    /** @short Number of attempts to commit which have failed */
+    quint64 failedCommits;
+    /** @short Number of modifications which were thrown away after the writer gave up */
+    quint64 droppedJobs;
+
+    SqlWriteQueueStatistics();
+};
+
+/** @short Apply modifications of the SQL cache on a dedicated thread
+
+The writer has its own connection to the database. Modifications are queued from the GUI thread in the form of closures
+which get executed on the writer's thread. All jobs which are waiting at the time the writer wakes up are committed within
+a single transaction. The writer briefly waits for more jobs to arrive before it starts working, so bursts of updates
+(like those produced by a mailbox synchronization) share one transaction and one fsync.
+
+The caller is responsible for ensuring that reads performed through other connections see the result of writes which have
+not been committed yet. The committed() signal is emitted (from the writer thread) each time a transaction is committed.
+A transaction which fails to commit is rolled back and its jobs are retried later on; no committed() is emitted for them.
+The callers are not throttled while the commits are failing. After a few failed attempts in a row, the writer gives up,
+throws away everything which is queued and ignores all further modifications. Each failure is reported via error(), so
+that the owner can stop using this cache.
+*/
+class SQLCacheWriter : public QThread
+{
+    Q_OBJECT
+public:
+    typedef std::function<void(SqlWriteContext &)> Job;
+
+    SQLCacheWriter(const QString &connectionName, const QString &fileName);
+    virtual ~SQLCacheWriter();
+
+    /** @short Start the thread and wait until it has opened its DB connection */
+    bool startWriting();
+
+    /** @short Queue a modification of the database
+
+    The @arg sequence numbers have to be increasing.
+    */
+    void enqueue(const quint64 sequence, const Job &job);
+    /** @short Block until everything which was queued so far got committed
+
+    Returns early when the writer is unable to commit; the jobs stay queued and are retried in that case unless the
+    writer has given up already.
+    */
+    void flush();
+    /** @short Compact the database file once the queue is empty */
+    void vacuum();
+
+    SqlWriteQueueStatistics statistics() const;
+
+signals:
+    /** @short All jobs up to and including the @arg sequence are now visible to other DB connections */
+    void committed(quint64 sequence);
+    void error(const QString &message);
+
+protected:
+    virtual void run() override;
+
+private:
+    struct QueuedJob {
+        quint64 sequence;
+        qint64 queuedAt;
+        Job job;
+    };
+
+    QString m_connectionName;
+    QString m_fileName;
+
+    mutable QMutex m_mutex;
+    /** @short Signalled when there is something to do for the writer */
+    QWaitCondition m_wakeUp;
+    /** @short Signalled when the writer has taken jobs from the queue or committed them */
+    QWaitCondition m_progress;
+    QSemaphore m_started;
+    bool m_openOk;
+    bool m_stopping;
+    bool m_finished;
+    /** @short The last attempt to commit has failed */
+    bool m_commitFailing;
+    /** @short Too many commits have failed, nothing is going to be written anymore */
+    bool m_givenUp;
+    /** @short Somebody wants the database to be compacted */
+    bool m_vacuumWanted;
+    int m_flushWaiters;
+    QVector<QueuedJob> m_queue;
+    quint64 m_lastQueued;
+    quint64 m_lastCommitted;
+    QElapsedTimer m_clock;
+    SqlWriteQueueStatistics m_statistics;
+};
+
+}
+}
+
+#endif /* IMAP_MODEL_SQLCACHEWRITER_H */
@@ -29,6 +29,7 @@
 #include "Imap/Tasks/CreateMailboxTask.h"
 #include "Imap/Tasks/DeleteMailboxTask.h"
 #include "Imap/Tasks/EnableTask.h"
+#include "Imap/Tasks/ExamineSearchTask.h"
 #include "Imap/Tasks/ExpungeMailboxTask.h"
 #include "Imap/Tasks/FetchMsgMetadataTask.h"
 #include "Imap/Tasks/FetchMsgPartTask.h"
@@ -38,6 +39,7 @@
 #include "Imap/Tasks/KeepMailboxOpenTask.h"
 #include "Imap/Tasks/Fake_ListChildMailboxesTask.h"
 #include "Imap/Tasks/Fake_OpenConnectionTask.h"
+#include "Imap/Tasks/MultiSearchTask.h"
 #include "Imap/Tasks/NumberOfMessagesTask.h"
 #include "Imap/Tasks/ObtainSynchronizedMailboxTask.h"
 #include "Imap/Tasks/OpenConnectionTask.h"
@@ -173,6 +175,16 @@ SortTask *TaskFactory::createSortTask(Model *model, const QModelIndex &mailbox,
     return new SortTask(model, mailbox, searchConditions, sortCriteria);
 }
 
+MultiSearchTask *TaskFactory::createMultiSearchTask(Model *model, const QStringList &mailboxes, const QStringList &searchConditions)
+{
+    return new MultiSearchTask(model, mailboxes, searchConditions);
+}
+
+ExamineSearchTask *TaskFactory::createExamineSearchTask(Model *model, const QStringList &mailboxes, const QStringList &searchConditions)
+{
+    return new ExamineSearchTask(model, mailboxes, searchConditions);
+}
+
 AppendTask *TaskFactory::createAppendTask(Model *model, const QString &targetMailbox, const QByteArray &rawMessageData,
                                           const QStringList &flags, const QDateTime &timestamp)
 {
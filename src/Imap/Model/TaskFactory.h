@@ -52,6 +52,8 @@ class IdTask;
 class ImapTask;
 class KeepMailboxOpenTask;
 class ListChildMailboxesTask;
+class MultiSearchTask;
+class ExamineSearchTask;
 class NumberOfMessagesTask;
 class ObtainSynchronizedMailboxTask;
 class OpenConnectionTask;
@@ -102,6 +104,8 @@ public:
     virtual NoopTask *createNoopTask(Model *model, ImapTask *parentTask);
     virtual UnSelectTask *createUnSelectTask(Model *model, ImapTask *parentTask);
     virtual SortTask *createSortTask(Model *model, const QModelIndex &mailbox, const QStringList &searchConditions, const QStringList &sortCriteria);
+    virtual MultiSearchTask *createMultiSearchTask(Model *model, const QStringList &mailboxes, const QStringList &searchConditions);
+    virtual ExamineSearchTask *createExamineSearchTask(Model *model, const QStringList &mailboxes, const QStringList &searchConditions);
     virtual AppendTask *createAppendTask(Model *model, const QString &targetMailbox, const QByteArray &rawMessageData,
                                          const QStringList &flags, const QDateTime &timestamp);
     virtual AppendTask *createAppendTask(Model *model, const QString &targetMailbox, const QList<CatenatePair> &data,
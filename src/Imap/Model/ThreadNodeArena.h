@@ -0,0 +1,284 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAP_THREADNODEARENA_H
+#define IMAP_THREADNODEARENA_H
+
+#include <vector>
+#include <QList>
+#include <QStringList>
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+class TreeItem;
+
+/** @short Summary of all messages in a subtree of the threading, see ThreadingMsgListModel::threadAggregate() */
+struct ThreadAggregate {
+    /** @short Number of real messages, i.e. not counting the placeholders for missing ones */
+    int messages;
+    /** @short How many of these messages are not marked as \\Seen */
+    int unread;
+    /** @short How many of these messages are marked as \\Flagged */
+    int flagged;
+    /** @short Date of the newest message as milliseconds since the epoch, or 0 if no date is known */
+    qint64 newest;
+    /** @short Union of all IMAP flags within the subtree */
+    QStringList flags;
+    /** @short Is the data above up-to-date?
+
+    If a node is invalid, all of its ancestors are invalid as well.
+    */
+    bool valid;
+    ThreadAggregate(): messages(0), unread(0), flagged(0), newest(0), valid(false) {}
+};
+
+/** @short A node in tree structure used for threading representation */
+struct ThreadNodeInfo {
+    /** @short Internal unique identifier used for model indexes */
+    uint internalId;
+    /** @short A UID of the message in a mailbox */
+    uint uid;
+    /** @short internalId of a parent of this message */
+    uint parent;
+    /** @short List of children of current node */
+    QList<uint> children;
+    /** @short Pointer to the TreeItemMessage* of the corresponding message */
+    TreeItem *ptr;
+    /** @short Position among our parent's children */
+    int offset;
+    /** @short Lazily computed summary of this node and all of its descendants */
+    mutable ThreadAggregate aggregate;
+    ThreadNodeInfo(): internalId(0), uid(0), parent(0), ptr(0), offset(0) {}
+};
+
+class ThreadNodeArena;
+
+/** @short Iterator over the nodes which are present in the ThreadNodeArena */
+template<typename Arena, typename Node>
+class ThreadNodeIterator
+{
+public:
+    ThreadNodeIterator(): m_arena(nullptr), m_id(0) {}
+    ThreadNodeIterator(Arena *arena, const uint id): m_arena(arena), m_id(id) {}
+    /** @short Allow the conversion from the mutable iterator to the const one */
+    template<typename OtherArena, typename OtherNode>
+    ThreadNodeIterator(const ThreadNodeIterator<OtherArena, OtherNode> &other): m_arena(other.m_arena), m_id(other.m_id) {}
+
+    uint key() const { return m_id; }
+    Node &value() const { return m_arena->m_nodes[m_id]; }
+    Node &operator*() const { return value(); }
+    Node *operator->() const { return &value(); }
+
+    ThreadNodeIterator &operator++()
+    {
+        m_id = m_arena->nextPresent(m_id + 1);
+        return *this;
+    }
+
+    ThreadNodeIterator operator++(int)
+    {
+        ThreadNodeIterator res = *this;
+        ++*this;
+        return res;
+    }
+
+    template<typename OtherArena, typename OtherNode>
+    bool operator==(const ThreadNodeIterator<OtherArena, OtherNode> &other) const { return m_id == other.m_id; }
+    template<typename OtherArena, typename OtherNode>
+    bool operator!=(const ThreadNodeIterator<OtherArena, OtherNode> &other) const { return m_id != other.m_id; }
+
+private:
+    template<typename, typename> friend class ThreadNodeIterator;
+    friend class ThreadNodeArena;
+
+    Arena *m_arena;
+    uint m_id;
+};
+
+/** @short Contiguous storage of the threading nodes, indexed by their internal IDs
+
+The internal IDs are handed out sequentially, which means that the nodes can live in a single vector instead of in a hash table
+which needs a separate allocation for each and every node. A lookup is a plain array access, and a mailbox with hundreds of thousands
+of messages no longer has its nodes scattered all over the heap.
+
+The interface is the subset of QHash<uint,ThreadNodeInfo> which the ThreadingMsgListModel needs. Unlike with QHash, the iteration
+order is the order of the internal IDs. The operator[] might reallocate the storage when creating a new node, so the references to
+the other nodes shall not be kept across that call.
+*/
+class ThreadNodeArena
+{
+public:
+    typedef ThreadNodeIterator<ThreadNodeArena, ThreadNodeInfo> iterator;
+    typedef ThreadNodeIterator<const ThreadNodeArena, const ThreadNodeInfo> const_iterator;
+
+    ThreadNodeArena(): m_count(0) {}
+
+    bool isEmpty() const { return m_count == 0; }
+    int size() const { return m_count; }
+
+    /** @short Remove all nodes and release the storage, which might have been sized for a much bigger mailbox */
+    void clear()
+    {
+        std::vector<ThreadNodeInfo>().swap(m_nodes);
+        std::vector<bool>().swap(m_present);
+        m_count = 0;
+    }
+
+    void reserve(const int size)
+    {
+        m_nodes.reserve(size);
+        m_present.reserve(size);
+    }
+
+    bool contains(const uint id) const { return id < m_present.size() && m_present[id]; }
+
+    /** @short Return the node with the given ID, creating an empty one if it is not present yet */
+    ThreadNodeInfo &operator[](const uint id)
+    {
+        if (id >= m_nodes.size()) {
+            m_nodes.resize(id + 1);
+            m_present.resize(id + 1, false);
+        }
+        if (!m_present[id]) {
+            m_present[id] = true;
+            m_nodes[id] = ThreadNodeInfo();
+            ++m_count;
+        }
+        return m_nodes[id];
+    }
+
+    ThreadNodeInfo value(const uint id) const { return contains(id) ? m_nodes[id] : ThreadNodeInfo(); }
+
+    iterator find(const uint id) { return iterator(this, contains(id) ? id : endId()); }
+    const_iterator find(const uint id) const { return constFind(id); }
+    const_iterator constFind(const uint id) const { return const_iterator(this, contains(id) ? id : endId()); }
+
+    iterator begin() { return iterator(this, nextPresent(0)); }
+    const_iterator begin() const { return constBegin(); }
+    const_iterator constBegin() const { return const_iterator(this, nextPresent(0)); }
+    iterator end() { return iterator(this, endId()); }
+    const_iterator end() const { return constEnd(); }
+    const_iterator constEnd() const { return const_iterator(this, endId()); }
+
+    /** @short Remove the node and return an iterator pointing to the next one */
+    iterator erase(iterator it)
+    {
+        const uint id = it.key();
+        // Release the list of children right now
+        m_nodes[id] = ThreadNodeInfo();
+        m_present[id] = false;
+        --m_count;
+        return iterator(this, nextPresent(id + 1));
+    }
+
+    /** @short Mark the aggregated data of a node and of all of its ancestors as stale */
+    void invalidateAggregates(uint id)
+    {
+        // The ancestors of an invalid node are never valid, so there is no need to continue past the first stale node
+        while (contains(id) && m_nodes[id].aggregate.valid) {
+            m_nodes[id].aggregate.valid = false;
+            if (id == 0)
+                break;
+            id = m_nodes[id].parent;
+        }
+    }
+
+    /** @short Are there so many erased slots that it pays off to compact() the storage? */
+    bool isFragmented() const
+    {
+        return m_nodes.size() > minSlotsForCompaction && m_nodes.size() > 2 * static_cast<std::size_t>(m_count);
+    }
+
+    /** @short Close the gaps left by the erased nodes
+
+    The remaining nodes get new internal IDs which keep their relative order; the root node stays at zero. The references
+    between the nodes are updated, but the caller has to translate all other copies of the IDs through the returned vector,
+    which is indexed by the old ID and contains zero for the nodes which were not present.
+    */
+    std::vector<uint> compact()
+    {
+        std::vector<uint> renumbered(m_nodes.size(), 0);
+        if (m_nodes.empty())
+            return renumbered;
+        uint next = 1;
+        for (uint id = 1; id < endId(); ++id) {
+            if (m_present[id])
+                renumbered[id] = next++;
+        }
+        for (uint id = 0; id < endId(); ++id) {
+            if (!m_present[id])
+                continue;
+            ThreadNodeInfo &node = m_nodes[id];
+            node.internalId = renumbered[id];
+            node.parent = renumbered[node.parent];
+            for (QList<uint>::iterator child = node.children.begin(); child != node.children.end(); ++child)
+                *child = renumbered[*child];
+            // The new ID is never higher than the old one, so nothing which is still needed gets overwritten
+            if (renumbered[id] != id)
+                m_nodes[renumbered[id]] = std::move(node);
+        }
+        const bool rootPresent = contains(0);
+        m_nodes.resize(next);
+        m_present.assign(next, true);
+        m_present[0] = rootPresent;
+        return renumbered;
+    }
+
+    QList<uint> keys() const
+    {
+        QList<uint> res;
+        res.reserve(m_count);
+        for (uint id = nextPresent(0); id < endId(); id = nextPresent(id + 1))
+            res.append(id);
+        return res;
+    }
+
+private:
+    template<typename, typename> friend class ThreadNodeIterator;
+
+    /** @short Don't bother with compacting tiny arenas */
+    static const std::size_t minSlotsForCompaction = 64;
+
+    uint endId() const { return static_cast<uint>(m_nodes.size()); }
+
+    uint nextPresent(uint id) const
+    {
+        while (id < m_present.size() && !m_present[id])
+            ++id;
+        return id;
+    }
+
+    std::vector<ThreadNodeInfo> m_nodes;
+    /** @short Which of the slots in m_nodes are actually used */
+    std::vector<bool> m_present;
+    int m_count;
+};
+
+}
+
+}
+
+#endif /* IMAP_THREADNODEARENA_H */
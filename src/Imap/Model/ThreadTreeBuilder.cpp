@@ -0,0 +1,277 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QHash>
+#include <QSet>
+#include <QtAlgorithms>
+#include <vector>
+#include "ThreadTreeBuilder.h"
+
+namespace {
+
+/** @short Convert the threading from a THREAD response into the nodes of the tree */
+void registerThreading(Imap::Mailbox::ThreadTree &tree, const QVector<Imap::Responses::ThreadingNode> &mapping,
+                       const QHash<uint,uint> &uidToInternal, QSet<uint> &usedNodes)
+{
+    Imap::Mailbox::ThreadNodeArena &threading = tree.threading;
+    // Work with an explicit stack; the threads can get very deep and we do not want to recurse that much.
+    // The siblings are pushed in the reverse order so that the nodes are visited exactly like with a recursive walk,
+    // which is important for the order of children and for the IDs of the fake nodes.
+    std::vector<std::pair<const Imap::Responses::ThreadingNode *, uint> > stack;
+    for (int i = mapping.size() - 1; i >= 0; --i) {
+        stack.push_back(std::make_pair(&mapping[i], 0u));
+    }
+    while (!stack.empty()) {
+        const Imap::Responses::ThreadingNode &node = *stack.back().first;
+        const uint parentId = stack.back().second;
+        stack.pop_back();
+
+        uint nodeId;
+        QHash<uint,uint>::const_iterator idIt;
+        if (node.num == 0 ||
+                (idIt = uidToInternal.find(node.num)) == uidToInternal.constEnd()) {
+            // Either this is an empty node, or the THREAD response references a UID which is no longer in the mailbox.
+            // This is a valid scenario; it can happen e.g. when reusing data from cache, or when a message got
+            // expunged after the untagged THREAD was received, but before the tagged OK.
+            // We cannot just ignore this node, though, because it might have some children which we would otherwise
+            // simply hide.
+            // The idIt which is initialized by the condition is used in the else branch.
+            Imap::Mailbox::ThreadNodeInfo fake;
+            fake.internalId = ++tree.lastId;
+            fake.parent = parentId;
+            Q_ASSERT(threading.contains(parentId));
+            // The child will be registered to the list of parent's children after the if/else branch
+            threading[ fake.internalId ] = fake;
+            nodeId = fake.internalId;
+        } else {
+            nodeId = *idIt;
+            // The following assert would fail if there was a node with a valid UID, but not in our tree.
+            // That is however non-issue, as we pre-create nodes for all messages beforehand.
+            Q_ASSERT(threading.contains(nodeId));
+        }
+        threading[nodeId].offset = threading[parentId].children.size();
+        threading[ parentId ].children.append(nodeId);
+        threading[ nodeId ].parent = parentId;
+        usedNodes.insert(nodeId);
+        for (int i = node.children.size() - 1; i >= 0; --i) {
+            stack.push_back(std::make_pair(&node.children[i], nodeId));
+        }
+    }
+}
+
+}
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+ThreadTreeInput::ThreadTreeInput(): headroom(0)
+{
+}
+
+ThreadTreePtr buildThreadTree(const ThreadTreeInput &input)
+{
+    ThreadTreePtr tree(new ThreadTree());
+    ThreadNodeArena &threading = tree->threading;
+    // Default-construct the root node
+    threading[0].ptr = 0;
+
+    // At first, initialize threading nodes for all messages which are right now available in the mailbox.
+    // We risk that we will have to delete some of them later on, but this is likely better than doing a lookup
+    // for each UID individually (remember, the THREAD response might contain UIDs in crazy order).
+    const int upstreamMessages = input.messages.size();
+    Q_ASSERT(input.uids.size() == upstreamMessages);
+    QHash<uint,uint> uidToInternal;
+    QSet<uint> usedNodes;
+    uidToInternal.reserve(upstreamMessages + input.headroom);
+    threading.reserve(upstreamMessages + 1 + input.headroom);
+    tree->sourceItemToInternal.reserve(upstreamMessages + input.headroom);
+    for (int i = 0; i < upstreamMessages; ++i) {
+        ThreadNodeInfo node;
+        node.uid = input.uids[i];
+        node.internalId = i + 1;
+        node.ptr = input.messages[i];
+        uidToInternal[node.uid] = node.internalId;
+        threading[node.internalId] = node;
+        tree->sourceItemToInternal[node.ptr] = node.internalId;
+    }
+    tree->lastId = upstreamMessages;
+    tree->uids = input.uids;
+
+    // Mark the root node as always present
+    usedNodes.insert(0);
+
+    // Set up parents and find the list of all used nodes
+    registerThreading(*tree, input.mapping, uidToInternal, usedNodes);
+
+    // Now remove all messages which were not referenced in the THREAD response from our mapping
+    ThreadNodeArena::iterator it = threading.begin();
+    while (it != threading.end()) {
+        if (usedNodes.contains(it.key())) {
+            // this message should be shown
+            ++it;
+        } else {
+            // this message is not included in the list of messages actually to be shown
+            if (it->ptr)
+                tree->sourceItemToInternal.remove(it->ptr);
+            it = threading.erase(it);
+        }
+    }
+    pruneThreadTree(threading, tree->threadedRootIds);
+    tree->threadedRootIds = threading[0].children;
+    return tree;
+}
+
+void pruneThreadTree(ThreadNodeArena &threading, QList<uint> &threadedRootIds)
+{
+    // Our mapping (threading) is completely unsorted, which means that we simply don't have any way of walking the tree from
+    // the top. Instead, we got to work with a random walk, processing nodes in an unspecified order.  If we iterated on the QHash
+    // directly, we'd hit an issue with iterator ordering (basically, we want to be able to say "hey, I don't care at which point
+    // of the iteration I'm right now, the next node to process should be that one, and then we should resume with the rest").
+    QList<uint> pending = threading.keys();
+
+    // These are the parents whose children will have to be renumbered later on
+    QSet<uint> parentsForRenumbering;
+
+    for (QList<uint>::iterator id = pending.begin(); id != pending.end(); /* nothing */) {
+        // Convert to the hashmap
+        // The "it" iterator point to the current node in the threading mapping
+        ThreadNodeArena::iterator it = threading.find(*id);
+        if (it == threading.end()) {
+            // We've already seen this node, that's due to promoting
+            ++id;
+            continue;
+        }
+
+        if (it->internalId == 0) {
+            // A special root item; we should not delete that one :)
+            ++id;
+            continue;
+        }
+        if (it->ptr) {
+            // regular and valid message -> skip
+            ++id;
+        } else {
+            // a fake one
+
+            // each node has a parent
+            ThreadNodeArena::iterator parent = threading.find(it->parent);
+            Q_ASSERT(parent != threading.end());
+
+            // and the node itself has to be found in its parent's children
+            QList<uint>::iterator childIt = qFind(parent->children.begin(), parent->children.end(), it->internalId);
+            Q_ASSERT(childIt != parent->children.end());
+            // The offset of this child might no longer be correct, though -- we're postponing the actual deletion until later
+
+            if (it->children.isEmpty()) {
+                // This is a leaf node, so we can just remove it
+                childIt = parent->children.erase(childIt);
+                // We do not perform the renumbering immediately, that would lead to an O(n^2) performance when deleting nodes.
+                parentsForRenumbering.insert(it->parent);
+                parentsForRenumbering.remove(it->internalId);
+
+                if (it->parent == 0) {
+                    threadedRootIds.removeOne(it->internalId);
+                }
+                threading.erase(it);
+                ++id;
+
+            } else {
+                // This node has some children, so we can't just delete it. Instead of that, we promote its first child
+                // to replace this node.
+                ThreadNodeArena::iterator replaceWith = threading.find(it->children.first());
+                Q_ASSERT(replaceWith != threading.end());
+
+                // The offsets will, again, be updated later on
+                parentsForRenumbering.insert(it->parent);
+                parentsForRenumbering.insert(replaceWith.key());
+                parentsForRenumbering.remove(it->internalId);
+
+                // Replace the node
+                *childIt = it->children.first();
+                replaceWith->parent = parent->internalId;
+
+                // Now merge the lists of children
+                it->children.removeFirst();
+                replaceWith->children = replaceWith->children + it->children;
+
+                // Fix parent information of all children of the replacement node
+                for (int i = 0; i < replaceWith->children.size(); ++i) {
+                    ThreadNodeArena::iterator sibling = threading.find(replaceWith->children[i]);
+                    Q_ASSERT(sibling != threading.end());
+                    sibling->parent = replaceWith.key();
+                }
+
+                if (parent->internalId == 0) {
+                    // Update the list of all thread roots
+                    QList<uint>::iterator rootIt = qFind(threadedRootIds.begin(), threadedRootIds.end(), it->internalId);
+                    if (rootIt != threadedRootIds.end())
+                        *rootIt = replaceWith->internalId;
+                }
+
+                // Now that all references are gone, remove the original node
+                threading.erase(it);
+
+                if (!replaceWith->ptr) {
+                    // If the just-promoted item is also a fake one, we'll have to visit it as well. This assignment is safe,
+                    // because we've already processed the current item and are completely done with it. The worst which can
+                    // happen is that we'll visit the same node twice, which is reasonably acceptable.
+                    *id = replaceWith.key();
+                }
+            }
+        }
+    }
+
+    // Now fix the sequential numbering of all siblings of deleted children
+    Q_FOREACH(const auto parentId, parentsForRenumbering) {
+        // These are also the only nodes whose list of descendants might have changed
+        threading.invalidateAggregates(parentId);
+        auto parentIt = threading.constFind(parentId);
+        Q_ASSERT(parentIt != threading.constEnd());
+        int offset = 0;
+        for (auto childNumber = parentIt->children.constBegin(); childNumber != parentIt->children.constEnd(); ++childNumber, ++offset) {
+            auto childIt = threading.find(*childNumber);
+            Q_ASSERT(childIt != threading.end());
+            childIt->offset = offset;
+        }
+    }
+}
+
+ThreadTreeWorker::ThreadTreeWorker(QObject *parent)
+    : BackgroundWorker(QStringLiteral("ThreadTreeWorker"), parent)
+{
+    qRegisterMetaType<Imap::Mailbox::ThreadTreePtr>("Imap::Mailbox::ThreadTreePtr");
+}
+
+void ThreadTreeWorker::request(const ThreadTreeInputPtr &input)
+{
+    enqueue([this, input]() -> Result {
+        const ThreadTreePtr tree = buildThreadTree(*input);
+        return [this, tree]() { emit treeAvailable(tree); };
+    });
+}
+
+}
+
+}
@@ -0,0 +1,109 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAP_MODEL_THREADTREEBUILDER_H
+#define IMAP_MODEL_THREADTREEBUILDER_H
+
+#include <QHash>
+#include <QSharedPointer>
+#include <QVector>
+#include "BackgroundWorker.h"
+#include "Imap/Parser/ThreadingNode.h"
+#include "ThreadNodeArena.h"
+
+namespace Imap
+{
+
+namespace Mailbox
+{
+
+/** @short Everything which is needed for turning a THREAD response into the tree of the ThreadingMsgListModel */
+struct ThreadTreeInput
+{
+    QVector<Responses::ThreadingNode> mapping;
+    /** @short Messages of the source model in the order of their rows
+
+    The pointers are only stored in the tree, they are never dereferenced while it is being built.
+    */
+    QVector<TreeItem *> messages;
+    /** @short UIDs of the messages above */
+    QVector<uint> uids;
+    /** @short Reserve space for this many new arrivals */
+    int headroom;
+
+    ThreadTreeInput();
+};
+
+/** @short The thread tree which is ready to be swapped into the ThreadingMsgListModel */
+struct ThreadTree
+{
+    ThreadNodeArena threading;
+    /** @short Mapping from the source messages to the internal IDs, messages which are not a part of the threading are left out */
+    QHash<TreeItem *, uint> sourceItemToInternal;
+    /** @short Thread roots in the order of the threading algorithm */
+    QList<uint> threadedRootIds;
+    /** @short UIDs of the source rows which the tree was built for */
+    QVector<uint> uids;
+    /** @short The last assigned internal ID */
+    uint lastId;
+
+    ThreadTree(): lastId(0) {}
+};
+
+typedef QSharedPointer<ThreadTreeInput> ThreadTreeInputPtr;
+typedef QSharedPointer<ThreadTree> ThreadTreePtr;
+
+/** @short Build the tree from the THREAD response
+
+Nothing but the input is accessed, which means that this can run on any thread.
+*/
+ThreadTreePtr buildThreadTree(const ThreadTreeInput &input);
+
+/** @short Remove the placeholders for missing messages from the tree
+
+A placeholder which has some children is replaced by its first child. The @arg threadedRootIds are updated accordingly.
+*/
+void pruneThreadTree(ThreadNodeArena &threading, QList<uint> &threadedRootIds);
+
+/** @short Build the thread trees on a background thread
+
+Each request() is eventually answered by a treeAvailable(), unless another request() or an invalidate() comes first.
+*/
+class ThreadTreeWorker : public BackgroundWorker
+{
+    Q_OBJECT
+public:
+    explicit ThreadTreeWorker(QObject *parent = nullptr);
+
+    void request(const ThreadTreeInputPtr &input);
+
+signals:
+    void treeAvailable(const Imap::Mailbox::ThreadTreePtr &tree);
+};
+
+}
+
+}
+
+Q_DECLARE_METATYPE(Imap::Mailbox::ThreadTreePtr)
+
+#endif /* IMAP_MODEL_THREADTREEBUILDER_H */
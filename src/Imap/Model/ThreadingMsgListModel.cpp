@@ -22,30 +22,59 @@
 
 #include "ThreadingMsgListModel.h"
 #include <algorithm>
+#include <limits>
 #include <QBuffer>
 #include <QDebug>
 #include "Imap/Tasks/SortTask.h"
 #include "Imap/Tasks/ThreadTask.h"
 #include "ItemRoles.h"
+#include "LocalSorting.h"
+#include "LocalThreading.h"
 #include "MailboxTree.h"
 #include "MsgListModel.h"
 
 namespace {
     /** @short Preallocate a bit more space in the hashmaps for future new arrivals */
     const int headroomForNewmessages = 1000;
+
+    /** @short How long to wait for more metadata before the client-side threading is updated, in milliseconds */
+    const int localMetadataCoalescingDelay = 100;
+    /** @short Mailboxes with at least this many messages get a preview of the server's SORT sorted locally */
+    const int localSortingPreviewThreshold = 5000;
+    /** @short Threading updates which reparent more messages than this are applied through a full layout rebuild */
+    const int maxIncrementalThreadingMoves = 100;
+    /** @short Mailboxes with at least this many messages have their thread tree built on a background thread */
+    const int backgroundThreadingThreshold = 10000;
+
+/** @short Drop the nodes which are not available, promoting their first child the same way as pruneThreadTree() does */
+void pruneMapping(const QVector<Imap::Responses::ThreadingNode> &input, const std::function<bool(const uint)> &isPresent,
+                  QVector<Imap::Responses::ThreadingNode> &output)
+{
+    for (const auto &node : input) {
+        QVector<Imap::Responses::ThreadingNode> children;
+        pruneMapping(node.children, isPresent, children);
+        if (node.num && isPresent(node.num)) {
+            output.append(Imap::Responses::ThreadingNode(node.num, children));
+        } else if (!children.isEmpty()) {
+            Imap::Responses::ThreadingNode replacement = children.takeFirst();
+            replacement.children += children;
+            output.append(replacement);
+        }
+    }
+}
 }
 
 namespace {
 using Imap::Mailbox::ThreadNodeInfo;
 
 #if 0
-QByteArray dumpThreadNodeInfo(const QHash<uint,ThreadNodeInfo> &mapping, const uint nodeId, const uint offset)
+QByteArray dumpThreadNodeInfo(const Imap::Mailbox::ThreadNodeArena &mapping, const uint nodeId, const uint offset)
 {
     QByteArray res;
     QByteArray prefix(offset, ' ');
     QTextStream ss(&res);
     Q_ASSERT(mapping.contains(nodeId));
-    const ThreadNodeInfo &node = mapping[nodeId];
+    const ThreadNodeInfo &node = *mapping.constFind(nodeId);
     ss << prefix << "ThreadNodeInfo intId " << node.internalId << " UID " << node.uid << " ptr " << node.ptr <<
           " parentIntId " << node.parent << "\n";
     Q_FOREACH(const uint childId, node.children) {
@@ -74,29 +103,49 @@ namespace Mailbox
 {
 
 ThreadingMsgListModel::ThreadingMsgListModel(QObject *parent):
-    QAbstractProxyModel(parent), threadingHelperLastId(0), modelResetInProgress(false), threadingInFlight(false),
+    QAbstractProxyModel(parent), threadingHelperLastId(0), modelResetInProgress(false), m_threadingApplied(false),
+    threadingInFlight(false),
+    m_localThreading(new LocalThreadingWorker(this)), m_localThreadingPrimed(false),
+    m_localSorting(new LocalSortingWorker(this)), m_localSortingPrimed(false), m_localSortingHighestUid(0),
+    m_localSortingIsFinal(false),
+    m_threadTreeWorker(new ThreadTreeWorker(this)), m_threadTreeInProgress(false), m_threadTreeStale(false),
+    m_backgroundThreadingThreshold(backgroundThreadingThreshold),
     m_shallBeThreading(false), m_filteredBySearch(false), m_sortTask(0), m_sortReverse(false), m_currentSortingCriteria(SORT_NONE),
-    m_searchValidity(RESULT_INVALIDATED)
+    m_searchValidity(RESULT_INVALIDATED), m_searchResultIsOffline(false)
 {
     m_delayedPrune = new QTimer(this);
     m_delayedPrune->setSingleShot(true);
     m_delayedPrune->setInterval(0);
     connect(m_delayedPrune, &QTimer::timeout, this, &ThreadingMsgListModel::delayedPrune);
+
+    m_localMetadataArrived = new QTimer(this);
+    m_localMetadataArrived->setSingleShot(true);
+    m_localMetadataArrived->setInterval(localMetadataCoalescingDelay);
+    connect(m_localMetadataArrived, &QTimer::timeout, this, &ThreadingMsgListModel::slotLocalMetadataArrived);
+
+    connect(m_localThreading, &LocalThreadingWorker::threadingAvailable, this, &ThreadingMsgListModel::slotLocalThreadingAvailable);
+    connect(m_localSorting, &LocalSortingWorker::sortingAvailable, this, &ThreadingMsgListModel::slotLocalSortingAvailable);
+    connect(m_threadTreeWorker, &ThreadTreeWorker::treeAvailable, this, &ThreadingMsgListModel::slotThreadTreeAvailable);
 }
 
 void ThreadingMsgListModel::setSourceModel(QAbstractItemModel *sourceModel)
 {
     beginResetModel();
     threading.clear();
-    ptrToInternal.clear();
+    sourceItemToInternal.clear();
     unknownUids.clear();
     threadedRootIds.clear();
     m_currentSortResult.clear();
     m_searchValidity = RESULT_INVALIDATED;
+    m_threadTreeWorker->invalidate();
+    setThreadTreeInProgress(false);
 
     if (this->sourceModel()) {
         // there's already something, so take care to disconnect all signals
         this->sourceModel()->disconnect(this);
+        if (Model *oldModel = qobject_cast<Model *>(static_cast<QAbstractProxyModel *>(this->sourceModel())->sourceModel())) {
+            disconnect(oldModel, &Model::networkPolicyChanged, this, &ThreadingMsgListModel::slotNetworkPolicyChanged);
+        }
     }
 
     endResetModel();
@@ -117,6 +166,9 @@ void ThreadingMsgListModel::setSourceModel(QAbstractItemModel *sourceModel)
     connect(sourceModel, &QAbstractItemModel::rowsRemoved, this, &ThreadingMsgListModel::handleRowsRemoved);
     connect(sourceModel, &QAbstractItemModel::rowsAboutToBeInserted, this, &ThreadingMsgListModel::handleRowsAboutToBeInserted);
     connect(sourceModel, &QAbstractItemModel::rowsInserted, this, &ThreadingMsgListModel::handleRowsInserted);
+    if (Model *imapModel = qobject_cast<Model *>(msgList->sourceModel())) {
+        connect(imapModel, &Model::networkPolicyChanged, this, &ThreadingMsgListModel::slotNetworkPolicyChanged);
+    }
     resetMe();
 }
 
@@ -136,19 +188,18 @@ void ThreadingMsgListModel::handleDataChanged(const QModelIndex &topLeft, const
     Q_ASSERT(topLeft.parent() == bottomRight.parent());
     Q_ASSERT(topLeft.row() == bottomRight.row());
     QModelIndex translated = mapFromSource(topLeft);
+    if (translated.isValid())
+        threading.invalidateAggregates(translated.internalId());
 
     emit dataChanged(translated, translated.sibling(translated.row(), bottomRight.column()));
 
-    // We provide funny data like "does this thread contain unread messages?". Now the original signal might mean that flags of a
-    // nested message have changed. In order to always be consistent, we have to find the thread root and emit dataChanged() on that
-    // as well.
-    QModelIndex rootCandidate = translated;
-    while (rootCandidate.parent().isValid()) {
-        rootCandidate = rootCandidate.parent();
-    }
-    if (rootCandidate != translated) {
-        // We're really an embedded message
-        emit dataChanged(rootCandidate, rootCandidate.sibling(rootCandidate.row(), bottomRight.column()));
+    // We provide funny data like "does this thread contain unread messages?" or the number of flagged messages in a subtree. Now
+    // the original signal might mean that flags of a nested message have changed. In order to always be consistent, we have to
+    // emit dataChanged() on all of its ancestors as well.
+    QModelIndex ancestor = translated.parent();
+    while (ancestor.isValid()) {
+        emit dataChanged(ancestor, ancestor.sibling(ancestor.row(), bottomRight.column()));
+        ancestor = ancestor.parent();
     }
 
     auto message = dynamic_cast<TreeItemMessage*>(static_cast<TreeItemMessage*>(topLeft.internalPointer()));
@@ -159,6 +210,13 @@ void ThreadingMsgListModel::handleDataChanged(const QModelIndex &topLeft, const
         return;
     }
 
+    if ((m_localThreadingMissing.contains(message->uid()) || m_localSortingMissing.contains(message->uid()))
+            && message->m_data && message->m_data->gotEnvelope()) {
+        // The client-side threading or sorting had to do without this message so far
+        if (!m_localMetadataArrived->isActive())
+            m_localMetadataArrived->start();
+    }
+
     QSet<TreeItem*>::iterator persistent = unknownUids.find(message);
     if (persistent != unknownUids.end()) {
         // The message wasn't fully synced before, and now it is
@@ -188,7 +246,7 @@ QModelIndex ThreadingMsgListModel::index(int row, int column, const QModelIndex
 
     uint parentId = parent.isValid() ? parent.internalId() : 0;
 
-    QHash<uint,ThreadNodeInfo>::const_iterator it = threading.constFind(parentId);
+    ThreadNodeArena::const_iterator it = threading.constFind(parentId);
     Q_ASSERT(it != threading.constEnd());
 
     if (it->children.size() <= row)
@@ -208,11 +266,11 @@ QModelIndex ThreadingMsgListModel::parent(const QModelIndex &index) const
     if (index.row() < 0 || index.column() < 0 || index.column() >= MsgListModel::COLUMN_COUNT)
         return QModelIndex();
 
-    QHash<uint,ThreadNodeInfo>::const_iterator node = threading.constFind(index.internalId());
+    ThreadNodeArena::const_iterator node = threading.constFind(index.internalId());
     if (node == threading.constEnd())
         return QModelIndex();
 
-    QHash<uint,ThreadNodeInfo>::const_iterator parentNode = threading.constFind(node->parent);
+    ThreadNodeArena::const_iterator parentNode = threading.constFind(node->parent);
     Q_ASSERT(parentNode != threading.constEnd());
     Q_ASSERT(parentNode->internalId == node->parent);
 
@@ -227,7 +285,8 @@ bool ThreadingMsgListModel::hasChildren(const QModelIndex &parent) const
     if (parent.isValid() && parent.column() != 0)
         return false;
 
-    return ! threading.isEmpty() && ! threading.value(parent.internalId()).children.isEmpty();
+    ThreadNodeArena::const_iterator it = threading.constFind(parent.internalId());
+    return it != threading.constEnd() && !it->children.isEmpty();
 }
 
 int ThreadingMsgListModel::rowCount(const QModelIndex &parent) const
@@ -238,7 +297,8 @@ int ThreadingMsgListModel::rowCount(const QModelIndex &parent) const
     if (parent.isValid() && parent.column() != 0)
         return 0;
 
-    return threading.value(parent.internalId()).children.size();
+    ThreadNodeArena::const_iterator it = threading.constFind(parent.internalId());
+    return it == threading.constEnd() ? 0 : it->children.size();
 }
 
 int ThreadingMsgListModel::columnCount(const QModelIndex &parent) const
@@ -260,7 +320,7 @@ QModelIndex ThreadingMsgListModel::mapToSource(const QModelIndex &proxyIndex) co
     Imap::Mailbox::MsgListModel *msgList = qobject_cast<Imap::Mailbox::MsgListModel *>(sourceModel());
     Q_ASSERT(msgList);
 
-    QHash<uint,ThreadNodeInfo>::const_iterator node = threading.constFind(proxyIndex.internalId());
+    ThreadNodeArena::const_iterator node = threading.constFind(proxyIndex.internalId());
     if (node == threading.constEnd())
         return QModelIndex();
 
@@ -279,18 +339,15 @@ QModelIndex ThreadingMsgListModel::mapFromSource(const QModelIndex &sourceIndex)
 
     Q_ASSERT(sourceIndex.model() == sourceModel());
 
-    QHash<void *,uint>::const_iterator it = ptrToInternal.constFind(sourceIndex.internalPointer());
-    if (it == ptrToInternal.constEnd())
+    const uint internalId = sourceItemToInternal.value(static_cast<TreeItem *>(sourceIndex.internalPointer()), 0);
+    if (!internalId)
         return QModelIndex();
 
-    const uint internalId = *it;
-
-    QHash<uint,ThreadNodeInfo>::const_iterator node = threading.constFind(internalId);
-    if (node == threading.constEnd()) {
+    ThreadNodeArena::const_iterator node = threading.constFind(internalId);
+    if (node == threading.constEnd() || node->ptr != sourceIndex.internalPointer()) {
         // The filtering criteria say that this index shall not be visible
         return QModelIndex();
     }
-    Q_ASSERT(node != threading.constEnd());
 
     return createIndex(node->offset, sourceIndex.column(), internalId);
 }
@@ -300,9 +357,23 @@ QVariant ThreadingMsgListModel::data(const QModelIndex &proxyIndex, int role) co
     if (! proxyIndex.isValid() || proxyIndex.model() != this)
         return QVariant();
 
-    QHash<uint,ThreadNodeInfo>::const_iterator it = threading.constFind(proxyIndex.internalId());
+    ThreadNodeArena::const_iterator it = threading.constFind(proxyIndex.internalId());
     Q_ASSERT(it != threading.constEnd());
 
+    switch (role) {
+    case RoleThreadMessageCount:
+        return threadAggregate(it->internalId).messages;
+    case RoleThreadUnreadCount:
+        return threadAggregate(it->internalId).unread;
+    case RoleThreadFlaggedCount:
+        return threadAggregate(it->internalId).flagged;
+    case RoleThreadNewestDate:
+    {
+        const qint64 newest = threadAggregate(it->internalId).newest;
+        return newest ? QVariant(QDateTime::fromMSecsSinceEpoch(newest)) : QVariant();
+    }
+    }
+
     if (it->ptr) {
         // It's a real item which exists in the underlying model
         switch (role) {
@@ -339,7 +410,7 @@ Qt::ItemFlags ThreadingMsgListModel::flags(const QModelIndex &index) const
     if (! index.isValid() || index.model() != this)
         return Qt::NoItemFlags;
 
-    QHash<uint,ThreadNodeInfo>::const_iterator it = threading.constFind(index.internalId());
+    ThreadNodeArena::const_iterator it = threading.constFind(index.internalId());
     Q_ASSERT(it != threading.constEnd());
     if (it->ptr && it->uid)
         return Qt::ItemIsSelectable | Qt::ItemIsDragEnabled | Qt::ItemIsEnabled;
@@ -351,6 +422,8 @@ Qt::ItemFlags ThreadingMsgListModel::flags(const QModelIndex &index) const
 void ThreadingMsgListModel::handleRowsAboutToBeRemoved(const QModelIndex &parent, int start, int end)
 {
     Q_ASSERT(!parent.isValid());
+    if (m_threadTreeInProgress)
+        m_threadTreeStale = true;
 
     for (int i = start; i <= end; ++i) {
         QModelIndex index = sourceModel()->index(i, 0, parent);
@@ -358,6 +431,7 @@ void ThreadingMsgListModel::handleRowsAboutToBeRemoved(const QModelIndex &parent
         QModelIndex translated = mapFromSource(index);
 
         unknownUids.remove(static_cast<TreeItem*>(index.internalPointer()));
+        sourceItemToInternal.remove(static_cast<TreeItem*>(index.internalPointer()));
 
         if (!translated.isValid()) {
             // The index being removed wasn't visible in our mapping anyway
@@ -365,10 +439,11 @@ void ThreadingMsgListModel::handleRowsAboutToBeRemoved(const QModelIndex &parent
         }
 
         Q_ASSERT(translated.isValid());
-        QHash<uint,ThreadNodeInfo>::iterator it = threading.find(translated.internalId());
+        ThreadNodeArena::iterator it = threading.find(translated.internalId());
         Q_ASSERT(it != threading.end());
         it->uid = 0;
         it->ptr = 0;
+        threading.invalidateAggregates(it.key());
     }
 }
 
@@ -377,6 +452,7 @@ void ThreadingMsgListModel::handleRowsRemoved(const QModelIndex &parent, int sta
     Q_ASSERT(!parent.isValid());
     Q_UNUSED(start);
     Q_UNUSED(end);
+    // The nodes stay in the tree until the delayed prune
     if (!m_delayedPrune->isActive())
         m_delayedPrune->start();
 }
@@ -385,7 +461,8 @@ void ThreadingMsgListModel::delayedPrune()
 {
     emit layoutAboutToBeChanged();
     updatePersistentIndexesPhase1();
-    pruneTree();
+    pruneThreadTree(threading, threadedRootIds);
+    compactThreading();
     updatePersistentIndexesPhase2();
     emit layoutChanged();
 }
@@ -393,6 +470,8 @@ void ThreadingMsgListModel::delayedPrune()
 void ThreadingMsgListModel::handleRowsAboutToBeInserted(const QModelIndex &parent, int start, int end)
 {
     Q_ASSERT(!parent.isValid());
+    if (m_threadTreeInProgress)
+        m_threadTreeStale = true;
 
     int myStart = threading[0].children.size();
     int myEnd = myStart + (end - start);
@@ -413,7 +492,7 @@ void ThreadingMsgListModel::handleRowsInserted(const QModelIndex &parent, int st
         node.offset = threading[0].children.size();
         threading[node.internalId] = node;
         threading[0].children << node.internalId;
-        ptrToInternal[node.ptr] = node.internalId;
+        sourceItemToInternal[node.ptr] = node.internalId;
         if (!node.uid) {
             unknownUids << static_cast<TreeItem*>(index.internalPointer());
         } else {
@@ -441,11 +520,20 @@ void ThreadingMsgListModel::resetMe()
     beginResetModel();
     modelResetInProgress = true;
     threading.clear();
-    ptrToInternal.clear();
+    sourceItemToInternal.clear();
     unknownUids.clear();
     threadedRootIds.clear();
     m_currentSortResult.clear();
     m_searchValidity = RESULT_INVALIDATED;
+    m_searchResultIsOffline = false;
+    // Whatever the client-side threading is working on right now, it's not for this mailbox anymore
+    m_localThreading->invalidate();
+    m_localThreadingPrimed = false;
+    m_localThreadingMissing.clear();
+    m_localSorting->invalidate();
+    m_localSortingPrimed = false;
+    m_localSortingHighestUid = 0;
+    m_localSortingMissing.clear();
     endResetModel();
     updateNoThreading();
     modelResetInProgress = false;
@@ -457,13 +545,17 @@ void ThreadingMsgListModel::resetMe()
 void ThreadingMsgListModel::updateNoThreading()
 {
     threadingHelperLastId = 0;
+    m_threadingApplied = false;
+    // The tree which might be getting built in the background is not wanted anymore
+    m_threadTreeWorker->invalidate();
+    setThreadTreeInProgress(false);
 
     if (!sourceModel()) {
         // Maybe we got reset because the parent model is no longer here...
         if (! threading.isEmpty()) {
             beginRemoveRows(QModelIndex(), 0, rowCount() - 1);
             threading.clear();
-            ptrToInternal.clear();
+            sourceItemToInternal.clear();
             endRemoveRows();
         }
         unknownUids.clear();
@@ -473,14 +565,14 @@ void ThreadingMsgListModel::updateNoThreading()
     emit layoutAboutToBeChanged();
     updatePersistentIndexesPhase1();
     threading.clear();
-    ptrToInternal.clear();
+    sourceItemToInternal.clear();
     unknownUids.clear();
     threadedRootIds.clear();
 
     int upstreamMessages = sourceModel()->rowCount();
     QList<uint> allIds;
-    QHash<uint,ThreadNodeInfo> newThreading;
-    QHash<void *,uint> newPtrToInternal;
+    ThreadNodeArena newThreading;
+    QHash<TreeItem *, uint> newSourceItemToInternal;
 
     if (upstreamMessages) {
         // Prefer the direct pointer access instead of going through the MVC API -- similar to how applyThreading() works.
@@ -495,8 +587,8 @@ void ThreadingMsgListModel::updateNoThreading()
         TreeItemMsgList *list = dynamic_cast<TreeItemMsgList *>(firstMessagePtr->parent());
         Q_ASSERT(list);
 
-        newThreading.reserve(upstreamMessages + headroomForNewmessages);
-        newPtrToInternal.reserve(upstreamMessages + headroomForNewmessages);
+        newThreading.reserve(upstreamMessages + 1 + headroomForNewmessages);
+        newSourceItemToInternal.reserve(upstreamMessages + headroomForNewmessages);
 
         for (int i = 0; i < upstreamMessages; ++i) {
             TreeItemMessage *ptr = static_cast<TreeItemMessage*>(list->m_children[i]);
@@ -508,7 +600,7 @@ void ThreadingMsgListModel::updateNoThreading()
             node.offset = i;
             newThreading[node.internalId] = node;
             allIds.append(node.internalId);
-            newPtrToInternal[node.ptr] = node.internalId;
+            newSourceItemToInternal[ptr] = node.internalId;
             if (!node.uid) {
                 unknownUids << ptr;
             }
@@ -517,7 +609,7 @@ void ThreadingMsgListModel::updateNoThreading()
 
     if (newThreading.size()) {
         threading = newThreading;
-        ptrToInternal = newPtrToInternal;
+        sourceItemToInternal = newSourceItemToInternal;
         threading[ 0 ].children = allIds;
         threading[ 0 ].ptr = 0;
         threadingHelperLastId = newThreading.size();
@@ -690,7 +782,65 @@ void ThreadingMsgListModel::askForThreading(const uint firstUnknownUid)
             connect(realModel, &Model::threadingAvailable, this, &ThreadingMsgListModel::slotThreadingAvailable);
             connect(realModel, &Model::threadingFailed, this, &ThreadingMsgListModel::slotThreadingFailed);
         }
+    } else {
+        askForLocalThreading(realModel, mailboxIndex, firstUnknownUid);
+    }
+}
+
+void ThreadingMsgListModel::askForLocalThreading(const Model *realModel, const QModelIndex &mailboxIndex, const uint firstUnknownUid)
+{
+    TreeItemMailbox *mailbox = static_cast<TreeItemMailbox*>(mailboxIndex.internalPointer());
+    Q_ASSERT(mailbox);
+    TreeItemMsgList *list = dynamic_cast<TreeItemMsgList*>(mailbox->m_children[0]);
+    Q_ASSERT(list);
+
+    // A search is threaded from scratch, only the full mailbox is kept around for the future arrivals
+    const bool incremental = firstUnknownUid && m_localThreadingPrimed && !m_filteredBySearch;
+    QSet<uint> searchResult;
+    if (m_filteredBySearch) {
+        for (const uint uid : m_currentSortResult)
+            searchResult.insert(uid);
+    }
+
+    Imap::Uids presentUids;
+    QList<TreeItemMessage*> wanted;
+    presentUids.reserve(list->m_children.size());
+    for (auto it = list->m_children.constBegin(); it != list->m_children.constEnd(); ++it) {
+        TreeItemMessage *message = static_cast<TreeItemMessage*>(*it);
+        const uint uid = message->uid();
+        if (!uid || (m_filteredBySearch && !searchResult.contains(uid)))
+            continue;
+        presentUids << uid;
+        if (!incremental || uid >= firstUnknownUid || m_localThreadingMissing.contains(uid))
+            wanted << message;
+    }
+
+    // Messages whose envelope is not known yet cannot be threaded properly. They are left out for now, shown as standalone
+    // threads and threaded once their metadata arrive; threading them as bare UIDs would put them into wrong places.
+    Imap::Uids missing;
+    const auto metadataList = messageMetadata(realModel, mailbox, wanted, &missing);
+    m_localThreadingMissing.clear();
+    for (const uint uid : missing)
+        m_localThreadingMissing.insert(uid);
+    QVector<LocalThreadingMessage> messages;
+    messages.reserve(wanted.size());
+    for (const auto &metadata : metadataList) {
+        if (!m_localThreadingMissing.contains(metadata.uid))
+            messages << LocalThreadingMessage(metadata.uid, metadata.envelope, metadata.hdrReferences, metadata.internalDate);
+    }
+    if (!missing.isEmpty()) {
+        for (TreeItemMessage *message : wanted) {
+            if (m_localThreadingMissing.contains(message->uid()))
+                message->fetch(const_cast<Model *>(realModel));
+        }
     }
+
+    logTrace(QStringLiteral("Threading %1 messages locally (%2), %3 are waiting for their metadata")
+             .arg(QString::number(messages.size()), incremental ? QStringLiteral("incremental") : QStringLiteral("full"),
+                  QString::number(missing.size())));
+    threadingInFlight = true;
+    m_localThreadingPrimed = !m_filteredBySearch;
+    m_localThreading->request(messages, presentUids, incremental);
 }
 
 /** @short Gather all UIDs present in the mapping and push them into the "uids" vector */
@@ -704,6 +854,8 @@ static void gatherAllUidsFromThreadNode(Imap::Uids &uids, const QVector<Response
 
 void ThreadingMsgListModel::slotIncrementalThreadingAvailable(const Responses::ESearch::IncrementalThreadingData_t &data)
 {
+    threadingInFlight = false;
+
     // Preparation: get through to the real model
     const Imap::Mailbox::Model *realModel;
     QModelIndex someMessage = sourceModel()->index(0,0);
@@ -713,52 +865,38 @@ void ThreadingMsgListModel::slotIncrementalThreadingAvailable(const Responses::E
     QModelIndex mailboxIndex = realIndex.parent().parent();
     Q_ASSERT(mailboxIndex.isValid());
 
-    // First phase: remove all messages mentioned in the incremental responses from their original placement
+    // The threads from the incremental response replace whatever their messages were a part of before
     Imap::Uids affectedUids;
     for (Responses::ESearch::IncrementalThreadingData_t::const_iterator it = data.constBegin(); it != data.constEnd(); ++it) {
         gatherAllUidsFromThreadNode(affectedUids, it->thread);
     }
-    qSort(affectedUids);
-    QList<TreeItemMessage*> affectedMessages = const_cast<Model*>(realModel)->
-            findMessagesByUids(static_cast<TreeItemMailbox*>(mailboxIndex.internalPointer()), affectedUids);
-    QHash<uint,void *> uidToPtrCache;
-
+    QSet<uint> affected;
+    affected.reserve(affectedUids.size());
+    for (const uint uid : affectedUids)
+        affected.insert(uid);
 
-    emit layoutAboutToBeChanged();
-    updatePersistentIndexesPhase1();
-    for (QList<TreeItemMessage*>::const_iterator it = affectedMessages.constBegin(); it != affectedMessages.constEnd(); ++it) {
-        QHash<void *,uint>::const_iterator ptrMappingIt = ptrToInternal.constFind(*it);
-        Q_ASSERT(ptrMappingIt != ptrToInternal.constEnd());
-        QHash<uint,ThreadNodeInfo>::iterator threadIt = threading.find(*ptrMappingIt);
-        Q_ASSERT(threadIt != threading.end());
-        uidToPtrCache[(*it)->uid()] = threadIt->ptr;
-        threadIt->ptr = 0;
-    }
-    pruneTree();
-    updatePersistentIndexesPhase2();
-    emit layoutChanged();
+    QVector<Responses::ThreadingNode> mapping;
+    pruneMapping(currentThreadingMapping(0), [&affected](const uint uid) { return !affected.contains(uid); }, mapping);
 
-    // Second phase: for each message whose UID is returned by the server, update the threading data
-    QSet<uint> usedNodes;
-    emit layoutAboutToBeChanged();
-    updatePersistentIndexesPhase1();
     for (Responses::ESearch::IncrementalThreadingData_t::const_iterator it = data.constBegin(); it != data.constEnd(); ++it) {
-        registerThreading(it->thread, 0, uidToPtrCache, usedNodes);
-        int actualOffset = threading[0].children.size() - 1;
-        int expectedOffsetOfPrevious = threading[0].children.indexOf(it->previousThreadRoot);
-        if (actualOffset == expectedOffsetOfPrevious + 1) {
-            // it's on the correct position, yay!
-        } else {
-            // move the new subthread to a correct place
-            threading[0].children.insert(expectedOffsetOfPrevious + 1, threading[0].children.takeLast());
-            // push the rest (including the new arrival) forward
-            for (int i = expectedOffsetOfPrevious + 1; i < threading[0].children.size(); ++i) {
-                threading[threading[0].children[i]].offset = i;
+        int offset = 0;
+        for (int i = 0; i < mapping.size(); ++i) {
+            if (mapping[i].num == it->previousThreadRoot) {
+                offset = i + 1;
+                break;
             }
         }
+        for (const auto &node : it->thread) {
+            mapping.insert(offset++, node);
+        }
     }
-    updatePersistentIndexesPhase2();
-    emit layoutChanged();
+
+    if (!m_filteredBySearch) {
+        // This is the threading of the whole mailbox, so there's no need to ask for it again next time
+        realModel->cache()->setMessageThreading(mailboxIndex.data(RoleMailboxName).toString(), mapping);
+    }
+
+    applyThreading(mapping);
 }
 
 void ThreadingMsgListModel::slotIncrementalThreadingFailed()
@@ -830,6 +968,233 @@ void ThreadingMsgListModel::slotThreadingAvailable(const QModelIndex &mailbox, c
         wantThreading();
 }
 
+/** @short Collect whatever is known about the @arg messages, either from the tree or from the cache
+
+Messages whose metadata are not known have everything but the UID empty.
+*/
+QVector<AbstractCache::MessageDataBundle> ThreadingMsgListModel::messageMetadata(const Model *realModel, TreeItemMailbox *mailbox,
+                                                                                const QList<TreeItemMessage*> &messages,
+                                                                                Imap::Uids *missing)
+{
+    QVector<AbstractCache::MessageDataBundle> res;
+    res.reserve(messages.size());
+    Imap::Uids notLoaded;
+    for (TreeItemMessage *message : messages) {
+        AbstractCache::MessageDataBundle metadata;
+        metadata.uid = message->uid();
+        if (message->m_data && message->m_data->gotEnvelope()) {
+            metadata.envelope = message->m_data->envelope();
+            metadata.internalDate = message->m_data->internalDate();
+            metadata.size = message->m_data->size();
+            metadata.hdrReferences = message->m_data->hdrReferences();
+        } else {
+            notLoaded << metadata.uid;
+        }
+        res << metadata;
+    }
+
+    if (!notLoaded.isEmpty()) {
+        // The tree only holds what has been looked at, the rest of the metadata is in the cache
+        auto cached = realModel->cache()->messageMetadataBatch(mailbox->mailbox(), notLoaded);
+        if (!cached.isEmpty()) {
+            for (auto &metadata : res) {
+                auto it = cached.constFind(metadata.uid);
+                if (it != cached.constEnd())
+                    metadata = *it;
+            }
+        }
+        if (missing) {
+            for (const uint uid : notLoaded) {
+                if (!cached.contains(uid))
+                    *missing << uid;
+            }
+        }
+    }
+    return res;
+}
+
+QVector<AbstractCache::MessageDataBundle> ThreadingMsgListModel::cachedMessageMetadata(const uint newerThan, const Imap::Uids &alsoWanted,
+                                                                                      bool *sawUnknownUids) const
+{
+    *sawUnknownUids = false;
+    if (!sourceModel() || !sourceModel()->rowCount())
+        return QVector<AbstractCache::MessageDataBundle>();
+
+    const Model *realModel;
+    QModelIndex realIndex;
+    Model::realTreeItem(sourceModel()->index(0, 0), &realModel, &realIndex);
+    TreeItemMailbox *mailbox = static_cast<TreeItemMailbox*>(realIndex.parent().parent().internalPointer());
+    Q_ASSERT(mailbox);
+    TreeItemMsgList *list = dynamic_cast<TreeItemMsgList*>(mailbox->m_children[0]);
+    Q_ASSERT(list);
+
+    QList<TreeItemMessage*> messages;
+    if (!alsoWanted.isEmpty())
+        messages = const_cast<Model*>(realModel)->findMessagesByUids(mailbox, alsoWanted);
+    for (auto it = const_cast<Model*>(realModel)->findMessageOrNextOneByUid(list, newerThan + 1); it != list->m_children.end(); ++it) {
+        TreeItemMessage *message = static_cast<TreeItemMessage*>(*it);
+        if (message->uid())
+            messages << message;
+        else
+            *sawUnknownUids = true;
+    }
+    return messageMetadata(realModel, mailbox, messages);
+}
+
+QSet<uint> ThreadingMsgListModel::threadNodesWithAncestors(const QSet<uint> &uids) const
+{
+    QSet<uint> res;
+    if (uids.isEmpty())
+        return res;
+    for (auto it = threading.constBegin(); it != threading.constEnd(); ++it) {
+        if (!it->uid || !uids.contains(it->uid))
+            continue;
+        // Once a node is in, so are all of its ancestors, which means that no node is visited twice
+        for (uint id = it.key(); id && !res.contains(id); id = threading.constFind(id)->parent)
+            res.insert(id);
+    }
+    return res;
+}
+
+void ThreadingMsgListModel::askForLocalSorting(const Model *realModel, const QModelIndex &mailboxIndex, const SortCriterium criterium)
+{
+    TreeItemMailbox *mailbox = static_cast<TreeItemMailbox*>(mailboxIndex.internalPointer());
+    Q_ASSERT(mailbox);
+    TreeItemMsgList *list = dynamic_cast<TreeItemMsgList*>(mailbox->m_children[0]);
+    Q_ASSERT(list);
+
+    // The sorter keeps the keys of all messages; only the new arrivals have to be passed to it
+    const bool incremental = m_localSortingPrimed;
+    Imap::Uids presentUids;
+    QList<TreeItemMessage*> wanted;
+    presentUids.reserve(list->m_children.size());
+    uint highestUid = m_localSortingHighestUid;
+    for (auto it = list->m_children.constBegin(); it != list->m_children.constEnd(); ++it) {
+        TreeItemMessage *message = static_cast<TreeItemMessage*>(*it);
+        const uint uid = message->uid();
+        if (!uid)
+            continue;
+        const bool wasMissing = m_localSortingMissing.contains(uid);
+        // Messages which were sorted without their keys are passed again, so their old place has to be forgotten
+        if (!incremental || !wasMissing)
+            presentUids << uid;
+        if (!incremental || uid > m_localSortingHighestUid || wasMissing) {
+            wanted << message;
+            highestUid = qMax(highestUid, uid);
+        }
+    }
+
+    Imap::Uids missing;
+    QVector<LocalSortingMessage> messages;
+    messages.reserve(wanted.size());
+    for (const auto &metadata : messageMetadata(realModel, mailbox, wanted, &missing))
+        messages << LocalSortingMessage(metadata.uid, metadata.envelope, metadata.internalDate, metadata.size);
+    // Without the envelope, a message gets sorted by empty keys. That is good enough for a preview of the server's SORT,
+    // but the final order has to be fixed once the data arrive.
+    m_localSortingMissing.clear();
+    for (const uint uid : missing)
+        m_localSortingMissing.insert(uid);
+    if (m_localSortingIsFinal && !missing.isEmpty()) {
+        for (TreeItemMessage *message : wanted) {
+            if (m_localSortingMissing.contains(message->uid()))
+                message->fetch(const_cast<Model *>(realModel));
+        }
+    }
+
+    logTrace(QStringLiteral("Sorting locally, %1 new messages, %2 without their metadata")
+             .arg(QString::number(messages.size()), QString::number(missing.size())));
+    m_localSortingPrimed = true;
+    m_localSortingHighestUid = highestUid;
+    m_localSorting->request(criterium, messages, presentUids, incremental);
+}
+
+void ThreadingMsgListModel::slotLocalSortingAvailable(const Imap::Uids &uids)
+{
+    if (m_localSortingIsFinal) {
+        // The server cannot help us, this is the real result
+        if (m_searchValidity != RESULT_ASKED)
+            return;
+        m_searchValidity = RESULT_FRESH;
+    } else if (m_searchValidity != RESULT_ASKED) {
+        // The server has already answered
+        return;
+    }
+
+    if (m_filteredBySearch) {
+        m_currentSortResult.clear();
+        m_currentSortResult.reserve(m_localSortingFilter.size());
+        for (const uint uid : uids) {
+            if (m_localSortingFilter.contains(uid))
+                m_currentSortResult << uid;
+        }
+    } else {
+        m_currentSortResult = uids;
+    }
+
+    if (m_localSortingIsFinal) {
+        wantThreading();
+    } else {
+        applySort();
+    }
+}
+
+void ThreadingMsgListModel::slotLocalThreadingAvailable(const QVector<Responses::ThreadingNode> &mapping)
+{
+    // Responses to the older requests, or to something which was asked before the mailbox got switched, never get here
+    threadingInFlight = false;
+
+    QModelIndex someMessage = sourceModel() ? sourceModel()->index(0,0) : QModelIndex();
+    if (!someMessage.isValid())
+        return;
+
+    if (!m_localThreadingMissing.isEmpty()) {
+        // Some messages were left out because their metadata are not available yet. Such a result is not good enough
+        // to be remembered as the threading of this mailbox, so it is only shown.
+        if (!m_shallBeThreading)
+            return;
+        QVector<Responses::ThreadingNode> withMissing = mapping;
+        Imap::Uids missing = m_localThreadingMissing.toList().toVector();
+        std::sort(missing.begin(), missing.end());
+        for (const uint uid : missing)
+            withMissing << Responses::ThreadingNode(uid);
+        applyThreading(withMissing);
+        return;
+    }
+
+    const Model *model;
+    QModelIndex realIndex;
+    Imap::Mailbox::Model::realTreeItem(someMessage, &model, &realIndex);
+    QModelIndex mailbox = realIndex.parent().parent();
+    model->cache()->setMessageThreading(mailbox.data(RoleMailboxName).toString(), mapping);
+
+    if (m_shallBeThreading)
+        wantThreading();
+}
+
+/** @short Some messages which the client-side threading or sorting had to do without have their metadata now */
+void ThreadingMsgListModel::slotLocalMetadataArrived()
+{
+    if (!sourceModel() || !sourceModel()->rowCount())
+        return;
+
+    const Model *realModel;
+    QModelIndex realIndex;
+    Model::realTreeItem(sourceModel()->index(0, 0), &realModel, &realIndex);
+    const QModelIndex mailboxIndex = realIndex.parent().parent();
+
+    if (m_shallBeThreading && !m_localThreadingMissing.isEmpty()) {
+        // Only the messages which were missing are added to what has been threaded already
+        askForLocalThreading(realModel, mailboxIndex, std::numeric_limits<uint>::max());
+    }
+
+    if (m_localSortingIsFinal && !m_localSortingMissing.isEmpty() && m_currentSortingCriteria != SORT_NONE
+            && m_searchValidity == RESULT_FRESH) {
+        // Nothing else is going to correct the order, so the messages which were sorted by empty keys are sorted again
+        m_searchValidity = RESULT_ASKED;
+        askForLocalSorting(realModel, mailboxIndex, m_currentSortingCriteria);
+    }
+}
+
 void ThreadingMsgListModel::slotSortingAvailable(const Imap::Uids &uids)
 {
     if (!m_sortTask->isPersistent()) {
@@ -846,6 +1211,25 @@ void ThreadingMsgListModel::slotSortingAvailable(const Imap::Uids &uids)
     wantThreading();
 }
 
+void ThreadingMsgListModel::slotNetworkPolicyChanged()
+{
+    if (!m_searchResultIsOffline || !sourceModel() || !sourceModel()->rowCount())
+        return;
+
+    const Model *realModel;
+    QModelIndex realIndex;
+    Model::realTreeItem(sourceModel()->index(0, 0), &realModel, &realIndex);
+    if (!realModel->isNetworkAvailable())
+        return;
+
+    // The local index might be missing some messages, or even whole bodies. Now that the server is reachable again, it
+    // gets to provide the authoritative answer.
+    logTrace(QStringLiteral("Back online, refreshing the search/sort result which was computed offline"));
+    m_searchResultIsOffline = false;
+    m_searchValidity = RESULT_INVALIDATED;
+    wantThreading();
+}
+
 void ThreadingMsgListModel::slotSortingFailed()
 {
     disconnect(m_sortTask.data(), &SortTask::sortingAvailable, this, &ThreadingMsgListModel::slotSortingAvailable);
@@ -914,7 +1298,7 @@ void ThreadingMsgListModel::calculateNullSort()
     m_currentSortResult.clear();
     m_currentSortResult.reserve(threadedRootIds.size() + headroomForNewmessages);
     Q_FOREACH(const uint internalId, threadedRootIds) {
-        QHash<uint,ThreadNodeInfo>::const_iterator it = threading.constFind(internalId);
+        ThreadNodeArena::const_iterator it = threading.constFind(internalId);
         if (it == threading.constEnd())
             continue;
         if (it->uid)
@@ -931,25 +1315,18 @@ void ThreadingMsgListModel::applyThreading(const QVector<Imap::Responses::Thread
         return;
     }
 
-    emit layoutAboutToBeChanged();
-
-    updatePersistentIndexesPhase1();
+    // Whatever is being built in the background right now is based on older data
+    m_threadTreeWorker->invalidate();
 
-    threading.clear();
-    ptrToInternal.clear();
-    // Default-construct the root node
-    threading[ 0 ].ptr = 0;
-
-    // At first, initialize threading nodes for all messages which are right now available in the mailbox.
-    // We risk that we will have to delete some of them later on, but this is likely better than doing a lookup
-    // for each UID individually (remember, the THREAD response might contain UIDs in crazy order).
-    int upstreamMessages = sourceModel()->rowCount();
-    QHash<uint,void *> uidToPtrCache;
-    QSet<uint> usedNodes;
-    uidToPtrCache.reserve(upstreamMessages + headroomForNewmessages);
-    threading.reserve(upstreamMessages + headroomForNewmessages);
-    ptrToInternal.reserve(upstreamMessages + headroomForNewmessages);
+    if (applyThreadingIncrementally(mapping)) {
+        setThreadTreeInProgress(false);
+        return;
+    }
 
+    ThreadTreeInputPtr input(new ThreadTreeInput());
+    input->mapping = mapping;
+    input->headroom = headroomForNewmessages;
+    const int upstreamMessages = sourceModel()->rowCount();
     if (upstreamMessages) {
         // Work with pointers instead going through the MVC API for performance.
         // This matters (at least that's what by benchmarks said).
@@ -962,86 +1339,338 @@ void ThreadingMsgListModel::applyThreading(const QVector<Imap::Responses::Thread
         Q_ASSERT(firstMessagePtr == firstMessageIndex.internalPointer());
         TreeItemMsgList *list = dynamic_cast<TreeItemMsgList *>(firstMessagePtr->parent());
         Q_ASSERT(list);
+        input->messages.reserve(upstreamMessages);
+        input->uids.reserve(upstreamMessages);
         for (int i = 0; i < upstreamMessages; ++i) {
-            ThreadNodeInfo node;
-            node.uid = dynamic_cast<TreeItemMessage *>(list->m_children[i])->uid();
-            if (! node.uid) {
+            const uint uid = static_cast<TreeItemMessage *>(list->m_children[i])->uid();
+            if (!uid) {
                 throw UnknownMessageIndex("Encountered a message with zero UID when threading. This is a bug in Trojita, sorry.");
             }
-
-            node.internalId = i + 1;
-            node.ptr = list->m_children[i];
-            uidToPtrCache[node.uid] = node.ptr;
-            threadingHelperLastId = node.internalId;
-            // We're creating a new node here
-            Q_ASSERT(!threading.contains(node.internalId));
-            threading[ node.internalId ] = node;
-            ptrToInternal[ node.ptr ] = node.internalId;
+            input->messages << list->m_children[i];
+            input->uids << uid;
         }
     }
 
-    // Mark the root node as always present
-    usedNodes.insert(0);
+    if (upstreamMessages < m_backgroundThreadingThreshold) {
+        swapInThreadTree(*buildThreadTree(*input));
+        // A background build of an older request might have been running
+        setThreadTreeInProgress(false);
+        return;
+    }
 
-    // Set up parents and find the list of all used nodes
-    registerThreading(mapping, 0, uidToPtrCache, usedNodes);
+    // The flat list, or whatever threading was shown before, remains usable until the new tree is ready
+    logTrace(QStringLiteral("Building the thread tree of %1 messages in the background").arg(upstreamMessages));
+    m_threadTreeStale = false;
+    setThreadTreeInProgress(true);
+    m_threadTreeWorker->request(input);
+}
 
-    // Now remove all messages which were not referenced in the THREAD response from our mapping
-    QHash<uint,ThreadNodeInfo>::iterator it = threading.begin();
-    while (it != threading.end()) {
-        if (usedNodes.contains(it.key())) {
-            // this message should be shown
-            ++it;
-        } else {
-            // this message is not included in the list of messages actually to be shown
-            ptrToInternal.remove(it->ptr);
-            it = threading.erase(it);
+void ThreadingMsgListModel::slotThreadTreeAvailable(const ThreadTreePtr &tree)
+{
+    if (m_threadTreeStale) {
+        // Some messages have arrived or vanished since the request, so the tree does not match the source rows anymore.
+        // Throwing it away would mean another expensive build, so bring it up to date instead.
+        m_threadTreeStale = false;
+        logTrace(QStringLiteral("The thread tree is out of date, updating it"));
+        reconcileThreadTree(*tree);
+    }
+
+    swapInThreadTree(*tree);
+    setThreadTreeInProgress(false);
+}
+
+/** @short Update a @arg tree which was built in the background to match the current rows of the source model
+
+Messages which have vanished in the meanwhile are removed the same way as when they get expunged, and new arrivals
+are appended as new thread roots, just like handleRowsInserted() does.
+*/
+void ThreadingMsgListModel::reconcileThreadTree(ThreadTree &tree)
+{
+    QSet<uint> snapshotUids;
+    snapshotUids.reserve(tree.uids.size());
+    Q_FOREACH(const uint uid, tree.uids) {
+        snapshotUids.insert(uid);
+    }
+
+    const int upstreamMessages = sourceModel()->rowCount();
+    QHash<uint, int> uidToRow;
+    uidToRow.reserve(upstreamMessages);
+    QVector<TreeItem *> rowToPtr(upstreamMessages);
+    for (int i = 0; i < upstreamMessages; ++i) {
+        QModelIndex index = sourceModel()->index(i, 0);
+        rowToPtr[i] = static_cast<TreeItem *>(index.internalPointer());
+        const uint uid = index.data(RoleMessageUid).toUInt();
+        if (uid)
+            uidToRow[uid] = i;
+    }
+
+    // The messages might have been replaced, so the mapping has to be rebuilt from scratch
+    tree.sourceItemToInternal.clear();
+    tree.sourceItemToInternal.reserve(upstreamMessages + headroomForNewmessages);
+    for (ThreadNodeArena::iterator it = tree.threading.begin(); it != tree.threading.end(); ++it) {
+        if (!it->ptr)
+            continue;
+        QHash<uint, int>::const_iterator row = uidToRow.constFind(it->uid);
+        if (row == uidToRow.constEnd()) {
+            // This one is gone; the pruning below takes care of the now-empty node
+            it->ptr = 0;
+            it->uid = 0;
+            tree.threading.invalidateAggregates(it.key());
+            continue;
         }
+        it->ptr = rowToPtr[*row];
+        tree.sourceItemToInternal[it->ptr] = it.key();
+    }
+
+    for (int i = 0; i < upstreamMessages; ++i) {
+        const uint uid = static_cast<TreeItemMessage *>(rowToPtr[i])->uid();
+        if (uid && snapshotUids.contains(uid))
+            continue;
+        // A new arrival; messages which were present, but not included in the threading, stay hidden
+        ThreadNodeInfo node;
+        node.internalId = ++tree.lastId;
+        node.uid = uid;
+        node.ptr = rowToPtr[i];
+        node.offset = tree.threading[0].children.size();
+        tree.threading[node.internalId] = node;
+        tree.threading[0].children << node.internalId;
+        tree.threading.invalidateAggregates(0);
+        tree.sourceItemToInternal[node.ptr] = node.internalId;
+        if (uid)
+            tree.threadedRootIds.append(node.internalId);
     }
-    pruneTree();
+
+    pruneThreadTree(tree.threading, tree.threadedRootIds);
+    tree.uids.clear();
+}
+
+/** @short Replace the current threading by the @arg tree in a single layout change
+
+The contents of the @arg tree are moved away.
+*/
+void ThreadingMsgListModel::swapInThreadTree(ThreadTree &tree)
+{
+    emit layoutAboutToBeChanged();
+    updatePersistentIndexesPhase1();
+    threading = std::move(tree.threading);
+    sourceItemToInternal = std::move(tree.sourceItemToInternal);
+    threadedRootIds = std::move(tree.threadedRootIds);
+    threadingHelperLastId = tree.lastId;
+    compactThreading();
     updatePersistentIndexesPhase2();
-    if (rowCount())
-        threadedRootIds = threading[0].children;
+    m_threadingApplied = true;
     emit layoutChanged();
 
     // If the sorting was active before, we shall reactivate it now
     searchSortPreferenceImplementation(m_currentSearchConditions, m_currentSortingCriteria, m_sortReverse ? Qt::DescendingOrder : Qt::AscendingOrder);
 }
 
-void ThreadingMsgListModel::registerThreading(const QVector<Imap::Responses::ThreadingNode> &mapping, uint parentId, const QHash<uint,void *> &uidToPtr, QSet<uint> &usedNodes)
-{
-    Q_FOREACH(const Imap::Responses::ThreadingNode &node, mapping) {
-        uint nodeId;
-        QHash<uint,void *>::const_iterator ptrIt;
-        if (node.num == 0 ||
-                (ptrIt = uidToPtr.find(node.num)) == uidToPtr.constEnd()) {
-            // Either this is an empty node, or the THREAD response references a UID which is no longer in the mailbox.
-            // This is a valid scenario; it can happen e.g. when reusing data from cache, or when a message got
-            // expunged after the untagged THREAD was received, but before the tagged OK.
-            // We cannot just ignore this node, though, because it might have some children which we would otherwise
-            // simply hide.
-            // The ptrIt which is initialized by the condition is used in the else branch.
-            ThreadNodeInfo fake;
-            fake.internalId = ++threadingHelperLastId;
-            fake.parent = parentId;
-            Q_ASSERT(threading.contains(parentId));
-            // The child will be registered to the list of parent's children after the if/else branch
-            threading[ fake.internalId ] = fake;
-            nodeId = fake.internalId;
-        } else {
-            QHash<void *,uint>::const_iterator nodeIt = ptrToInternal.constFind(*ptrIt);
-            // The following assert would fail if there was a node with a valid UID, but not in our ptrToInternal mapping.
-            // That is however non-issue, as we pre-create nodes for all messages beforehand.
-            Q_ASSERT(nodeIt != ptrToInternal.constEnd());
-            nodeId = *nodeIt;
-            // This is needed for the incremental stuff
-            threading[nodeId].ptr = static_cast<TreeItem*>(*ptrIt);
+void ThreadingMsgListModel::setThreadTreeInProgress(const bool inProgress)
+{
+    if (m_threadTreeInProgress == inProgress)
+        return;
+    m_threadTreeInProgress = inProgress;
+    emit threadingInProgressChanged(inProgress);
+}
+
+bool ThreadingMsgListModel::isThreadingInProgress() const
+{
+    return m_threadTreeInProgress;
+}
+
+void ThreadingMsgListModel::setBackgroundThreadingThreshold(const int messages)
+{
+    m_backgroundThreadingThreshold = messages;
+}
+
+QVector<Imap::Responses::ThreadingNode> ThreadingMsgListModel::currentThreadingMapping(const uint parentId) const
+{
+    QVector<Imap::Responses::ThreadingNode> res;
+
+    // Work with an explicit stack; the threads can get very deep. Each vector is filled in one go before its nodes are
+    // pushed, so the pointers to their children stay valid.
+    std::vector<std::pair<uint, QVector<Imap::Responses::ThreadingNode> *>> stack;
+    stack.emplace_back(parentId, &res);
+    while (!stack.empty()) {
+        const uint nodeId = stack.back().first;
+        QVector<Imap::Responses::ThreadingNode> &target = *stack.back().second;
+        stack.pop_back();
+
+        ThreadNodeArena::const_iterator nodeIt = threading.constFind(nodeId);
+        if (nodeIt == threading.constEnd())
+            continue;
+
+        // The order of thread roots might have been altered by sorting; the threading algorithm's one is remembered separately
+        const QList<uint> &children = nodeId == 0 ? threadedRootIds : nodeIt->children;
+        QVector<uint> childIds;
+        target.reserve(children.size());
+        childIds.reserve(children.size());
+        Q_FOREACH(const uint childId, children) {
+            ThreadNodeArena::const_iterator it = threading.constFind(childId);
+            if (it == threading.constEnd())
+                continue;
+            const uint uid = it->ptr ? static_cast<TreeItemMessage *>(it->ptr)->uid() : 0;
+            target.append(Imap::Responses::ThreadingNode(uid, QVector<Imap::Responses::ThreadingNode>()));
+            childIds.append(childId);
         }
-        threading[nodeId].offset = threading[parentId].children.size();
-        threading[ parentId ].children.append(nodeId);
-        threading[ nodeId ].parent = parentId;
-        usedNodes.insert(nodeId);
-        registerThreading(node.children, nodeId, uidToPtr, usedNodes);
+        for (int i = 0; i < childIds.size(); ++i)
+            stack.emplace_back(childIds[i], &target[i].children);
+    }
+    return res;
+}
+
+bool ThreadingMsgListModel::applyThreadingIncrementally(const QVector<Imap::Responses::ThreadingNode> &mapping)
+{
+    // The initial load goes through the full rebuild. So does a sorted or filtered view where the thread roots are not shown
+    // in the order of the threading algorithm.
+    if (!m_threadingApplied || m_filteredBySearch || m_currentSortingCriteria != SORT_NONE)
+        return false;
+
+    // Each message has to have a node, and there must not be any fake nodes waiting for pruneThreadTree()
+    const int upstreamMessages = sourceModel()->rowCount();
+    if (threading.size() != upstreamMessages + 1)
+        return false;
+
+    QHash<uint,uint> uidToInternal;
+    uidToInternal.reserve(upstreamMessages);
+    for (ThreadNodeArena::iterator it = threading.begin(); it != threading.end(); ++it) {
+        if (it.key() == 0)
+            continue;
+        if (!it->ptr)
+            return false;
+        // The UID of a new arrival might have been unknown when its node got created
+        it->uid = static_cast<TreeItemMessage *>(it->ptr)->uid();
+        if (!it->uid)
+            return false;
+        uidToInternal[it->uid] = it.key();
+    }
+
+    QVector<Imap::Responses::ThreadingNode> target;
+    pruneMapping(mapping, [&uidToInternal](const uint uid) { return uidToInternal.contains(uid); }, target);
+
+    // The new threading must cover exactly the messages which we have right now. Count the messages which change their parent
+    // along the way; if there are too many of them, a single layout change is cheaper than the individual moves.
+    int moves = 0;
+    QSet<uint> seen;
+    seen.reserve(upstreamMessages);
+    std::vector<std::pair<const Imap::Responses::ThreadingNode *, uint>> queue;
+    for (const auto &node : target)
+        queue.emplace_back(&node, 0);
+    while (!queue.empty()) {
+        const Imap::Responses::ThreadingNode *node = queue.back().first;
+        const uint parentId = queue.back().second;
+        queue.pop_back();
+        const uint internalId = uidToInternal[node->num];
+        if (seen.contains(internalId))
+            return false;
+        seen.insert(internalId);
+        if (threading[internalId].parent != parentId && ++moves > maxIncrementalThreadingMoves)
+            return false;
+        for (const auto &child : node->children)
+            queue.emplace_back(&child, internalId);
+    }
+    if (seen.size() != upstreamMessages)
+        return false;
+
+    logTrace(QStringLiteral("Updating the threading incrementally: %1 messages got a new parent").arg(moves));
+
+    // Thread roots are displayed in the reverse order when sorting in the descending order
+    QVector<Imap::Responses::ThreadingNode> targetRoots = target;
+    if (m_sortReverse)
+        std::reverse(targetRoots.begin(), targetRoots.end());
+
+    QSet<uint> changedThreads;
+    moveChildrenIntoPlace(0, targetRoots, uidToInternal, changedThreads);
+    Q_ASSERT(threading[0].children.size() == target.size());
+
+    threadedRootIds.clear();
+    for (const auto &node : target)
+        threadedRootIds.append(uidToInternal[node.num]);
+    calculateNullSort();
+
+    // The aggregated data of the thread roots, like the "this thread has unread messages", might have changed
+    changedThreads.remove(0);
+    QSet<uint> changedRoots;
+    Q_FOREACH(uint internalId, changedThreads) {
+        ThreadNodeArena::const_iterator it = threading.constFind(internalId);
+        while (it != threading.constEnd() && it->parent != 0)
+            it = threading.constFind(it->parent);
+        if (it != threading.constEnd())
+            changedRoots.insert(it->internalId);
+    }
+    Q_FOREACH(uint internalId, changedRoots) {
+        const int row = threading[internalId].offset;
+        emit dataChanged(createIndex(row, 0, internalId), createIndex(row, MsgListModel::COLUMN_COUNT - 1, internalId));
+    }
+    return true;
+}
+
+/** @short Make sure that the children of the parentId follow the target threading, and continue with the grandchildren
+
+Each parent is put into place before its children are, which means that none of the nodes which are moved under it can be
+its ancestors.
+*/
+void ThreadingMsgListModel::moveChildrenIntoPlace(const uint parentId, const QVector<Imap::Responses::ThreadingNode> &children,
+                                                  const QHash<uint,uint> &uidToInternal, QSet<uint> &changedThreads)
+{
+    // Work with an explicit stack; the threads can get very deep and we do not want to recurse that much
+    std::vector<std::pair<uint, const QVector<Imap::Responses::ThreadingNode> *>> stack;
+    stack.emplace_back(parentId, &children);
+    while (!stack.empty()) {
+        const uint nodeId = stack.back().first;
+        const QVector<Imap::Responses::ThreadingNode> &nodeChildren = *stack.back().second;
+        stack.pop_back();
+
+        for (int i = 0; i < nodeChildren.size(); ++i) {
+            const uint internalId = uidToInternal[nodeChildren[i].num];
+            const ThreadNodeInfo &parent = threading[nodeId];
+            if (i < parent.children.size() && parent.children[i] == internalId)
+                continue;
+            const uint oldParentId = threading[internalId].parent;
+            if (oldParentId != nodeId) {
+                changedThreads << oldParentId << nodeId << internalId;
+            }
+            moveThreadNode(internalId, nodeId, i);
+        }
+        // Visit the children in their order, the same as a recursive walk would
+        for (int i = nodeChildren.size() - 1; i >= 0; --i) {
+            stack.emplace_back(uidToInternal[nodeChildren[i].num], &nodeChildren[i].children);
+        }
+    }
+}
+
+/** @short Move a node along with its subtree so that it becomes the row-th child of newParentId */
+void ThreadingMsgListModel::moveThreadNode(const uint internalId, const uint newParentId, const int row)
+{
+    const uint oldParentId = threading[internalId].parent;
+    const int oldRow = threading[internalId].offset;
+    if (oldParentId == newParentId && oldRow == row)
+        return;
+
+    QModelIndex oldParent = oldParentId ? createIndex(threading[oldParentId].offset, 0, oldParentId) : QModelIndex();
+    QModelIndex newParent = newParentId ? createIndex(threading[newParentId].offset, 0, newParentId) : QModelIndex();
+    // Qt wants to know the destination row as it is before the move
+    const int destinationChild = (oldParentId == newParentId && row > oldRow) ? row + 1 : row;
+    const bool ok = beginMoveRows(oldParent, oldRow, oldRow, newParent, destinationChild);
+    Q_ASSERT(ok);
+    Q_UNUSED(ok);
+
+    threading.invalidateAggregates(oldParentId);
+    threading[oldParentId].children.removeAt(oldRow);
+    renumberChildren(oldParentId, oldRow);
+    threading[newParentId].children.insert(row, internalId);
+    threading[internalId].parent = newParentId;
+    renumberChildren(newParentId, row);
+    threading.invalidateAggregates(newParentId);
+
+    endMoveRows();
+}
+
+void ThreadingMsgListModel::renumberChildren(const uint parentId, const int firstRow)
+{
+    const QList<uint> &children = threading[parentId].children;
+    for (int i = firstRow; i < children.size(); ++i) {
+        threading[children[i]].offset = i;
     }
 }
 
@@ -1049,37 +1678,62 @@ void ThreadingMsgListModel::registerThreading(const QVector<Imap::Responses::Thr
 void ThreadingMsgListModel::updatePersistentIndexesPhase1()
 {
     oldPersistentIndexes = persistentIndexList();
-    oldPtrs.clear();
+    oldSourceItems.clear();
     Q_FOREACH(const QModelIndex &idx, oldPersistentIndexes) {
-        // the index could get invalidated by the pruneTree() or something else manipulating our threading
+        // the index could get invalidated by the pruneThreadTree() or something else manipulating our threading
         bool isOk = idx.isValid() && threading.contains(idx.internalId());
         if (!isOk) {
-            oldPtrs << 0;
+            oldSourceItems << nullptr;
             continue;
         }
         QModelIndex translated = mapToSource(idx);
         if (!translated.isValid()) {
             // another stale item
-            oldPtrs << 0;
+            oldSourceItems << nullptr;
             continue;
         }
-        oldPtrs << translated.internalPointer();
+        oldSourceItems << static_cast<TreeItem *>(translated.internalPointer());
     }
 }
 
+void ThreadingMsgListModel::compactThreading()
+{
+    if (!threading.isFragmented())
+        return;
+
+    const std::vector<uint> renumbered = threading.compact();
+    for (QHash<TreeItem *, uint>::iterator it = sourceItemToInternal.begin(); it != sourceItemToInternal.end(); ) {
+        const uint id = it.value() < renumbered.size() ? renumbered[it.value()] : 0;
+        if (id) {
+            it.value() = id;
+            ++it;
+        } else {
+            it = sourceItemToInternal.erase(it);
+        }
+    }
+    QList<uint> roots;
+    roots.reserve(threadedRootIds.size());
+    Q_FOREACH(const uint root, threadedRootIds) {
+        if (root < renumbered.size() && renumbered[root])
+            roots.append(renumbered[root]);
+    }
+    threadedRootIds = roots;
+    threadingHelperLastId = static_cast<uint>(threading.size()) - (threading.contains(0) ? 1 : 0);
+}
+
 /** @short Update the gathered persistent indexes after our change in the layout */
 void ThreadingMsgListModel::updatePersistentIndexesPhase2()
 {
-    Q_ASSERT(oldPersistentIndexes.size() == oldPtrs.size());
+    Q_ASSERT(oldPersistentIndexes.size() == oldSourceItems.size());
     QList<QModelIndex> updatedIndexes;
     for (int i = 0; i < oldPersistentIndexes.size(); ++i) {
-        QHash<void *,uint>::const_iterator ptrIt = ptrToInternal.constFind(oldPtrs[i]);
-        if (ptrIt == ptrToInternal.constEnd()) {
+        const uint internalId = oldSourceItems[i] ? sourceItemToInternal.value(oldSourceItems[i], 0) : 0;
+        if (!internalId) {
             // That message is no longer there
             updatedIndexes.append(QModelIndex());
             continue;
         }
-        QHash<uint,ThreadNodeInfo>::const_iterator it = threading.constFind(*ptrIt);
+        ThreadNodeArena::const_iterator it = threading.constFind(internalId);
         if (it == threading.constEnd()) {
             // Filtering doesn't accept this index, let's declare it dead
             updatedIndexes.append(QModelIndex());
@@ -1090,120 +1744,7 @@ void ThreadingMsgListModel::updatePersistentIndexesPhase2()
     Q_ASSERT(oldPersistentIndexes.size() == updatedIndexes.size());
     changePersistentIndexList(oldPersistentIndexes, updatedIndexes);
     oldPersistentIndexes.clear();
-    oldPtrs.clear();
-}
-
-void ThreadingMsgListModel::pruneTree()
-{
-    // Our mapping (threading) is completely unsorted, which means that we simply don't have any way of walking the tree from
-    // the top. Instead, we got to work with a random walk, processing nodes in an unspecified order.  If we iterated on the QHash
-    // directly, we'd hit an issue with iterator ordering (basically, we want to be able to say "hey, I don't care at which point
-    // of the iteration I'm right now, the next node to process should be that one, and then we should resume with the rest").
-    QList<uint> pending = threading.keys();
-
-    // These are the parents whose children will have to be renumbered later on
-    QSet<uint> parentsForRenumbering;
-
-    for (QList<uint>::iterator id = pending.begin(); id != pending.end(); /* nothing */) {
-        // Convert to the hashmap
-        // The "it" iterator point to the current node in the threading mapping
-        QHash<uint, ThreadNodeInfo>::iterator it = threading.find(*id);
-        if (it == threading.end()) {
-            // We've already seen this node, that's due to promoting
-            ++id;
-            continue;
-        }
-
-        if (it->internalId == 0) {
-            // A special root item; we should not delete that one :)
-            ++id;
-            continue;
-        }
-        if (it->ptr) {
-            // regular and valid message -> skip
-            ++id;
-        } else {
-            // a fake one
-
-            // each node has a parent
-            QHash<uint, ThreadNodeInfo>::iterator parent = threading.find(it->parent);
-            Q_ASSERT(parent != threading.end());
-
-            // and the node itself has to be found in its parent's children
-            QList<uint>::iterator childIt = qFind(parent->children.begin(), parent->children.end(), it->internalId);
-            Q_ASSERT(childIt != parent->children.end());
-            // The offset of this child might no longer be correct, though -- we're postponing the actual deletion until later
-
-            if (it->children.isEmpty()) {
-                // This is a leaf node, so we can just remove it
-                childIt = parent->children.erase(childIt);
-                // We do not perform the renumbering immediately, that would lead to an O(n^2) performance when deleting nodes.
-                parentsForRenumbering.insert(it->parent);
-                parentsForRenumbering.remove(it->internalId);
-
-                if (it->parent == 0) {
-                    threadedRootIds.removeOne(it->internalId);
-                }
-                threading.erase(it);
-                ++id;
-
-            } else {
-                // This node has some children, so we can't just delete it. Instead of that, we promote its first child
-                // to replace this node.
-                QHash<uint, ThreadNodeInfo>::iterator replaceWith = threading.find(it->children.first());
-                Q_ASSERT(replaceWith != threading.end());
-
-                // The offsets will, again, be updated later on
-                parentsForRenumbering.insert(it->parent);
-                parentsForRenumbering.insert(replaceWith.key());
-                parentsForRenumbering.remove(it->internalId);
-
-                // Replace the node
-                *childIt = it->children.first();
-                replaceWith->parent = parent->internalId;
-
-                // Now merge the lists of children
-                it->children.removeFirst();
-                replaceWith->children = replaceWith->children + it->children;
-
-                // Fix parent information of all children of the replacement node
-                for (int i = 0; i < replaceWith->children.size(); ++i) {
-                    QHash<uint, ThreadNodeInfo>::iterator sibling = threading.find(replaceWith->children[i]);
-                    Q_ASSERT(sibling != threading.end());
-                    sibling->parent = replaceWith.key();
-                }
-
-                if (parent->internalId == 0) {
-                    // Update the list of all thread roots
-                    QList<uint>::iterator rootIt = qFind(threadedRootIds.begin(), threadedRootIds.end(), it->internalId);
-                    if (rootIt != threadedRootIds.end())
-                        *rootIt = replaceWith->internalId;
-                }
-
-                // Now that all references are gone, remove the original node
-                threading.erase(it);
-
-                if (!replaceWith->ptr) {
-                    // If the just-promoted item is also a fake one, we'll have to visit it as well. This assignment is safe,
-                    // because we've already processed the current item and are completely done with it. The worst which can
-                    // happen is that we'll visit the same node twice, which is reasonably acceptable.
-                    *id = replaceWith.key();
-                }
-            }
-        }
-    }
-
-    // Now fix the sequential numbering of all siblings of deleted children
-    Q_FOREACH(const auto parentId, parentsForRenumbering) {
-        auto parentIt = threading.constFind(parentId);
-        Q_ASSERT(parentIt != threading.constEnd());
-        int offset = 0;
-        for (auto childNumber = parentIt->children.constBegin(); childNumber != parentIt->children.constEnd(); ++childNumber, ++offset) {
-            auto childIt = threading.find(*childNumber);
-            Q_ASSERT(childIt != threading.end());
-            childIt->offset = offset;
-        }
-    }
+    oldSourceItems.clear();
 }
 
 QStringList ThreadingMsgListModel::supportedCapabilities()
@@ -1228,61 +1769,80 @@ QMimeData *ThreadingMsgListModel::mimeData(const QModelIndexList &indexes) const
     return sourceModel()->mimeData(translated);
 }
 
-template<typename T>
-bool threadForeachCallback(std::function<T(const TreeItemMessage &)> callback, const TreeItemMessage &message)
-{
-    callback(message);
-    return false;
-}
-template<>
-bool threadForeachCallback<const bool>(std::function<const bool(const TreeItemMessage &)> callback, const TreeItemMessage &message)
-{
-    return callback(message);
-}
-
-/** @short Execute the provided function once for each message
+/** @short Return the summary of the whole subtree
 
-Returns immediately if the provided function returns `true`.
+The results are cached in the thread nodes. Only those nodes which were invalidated since the last call are visited, which
+means that a FLAGS update of a single message costs one pass along its ancestors instead of a walk through the whole thread.
 */
-template<typename T>
-void ThreadingMsgListModel::threadForeach(const uint &root, std::function<T(const TreeItemMessage &)> callback) const
-{
-    QList<uint> queue;
-    queue.append(root);
-    while (! queue.isEmpty()) {
-        uint current = queue.takeFirst();
-        QHash<uint,ThreadNodeInfo>::const_iterator it = threading.constFind(current);
+const ThreadAggregate &ThreadingMsgListModel::threadAggregate(const uint root) const
+{
+    // Work with an explicit stack; the threads can get very deep and we do not want to recurse that much
+    std::vector<uint> stack;
+    stack.push_back(root);
+    while (!stack.empty()) {
+        ThreadNodeArena::const_iterator it = threading.constFind(stack.back());
         Q_ASSERT(it != threading.constEnd());
+        if (it->aggregate.valid) {
+            stack.pop_back();
+            continue;
+        }
+
+        bool childrenReady = true;
+        Q_FOREACH(const uint childId, it->children) {
+            ThreadNodeArena::const_iterator child = threading.constFind(childId);
+            Q_ASSERT(child != threading.constEnd());
+            if (!child->aggregate.valid) {
+                stack.push_back(childId);
+                childrenReady = false;
+            }
+        }
+        if (!childrenReady)
+            continue;
+        stack.pop_back();
+
+        ThreadAggregate &aggregate = it->aggregate;
+        aggregate = ThreadAggregate();
+        // Because of the delayed delete via pruneThreadTree(), we can hit a null pointer here
         if (it->ptr) {
-            // Because of the delayed delete via pruneTree, we can hit a null pointer here
-            TreeItemMessage *message = dynamic_cast<TreeItemMessage *>(it->ptr);
-            Q_ASSERT(message);
-            if (threadForeachCallback(callback, *message))
-                return;
+            const TreeItemMessage *message = static_cast<const TreeItemMessage *>(it->ptr);
+            aggregate.messages = 1;
+            aggregate.unread = message->isMarkedAsRead() ? 0 : 1;
+            aggregate.flagged = message->isMarkedAsFlagged() ? 1 : 0;
+            aggregate.flags = message->m_flags;
+            // Only use what is already available, asking for the envelope would trigger a fetch
+            if (message->m_data && message->m_data->gotEnvelope() && message->m_data->envelope().date.isValid()) {
+                aggregate.newest = message->m_data->envelope().date.toMSecsSinceEpoch();
+            } else if (message->m_data && message->m_data->gotInternalDate() && message->m_data->internalDate().isValid()) {
+                aggregate.newest = message->m_data->internalDate().toMSecsSinceEpoch();
+            }
+        }
+        bool extraFlags = false;
+        Q_FOREACH(const uint childId, it->children) {
+            const ThreadAggregate &child = threading.constFind(childId)->aggregate;
+            aggregate.messages += child.messages;
+            aggregate.unread += child.unread;
+            aggregate.flagged += child.flagged;
+            aggregate.newest = qMax(aggregate.newest, child.newest);
+            if (!child.flags.isEmpty()) {
+                aggregate.flags += child.flags;
+                extraFlags = true;
+            }
         }
-        queue.append(it->children);
+        if (extraFlags)
+            aggregate.flags.removeDuplicates();
+        aggregate.valid = true;
     }
+    return threading.constFind(root)->aggregate;
 }
 
 bool ThreadingMsgListModel::threadContainsUnreadMessages(const uint root) const
 {
-    // FIXME: cache the value somewhere...
-    bool containsUnreadMessages = false;
-    threadForeach<bool>(root, [&containsUnreadMessages](const TreeItemMessage &message) -> bool {
-        return containsUnreadMessages = ! message.isMarkedAsRead();
-    });
-    return containsUnreadMessages;
+    return threadAggregate(root).unread > 0;
 }
 
 QStringList ThreadingMsgListModel::threadAggregatedFlags(const uint root) const
 {
-    // FIXME: cache the value somewhere...
-    QStringList aggregatedFlags;
-    threadForeach<void>(root, [&aggregatedFlags](const TreeItemMessage &message) {
-        aggregatedFlags += message.m_flags;
-    });
-    aggregatedFlags.removeDuplicates();
-    return aggregatedFlags;
+    return threadAggregate(root).flags;
 }
 
 /** @short Pass a debugging message to the real Model, if possible
@@ -1387,6 +1947,9 @@ bool ThreadingMsgListModel::searchSortPreferenceImplementation(const QStringList
         sortOptions << (hasDisplaySort ? QStringLiteral("DISPLAYTO") : QStringLiteral("TO"));
         break;
     case SORT_NONE:
+        // Whatever the client-side sorting is doing right now is no longer interesting
+        m_localSorting->invalidate();
+
         if (m_sortTask && m_sortTask->isPersistent() &&
                 (m_currentSearchConditions != searchConditions || m_currentSortingCriteria != criterium)) {
             // Any change shall result in us killing that sort task
@@ -1404,14 +1967,36 @@ bool ThreadingMsgListModel::searchSortPreferenceImplementation(const QStringList
             return true;
         } else if (searchConditions != m_currentSearchConditions || m_searchValidity != RESULT_FRESH) {
             // We have to update our search conditions
+            m_currentSearchConditions = searchConditions;
+            m_filteredBySearch = true;
+
+            // The full-text index of the cache is all we have when offline. Servers without SEARCH=FUZZY are still asked,
+            // but the local result is shown in the meanwhile because it arrives much sooner.
+            Imap::Uids localResult;
+            bool haveLocalResult = false;
+            if (!realModel->isNetworkAvailable() || !realModel->capabilities().contains(QStringLiteral("SEARCH=FUZZY"))) {
+                haveLocalResult = realModel->cache()->searchMessages(mailboxIndex.data(RoleMailboxName).toString(),
+                                                                     searchConditions, localResult);
+            }
+            m_searchResultIsOffline = !realModel->isNetworkAvailable();
+            if (haveLocalResult && !realModel->isNetworkAvailable()) {
+                logTrace(QStringLiteral("Offline search: %1 matching messages in the local index").arg(localResult.size()));
+                m_currentSortResult = localResult;
+                m_searchValidity = RESULT_FRESH;
+                wantThreading();
+                return true;
+            }
+
             m_sortTask = realModel->m_taskFactory->createSortTask(const_cast<Model *>(realModel), mailboxIndex, searchConditions,
                                                                   QStringList());
             connect(m_sortTask.data(), &SortTask::sortingAvailable, this, &ThreadingMsgListModel::slotSortingAvailable);
             connect(m_sortTask.data(), &SortTask::sortingFailed, this, &ThreadingMsgListModel::slotSortingFailed);
             connect(m_sortTask.data(), &SortTask::incrementalSortUpdate, this, &ThreadingMsgListModel::slotSortingIncrementalUpdate);
-            m_currentSearchConditions = searchConditions;
-            m_filteredBySearch = true;
             m_searchValidity = RESULT_ASKED;
+            if (haveLocalResult) {
+                m_currentSortResult = localResult;
+                applySort();
+            }
         } else {
             // A result of SEARCH has just arrived
             Q_ASSERT(m_searchValidity == RESULT_FRESH);
@@ -1421,30 +2006,50 @@ bool ThreadingMsgListModel::searchSortPreferenceImplementation(const QStringList
         return true;
     }
 
-    if (!hasSort) {
-        // sorting is completely unsupported
-        return false;
-    }
-
     Q_ASSERT(!sortOptions.isEmpty());
 
     if (m_currentSortingCriteria == criterium && m_currentSearchConditions == searchConditions &&
             m_searchValidity != RESULT_INVALIDATED) {
         applySort();
     } else {
+        // The cached envelopes can be sorted locally. That is all we have when the server cannot sort. In big mailboxes,
+        // it is also much faster than the server's SORT, so the local result is shown until the server answers.
+        const bool canAskServer = hasSort && realModel->isNetworkAvailable();
+        bool canSortLocally = !canAskServer || sourceModel()->rowCount() >= localSortingPreviewThreshold;
+        Imap::Uids localSearchResult;
+        if (canSortLocally && !searchConditions.isEmpty()) {
+            canSortLocally = realModel->cache()->searchMessages(mailboxIndex.data(RoleMailboxName).toString(),
+                                                                searchConditions, localSearchResult);
+        }
+        if (!canAskServer && !canSortLocally) {
+            // sorting is completely unsupported
+            return false;
+        }
+
         m_currentSearchConditions = searchConditions;
         m_filteredBySearch = ! searchConditions.isEmpty();
         m_currentSortingCriteria = criterium;
+        m_searchResultIsOffline = !realModel->isNetworkAvailable();
         calculateNullSort();
         applySort();
 
         if (m_sortTask && m_sortTask->isPersistent())
             m_sortTask->cancelSortingUpdates();
 
-        m_sortTask = realModel->m_taskFactory->createSortTask(const_cast<Model *>(realModel), mailboxIndex, searchConditions, sortOptions);
-        connect(m_sortTask.data(), &SortTask::sortingAvailable, this, &ThreadingMsgListModel::slotSortingAvailable);
-        connect(m_sortTask.data(), &SortTask::sortingFailed, this, &ThreadingMsgListModel::slotSortingFailed);
-        connect(m_sortTask.data(), &SortTask::incrementalSortUpdate, this, &ThreadingMsgListModel::slotSortingIncrementalUpdate);
+        if (canSortLocally) {
+            m_localSortingFilter.clear();
+            for (const uint uid : localSearchResult)
+                m_localSortingFilter.insert(uid);
+            m_localSortingIsFinal = !canAskServer;
+            askForLocalSorting(realModel, mailboxIndex, criterium);
+        }
+
+        if (canAskServer) {
+            m_sortTask = realModel->m_taskFactory->createSortTask(const_cast<Model *>(realModel), mailboxIndex, searchConditions, sortOptions);
+            connect(m_sortTask.data(), &SortTask::sortingAvailable, this, &ThreadingMsgListModel::slotSortingAvailable);
+            connect(m_sortTask.data(), &SortTask::sortingFailed, this, &ThreadingMsgListModel::slotSortingFailed);
+            connect(m_sortTask.data(), &SortTask::incrementalSortUpdate, this, &ThreadingMsgListModel::slotSortingIncrementalUpdate);
+        }
         m_searchValidity = RESULT_ASKED;
     }
 
@@ -1482,16 +2087,16 @@ void ThreadingMsgListModel::applySort()
             continue;
         }
         Q_ASSERT(messages.size() == 1);
-        QHash<void *,uint>::const_iterator it = ptrToInternal.constFind(messages.front());
+        const uint internalId = sourceItemToInternal.value(messages.front(), 0);
         // else applyThreading() taking care of it
         if (!threadingInFlight)
-            Q_ASSERT(it != ptrToInternal.constEnd());
-        if (!allRootIds.contains(*it)) {
+            Q_ASSERT(internalId);
+        if (!internalId || !allRootIds.contains(internalId)) {
             // not a thread root, so don't show it
             continue;
         }
-        threading[*it].offset = threading[0].children.size();
-        threading[0].children.append(*it);
+        threading[internalId].offset = threading[0].children.size();
+        threading[0].children.append(internalId);
     }
 
     // Now remove everything which is no longer reachable from the root of the thread mapping
@@ -1501,12 +2106,13 @@ void ThreadingMsgListModel::applySort()
     }
     std::vector<uint> queue(newlyUnreachable.constBegin(), newlyUnreachable.constEnd());
     for (std::vector<uint>::size_type i = 0; i < queue.size(); ++i) {
-        QHash<uint,ThreadNodeInfo>::iterator threadingIt = threading.find(queue[i]);
+        ThreadNodeArena::iterator threadingIt = threading.find(queue[i]);
         Q_ASSERT(threadingIt != threading.end());
         queue.insert(queue.end(), threadingIt->children.constBegin(), threadingIt->children.constEnd());
         threading.erase(threadingIt);
     }
 
+    compactThreading();
     updatePersistentIndexesPhase2();
     emit layoutChanged();
 }
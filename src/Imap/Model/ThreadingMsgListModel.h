@@ -27,7 +27,10 @@
 #include <QAbstractProxyModel>
 #include <QPointer>
 #include <QSet>
+#include "Cache.h"
 #include "MailboxTree.h"
+#include "ThreadNodeArena.h"
+#include "ThreadTreeBuilder.h"
 #include "Imap/Parser/Response.h"
 
 class QTimer;
@@ -41,27 +44,12 @@ namespace Imap
 namespace Mailbox
 {
 
+class LocalSortingWorker;
+class LocalThreadingWorker;
 class SortTask;
 class TreeItem;
 class TreeItemMsgList;
 
-/** @short A node in tree structure used for threading representation */
-struct ThreadNodeInfo {
-    /** @short Internal unique identifier used for model indexes */
-    uint internalId;
-    /** @short A UID of the message in a mailbox */
-    uint uid;
-    /** @short internalId of a parent of this message */
-    uint parent;
-    /** @short List of children of current node */
-    QList<uint> children;
-    /** @short Pointer to the TreeItemMessage* of the corresponding message */
-    TreeItem *ptr;
-    /** @short Position among our parent's children */
-    int offset;
-    ThreadNodeInfo(): internalId(0), uid(0), parent(0), ptr(0), offset(0) {}
-};
-
 QDebug operator<<(QDebug debug, const ThreadNodeInfo &node);
 
 /** @short A model implementing view of the whole IMAP server
@@ -76,7 +64,7 @@ available via the MVC API will always be non-zero.
 
 The model should also refrain from sending extra THREAD commands to the server, and cache the responses locally.  This is pretty easy for
 message deletions, as it should be only a matter of replacing some node in the threading info with a fake ThreadNodeInfo node and running
-the pruneTree() method, except that we might not know the UID of the message in question, and hence can't know what to delete.
+the pruneThreadTree() function, except that we might not know the UID of the message in question, and hence can't know what to delete.
 
 */
 class ThreadingMsgListModel: public QAbstractProxyModel
@@ -151,8 +139,28 @@ public:
 
     QStringList currentSearchCondition() const;
     SortCriterium currentSortCriterium() const;
+
+    /** @short Envelopes of the messages in the current mailbox which are already known locally
+
+    The data come from the tree or from the cache, nothing is fetched from the server. Only messages whose UID is higher than
+    @arg newerThan, and those listed in the sorted @arg alsoWanted, are included. New arrivals are always at the end of the
+    list, so only its tail is visited. If the tail contains messages whose UIDs are not known yet, @arg sawUnknownUids is set.
+    */
+    QVector<AbstractCache::MessageDataBundle> cachedMessageMetadata(const uint newerThan, const Imap::Uids &alsoWanted,
+                                                                    bool *sawUnknownUids) const;
+    /** @short Internal IDs of the thread nodes of the given messages and of all their ancestors
+
+    These IDs are the internalId() of the corresponding indexes. They are only valid until the next change of the layout.
+    */
+    QSet<uint> threadNodesWithAncestors(const QSet<uint> &uids) const;
     Q_INVOKABLE Qt::SortOrder currentSortOrder() const;
 
+    /** @short Is the thread tree being built in the background right now? */
+    bool isThreadingInProgress() const;
+
+    /** @short Build the thread tree in the background when the mailbox has at least @arg messages messages */
+    void setBackgroundThreadingThreshold(const int messages);
+
 public slots:
     void resetMe();
     void handleDataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight);
@@ -187,10 +195,24 @@ public slots:
     void slotIncrementalThreadingAvailable(const Responses::ESearch::IncrementalThreadingData_t &data);
     void slotIncrementalThreadingFailed();
 
+    /** @short The client-side threading has finished */
+    void slotLocalThreadingAvailable(const QVector<Imap::Responses::ThreadingNode> &mapping);
+
+    /** @short The client-side sorting has finished */
+    void slotLocalSortingAvailable(const Imap::Uids &uids);
+
+    /** @short The thread tree has been built in the background */
+    void slotThreadTreeAvailable(const Imap::Mailbox::ThreadTreePtr &tree);
+
     void delayedPrune();
+    void slotLocalMetadataArrived();
+    /** @short Ask the server again for whatever was computed from the local cache while offline */
+    void slotNetworkPolicyChanged();
 
 signals:
     void sortingFailed();
+    /** @short The thread tree has started or finished being built in the background */
+    void threadingInProgressChanged(bool inProgress);
 
 private:
     /** @short Display messages without any threading at all, as a liner list */
@@ -202,8 +224,24 @@ private:
     */
     void askForThreading(const uint firstUnknownUid = 0);
 
+    /** @short Compute the threading from the cached data when the server cannot do that */
+    void askForLocalThreading(const Model *realModel, const QModelIndex &mailboxIndex, const uint firstUnknownUid);
+
+    /** @short Sort the cached envelopes on a background thread */
+    void askForLocalSorting(const Model *realModel, const QModelIndex &mailboxIndex, const SortCriterium criterium);
+
+    /** @short Envelopes of the @arg messages, from the tree or from the cache
+
+    UIDs of messages which are known neither to the tree nor to the cache are added to @arg missing.
+    */
+    static QVector<AbstractCache::MessageDataBundle> messageMetadata(const Model *realModel, TreeItemMailbox *mailbox,
+                                                                     const QList<TreeItemMessage*> &messages,
+                                                                     Imap::Uids *missing = nullptr);
+
     void updatePersistentIndexesPhase1();
     void updatePersistentIndexesPhase2();
+    /** @short Get rid of the slots of the erased nodes; only valid between the two phases above */
+    void compactThreading();
 
     /** @short Shall we ask for SORT/SEARCH automatically? */
     typedef enum {
@@ -214,18 +252,30 @@ private:
     /** @short Apply cached THREAD response or ask for threading again */
     void wantThreading(const SkipSortSearch skipSortSearch = AUTO_SORT_SEARCH);
 
-    /** @short Convert the threading from a THREAD response and apply that threading to this model */
-    void registerThreading(const QVector<Imap::Responses::ThreadingNode> &mapping, uint parentId,
-                           const QHash<uint,void *> &uidToPtr, QSet<uint> &usedNodes);
-
     bool searchSortPreferenceImplementation(const QStringList &searchConditions, const SortCriterium criterium,
                                             const Qt::SortOrder order = Qt::AscendingOrder);
 
-    /** @short Remove fake messages from the threading tree */
-    void pruneTree();
+    /** @short Show the freshly built thread tree */
+    void reconcileThreadTree(ThreadTree &tree);
+    void swapInThreadTree(ThreadTree &tree);
+    void setThreadTreeInProgress(const bool inProgress);
+
+    /** @short Turn the current tree into the threading mapping in the THREAD response format */
+    QVector<Imap::Responses::ThreadingNode> currentThreadingMapping(const uint parentId) const;
 
-    /** @short Execute the provided function once for each message */
-    template<typename T> void threadForeach(const uint &root, std::function<T(const TreeItemMessage &)> callback) const;
+    /** @short Update an already threaded tree through row moves instead of rebuilding the whole layout
+
+    Returns false if the new threading differs too much or if the current tree cannot be reused. The caller is
+    expected to fall back to a full rebuild in that case.
+    */
+    bool applyThreadingIncrementally(const QVector<Imap::Responses::ThreadingNode> &mapping);
+    void moveChildrenIntoPlace(const uint parentId, const QVector<Imap::Responses::ThreadingNode> &children,
+                               const QHash<uint,uint> &uidToInternal, QSet<uint> &changedThreads);
+    void moveThreadNode(const uint internalId, const uint newParentId, const int row);
+    void renumberChildren(const uint parentId, const int firstRow);
+
+    /** @short Return the summary of the whole subtree, recomputing the stale parts of it on the fly */
+    const ThreadAggregate &threadAggregate(const uint root) const;
 
     /** @short Check current thread for "unread messages" */
     bool threadContainsUnreadMessages(const uint root) const;
@@ -250,14 +300,18 @@ private:
     ThreadingMsgListModel &operator=(const ThreadingMsgListModel &);  // don't implement
     ThreadingMsgListModel(const ThreadingMsgListModel &);  // don't implement
 
-    /** @short Mapping from the upstream model's internalId to ThreadingMsgListModel's internal IDs */
-    QHash<void *,uint> ptrToInternal;
+    /** @short Mapping from the messages of the upstream model to ThreadingMsgListModel's internal IDs
+
+    The messages are identified by their TreeItem so that nothing has to be shifted when the upstream rows move around.
+    The way back is through ThreadNodeInfo::ptr.
+    */
+    QHash<TreeItem *, uint> sourceItemToInternal;
 
     /** @short Tree for the threading
 
     This tree is indexed by our internal ID.
     */
-    QHash<uint,ThreadNodeInfo> threading;
+    ThreadNodeArena threading;
 
     /** @short Last assigned internal ID */
     uint threadingHelperLastId;
@@ -277,11 +331,51 @@ private:
     bool modelResetInProgress;
 
     QModelIndexList oldPersistentIndexes;
-    QList<void *> oldPtrs;
+    QList<TreeItem *> oldSourceItems;
+
+    /** @short Is the tree the result of applyThreading(), as opposed to the flat list from updateNoThreading()? */
+    bool m_threadingApplied;
 
     /** @short There's a pending THREAD command for which we haven't received data yet */
     bool threadingInFlight;
 
+    /** @short The client-side threading which runs in the background */
+    LocalThreadingWorker *m_localThreading;
+
+    /** @short Does the client-side threading know about all messages up to the last one which was threaded? */
+    bool m_localThreadingPrimed;
+
+    /** @short Messages which the client-side threading had to leave out because their envelopes were not available */
+    QSet<uint> m_localThreadingMissing;
+
+    /** @short The client-side sorting which runs in the background */
+    LocalSortingWorker *m_localSorting;
+
+    /** @short Does the client-side sorter have the keys of all messages up to m_localSortingHighestUid? */
+    bool m_localSortingPrimed;
+    uint m_localSortingHighestUid;
+
+    /** @short Is the client-side sorting the only one, or is it just a preview of the server's SORT? */
+    bool m_localSortingIsFinal;
+
+    /** @short Messages which the client-side sorting had to sort without their envelopes */
+    QSet<uint> m_localSortingMissing;
+
+    /** @short Messages to show from the client-side sorting when the mailbox is filtered by a search */
+    QSet<uint> m_localSortingFilter;
+
+    /** @short Builds the thread trees of big mailboxes in the background */
+    ThreadTreeWorker *m_threadTreeWorker;
+
+    /** @short Is there a thread tree being built in the background? */
+    bool m_threadTreeInProgress;
+
+    /** @short Have the source rows changed since the thread tree which is being built was requested? */
+    bool m_threadTreeStale;
+
+    /** @short Mailboxes with at least this many messages are threaded in the background */
+    int m_backgroundThreadingThreshold;
+
     /** @short Is threading enabled, or shall we just use other features like sorting and filtering? */
     bool m_shallBeThreading;
 
@@ -317,8 +411,12 @@ private:
     } ResultValidity;
 
     ResultValidity m_searchValidity;
+    /** @short Was the current result of SEARCH/SORT requested while the network was offline? */
+    bool m_searchResultIsOffline;
 
     QTimer *m_delayedPrune;
+    /** @short Update the client-side threading and sorting once the missing metadata have arrived */
+    QTimer *m_localMetadataArrived;
 
     friend class ::ImapModelThreadingTest; // needs access to wantThreading();
 };
@@ -106,6 +106,7 @@ void FileDownloadManager::downloadPart()
     url.setPath(partIndex.data(Imap::Mailbox::RolePartPathToPart).toString());
     request.setUrl(url);
     reply = manager->get(request);
+    connect(reply, &QIODevice::readyRead, this, &FileDownloadManager::onPartDataAvailable);
     connect(reply, &QNetworkReply::finished, this, &FileDownloadManager::onPartDataTransfered);
     connect(reply, static_cast<void (QNetworkReply::*)(QNetworkReply::NetworkError)>(&QNetworkReply::error),
             this, &FileDownloadManager::onReplyTransferError);
@@ -137,15 +138,47 @@ void FileDownloadManager::downloadMessage()
     m_combiner->load();
 }
 
+/** @short Write whatever has arrived so far, large parts are delivered in chunks */
+void FileDownloadManager::onPartDataAvailable()
+{
+    Q_ASSERT(reply);
+    if (reply->isFinished() || reply->error() != QNetworkReply::NoError)
+        return;
+    if (!saving.isOpen() && !saving.open(QIODevice::WriteOnly)) {
+        emit transferError(saving.errorString());
+        return;
+    }
+    if (!copyAvailableData()) {
+        emit transferError(saving.errorString());
+        return;
+    }
+}
+
+/** @short Move everything which the reply has got into the file
+
+The data are passed in small blocks, so that saving a big part which is mapped from the disk cache doesn't require
+a copy of the whole thing in memory.
+*/
+bool FileDownloadManager::copyAvailableData()
+{
+    char buf[64 * 1024];
+    qint64 size;
+    while ((size = reply->read(buf, sizeof(buf))) > 0) {
+        if (saving.write(buf, size) != size)
+            return false;
+    }
+    return true;
+}
+
 void FileDownloadManager::onPartDataTransfered()
 {
     Q_ASSERT(reply);
     if (reply->error() == QNetworkReply::NoError) {
-        if (!saving.open(QIODevice::WriteOnly)) {
+        if (!saving.isOpen() && !saving.open(QIODevice::WriteOnly)) {
             emit transferError(saving.errorString());
             return;
         }
-        if (saving.write(reply->readAll()) == -1) {
+        if (!copyAvailableData()) {
             emit transferError(saving.errorString());
             return;
         }
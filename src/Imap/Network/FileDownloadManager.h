@@ -48,6 +48,7 @@ public:
     FileDownloadManager(QObject *parent, Imap::Network::MsgPartNetAccessManager *manager, const QUrl &url, const QModelIndex &relativeRoot);
     static QString toRealFileName(const QModelIndex &index);
 private slots:
+    void onPartDataAvailable();
     void onPartDataTransfered();
     void onReplyTransferError();
     void onCombinerTransferError(const QString &message);
@@ -62,6 +63,8 @@ signals:
     void succeeded();
     void cancelled();
 private:
+    bool copyAvailableData();
+
     Imap::Network::MsgPartNetAccessManager *manager;
     QPersistentModelIndex partIndex;
     QNetworkReply *reply;
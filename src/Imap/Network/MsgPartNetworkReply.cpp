@@ -36,7 +36,7 @@ namespace Network
 {
 
 MsgPartNetworkReply::MsgPartNetworkReply(MsgPartNetAccessManager *parent, const QPersistentModelIndex &part):
-    QNetworkReply(parent), part(part)
+    QNetworkReply(parent), part(part), announcedSize(0)
 {
     QUrl url;
     url.setScheme(QStringLiteral("trojita-imap"));
@@ -49,13 +49,13 @@ MsgPartNetworkReply::MsgPartNetworkReply(MsgPartNetAccessManager *parent, const
 
     connect(part.model(), &QAbstractItemModel::dataChanged, this, &MsgPartNetworkReply::slotModelDataChanged);
 
-    // We have to ask for contents before we check whether it's already fetched
-    part.data(Imap::Mailbox::RolePartData);
+    // We have to ask for contents before we check whether it's already fetched. The buffer is accessed directly, without
+    // any copying, so that big parts which are mapped from the disk cache do not occupy any extra memory.
+    QByteArray* bufferPtr = part.data(Imap::Mailbox::RolePartBufferPtr).value<QByteArray*>();
 
     // The part data might be already unavailable or already fetched
     QTimer::singleShot(0, this, SLOT(slotMyDataChanged()));
 
-    QByteArray* bufferPtr = part.data(Imap::Mailbox::RolePartBufferPtr).value<QByteArray*>();
     Q_ASSERT(bufferPtr);
     buffer.setBuffer(bufferPtr);
     buffer.open(QIODevice::ReadOnly);
@@ -93,9 +93,27 @@ void MsgPartNetworkReply::slotMyDataChanged()
         return;
     }
 
-    if (!part.data(Mailbox::RoleIsFetched).toBool())
+    if (!part.data(Mailbox::RoleIsFetched).toBool()) {
+        // Large parts are downloaded in chunks, so there might be something to pass along already
+        disconnectBufferIfVanished();
+        if (buffer.isOpen() && buffer.size() > announcedSize) {
+            if (!announcedSize)
+                setContentTypeHeader();
+            announcedSize = buffer.size();
+            emit downloadProgress(announcedSize, part.data(Mailbox::RolePartOctets).toLongLong());
+            emit readyRead();
+        }
         return;
+    }
 
+    setContentTypeHeader();
+    setFinished(true);
+    emit readyRead();
+    emit finished();
+}
+
+void MsgPartNetworkReply::setContentTypeHeader()
+{
     MsgPartNetAccessManager *netAccess = qobject_cast<MsgPartNetAccessManager*>(manager());
     Q_ASSERT(netAccess);
     QString mimeType = netAccess->translateToSupportedMimeType(part.data(Mailbox::RolePartMimeType).toString());
@@ -107,9 +125,6 @@ void MsgPartNetworkReply::slotMyDataChanged()
     } else {
         setHeader(QNetworkRequest::ContentTypeHeader, mimeType);
     }
-    setFinished(true);
-    emit readyRead();
-    emit finished();
 }
 
 /** @short QIODevice compatibility */
@@ -49,9 +49,12 @@ protected:
     virtual qint64 readData(char *data, qint64 maxSize);
 private:
     void disconnectBufferIfVanished() const;
+    void setContentTypeHeader();
 
     QPersistentModelIndex part;
     mutable QBuffer buffer;
+    /** @short How much of a part which is still being downloaded has been announced via readyRead() */
+    qint64 announcedSize;
 
     MsgPartNetworkReply(const MsgPartNetworkReply &); // don't implement
     MsgPartNetworkReply &operator=(const MsgPartNetworkReply &); // don't implement
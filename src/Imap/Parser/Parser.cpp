@@ -308,13 +308,17 @@ CommandHandle Parser::expunge()
     return queueCommand(Commands::ATOM, "EXPUNGE");
 }
 
-CommandHandle Parser::searchHelper(const QByteArray &command, const QStringList &criteria, const QByteArray &charset)
+CommandHandle Parser::searchHelper(const QByteArray &command, const QStringList &criteria, const QByteArray &charset,
+                                   const QByteArray &restriction)
 {
     Commands::Command cmd(command);
 
     if (!charset.isEmpty())
         cmd << "CHARSET" << charset;
 
+    if (!restriction.isEmpty())
+        cmd << Commands::PartOfCommand(Commands::ATOM, restriction);
+
     // FIXME: we don't really support anything else but utf-8 here
 
     if (criteria.size() == 1) {
@@ -336,6 +340,14 @@ CommandHandle Parser::uidSearchUid(const QByteArray &sequence)
     return queueCommand(command);
 }
 
+CommandHandle Parser::uidSearchChangedSince(const uint uidNext, const quint64 highestModSeq)
+{
+    Commands::Command command("UID SEARCH");
+    command << Commands::PartOfCommand(Commands::ATOM, "OR UID " + Sequence::startingAt(uidNext).toByteArray()
+                                       + " MODSEQ " + QByteArray::number(highestModSeq + 1));
+    return queueCommand(command);
+}
+
 CommandHandle Parser::uidESearchUid(const QByteArray &sequence)
 {
     Commands::Command command("UID SEARCH RETURN (ALL)");
@@ -343,6 +355,37 @@ CommandHandle Parser::uidESearchUid(const QByteArray &sequence)
     return queueCommand(command);
 }
 
+CommandHandle Parser::multiSearch(const QStringList &mailboxes, const QByteArray &charset, const QStringList &criteria)
+{
+    Q_ASSERT(!mailboxes.isEmpty());
+    Commands::Command cmd("ESEARCH");
+    cmd << Commands::PartOfCommand(Commands::ATOM, "IN (MAILBOXES");
+    if (mailboxes.size() == 1) {
+        cmd << encodeImapFolderName(mailboxes.front());
+        cmd << Commands::PartOfCommand(Commands::ATOM_NO_SPACE_AROUND, ") RETURN (ALL) ");
+    } else {
+        // RFC 7377 and RFC 5465: more than one mailbox has to be a parenthesized list
+        cmd << Commands::PartOfCommand(Commands::ATOM_NO_SPACE_AROUND, " (");
+        Q_FOREACH(const QString &mailbox, mailboxes) {
+            cmd << encodeImapFolderName(mailbox);
+        }
+        cmd << Commands::PartOfCommand(Commands::ATOM_NO_SPACE_AROUND, ")) RETURN (ALL) ");
+    }
+
+    if (!charset.isEmpty())
+        cmd << "CHARSET" << charset;
+
+    if (criteria.size() == 1) {
+        // The same hack as in searchHelper(): a single item is assumed to be formatted already
+        cmd << Commands::PartOfCommand(Commands::ATOM, criteria.front().toUtf8());
+    } else {
+        for (QStringList::const_iterator it = criteria.begin(); it != criteria.end(); ++it)
+            cmd << it->toUtf8();
+    }
+
+    return queueCommand(cmd);
+}
+
 CommandHandle Parser::sortHelper(const QByteArray &command, const QStringList &sortCriteria, const QByteArray &charset, const QStringList &searchCriteria)
 {
     Q_ASSERT(! sortCriteria.isEmpty());
@@ -764,6 +807,10 @@ void Parser::handleSocketEncrypted()
     qDebug() << m_parserId << "***" << buf;
 #endif
     emit lineReceived(this, buf);
+    const QString tlsSessionInfo = socket->tlsSessionInfo();
+    if (!tlsSessionInfo.isEmpty()) {
+        emit lineReceived(this, "*** " + tlsSessionInfo.toUtf8());
+    }
     handleReadyRead();
     queueResponse(resp);
     executeCommands();
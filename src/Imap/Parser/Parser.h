@@ -202,6 +202,17 @@ public slots:
     /** @short A special case of the "UID SEARCH UID" command */
     CommandHandle uidSearchUid(const QByteArray &sequence);
 
+    /** @short UID SEARCH limited to messages from the @arg uids set */
+    CommandHandle uidSearchWithinUids(const Sequence &uids, const QStringList &criteria, const QByteArray &charset = QByteArray()) {
+        return searchHelper("UID SEARCH", criteria, charset, "UID " + uids.toByteArray());
+    }
+
+    /** @short Find messages which have arrived or changed since the mailbox had the @arg uidNext and @arg highestModSeq
+
+    Uses the MODSEQ search key from CONDSTORE, RFC 7162 sect 3.1.5.
+    */
+    CommandHandle uidSearchChangedSince(const uint uidNext, const quint64 highestModSeq);
+
     /** @short Perform the UID ESEARCH command with the specified UID set */
     CommandHandle uidESearchUid(const QByteArray &sequence);
 
@@ -248,6 +259,9 @@ public slots:
     /** @short ESEARCH, the extended UID SEARCH with support for ESEARCH return options from RFC 5267 */
     CommandHandle uidESearch(const QByteArray &charset, const QStringList &searchCriteria, const QStringList &returnOptions);
 
+    /** @short Search through several mailboxes at once using the MULTISEARCH extension from RFC 7377 */
+    CommandHandle multiSearch(const QStringList &mailboxes, const QByteArray &charset, const QStringList &criteria);
+
 
     CommandHandle uidEThread(const QByteArray &algo, const QByteArray &charset, const QStringList &searchCriteria,
                              const QStringList &returnOptions);
@@ -339,9 +353,12 @@ private:
     /** @short Helper for handleReadyRead() -- actually read & parse the data */
     void reallyReadLine();
 
-    /** @short Helper for search() and uidSearch() */
+    /** @short Helper for search() and uidSearch()
+
+    The @arg restriction is a well-formatted search key which gets prepended to the @arg criteria.
+    */
     CommandHandle searchHelper(const QByteArray &command, const QStringList &criteria,
-                               const QByteArray &charset = QByteArray());
+                               const QByteArray &charset = QByteArray(), const QByteArray &restriction = QByteArray());
 
     CommandHandle sortHelper(const QByteArray &command, const QStringList &sortCriteria, const QByteArray &charset, const QStringList &searchCriteria);
     CommandHandle threadHelper(const QByteArray &command, const QByteArray &algo, const QByteArray &charset, const QStringList &searchCriteria);
@@ -645,9 +645,23 @@ Flags::Flags(const QByteArray &line, int &start)
         throw TooMuchData(line, start);
 }
 
-Search::Search(const QByteArray &line, int &start)
+Search::Search(const QByteArray &line, int &start): highestModSeq(0)
 {
     while (start < line.size() - 2) {
+        if (line[start] == '(') {
+            // RFC 7162: a SEARCH which used the MODSEQ criterion ends with "(MODSEQ <mod-sequence>)"
+            ++start;
+            if (LowLevelParser::getAtom(line, start).toUpper() != "MODSEQ")
+                throw UnexpectedHere("SEARCH: expected MODSEQ", line, start);
+            LowLevelParser::eatSpaces(line, start);
+            highestModSeq = LowLevelParser::getUInt64(line, start);
+            if (start >= line.size() || line[start] != ')')
+                throw UnexpectedHere("SEARCH: malformed MODSEQ", line, start);
+            ++start;
+            if (start < line.size() - 2)
+                throw TooMuchData(line, start);
+            break;
+        }
         try {
             uint number = LowLevelParser::getUInt(line, start);
             items << number;
@@ -658,7 +672,7 @@ Search::Search(const QByteArray &line, int &start)
     }
 }
 
-ESearch::ESearch(const QByteArray &line, int &start): seqOrUids(SEQUENCE)
+ESearch::ESearch(const QByteArray &line, int &start): uidValidity(0), seqOrUids(SEQUENCE)
 {
     LowLevelParser::eatSpaces(line, start);
 
@@ -685,6 +699,23 @@ ESearch::ESearch(const QByteArray &line, int &start): seqOrUids(SEQUENCE)
         tag = astring.first;
         if (start >= line.size()) throw NoData(line, start);
 
+        // RFC 7377 identifies the mailbox which the results of MULTISEARCH belong to
+        while (line[start] == ' ') {
+            LowLevelParser::eatSpaces(line, start);
+            if (start >= line.size()) throw NoData(line, start);
+            QByteArray key = LowLevelParser::getAtom(line, start).toUpper();
+            LowLevelParser::eatSpaces(line, start);
+            if (start >= line.size()) throw NoData(line, start);
+            if (key == "MAILBOX") {
+                mailbox = LowLevelParser::getMailbox(line, start);
+            } else if (key == "UIDVALIDITY") {
+                uidValidity = LowLevelParser::getUInt(line, start);
+            } else {
+                throw ParseError("ESEARCH response: malformed search-correlator", line, start);
+            }
+            if (start >= line.size()) throw NoData(line, start);
+        }
+
         if (line[start] != ')')
             throw ParseError("ESEARCH: search-correlator not enclosed in parentheses", line, start);
 
@@ -1153,6 +1184,8 @@ QTextStream &Search::dump(QTextStream &stream) const
     stream << "SEARCH";
     for (auto it = items.begin(); it != items.end(); ++it)
         stream << " " << *it;
+    if (highestModSeq)
+        stream << " (MODSEQ " << highestModSeq << ")";
     return stream;
 }
 
@@ -1161,6 +1194,8 @@ QTextStream &ESearch::dump(QTextStream &stream) const
     stream << "ESEARCH ";
     if (!tag.isEmpty())
         stream << "TAG " << tag << " ";
+    if (!mailbox.isEmpty())
+        stream << "MAILBOX " << mailbox << " UIDVALIDITY " << uidValidity << " ";
     if (seqOrUids == UIDS)
         stream << "UID ";
     for (ListData_t::const_iterator it = listData.constBegin(); it != listData.constEnd(); ++it) {
@@ -1435,7 +1470,7 @@ bool Search::eq(const AbstractResponse &other) const
 {
     try {
         const Search &s = dynamic_cast<const Search &>(other);
-        return items == s.items;
+        return items == s.items && highestModSeq == s.highestModSeq;
     } catch (std::bad_cast &) {
         return false;
     }
@@ -1445,7 +1480,7 @@ bool ESearch::eq(const AbstractResponse &other) const
 {
     try {
         const ESearch &s = dynamic_cast<const ESearch &>(other);
-        return tag == s.tag && seqOrUids == s.seqOrUids && listData == s.listData &&
+        return tag == s.tag && mailbox == s.mailbox && uidValidity == s.uidValidity && seqOrUids == s.seqOrUids && listData == s.listData &&
                 incrementalContextData == s.incrementalContextData && incThreadData == s.incThreadData;
     } catch (std::bad_cast &) {
         return false;
@@ -392,8 +392,10 @@ class Search : public AbstractResponse
 public:
     /** @short List of matching messages */
     Uids items;
+    /** @short Highest mod-sequence of the matching messages as reported by CONDSTORE (RFC 7162), or 0 */
+    quint64 highestModSeq;
     Search(const QByteArray &line, int &start);
-    Search(const Uids &items) : items(items) {};
+    Search(const Uids &items, const quint64 highestModSeq = 0) : items(items), highestModSeq(highestModSeq) {};
     virtual QTextStream &dump(QTextStream &s) const;
     virtual bool eq(const AbstractResponse &other) const;
     virtual void plug(Imap::Parser *parser, Imap::Mailbox::Model *model) const;
@@ -470,6 +472,11 @@ public:
     /** @short The tag of the command which requested in this operation */
     QByteArray tag;
 
+    /** @short The mailbox which the results of MULTISEARCH from RFC 7377 refer to, empty for the selected mailbox */
+    QString mailbox;
+    /** @short UIDVALIDITY of the mailbox, only set along with the mailbox */
+    uint uidValidity;
+
     /** @short Are the numbers given in UIDs, or as sequence numbers? */
     SequencesOrUids seqOrUids;
 
@@ -505,11 +512,14 @@ public:
 
     ESearch(const QByteArray &line, int &start);
     ESearch(const QByteArray &tag, const SequencesOrUids seqOrUids, const ListData_t &listData) :
-        tag(tag), seqOrUids(seqOrUids), listData(listData) {}
+        tag(tag), uidValidity(0), seqOrUids(seqOrUids), listData(listData) {}
+    ESearch(const QByteArray &tag, const QString &mailbox, const uint uidValidity, const SequencesOrUids seqOrUids,
+            const ListData_t &listData) :
+        tag(tag), mailbox(mailbox), uidValidity(uidValidity), seqOrUids(seqOrUids), listData(listData) {}
     ESearch(const QByteArray &tag, const SequencesOrUids seqOrUids, const IncrementalContextData_t &incrementalContextData) :
-        tag(tag), seqOrUids(seqOrUids), incrementalContextData(incrementalContextData) {}
+        tag(tag), uidValidity(0), seqOrUids(seqOrUids), incrementalContextData(incrementalContextData) {}
     ESearch(const QByteArray &tag, const SequencesOrUids seqOrUids, const IncrementalThreadingData_t &incThreadData):
-        tag(tag), seqOrUids(seqOrUids), incThreadData(incThreadData) {}
+        tag(tag), uidValidity(0), seqOrUids(seqOrUids), incThreadData(incThreadData) {}
     virtual QTextStream &dump(QTextStream &stream) const;
     virtual bool eq(const AbstractResponse &other) const;
     virtual void plug(Imap::Parser *parser, Imap::Mailbox::Model *model) const;
@@ -0,0 +1,190 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ExamineSearchTask.h"
+#include <algorithm>
+#include "Imap/Model/ItemRoles.h"
+#include "Imap/Model/Model.h"
+#include "Imap/Model/TaskFactory.h"
+#include "OfflineConnectionTask.h"
+#include "OpenConnectionTask.h"
+
+namespace Imap
+{
+namespace Mailbox
+{
+
+
+ExamineSearchTask::ExamineSearchTask(Model *model, const QStringList &mailboxes, const QStringList &searchConditions):
+    ImapTask(model), m_searchConditions(searchConditions), m_current(0)
+{
+    if (model->networkPolicy() == NETWORK_OFFLINE) {
+        conn = new OfflineConnectionTask(model);
+    } else {
+        // Never share the connection with anybody else, see ParserState::dedicated
+        conn = model->m_taskFactory->createOpenConnectionTask(model);
+        model->accessParser(conn->parser).dedicated = true;
+    }
+    conn->addDependentTask(this);
+
+    if (m_searchConditions.isEmpty())
+        m_searchConditions << QStringLiteral("ALL");
+    Q_FOREACH(const QString &mailbox, mailboxes) {
+        MailboxSearch search;
+        search.mailbox = mailbox;
+        search.uidValidity = 0;
+        search.failed = false;
+        m_searches << search;
+    }
+}
+
+void ExamineSearchTask::perform()
+{
+    parser = conn->parser;
+    markAsActiveTask();
+
+    IMAP_TASK_CHECK_ABORT_DIE;
+
+    if (m_searches.isEmpty()) {
+        model->accessParser(parser).logoutCmd = parser->logout();
+        model->changeConnectionState(parser, CONN_STATE_LOGOUT);
+        emit searchFinished();
+        _completed();
+        return;
+    }
+
+    // Exchange 2003 does not like UTF-8 in searches, see SortTask::searchCharset()
+    QByteArray charset = model->m_capabilitiesBlacklist.contains(QStringLiteral("X-NO-UTF8-SEARCH")) ?
+                QByteArray() : QByteArray("utf-8");
+    for (auto it = m_searches.begin(); it != m_searches.end(); ++it) {
+        it->examineTag = parser->examine(it->mailbox);
+        it->searchTag = parser->uidSearch(m_searchConditions, charset);
+    }
+}
+
+bool ExamineSearchTask::handleStateHelper(const Imap::Responses::State *const resp)
+{
+    if (m_current >= m_searches.size())
+        return false;
+
+    MailboxSearch &current = m_searches[m_current];
+
+    if (resp->tag.isEmpty()) {
+        // Nobody else uses this connection, so whatever comes here is a reaction to our EXAMINE
+        if (resp->respCode == Responses::UIDVALIDITY) {
+            const Responses::RespData<uint> *const num = dynamic_cast<const Responses::RespData<uint>* const>(resp->respCodeData.data());
+            if (num)
+                current.uidValidity = num->data;
+        }
+        return resp->kind == Responses::OK;
+    }
+
+    if (resp->tag == current.examineTag) {
+        if (resp->kind != Responses::OK) {
+            log(QStringLiteral("Cannot EXAMINE %1").arg(current.mailbox), Common::LOG_MAILBOX_SYNC);
+            current.failed = true;
+        }
+        return true;
+    } else if (resp->tag == current.searchTag) {
+        if (resp->kind != Responses::OK)
+            current.failed = true;
+        finishCurrentMailbox();
+        return true;
+    } else {
+        return false;
+    }
+}
+
+void ExamineSearchTask::finishCurrentMailbox()
+{
+    const MailboxSearch &current = m_searches[m_current];
+    if (current.failed) {
+        emit mailboxSearchFailed(current.mailbox);
+    } else {
+        Imap::Uids uids = current.uids;
+        qSort(uids);
+        uids.erase(std::unique(uids.begin(), uids.end()), uids.end());
+        emit mailboxSearchResult(current.mailbox, current.uidValidity, uids);
+    }
+
+    ++m_current;
+    if (m_current == m_searches.size()) {
+        // The connection was opened just for us, so there's no reason to keep it around
+        model->accessParser(parser).logoutCmd = parser->logout();
+        model->changeConnectionState(parser, CONN_STATE_LOGOUT);
+        emit searchFinished();
+        _completed();
+    }
+}
+
+bool ExamineSearchTask::handleNumberResponse(const Imap::Responses::NumberResponse *const resp)
+{
+    // EXISTS, RECENT and EXPUNGE about the examined mailbox; we are not syncing it, so they are of no interest
+    Q_UNUSED(resp);
+    return m_current < m_searches.size();
+}
+
+bool ExamineSearchTask::handleFlags(const Imap::Responses::Flags *const resp)
+{
+    Q_UNUSED(resp);
+    return m_current < m_searches.size();
+}
+
+bool ExamineSearchTask::handleSearch(const Imap::Responses::Search *const resp)
+{
+    if (m_current >= m_searches.size())
+        return false;
+    // The result can be split into several responses
+    m_searches[m_current].uids += resp->items;
+    return true;
+}
+
+bool ExamineSearchTask::handleFetch(const Imap::Responses::Fetch *const resp)
+{
+    Q_UNUSED(resp);
+    return m_current < m_searches.size();
+}
+
+bool ExamineSearchTask::handleVanished(const Imap::Responses::Vanished *const resp)
+{
+    Q_UNUSED(resp);
+    return m_current < m_searches.size();
+}
+
+void ExamineSearchTask::_failed(const QString &errorMessage)
+{
+    emit searchFailed(errorMessage);
+    ImapTask::_failed(errorMessage);
+}
+
+QString ExamineSearchTask::debugIdentification() const
+{
+    return QStringLiteral("%1 of %2 mailboxes").arg(QString::number(m_current), QString::number(m_searches.size()));
+}
+
+QVariant ExamineSearchTask::taskData(const int role) const
+{
+    return role == RoleTaskCompactName ? QVariant(tr("Searching in mailboxes")) : QVariant();
+}
+
+}
+}
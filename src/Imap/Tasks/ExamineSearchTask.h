@@ -0,0 +1,95 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAP_EXAMINESEARCH_TASK_H
+#define IMAP_EXAMINESEARCH_TASK_H
+
+#include "ImapTask.h"
+#include "Imap/Parser/Response.h"
+
+namespace Imap
+{
+namespace Mailbox
+{
+
+/** @short Search through several mailboxes one by one on a connection of its own
+
+This is the fallback for servers without MULTISEARCH. The task opens a new connection which no other task is allowed
+to use, EXAMINEs each mailbox in turn and runs a UID SEARCH in it. The mailboxes are never SELECTed and none of them gets
+synced, so the connections which keep the user's mailboxes open are left alone. All commands are pipelined; when an
+EXAMINE fails, the server goes back to the authenticated state and the following UID SEARCH fails as well instead of
+searching some other mailbox. The connection is logged out once the last mailbox has been searched.
+*/
+class ExamineSearchTask : public ImapTask
+{
+    Q_OBJECT
+public:
+    ExamineSearchTask(Model *model, const QStringList &mailboxes, const QStringList &searchConditions);
+    virtual void perform();
+
+    virtual bool handleStateHelper(const Imap::Responses::State *const resp);
+    virtual bool handleNumberResponse(const Imap::Responses::NumberResponse *const resp);
+    virtual bool handleFlags(const Imap::Responses::Flags *const resp);
+    virtual bool handleSearch(const Imap::Responses::Search *const resp);
+    virtual bool handleFetch(const Imap::Responses::Fetch *const resp);
+    virtual bool handleVanished(const Imap::Responses::Vanished *const resp);
+
+    virtual QString debugIdentification() const;
+    virtual QVariant taskData(const int role) const;
+    virtual bool needsMailbox() const {return false;}
+
+signals:
+    /** @short UIDs of messages matching the search in one of the requested mailboxes have arrived */
+    void mailboxSearchResult(const QString &mailbox, const uint uidValidity, const Imap::Uids &uids);
+    /** @short Searching in this mailbox has failed, the other ones are still being searched */
+    void mailboxSearchFailed(const QString &mailbox);
+    /** @short All mailboxes were searched */
+    void searchFinished();
+    /** @short The search could not be performed at all */
+    void searchFailed(const QString &errorMessage);
+
+protected:
+    virtual void _failed(const QString &errorMessage);
+
+private:
+    struct MailboxSearch {
+        QString mailbox;
+        CommandHandle examineTag;
+        CommandHandle searchTag;
+        uint uidValidity;
+        Imap::Uids uids;
+        bool failed;
+    };
+
+    void finishCurrentMailbox();
+
+    ImapTask *conn;
+    QStringList m_searchConditions;
+    QList<MailboxSearch> m_searches;
+    /** @short Index of the mailbox whose responses are arriving now */
+    int m_current;
+};
+
+}
+}
+
+#endif // IMAP_EXAMINESEARCH_TASK_H
@@ -147,7 +147,11 @@ void FetchMsgPartTask::markPendingItemsUnavailable()
                 .arg(QString::fromUtf8(partId), QString::number(uid)), Common::LOG_MESSAGES);
             return;
         }
-        if (part->loading()) {
+        if (part->m_partialFetch && part->m_partialFetch->currentFetchItem() != partId) {
+            // This chunk has arrived and the next one is already on its way
+            log(QStringLiteral("Fetched chunk %1 for UID %2").arg(QString::fromUtf8(partId), QString::number(uid)),
+                Common::LOG_MESSAGES);
+        } else if (part->loading()) {
             log(QStringLiteral("Received no data for part %1 UID %2").arg(QString::fromUtf8(partId), QString::number(uid)),
                 Common::LOG_MESSAGES);
             markPartUnavailable(part);
@@ -161,6 +165,11 @@ void FetchMsgPartTask::markPendingItemsUnavailable()
 /** @short Give up fetching attempts for this part */
 void FetchMsgPartTask::markPartUnavailable(TreeItemPart *part)
 {
+    if (part->m_partialFetch) {
+        // Whatever has arrived is safe in the cache, a future attempt will resume from there
+        part->m_partialFetch.reset();
+        part->m_data.clear();
+    }
     part->setFetchStatus(TreeItem::UNAVAILABLE);
     QModelIndex idx = part->toIndex(model);
     emit model->dataChanged(idx, idx);
@@ -0,0 +1,126 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MultiSearchTask.h"
+#include <algorithm>
+#include "Imap/Model/ItemRoles.h"
+#include "Imap/Model/Model.h"
+#include "GetAnyConnectionTask.h"
+
+namespace Imap
+{
+namespace Mailbox
+{
+
+
+MultiSearchTask::MultiSearchTask(Model *model, const QStringList &mailboxes, const QStringList &searchConditions):
+    ImapTask(model), m_mailboxes(mailboxes), m_searchConditions(searchConditions)
+{
+    conn = model->m_taskFactory->createGetAnyConnectionTask(model);
+    conn->addDependentTask(this);
+    if (m_searchConditions.isEmpty())
+        m_searchConditions << QStringLiteral("ALL");
+}
+
+void MultiSearchTask::perform()
+{
+    parser = conn->parser;
+    markAsActiveTask();
+
+    IMAP_TASK_CHECK_ABORT_DIE;
+
+    if (m_mailboxes.isEmpty()) {
+        emit searchFinished();
+        _completed();
+        return;
+    }
+
+    if (!model->accessParser(parser).capabilities.contains(QStringLiteral("MULTISEARCH"))) {
+        _failed(tr("The server does not support searching in multiple mailboxes at once"));
+        return;
+    }
+
+    // Exchange 2003 does not like UTF-8 in searches, see SortTask::searchCharset()
+    QByteArray charset = model->m_capabilitiesBlacklist.contains(QStringLiteral("X-NO-UTF8-SEARCH")) ?
+                QByteArray() : QByteArray("utf-8");
+    tag = parser->multiSearch(m_mailboxes, charset, m_searchConditions);
+}
+
+bool MultiSearchTask::handleESearch(const Imap::Responses::ESearch *const resp)
+{
+    if (resp->tag != tag)
+        return false;
+
+    if (resp->mailbox.isEmpty())
+        throw UnexpectedResponseReceived("ESEARCH response to a MULTISEARCH command does not identify the mailbox", *resp);
+
+    Responses::ESearch::CompareListDataIdentifier<Responses::ESearch::ListData_t> allComparator("ALL");
+    Responses::ESearch::ListData_t::const_iterator allIterator =
+            std::find_if(resp->listData.constBegin(), resp->listData.constEnd(), allComparator);
+    if (allIterator == resp->listData.constEnd() || allIterator->second.isEmpty())
+        return true;
+
+    if (resp->seqOrUids != Imap::Responses::ESearch::UIDS) {
+        throw UnexpectedResponseReceived("ESEARCH response to a MULTISEARCH command uses "
+                                         "sequence numbers instead of UIDs", *resp);
+    }
+
+    emit mailboxSearchResult(resp->mailbox, resp->uidValidity, allIterator->second);
+    return true;
+}
+
+bool MultiSearchTask::handleStateHelper(const Imap::Responses::State *const resp)
+{
+    if (resp->tag.isEmpty())
+        return false;
+
+    if (resp->tag == tag) {
+        if (resp->kind == Responses::OK) {
+            emit searchFinished();
+            _completed();
+        } else {
+            _failed(tr("Searching in multiple mailboxes has failed"));
+        }
+        return true;
+    } else {
+        return false;
+    }
+}
+
+void MultiSearchTask::_failed(const QString &errorMessage)
+{
+    emit searchFailed(errorMessage);
+    ImapTask::_failed(errorMessage);
+}
+
+QString MultiSearchTask::debugIdentification() const
+{
+    return QStringLiteral("%1 mailboxes").arg(m_mailboxes.size());
+}
+
+QVariant MultiSearchTask::taskData(const int role) const
+{
+    return role == RoleTaskCompactName ? QVariant(tr("Searching in mailboxes")) : QVariant();
+}
+
+}
+}
@@ -0,0 +1,73 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAP_MULTISEARCH_TASK_H
+#define IMAP_MULTISEARCH_TASK_H
+
+#include "ImapTask.h"
+#include "Imap/Parser/Response.h"
+
+namespace Imap
+{
+namespace Mailbox
+{
+
+/** @short Search through several mailboxes at once via the ESEARCH command from RFC 7377
+
+None of the mailboxes has to be selected; the task runs on any available connection.
+*/
+class MultiSearchTask : public ImapTask
+{
+    Q_OBJECT
+public:
+    MultiSearchTask(Model *model, const QStringList &mailboxes, const QStringList &searchConditions);
+    virtual void perform();
+
+    virtual bool handleStateHelper(const Imap::Responses::State *const resp);
+    virtual bool handleESearch(const Imap::Responses::ESearch *const resp);
+
+    virtual QString debugIdentification() const;
+    virtual QVariant taskData(const int role) const;
+    virtual bool needsMailbox() const {return false;}
+
+signals:
+    /** @short UIDs of messages matching the search in one of the requested mailboxes have arrived */
+    void mailboxSearchResult(const QString &mailbox, const uint uidValidity, const Imap::Uids &uids);
+    /** @short All mailboxes were searched */
+    void searchFinished();
+    /** @short The search has failed */
+    void searchFailed(const QString &errorMessage);
+
+protected:
+    virtual void _failed(const QString &errorMessage);
+
+private:
+    CommandHandle tag;
+    ImapTask *conn;
+    QStringList m_mailboxes;
+    QStringList m_searchConditions;
+};
+
+}
+}
+
+#endif // IMAP_MULTISEARCH_TASK_H
@@ -37,8 +37,9 @@ namespace Mailbox
 {
 
 OpenConnectionTask::OpenConnectionTask(Model *model) :
-    ImapTask(model)
+    ImapTask(model), m_usingRememberedCapabilities(false), m_postLoginPipelined(false), m_loginFailed(false), m_lastPhaseAt(0)
 {
+    m_handshakeTimer.start();
     // Offline mode shall be checked by the caller who decides to create the connection
     Q_ASSERT(model->networkPolicy() != NETWORK_OFFLINE);
     parser = new Parser(model, model->m_socketFactory->create(), Common::ConnectionId::next());
@@ -53,8 +54,9 @@ OpenConnectionTask::OpenConnectionTask(Model *model) :
 }
 
 OpenConnectionTask::OpenConnectionTask(Model *model, void *dummy):
-    ImapTask(model)
+    ImapTask(model), m_usingRememberedCapabilities(false), m_postLoginPipelined(false), m_loginFailed(false), m_lastPhaseAt(0)
 {
+    m_handshakeTimer.start();
     Q_UNUSED(dummy);
 }
 
@@ -152,6 +154,7 @@ bool OpenConnectionTask::handleStateHelper(const Imap::Responses::State *const r
     case CONN_STATE_CONNECTED_PRETLS_PRECAPS:
         // We're connected now -- this is our initial state.
     {
+        logPhase(QStringLiteral("greeting"));
         switch (resp->kind) {
         case PREAUTH:
             if (model->m_startTls) {
@@ -215,6 +218,7 @@ bool OpenConnectionTask::handleStateHelper(const Imap::Responses::State *const r
     {
         bool wasCaps = checkCapabilitiesResult(resp);
         if (wasCaps && !_finished) {
+            logPhase(QStringLiteral("CAPABILITY"));
             startTlsOrLoginNow();
         }
         return wasCaps;
@@ -261,6 +265,7 @@ bool OpenConnectionTask::handleStateHelper(const Imap::Responses::State *const r
     {
         bool wasCaps = checkCapabilitiesResult(resp);
         if (wasCaps && !_finished) {
+            logPhase(QStringLiteral("CAPABILITY after STARTTLS"));
             if (model->accessParser(parser).capabilities.contains(QStringLiteral("LOGINDISABLED"))) {
                 abortConnection(tr("Server error: Capabilities contain LOGINDISABLED even after STARTTLS"));
             } else {
@@ -279,9 +284,19 @@ bool OpenConnectionTask::handleStateHelper(const Imap::Responses::State *const r
             // The LOGIN command is finished
             if (resp->kind == OK) {
                 model->setImapAuthError(QString());
+                logPhase(QStringLiteral("LOGIN"));
+                if (resp->respCode != CAPABILITIES && !model->accessParser(parser).capabilitiesFresh && canUseRememberedCapabilities()) {
+                    // The server looks exactly the same as the last time, so let's save a roundtrip
+                    log(QStringLiteral("Using capabilities remembered from the last login"), Common::LOG_OTHER);
+                    model->updateCapabilities(parser, model->m_rememberedPostAuthCapabilities);
+                    m_usingRememberedCapabilities = true;
+                }
                 if (resp->respCode == CAPABILITIES || model->accessParser(parser).capabilitiesFresh) {
                     // Capabilities are already known
-                    if (TROJITA_COMPRESS_DEFLATE && model->accessParser(parser).capabilities.contains(QStringLiteral("COMPRESS=DEFLATE"))) {
+                    if (!compressCmd.isEmpty()) {
+                        // The COMPRESS has been pipelined right after LOGIN, so we just have to wait for its result
+                        model->changeConnectionState(parser, CONN_STATE_COMPRESS_DEFLATE);
+                    } else if (TROJITA_COMPRESS_DEFLATE && model->accessParser(parser).capabilities.contains(QStringLiteral("COMPRESS=DEFLATE"))) {
                         compressCmd = parser->compressDeflate();
                         model->changeConnectionState(parser, CONN_STATE_COMPRESS_DEFLATE);
                     } else {
@@ -332,6 +347,10 @@ bool OpenConnectionTask::handleStateHelper(const Imap::Responses::State *const r
                 model->setImapAuthError(message);
                 EMIT_LATER(model, authAttemptFailed, Q_ARG(QString, message));
 
+                // Whatever got pipelined after the LOGIN has failed as well, and it won't be pipelined again
+                m_postLoginPipelined = false;
+                m_loginFailed = true;
+
                 model->m_imapPassword.clear();
                 model->m_hasImapPassword = Model::PasswordAvailability::NOT_REQUESTED;
                 if (model->accessParser(parser).connState == CONN_STATE_LOGOUT) {
@@ -342,6 +361,10 @@ bool OpenConnectionTask::handleStateHelper(const Imap::Responses::State *const r
                 askForAuth();
             }
             return true;
+        } else if (resp->tag == compressCmd) {
+            // A pipelined COMPRESS which was refused because the LOGIN has failed
+            compressCmd.clear();
+            return true;
         }
         return false;
     }
@@ -350,6 +373,7 @@ bool OpenConnectionTask::handleStateHelper(const Imap::Responses::State *const r
     {
         bool wasCaps = checkCapabilitiesResult(resp);
         if (wasCaps && !_finished) {
+            logPhase(QStringLiteral("CAPABILITY after authentication"));
             model->changeConnectionState(parser, CONN_STATE_AUTHENTICATED);
             onComplete();
         }
@@ -358,6 +382,8 @@ bool OpenConnectionTask::handleStateHelper(const Imap::Responses::State *const r
 
     case CONN_STATE_COMPRESS_DEFLATE:
         if (resp->tag == compressCmd) {
+            compressCmd.clear();
+            logPhase(QStringLiteral("COMPRESS"));
             model->changeConnectionState(parser, CONN_STATE_AUTHENTICATED);
             onComplete();
             return true;
@@ -413,17 +439,47 @@ bool OpenConnectionTask::checkCapabilitiesResult(const Responses::State *const r
 }
 
 void OpenConnectionTask::onComplete()
+{
+    const QStringList &postAuth = model->accessParser(parser).capabilities;
+
+    if ((m_usingRememberedCapabilities || m_postLoginPipelined) && postAuth != model->m_rememberedPostAuthCapabilities) {
+        // An untagged CAPABILITY or a response code disagrees with what we remembered, so it cannot be trusted anymore
+        log(QStringLiteral("Capabilities have changed since the last login, forgetting the remembered ones"), Common::LOG_OTHER);
+        model->setRememberedCapabilities(QStringList(), QStringList());
+        m_usingRememberedCapabilities = false;
+    }
+
+    // These are only sent once the LOGIN has succeeded, so they are never repeated after a failed attempt
+    issuePostLoginCommands(postAuth);
+
+    if (!m_preAuthCapabilities.isEmpty() && !m_usingRememberedCapabilities) {
+        // We've got a fresh view of what the server supports, so let's make it available for the next reconnect
+        if (m_preAuthCapabilities != model->m_rememberedPreAuthCapabilities
+                || postAuth != model->m_rememberedPostAuthCapabilities) {
+            EMIT_LATER(model, capabilitiesRemembered, Q_ARG(QStringList, m_preAuthCapabilities), Q_ARG(QStringList, postAuth));
+        }
+    }
+
+    log(QStringLiteral("Handshake: connection ready after %1 ms%2").arg(
+            QString::number(m_handshakeTimer.elapsed()),
+            m_postLoginPipelined ? QStringLiteral(" (pipelined)") : QString()), Common::LOG_OTHER);
+
+    // But do terminate this task
+    _completed();
+}
+
+void OpenConnectionTask::issuePostLoginCommands(const QStringList &capabilities)
 {
     // Optionally issue the ID command
-    if (model->accessParser(parser).capabilities.contains(QStringLiteral("ID"))) {
+    if (capabilities.contains(QStringLiteral("ID"))) {
         Imap::Mailbox::ImapTask *task = model->m_taskFactory->createIdTask(model, this);
         task->perform();
     }
     // Optionally enable extensions which need enabling
-    if (model->accessParser(parser).capabilities.contains(QStringLiteral("ENABLE"))) {
+    if (capabilities.contains(QStringLiteral("ENABLE"))) {
         QList<QByteArray> extensions;
 
-        if (model->accessParser(parser).capabilities.contains(QStringLiteral("QRESYNC"))) {
+        if (capabilities.contains(QStringLiteral("QRESYNC"))) {
             extensions << "QRESYNC";
         }
 
@@ -431,9 +487,41 @@ void OpenConnectionTask::onComplete()
             model->m_taskFactory->createEnableTask(model, this, extensions)->perform();
         }
     }
+}
 
-    // But do terminate this task
-    _completed();
+void OpenConnectionTask::sendLogin()
+{
+    Q_ASSERT(loginCmd.isEmpty());
+    m_preAuthCapabilities = model->accessParser(parser).capabilities;
+    loginCmd = parser->login(model->m_imapUser, model->m_imapPassword);
+    model->accessParser(parser).capabilitiesFresh = false;
+
+    // When talking to a server which we know well and which is happy about non-synchronizing literals, there's no need
+    // to wait for the LOGIN to finish before asking for compression. The ID and ENABLE have to wait for the tagged OK
+    // (see onComplete()) because they are only valid in the authenticated state. Nothing is pipelined after a failed
+    // attempt; the server's reply to the previous one is a good hint that it's not the server we remember.
+    const QStringList &remembered = model->m_rememberedPostAuthCapabilities;
+    if (TROJITA_COMPRESS_DEFLATE && !m_loginFailed && canUseRememberedCapabilities() && compressCmd.isEmpty()
+            && remembered.contains(QStringLiteral("COMPRESS=DEFLATE"))
+            && (remembered.contains(QStringLiteral("LITERAL+")) || remembered.contains(QStringLiteral("LITERAL-")))) {
+        log(QStringLiteral("Pipelining COMPRESS after LOGIN"), Common::LOG_OTHER);
+        m_postLoginPipelined = true;
+        compressCmd = parser->compressDeflate();
+    }
+}
+
+bool OpenConnectionTask::canUseRememberedCapabilities() const
+{
+    return !model->m_rememberedPostAuthCapabilities.isEmpty()
+            && model->m_rememberedPreAuthCapabilities == m_preAuthCapabilities;
+}
+
+void OpenConnectionTask::logPhase(const QString &phase)
+{
+    const qint64 now = m_handshakeTimer.elapsed();
+    log(QStringLiteral("Handshake: %1 took %2 ms (%3 ms since connecting)").arg(
+            phase, QString::number(now - m_lastPhaseAt), QString::number(now)), Common::LOG_OTHER);
+    m_lastPhaseAt = now;
 }
 
 void OpenConnectionTask::abortConnection(const QString &message)
@@ -456,9 +544,7 @@ void OpenConnectionTask::askForAuth()
                         QLatin1String("Password already requested, will wait"));
         break;
     case Model::PasswordAvailability::AVAILABLE:
-        Q_ASSERT(loginCmd.isEmpty());
-        loginCmd = parser->login(model->m_imapUser, model->m_imapPassword);
-        model->accessParser(parser).capabilitiesFresh = false;
+        sendLogin();
         break;
     }
 }
@@ -472,8 +558,7 @@ void OpenConnectionTask::authCredentialsNowAvailable()
             abortConnection(tr("Cannot login, you have not provided any credentials yet."));
             break;
         case Model::PasswordAvailability::AVAILABLE:
-            loginCmd = parser->login(model->m_imapUser, model->m_imapPassword);
-            model->accessParser(parser).capabilitiesFresh = false;
+            sendLogin();
             break;
         }
     }
@@ -523,12 +608,14 @@ bool OpenConnectionTask::handleSocketEncryptedResponse(const Responses::SocketEn
 {
     switch (model->accessParser(parser).connState) {
     case CONN_STATE_SSL_HANDSHAKE:
+        logPhase(QStringLiteral("TLS handshake"));
         model->changeConnectionState(parser, CONN_STATE_SSL_VERIFYING);
         m_sslChain = resp->sslChain;
         m_sslErrors = resp->sslErrors;
         model->processSslErrors(this);
         return true;
     case CONN_STATE_STARTTLS_HANDSHAKE:
+        logPhase(QStringLiteral("STARTTLS handshake"));
         model->changeConnectionState(parser, CONN_STATE_STARTTLS_VERIFYING);
         m_sslChain = resp->sslChain;
         m_sslErrors = resp->sslErrors;
@@ -24,6 +24,7 @@
 #define IMAP_OPENCONNECTIONTASK_H
 
 #include "ImapTask.h"
+#include <QElapsedTimer>
 #include <QSslError>
 #include "../Model/Model.h"
 
@@ -81,10 +82,22 @@ private:
     /** @short Wrapper around the _completed() call for optionally launching the ID command */
     void onComplete();
 
+    /** @short Launch the ID and ENABLE commands, as appropriate for the given @arg capabilities */
+    void issuePostLoginCommands(const QStringList &capabilities);
+
     void abortConnection(const QString &message);
 
     void askForAuth();
 
+    /** @short Send LOGIN, optionally followed by the post-login commands if the server is known well enough */
+    void sendLogin();
+
+    /** @short Is the server advertising the same pre-login capabilities as during the last successful login? */
+    bool canUseRememberedCapabilities() const;
+
+    /** @short Log how long the just finished phase of the handshake took */
+    void logPhase(const QString &phase);
+
 private:
     CommandHandle startTlsCmd;
     CommandHandle capabilityCmd;
@@ -92,6 +105,16 @@ private:
     CommandHandle compressCmd;
     QList<QSslCertificate> m_sslChain;
     QList<QSslError> m_sslErrors;
+    /** @short Capabilities which were valid at the time we issued LOGIN */
+    QStringList m_preAuthCapabilities;
+    /** @short Did we skip asking for capabilities after LOGIN because we trusted the remembered ones? */
+    bool m_usingRememberedCapabilities;
+    /** @short Was the COMPRESS command sent right after LOGIN without waiting for its result? */
+    bool m_postLoginPipelined;
+    /** @short Has any LOGIN attempt within this task been rejected already? */
+    bool m_loginFailed;
+    QElapsedTimer m_handshakeTimer;
+    qint64 m_lastPhaseAt;
 };
 
 }
@@ -22,6 +22,7 @@
 
 #include "SortTask.h"
 #include <algorithm>
+#include <iterator>
 #include "Imap/Model/ItemRoles.h"
 #include "Imap/Model/Model.h"
 #include "Imap/Model/MailboxTree.h"
@@ -61,6 +62,16 @@ void SortTask::perform()
     Q_ASSERT(keepTask);
     keepTask->feelFreeToAbortCaller(this);
 
+    TreeItemMailbox *mailbox = dynamic_cast<TreeItemMailbox *>(static_cast<TreeItem *>(mailboxIndex.internalPointer()));
+    Q_ASSERT(mailbox);
+    if (useCachedResult(mailbox))
+        return;
+
+    sendSearchCommand();
+}
+
+void SortTask::sendSearchCommand()
+{
     if (sortCriteria.isEmpty()) {
         if (model->accessParser(parser).capabilitiesFresh &&
                 model->accessParser(parser).capabilities.contains(QStringLiteral("ESEARCH"))) {
@@ -76,11 +87,7 @@ void SortTask::perform()
             }
         } else {
             // Plain "old" SORT
-            sortTag = parser->uidSearch(searchConditions,
-                                        // It looks that Exchange 2003 does not support the UTF-8 charset in searches.
-                                        // That is, of course, insane, and only illustrates how useless its support of IMAP really is.
-                                        model->m_capabilitiesBlacklist.contains(QStringLiteral("X-NO-UTF8-SEARCH")) ? QByteArray() : "utf-8"
-                                        );
+            sortTag = parser->uidSearch(searchConditions, searchCharset());
         }
     } else {
         // SEARCH and SORT combined
@@ -103,6 +110,132 @@ void SortTask::perform()
     }
 }
 
+QByteArray SortTask::searchCharset() const
+{
+    // It looks that Exchange 2003 does not support the UTF-8 charset in searches.
+    // That is, of course, insane, and only illustrates how useless its support of IMAP really is.
+    return model->m_capabilitiesBlacklist.contains(QStringLiteral("X-NO-UTF8-SEARCH")) ? QByteArray() : QByteArray("utf-8");
+}
+
+/** @short Identify this request in the cache of search results */
+QString SortTask::cacheKey() const
+{
+    // A single item is a raw search typed by the user, it's sent verbatim
+    const QString conditions = searchConditions.size() == 1 ? searchConditions.front().trimmed()
+                                                            : searchConditions.join(QLatin1Char('\n'));
+    return QStringLiteral("SORT (%1) SEARCH %2").arg(sortCriteria.join(QLatin1Char(' ')), conditions);
+}
+
+/** @short Try to avoid asking the server for the complete result once again
+
+The cached result is valid for as long as the UIDVALIDITY, HIGHESTMODSEQ and UIDNEXT of the mailbox remain the same. If they have changed,
+a plain SEARCH can still be refreshed by looking at the new and modified messages only. That's not possible for SORT
+because the position of a modified message cannot be determined without its sort keys.
+
+Returns true if the cached result was either used directly, or if its refresh has been started.
+*/
+bool SortTask::useCachedResult(TreeItemMailbox *mailbox)
+{
+    const auto &parserState = model->accessParser(parser);
+    if (!parserState.capabilitiesFresh || !parserState.capabilities.contains(QStringLiteral("QRESYNC")))
+        return false;
+
+    // With CONTEXT=SEARCH or CONTEXT=SORT, the server keeps the result up to date on its own
+    const bool contextUpdates = sortCriteria.isEmpty() ?
+                parserState.capabilities.contains(QStringLiteral("ESEARCH"))
+                && parserState.capabilities.contains(QStringLiteral("CONTEXT=SEARCH")) :
+                parserState.capabilities.contains(QStringLiteral("ESORT"))
+                && parserState.capabilities.contains(QStringLiteral("CONTEXT=SORT"));
+    if (contextUpdates || !mailbox->syncState.highestModSeq() || !mailbox->syncState.uidNext())
+        return false;
+
+    m_mailboxState.highestModSeq = mailbox->syncState.highestModSeq();
+    m_mailboxState.uidNext = mailbox->syncState.uidNext();
+    m_mailboxState.uidValidity = mailbox->syncState.uidValidity();
+
+    AbstractCache::SearchResult cached;
+    if (!model->cache()->searchResult(mailbox->mailbox(), cacheKey(), cached)
+            || cached.uidValidity != m_mailboxState.uidValidity)
+        return false;
+
+    if (cached.highestModSeq == m_mailboxState.highestModSeq && cached.uidNext == m_mailboxState.uidNext) {
+        // Nothing has changed since the last time
+        sortResult = cached.uids;
+        dropVanishedMessages(sortResult);
+        m_firstCommandCompleted = true;
+        emit sortingAvailable(sortResult);
+        _completed();
+        return true;
+    }
+
+    if (!sortCriteria.isEmpty() || searchConditions == QStringList() << QStringLiteral("ALL")
+            || !cached.highestModSeq || cached.highestModSeq > m_mailboxState.highestModSeq) {
+        return false;
+    }
+
+    m_staleResult = cached.uids;
+    changedTag = parser->uidSearchChangedSince(cached.uidNext, cached.highestModSeq);
+    return true;
+}
+
+/** @short The changed messages are known, check which of them match the search criteria */
+void SortTask::refreshChangedMessages()
+{
+    std::sort(m_changedUids.begin(), m_changedUids.end());
+    m_changedUids.erase(std::unique(m_changedUids.begin(), m_changedUids.end()), m_changedUids.end());
+
+    // Those changed messages which still match will be found once again
+    Imap::Uids unchanged;
+    unchanged.reserve(m_staleResult.size());
+    for (const uint uid : m_staleResult) {
+        if (!std::binary_search(m_changedUids.constBegin(), m_changedUids.constEnd(), uid))
+            unchanged << uid;
+    }
+    dropVanishedMessages(unchanged);
+    m_staleResult = unchanged;
+
+    if (m_changedUids.isEmpty()) {
+        // Some messages have been expunged, but there's nothing new to search through
+        m_firstCommandCompleted = true;
+        sortResult = m_staleResult;
+        rememberResult();
+        emit sortingAvailable(sortResult);
+        _completed();
+        return;
+    }
+
+    sortTag = parser->uidSearchWithinUids(Sequence::fromVector(m_changedUids), searchConditions, searchCharset());
+}
+
+/** @short Remove UIDs of the messages which are no longer in the mailbox, keeping the order of the remaining ones */
+void SortTask::dropVanishedMessages(Imap::Uids &uids)
+{
+    TreeItemMailbox *mailbox = dynamic_cast<TreeItemMailbox *>(static_cast<TreeItem *>(mailboxIndex.internalPointer()));
+    Q_ASSERT(mailbox);
+    Imap::Uids sorted = uids;
+    std::sort(sorted.begin(), sorted.end());
+    Imap::Uids present;
+    present.reserve(sorted.size());
+    const QList<TreeItemMessage *> messages = model->findMessagesByUids(mailbox, sorted);
+    for (const TreeItemMessage *message : messages)
+        present << message->uid();
+    if (present.size() == uids.size())
+        return;
+    uids.erase(std::remove_if(uids.begin(), uids.end(), [&present](const uint uid) {
+        return !std::binary_search(present.constBegin(), present.constEnd(), uid);
+    }), uids.end());
+}
+
+void SortTask::rememberResult()
+{
+    if (!m_mailboxState.highestModSeq || m_persistentSearch)
+        return;
+
+    AbstractCache::SearchResult result = m_mailboxState;
+    result.uids = sortResult;
+    model->cache()->setSearchResult(mailboxIndex.data(RoleMailboxName).toString(), cacheKey(), result);
+}
+
 bool SortTask::handleStateHelper(const Imap::Responses::State *const resp)
 {
     if (resp->tag.isEmpty()) {
@@ -129,9 +262,28 @@ bool SortTask::handleStateHelper(const Imap::Responses::State *const resp)
         return false;
     }
 
-    if (resp->tag == sortTag) {
+    if (resp->tag == changedTag && sortTag.isEmpty()) {
+        if (resp->kind == Responses::OK) {
+            refreshChangedMessages();
+        } else {
+            // Perhaps the server does not like the MODSEQ, let's ask for everything
+            m_staleResult.clear();
+            changedTag.clear();
+            sendSearchCommand();
+        }
+        return true;
+    } else if (resp->tag == sortTag) {
         m_firstCommandCompleted = true;
         if (resp->kind == Responses::OK) {
+            if (!changedTag.isEmpty()) {
+                // Both lists are sorted by UID, and they cannot overlap
+                Imap::Uids merged;
+                merged.reserve(m_staleResult.size() + sortResult.size());
+                std::merge(m_staleResult.constBegin(), m_staleResult.constEnd(), sortResult.constBegin(), sortResult.constEnd(),
+                           std::back_inserter(merged));
+                sortResult = merged;
+            }
+            rememberResult();
             emit sortingAvailable(sortResult);
             if (!m_persistentSearch || _aborted) {
                 // This is a one-shot operation, we shall not remain as an active task, listening for further updates
@@ -168,6 +320,12 @@ bool SortTask::handleSort(const Imap::Responses::Sort *const resp)
 
 bool SortTask::handleSearch(const Imap::Responses::Search *const resp)
 {
+    if (!changedTag.isEmpty() && sortTag.isEmpty()) {
+        // These are the messages which have changed since the cached result was obtained
+        m_changedUids += resp->items;
+        return true;
+    }
+
     if (searchConditions == QStringList() << QStringLiteral("ALL")) {
         // We're really a SORT task, so we shouldn't process this stuff
         return false;
@@ -25,12 +25,15 @@
 
 #include <QPersistentModelIndex>
 #include "ImapTask.h"
+#include "Imap/Model/Cache.h"
 
 namespace Imap
 {
 namespace Mailbox
 {
 
+class TreeItemMailbox;
+
 /** @short Send a SORT command and take care of its processing */
 class SortTask : public ImapTask
 {
@@ -65,7 +68,17 @@ signals:
 protected:
     virtual void _failed(const QString &errorMessage);
 private:
+    void sendSearchCommand();
+    QByteArray searchCharset() const;
+    bool useCachedResult(TreeItemMailbox *mailbox);
+    void refreshChangedMessages();
+    void dropVanishedMessages(Imap::Uids &uids);
+    void rememberResult();
+    QString cacheKey() const;
+
     CommandHandle sortTag;
+    /** @short Tag of the UID SEARCH for messages which changed since the cached result was obtained */
+    CommandHandle changedTag;
     CommandHandle cancelUpdateTag;
     ImapTask *conn;
     QPersistentModelIndex mailboxIndex;
@@ -81,6 +94,13 @@ private:
 
     /** @short Did the first command (the ESEARCH/ESORT) finish properly, including its tagged response? */
     bool m_firstCommandCompleted;
+
+    /** @short State of the mailbox when this task started, or zeros if the result shall not be cached */
+    AbstractCache::SearchResult m_mailboxState;
+    /** @short A result from the cache which is being refreshed, only the messages which changed since then are searched */
+    Imap::Uids m_staleResult;
+    /** @short Messages which arrived or were modified after the m_staleResult was obtained */
+    Imap::Uids m_changedUids;
 };
 
 }
@@ -21,6 +21,7 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "SMTP.h"
+#include "Streams/TlsSessionCache.h"
 
 namespace MSA
 {
@@ -37,6 +38,7 @@ SMTP::SMTP(QObject *parent, const QString &host, quint16 port, bool encryptedCon
     connect(qwwSmtp, &QwwSmtpClient::connected, this, &AbstractMSA::sending);
     connect(qwwSmtp, &QwwSmtpClient::done, this, &SMTP::handleDone);
     connect(qwwSmtp, &QwwSmtpClient::socketError, this, &SMTP::handleError);
+    connect(qwwSmtp, &QwwSmtpClient::encrypted, this, &SMTP::handleEncrypted);
     connect(qwwSmtp, &QwwSmtpClient::logReceived, this, [this](const QByteArray& data) {
         emit logged(Common::LogKind::LOG_IO_READ, QStringLiteral("SMTP"), QString::fromUtf8(data));
     });
@@ -78,6 +80,19 @@ void SMTP::handleError(QAbstractSocket::SocketError err, const QString &msg)
     emit error(msg);
 }
 
+void SMTP::handleEncrypted()
+{
+    if (m_tlsSessionCache) {
+        emit logged(Common::LogKind::LOG_OTHER, QStringLiteral("SMTP"),
+                    m_tlsSessionCache->sessionEstablished(qwwSmtp->sslConfiguration(), host, port, m_offeredTlsSession));
+    }
+}
+
+void SMTP::setTlsSessionCache(std::shared_ptr<Streams::TlsSessionCache> cache)
+{
+    m_tlsSessionCache = cache;
+}
+
 void SMTP::setPassword(const QString &password)
 {
     pass = password;
@@ -105,6 +120,11 @@ void SMTP::sendMail(const QByteArray &from, const QList<QByteArray> &to, const Q
 void SMTP::sendContinueGotPassword()
 {
     isWaitingForPassword = false;
+    if (m_tlsSessionCache && (encryptedConnect || startTls)) {
+        QSslConfiguration sslConf = qwwSmtp->sslConfiguration();
+        m_offeredTlsSession = m_tlsSessionCache->prepareConfiguration(sslConf, host, port);
+        qwwSmtp->setSslConfiguration(sslConf);
+    }
     if (encryptedConnect)
         qwwSmtp->connectToHostEncrypted(host, port);
     else
@@ -170,7 +190,14 @@ SMTPFactory::~SMTPFactory()
 
 AbstractMSA *SMTPFactory::create(QObject *parent) const
 {
-    return new SMTP(parent, m_host, m_port, m_encryptedConnect, m_startTls, m_auth, m_user);
+    SMTP *smtp = new SMTP(parent, m_host, m_port, m_encryptedConnect, m_startTls, m_auth, m_user);
+    smtp->setTlsSessionCache(m_tlsSessionCache);
+    return smtp;
+}
+
+void SMTPFactory::setTlsSessionCache(std::shared_ptr<Streams::TlsSessionCache> cache)
+{
+    m_tlsSessionCache = cache;
 }
 
 }
@@ -22,9 +22,14 @@
 #ifndef SMTP_H
 #define SMTP_H
 
+#include <memory>
 #include "AbstractMSA.h"
 #include "qwwsmtpclient/qwwsmtpclient.h"
 
+namespace Streams {
+class TlsSessionCache;
+}
+
 namespace MSA
 {
 
@@ -38,11 +43,14 @@ public:
 
     virtual bool supportsBurl() const;
     virtual void sendBurl(const QByteArray &from, const QList<QByteArray> &to, const QByteArray &imapUrl);
+    void setTlsSessionCache(std::shared_ptr<Streams::TlsSessionCache> cache);
 public slots:
     virtual void cancel();
     virtual void setPassword(const QString &password);
     void handleDone(bool ok);
     void handleError(QAbstractSocket::SocketError err, const QString &msg);
+private slots:
+    void handleEncrypted();
 private:
     QwwSmtpClient *qwwSmtp;
     QString host;
@@ -58,6 +66,8 @@ private:
     QByteArray data;
     bool isWaitingForPassword;
     enum { MODE_SMTP_INVALID, MODE_SMTP_DATA, MODE_SMTP_BURL } sendingMode;
+    std::shared_ptr<Streams::TlsSessionCache> m_tlsSessionCache;
+    QByteArray m_offeredTlsSession;
 
     void sendContinueGotPassword();
 
@@ -72,6 +82,8 @@ public:
          const QString &user);
     virtual ~SMTPFactory();
     virtual AbstractMSA *create(QObject *parent) const;
+    /** @short Share the TLS sessions with other connections to the same server */
+    void setTlsSessionCache(std::shared_ptr<Streams::TlsSessionCache> cache);
 private:
     QString m_host;
     quint16 m_port;
@@ -79,6 +91,7 @@ private:
     bool m_startTls;
     bool m_auth;
     QString m_user;
+    std::shared_ptr<Streams::TlsSessionCache> m_tlsSessionCache;
 };
 
 }
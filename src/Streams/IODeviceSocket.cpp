@@ -28,6 +28,7 @@
 #include <QSslConfiguration>
 #include <QSslSocket>
 #include <QTimer>
+#include "TlsSessionCache.h"
 #include "TrojitaZlibStatus.h"
 #if TROJITA_COMPRESS_DEFLATE
 #include "3rdparty/rfc1951.h"
@@ -239,7 +240,7 @@ SslTlsSocket::SslTlsSocket(QSslSocket *sock, const QString &host, const quint16
     sslConf.setSslOption(QSsl::SslOptionDisableCompression, false);
     sock->setSslConfiguration(sslConf);
 
-    connect(sock, &QSslSocket::encrypted, this, &Socket::encrypted);
+    connect(sock, &QSslSocket::encrypted, this, &SslTlsSocket::handleEncrypted);
     connect(sock, &QAbstractSocket::stateChanged, this, &SslTlsSocket::handleStateChanged);
     connect(sock, static_cast<void (QAbstractSocket::*)(QAbstractSocket::SocketError)>(&QAbstractSocket::error),
             this, &SslTlsSocket::handleSocketError);
@@ -251,6 +252,11 @@ void SslTlsSocket::setProxySettings(const ProxySettings proxySettings, const QSt
     m_protocolTag = protocolTag;
 }
 
+void SslTlsSocket::setTlsSessionCache(std::shared_ptr<TlsSessionCache> cache)
+{
+    m_tlsSessionCache = cache;
+}
+
 void SslTlsSocket::close()
 {
     QSslSocket *sock = qobject_cast<QSslSocket*>(d);
@@ -330,6 +336,16 @@ void SslTlsSocket::handleSocketError(QAbstractSocket::SocketError err)
                           host, QString::number(port), sock->errorString()));
 }
 
+void SslTlsSocket::handleEncrypted()
+{
+    if (m_tlsSessionCache) {
+        QSslSocket *sock = qobject_cast<QSslSocket *>(d);
+        Q_ASSERT(sock);
+        m_tlsSessionInfo = m_tlsSessionCache->sessionEstablished(sock->sslConfiguration(), host, port, m_offeredTlsSession);
+    }
+    emit encrypted();
+}
+
 bool SslTlsSocket::isDead()
 {
     QAbstractSocket *sock = qobject_cast<QAbstractSocket *>(d);
@@ -388,6 +404,12 @@ void SslTlsSocket::delayedStart()
         break;
     }
 
+    if (m_tlsSessionCache) {
+        QSslConfiguration sslConf = sock->sslConfiguration();
+        m_offeredTlsSession = m_tlsSessionCache->prepareConfiguration(sslConf, host, port);
+        sock->setSslConfiguration(sslConf);
+    }
+
     if (startEncrypted)
         sock->connectToHostEncrypted(host, port);
     else
@@ -413,4 +435,9 @@ bool SslTlsSocket::isConnectingEncryptedSinceStart() const
     return startEncrypted;
 }
 
+QString SslTlsSocket::tlsSessionInfo() const
+{
+    return m_tlsSessionInfo;
+}
+
 }
@@ -22,6 +22,7 @@
 #ifndef STREAMS_IODEVICE_SOCKET_H
 #define STREAMS_IODEVICE_SOCKET_H
 
+#include <memory>
 #include <QProcess>
 #include <QSslSocket>
 #include "Socket.h"
@@ -34,6 +35,7 @@ namespace Streams {
 class Rfc1951Compressor;
 class Rfc1951Decompressor;
 class SocketFactory;
+class TlsSessionCache;
 
 /** @short Helper class for all sockets which are based on a QIODevice */
 class IODeviceSocket: public Socket
@@ -92,14 +94,17 @@ public:
     connected() only after it has established proper encryption */
     SslTlsSocket(QSslSocket *sock, const QString &host, const quint16 port, const bool startEncrypted=false);
     void setProxySettings(const Streams::ProxySettings proxySettings, const QString &protocolTag);
+    void setTlsSessionCache(std::shared_ptr<TlsSessionCache> cache);
     bool isDead();
     virtual QList<QSslCertificate> sslChain() const;
     virtual QList<QSslError> sslErrors() const;
     bool isConnectingEncryptedSinceStart() const;
+    virtual QString tlsSessionInfo() const;
     virtual void close();
 private slots:
     void handleStateChanged();
     void handleSocketError(QAbstractSocket::SocketError);
+    void handleEncrypted();
     void delayedStart();
 private:
     bool startEncrypted;
@@ -107,6 +112,10 @@ private:
     quint16 port;
     QString m_protocolTag;
     ProxySettings m_proxySettings;
+    std::shared_ptr<TlsSessionCache> m_tlsSessionCache;
+    /** @short The TLS session which we have offered to the server */
+    QByteArray m_offeredTlsSession;
+    QString m_tlsSessionInfo;
 };
 
 };
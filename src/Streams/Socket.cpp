@@ -33,6 +33,11 @@ bool Socket::isConnectingEncryptedSinceStart() const
     return false;
 }
 
+QString Socket::tlsSessionInfo() const
+{
+    return QString();
+}
+
 
 QList<QSslCertificate> Socket::sslChain() const
 {
@@ -72,6 +72,9 @@ public:
     /** @short Is this socket starting ecnryption from the very start? */
     virtual bool isConnectingEncryptedSinceStart() const;
 
+    /** @short Return a human-readable note about the TLS session resumption of this connection */
+    virtual QString tlsSessionInfo() const;
+
     /** @short Close the connection */
     virtual void close() = 0;
 
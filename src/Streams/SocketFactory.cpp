@@ -43,6 +43,11 @@ bool SocketFactory::startTlsRequired()
     return m_startTls;
 }
 
+void SocketFactory::setTlsSessionCache(std::shared_ptr<TlsSessionCache> cache)
+{
+    m_tlsSessionCache = cache;
+}
+
 ProcessSocketFactory::ProcessSocketFactory(
     const QString &executable, const QStringList &args):
     executable(executable), args(args)
@@ -77,6 +82,7 @@ Socket *SslSocketFactory::create()
     QSslSocket *sslSock = new QSslSocket();
     SslTlsSocket *sock = new SslTlsSocket(sslSock, host, port, true);
     sock->setProxySettings(m_proxySettings, m_protocolTag);
+    sock->setTlsSessionCache(m_tlsSessionCache);
     return sock;
 }
 
@@ -97,6 +103,7 @@ Socket *TlsAbleSocketFactory::create()
     QSslSocket *sslSock = new QSslSocket();
     SslTlsSocket *sock = new SslTlsSocket(sslSock, host, port);
     sock->setProxySettings(m_proxySettings, m_protocolTag);
+    sock->setTlsSessionCache(m_tlsSessionCache);
     return sock;
 }
 
@@ -106,7 +113,9 @@ FakeSocketFactory::FakeSocketFactory(const Imap::ConnectionState initialState):
 
 Socket *FakeSocketFactory::create()
 {
-    return m_last = new FakeSocket(m_initialState);
+    m_last = new FakeSocket(m_initialState);
+    m_sockets << m_last;
+    return m_last;
 }
 
 Socket *FakeSocketFactory::lastSocket()
@@ -115,6 +124,16 @@ Socket *FakeSocketFactory::lastSocket()
     return m_last;
 }
 
+QList<Socket *> FakeSocketFactory::sockets() const
+{
+    QList<Socket *> res;
+    Q_FOREACH(const QPointer<Socket> &socket, m_sockets) {
+        if (socket)
+            res << socket.data();
+    }
+    return res;
+}
+
 void FakeSocketFactory::setInitialState(const Imap::ConnectionState initialState)
 {
     m_initialState = initialState;
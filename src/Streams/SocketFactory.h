@@ -23,12 +23,15 @@
 #ifndef STREAMS_SOCKETFACTORY_H
 #define STREAMS_SOCKETFACTORY_H
 
+#include <memory>
 #include <QPointer>
 #include <QStringList>
 #include "Socket.h"
 
 namespace Streams {
 
+class TlsSessionCache;
+
 /** @short Specify preference for Proxy Settings */
 enum class ProxySettings
 {
@@ -50,6 +53,10 @@ public:
     virtual void setProxySettings(const Streams::ProxySettings proxySettings, const QString &protocolTag) = 0;
     void setStartTlsRequired(const bool doIt);
     bool startTlsRequired();
+    /** @short Share TLS sessions among all connections created by this factory and anybody else using the @arg cache */
+    void setTlsSessionCache(std::shared_ptr<TlsSessionCache> cache);
+protected:
+    std::shared_ptr<TlsSessionCache> m_tlsSessionCache;
 signals:
     void error(const QString &);
 };
@@ -113,11 +120,14 @@ public:
     virtual Socket *create();
     /** @short Return the last created socket */
     Socket *lastSocket();
+    /** @short Return all sockets created so far which still exist, the oldest one first */
+    QList<Socket *> sockets() const;
     void setInitialState(const Imap::ConnectionState initialState);
     virtual void setProxySettings(const Streams::ProxySettings proxySettings, const QString &protocolTag);
 
 private:
     QPointer<Socket> m_last;
+    QList<QPointer<Socket>> m_sockets;
     Imap::ConnectionState m_initialState;
 };
 
@@ -0,0 +1,82 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QSslConfiguration>
+#include "TlsSessionCache.h"
+
+namespace Streams {
+
+TlsSessionCache::TlsSessionCache(): m_handshakes(0), m_resumeAttempts(0), m_resumed(0)
+{
+}
+
+QString TlsSessionCache::key(const QString &host, const quint16 port)
+{
+    return host.toLower() + QLatin1Char(':') + QString::number(port);
+}
+
+QByteArray TlsSessionCache::prepareConfiguration(QSslConfiguration &sslConf, const QString &host, const quint16 port)
+{
+    // Qt only exports the session data when explicitly asked to
+    sslConf.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    QByteArray offered = m_sessions.value(key(host, port));
+    sslConf.setSessionTicket(offered);
+    return offered;
+}
+
+QString TlsSessionCache::sessionEstablished(const QSslConfiguration &sslConf, const QString &host, const quint16 port,
+                                            const QByteArray &offered)
+{
+    ++m_handshakes;
+    const QByteArray current = sslConf.sessionTicket();
+
+    // Qt doesn't tell us whether the server has accepted the session. Servers which resume a session without
+    // issuing a new ticket hand back exactly what we have offered, though, so that's what we count as a hit.
+    // Servers which rotate their tickets on each resumption are therefore reported as misses.
+    bool resumed = false;
+    if (!offered.isEmpty()) {
+        ++m_resumeAttempts;
+        if (current == offered) {
+            resumed = true;
+            ++m_resumed;
+        }
+    }
+
+    if (current.isEmpty()) {
+        m_sessions.remove(key(host, port));
+    } else {
+        m_sessions[key(host, port)] = current;
+    }
+
+    QString status;
+    if (offered.isEmpty()) {
+        status = QStringLiteral("TLS session: full handshake, no session to resume");
+    } else if (resumed) {
+        status = QStringLiteral("TLS session: resumed");
+    } else {
+        status = QStringLiteral("TLS session: not resumed");
+    }
+    return status + QStringLiteral(" (%1 of %2 attempts resumed, %3 handshakes in total)").arg(
+                QString::number(m_resumed), QString::number(m_resumeAttempts), QString::number(m_handshakes));
+}
+
+}
@@ -0,0 +1,66 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STREAMS_TLSSESSIONCACHE_H
+#define STREAMS_TLSSESSIONCACHE_H
+
+#include <QHash>
+#include <QString>
+
+class QSslConfiguration;
+
+namespace Streams {
+
+/** @short Storage of TLS sessions for quick resumption of subsequent connections
+
+Each new connection to a server which we have already talked to can skip the full TLS handshake by presenting the
+session ticket which was obtained previously. Instances are meant to be shared by all socket factories of a single
+account, which means that both the IMAP and the SMTP connections benefit from that. The sessions are keyed by the
+remote host and port and are only kept in memory.
+*/
+class TlsSessionCache
+{
+public:
+    TlsSessionCache();
+
+    /** @short Make the @arg sslConf offer a previously stored session, return the offered session ticket */
+    QByteArray prepareConfiguration(QSslConfiguration &sslConf, const QString &host, const quint16 port);
+
+    /** @short Remember the session of a freshly encrypted connection and return a description suitable for the log
+
+    The @arg sslConf is the configuration of the socket after the handshake has finished, the @arg offered shall be
+    the value returned by the prepareConfiguration().
+    */
+    QString sessionEstablished(const QSslConfiguration &sslConf, const QString &host, const quint16 port, const QByteArray &offered);
+
+private:
+    static QString key(const QString &host, const quint16 port);
+
+    QHash<QString, QByteArray> m_sessions;
+    uint m_handshakes;
+    uint m_resumeAttempts;
+    uint m_resumed;
+};
+
+}
+
+#endif
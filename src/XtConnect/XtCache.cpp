@@ -112,6 +112,13 @@ void XtCache::setMsgFlags( const QString& mailbox, uint uid, const QStringList&
     Q_UNUSED(flags);
 }
 
+QMap<uint, QStringList> XtCache::msgFlagsBatch( const QString& mailbox, const Imap::Uids& uids ) const
+{
+    Q_UNUSED(mailbox);
+    Q_UNUSED(uids);
+    return QMap<uint, QStringList>();
+}
+
 XtCache::MessageDataBundle XtCache::messageMetadata( const QString& mailbox, uint uid ) const
 {
     Q_UNUSED(mailbox);
@@ -126,6 +133,13 @@ void XtCache::setMessageMetadata( const QString& mailbox, uint uid, const Messag
     Q_UNUSED(metadata);
 }
 
+QMap<uint, XtCache::MessageDataBundle> XtCache::messageMetadataBatch( const QString& mailbox, const Imap::Uids& uids ) const
+{
+    Q_UNUSED(mailbox);
+    Q_UNUSED(uids);
+    return QMap<uint, MessageDataBundle>();
+}
+
 QByteArray XtCache::messagePart( const QString& mailbox, uint uid, const QString& partId ) const
 {
     Q_UNUSED(mailbox);
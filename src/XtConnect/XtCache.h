@@ -77,11 +77,15 @@ public:
 
     virtual MessageDataBundle messageMetadata( const QString& mailbox, uint uid ) const;
     virtual void setMessageMetadata( const QString& mailbox, uint uid, const MessageDataBundle& metadata );
+    /** @short Returns no data */
+    virtual QMap<uint, MessageDataBundle> messageMetadataBatch( const QString& mailbox, const Imap::Uids& uids ) const;
 
     /** @short Do nothing */
     virtual QStringList msgFlags( const QString& mailbox, uint uid ) const;
     /** @short Returns no data */
     virtual void setMsgFlags( const QString& mailbox, uint uid, const QStringList& flags );
+    /** @short Returns no data */
+    virtual QMap<uint, QStringList> msgFlagsBatch( const QString& mailbox, const Imap::Uids& uids ) const;
 
     /** @short ALways returns an empty QByteArray */
     virtual QByteArray messagePart( const QString& mailbox, uint uid, const QString& partId ) const;
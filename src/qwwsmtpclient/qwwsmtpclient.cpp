@@ -585,6 +585,7 @@ QwwSmtpClient::QwwSmtpClient(QObject *parent)
     connect(d->socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
     connect(d->socket, SIGNAL(readyRead()), this, SLOT(_q_readFromSocket()));
     connect(d->socket, SIGNAL(sslErrors(const QList<QSslError> &)), this, SIGNAL(sslErrors(const QList<QSslError>&)));
+    connect(d->socket, SIGNAL(encrypted()), this, SIGNAL(encrypted()));
 }
 
 
@@ -650,6 +651,14 @@ void QwwSmtpClient::setLocalNameEncrypted(const QString & ln) {
     d->localNameEncrypted = ln;
 }
 
+QSslConfiguration QwwSmtpClient::sslConfiguration() const {
+    return d->socket->sslConfiguration();
+}
+
+void QwwSmtpClient::setSslConfiguration(const QSslConfiguration &config) {
+    d->socket->setSslConfiguration(config);
+}
+
 
 int QwwSmtpClient::authenticate(const QString &user, const QString &password, AuthMode mode) {
     SMTPCommand cmd;
@@ -15,6 +15,7 @@
 #include <QObject>
 #include <QHostAddress>
 #include <QString>
+#include <QSslConfiguration>
 #include <QSslError>
 
 class QwwSmtpClientPrivate;
@@ -60,6 +61,8 @@ public:
     Q_DECLARE_FLAGS ( AuthModes, AuthMode );
     void setLocalName(const QString &ln);
     void setLocalNameEncrypted(const QString &ln);
+    QSslConfiguration sslConfiguration() const;
+    void setSslConfiguration(const QSslConfiguration &config);
 
     int connectToHost ( const QString & hostName, quint16 port = 25);
     int connectToHostEncrypted(const QString &hostName, quint16 port = 465);
@@ -84,6 +87,7 @@ signals:
     void commandFinished(int, bool error);
     void commandStarted(int);
     void tlsStarted();
+    void encrypted();
     void authenticated();
     void rawCommandReply(int code, const QString &details);
     void sslErrors(const QList<QSslError> &);
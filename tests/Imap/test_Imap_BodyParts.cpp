@@ -553,4 +553,71 @@ void BodyPartsTest::testBinaryFallback()
     }
 }
 
+/** @short Check that large parts are downloaded in chunks, and that these downloads can be resumed */
+void BodyPartsTest::testPartialFetch()
+{
+    model->setProperty("trojita-imap-delayed-fetch-part", 0);
+    model->setProperty("trojita-imap-partial-fetch-chunk", 4);
+    helperSyncBNoMessages();
+    cServer("* 1 EXISTS\r\n");
+    cClient(t.mk("UID FETCH 1:* (FLAGS)\r\n"));
+    cServer("* 1 FETCH (UID 333 FLAGS ())\r\n" + t.last("OK fetched\r\n"));
+    QCOMPARE(model->rowCount(msgListB), 1);
+    QModelIndex msg = msgListB.child(0, 0);
+    QVERIFY(msg.isValid());
+    QCOMPARE(model->rowCount(msg), 0);
+    cClient(t.mk("UID FETCH 333 (" FETCH_METADATA_ITEMS ")\r\n"));
+    cServer("* 1 FETCH (UID 333 BODYSTRUCTURE ("
+            "(\"text\" \"plain\" () NIL NIL \"7bit\" 10 1)"
+            "(\"application\" \"octet-stream\" () NIL NIL \"base64\" 12) \"mixed\""
+            "))\r\n" + t.last("OK fetched\r\n"));
+    QCOMPARE(model->rowCount(msg), 1);
+    QModelIndex rootMultipart = msg.child(0, 0);
+    QVERIFY(rootMultipart.isValid());
+    QCOMPARE(model->rowCount(rootMultipart), 2);
+
+    QSignalSpy dataChangedSpy(model, SIGNAL(dataChanged(QModelIndex,QModelIndex)));
+
+    // The data which are not subject to any CTE are available as soon as each chunk arrives
+    QModelIndex part = rootMultipart.child(0, 0);
+    QCOMPARE(part.data(RolePartData).toByteArray(), QByteArray());
+    cClient(t.mk("UID FETCH 333 (BODY.PEEK[1]<0.4>)\r\n"));
+    cServer("* 1 FETCH (UID 333 BODY[1]<0> \"0123\")\r\n" + t.last("OK fetched\r\n"));
+    QCOMPARE(dataChangedSpy.size(), 1);
+    QVERIFY(!part.data(RoleIsFetched).toBool());
+    QVERIFY(!part.data(RoleIsUnavailable).toBool());
+    QCOMPARE(part.data(RolePartData).toByteArray(), QByteArray("0123"));
+    QCOMPARE(model->cache()->partialMessagePart(QStringLiteral("b"), 333, "1.X-RAW", 4), QByteArray("0123"));
+    cClient(t.mk("UID FETCH 333 (BODY.PEEK[1]<4.4>)\r\n"));
+    cServer("* 1 FETCH (UID 333 BODY[1]<4> \"4567\")\r\n" + t.last("OK fetched\r\n"));
+    QCOMPARE(part.data(RolePartData).toByteArray(), QByteArray("01234567"));
+    cClient(t.mk("UID FETCH 333 (BODY.PEEK[1]<8.4>)\r\n"));
+    cServer("* 1 FETCH (UID 333 BODY[1]<8> \"89\")\r\n" + t.last("OK fetched\r\n"));
+    QCOMPARE(dataChangedSpy.size(), 3);
+    QVERIFY(part.data(RoleIsFetched).toBool());
+    QCOMPARE(part.data(RolePartData).toByteArray(), QByteArray("0123456789"));
+    QCOMPARE(model->cache()->messagePart(QStringLiteral("b"), 333, "1"), QByteArray("0123456789"));
+    QVERIFY(model->cache()->partialMessagePart(QStringLiteral("b"), 333, "1.X-RAW", 4).isNull());
+    cEmpty();
+    dataChangedSpy.clear();
+
+    // An interrupted download continues where the previous attempt left off
+    part = rootMultipart.child(1, 0);
+    model->cache()->setMsgPartChunk(QStringLiteral("b"), 333, "2.X-RAW", 0, 4, QByteArray("abc").toBase64());
+    QCOMPARE(part.data(RolePartData).toByteArray(), QByteArray());
+    cClient(t.mk("UID FETCH 333 (BODY.PEEK[2]<4.4>)\r\n"));
+    cServer("* 1 FETCH (UID 333 BODY[2]<4> \"" + QByteArray("def").toBase64() + "\")\r\n" + t.last("OK fetched\r\n"));
+    // The base64 payload is only decoded at the very end
+    QCOMPARE(part.data(RolePartData).toByteArray(), QByteArray());
+    cClient(t.mk("UID FETCH 333 (BODY.PEEK[2]<8.4>)\r\n"));
+    cServer(t.last("NO connection dropped, or something\r\n"));
+    QVERIFY(!part.data(RoleIsFetched).toBool());
+    QVERIFY(part.data(RoleIsUnavailable).toBool());
+    QCOMPARE(model->cache()->partialMessagePart(QStringLiteral("b"), 333, "2.X-RAW", 4),
+             QByteArray("abc").toBase64() + QByteArray("def").toBase64());
+    // Data stored with a different chunk size are useless
+    QVERIFY(model->cache()->partialMessagePart(QStringLiteral("b"), 333, "2.X-RAW", 8).isNull());
+    cEmpty();
+}
+
 QTEST_GUILESS_MAIN(BodyPartsTest)
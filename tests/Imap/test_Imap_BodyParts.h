@@ -43,6 +43,8 @@ private slots:
     void testFilenameExtraction_data();
 
     void testBinaryFallback();
+
+    void testPartialFetch();
 };
 
 #endif
@@ -0,0 +1,238 @@
+/* Copyright (C) 2006 - 2014 Jan Kundrát <jkt@flaska.net>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QtTest>
+#include "test_Imap_MessagePrefetcher.h"
+#include "Streams/FakeSocket.h"
+#include "Imap/Model/ItemRoles.h"
+#include "Imap/Model/MessagePrefetcher.h"
+#include "Imap/Model/MsgListModel.h"
+
+using Imap::Mailbox::MessagePrefetcher;
+
+/** @short The direction of navigation is forgotten when the mailbox gets selected again */
+void ImapModelMessagePrefetcherTest::testDirectionAfterResync()
+{
+    existsA = 3;
+    uidValidityA = 333;
+    uidMapA << 6 << 9 << 10;
+    uidNextA = 11;
+    helperSyncAWithMessagesEmptyState();
+    msgListModel->setMailbox(idxA);
+    QCOMPARE(msgListModel->rowCount(), 3);
+
+    MessagePrefetcher prefetcher(nullptr);
+    prefetcher.setLookahead(0);
+    QCOMPARE(prefetcher.direction(), MessagePrefetcher::Direction::FORWARD);
+
+    prefetcher.setDirection(MessagePrefetcher::Direction::BACKWARD);
+    prefetcher.messageOpened(msgListModel->index(2, 0));
+    QCOMPARE(prefetcher.direction(), MessagePrefetcher::Direction::BACKWARD);
+
+    // Clicking around within the same mailbox keeps the direction
+    prefetcher.messageOpened(msgListModel->index(1, 0));
+    QCOMPARE(prefetcher.direction(), MessagePrefetcher::Direction::BACKWARD);
+    cEmpty();
+
+    // Syncing some other mailbox is irrelevant
+    helperSyncBNoMessages();
+    QCOMPARE(prefetcher.direction(), MessagePrefetcher::Direction::BACKWARD);
+
+    // Going back to A makes the prefetching go forward again
+    helperSyncAWithMessagesNoArrivals();
+    QCOMPARE(prefetcher.direction(), MessagePrefetcher::Direction::FORWARD);
+    cEmpty();
+    QVERIFY(errorSpy->isEmpty());
+}
+
+/** @short Opening a message from another mailbox resets the direction unless it was chosen for this very message */
+void ImapModelMessagePrefetcherTest::testDirectionAfterMailboxChange()
+{
+    existsA = 3;
+    uidValidityA = 333;
+    uidMapA << 6 << 9 << 10;
+    uidNextA = 11;
+    helperSyncAWithMessagesEmptyState();
+
+    MessagePrefetcher prefetcher(nullptr);
+    prefetcher.setLookahead(0);
+    prefetcher.setDirection(MessagePrefetcher::Direction::BACKWARD);
+    prefetcher.messageOpened(msgListA.child(2, 0));
+    QCOMPARE(prefetcher.direction(), MessagePrefetcher::Direction::BACKWARD);
+
+    model->switchToMailbox(idxB);
+    cClient(t.mk("SELECT b\r\n"));
+    cServer(QByteArray("* 1 EXISTS\r\n* OK [UIDVALIDITY 666] .\r\n* OK [UIDNEXT 2] .\r\n") + t.last("OK selected\r\n"));
+    cClient(t.mk("UID SEARCH ALL\r\n"));
+    cServer(QByteArray("* SEARCH 1\r\n") + t.last("OK search\r\n"));
+    cClient(t.mk("FETCH 1 (FLAGS)\r\n"));
+    cServer(QByteArray("* 1 FETCH (FLAGS (\\Seen))\r\n") + t.last("OK flags\r\n"));
+    cEmpty();
+    QCOMPARE(model->rowCount(msgListB), 1);
+    QCOMPARE(prefetcher.direction(), MessagePrefetcher::Direction::BACKWARD);
+
+    prefetcher.messageOpened(msgListB.child(0, 0));
+    QCOMPARE(prefetcher.direction(), MessagePrefetcher::Direction::FORWARD);
+
+    prefetcher.setDirection(MessagePrefetcher::Direction::BACKWARD);
+    prefetcher.messageOpened(msgListA.child(0, 0));
+    QCOMPARE(prefetcher.direction(), MessagePrefetcher::Direction::BACKWARD);
+    cEmpty();
+    QVERIFY(errorSpy->isEmpty());
+}
+
+/** @short Sync mailbox A with one unread text/plain message for each of the @arg partSizes and load their metadata */
+void ImapModelMessagePrefetcherTest::helperUnreadMessages(const QVector<uint> &partSizes)
+{
+    // The part requests would otherwise be delayed by a timer
+    model->setProperty("trojita-imap-delayed-fetch-part", 0);
+    existsA = partSizes.size();
+    uidValidityA = 333;
+    for (int i = 0; i < partSizes.size(); ++i)
+        uidMapA << i + 1;
+    uidNextA = partSizes.size() + 1;
+    helperSyncAWithMessagesEmptyState();
+    QByteArray flags;
+    for (int i = 1; i <= partSizes.size(); ++i)
+        flags += "* " + QByteArray::number(i) + " FETCH (FLAGS ())\r\n";
+    cServer(flags);
+    msgListModel->setMailbox(idxA);
+    QCOMPARE(msgListModel->rowCount(), partSizes.size());
+
+    msgListA.child(0, 0).data(Imap::Mailbox::RoleMessageSubject);
+    cClient(t.mk(QStringLiteral("UID FETCH 1:%1 (" FETCH_METADATA_ITEMS ")\r\n").arg(partSizes.size()).toUtf8()));
+    QByteArray metadata;
+    for (int i = 1; i <= partSizes.size(); ++i) {
+        metadata += QStringLiteral("* %1 FETCH (UID %1 RFC822.SIZE %2 INTERNALDATE \"15-Jan-2013 12:17:06 +0000\" "
+                                   "ENVELOPE (NIL \"message %1\" NIL NIL NIL NIL NIL NIL NIL NIL) "
+                                   "BODYSTRUCTURE (\"text\" \"plain\" () NIL NIL NIL %2 2 NIL NIL NIL NIL))\r\n")
+                .arg(QString::number(i), QString::number(partSizes[i - 1])).toUtf8();
+    }
+    cServer(metadata + t.last("OK fetched\r\n"));
+    for (int i = 0; i < partSizes.size(); ++i)
+        QVERIFY(msgListA.child(i, 0).data(Imap::Mailbox::RoleIsFetched).toBool());
+    cEmpty();
+}
+
+/** @short Give the prefetcher's delayed start a chance to fire */
+static void waitForPrefetcher()
+{
+    QTest::qWait(400);
+}
+
+/** @short The main parts of the next messages are requested, and the counters track how useful that was */
+void ImapModelMessagePrefetcherTest::testPrefetchNextMessages()
+{
+    helperUnreadMessages(QVector<uint>() << 19 << 19 << 19 << 19 << 19);
+
+    MessagePrefetcher prefetcher(nullptr);
+    prefetcher.setLookahead(2);
+
+    // Nothing is known about the body of the opened message
+    prefetcher.messageOpened(msgListModel->index(0, 0));
+    QCOMPARE(prefetcher.statistics().misses, 1u);
+    cEmpty();
+    waitForPrefetcher();
+    cClient(t.mk("UID FETCH 2:3 (BODY.PEEK[1])\r\n"));
+    QCOMPARE(prefetcher.statistics().requestedParts, 2u);
+    QCOMPARE(prefetcher.statistics().requestedBytes, quint64(38));
+    cServer("* 2 FETCH (UID 2 BODY[1] \"second\")\r\n* 3 FETCH (UID 3 BODY[1] \"third\")\r\n" + t.last("OK fetched\r\n"));
+
+    // The next message is ready, and the one after it has been downloaded already, so only the fourth one is requested
+    prefetcher.messageOpened(msgListModel->index(1, 0));
+    QCOMPARE(prefetcher.statistics().hits, 1u);
+    waitForPrefetcher();
+    cClient(t.mk("UID FETCH 4 (BODY.PEEK[1])\r\n"));
+    QByteArray fetched4 = t.last("OK fetched\r\n");
+    QCOMPARE(prefetcher.statistics().requestedParts, 3u);
+
+    // The user is faster than the network
+    prefetcher.messageOpened(msgListModel->index(3, 0));
+    QCOMPARE(prefetcher.statistics().lateHits, 1u);
+    waitForPrefetcher();
+    cClient(t.mk("UID FETCH 5 (BODY.PEEK[1])\r\n"));
+    cServer("* 4 FETCH (UID 4 BODY[1] \"fourth\")\r\n" + fetched4
+            + "* 5 FETCH (UID 5 BODY[1] \"fifth\")\r\n" + t.last("OK fetched\r\n"));
+    QCOMPARE(msgListA.child(4, 0).child(0, 0).data(Imap::Mailbox::RolePartData).toByteArray(), QByteArray("fifth"));
+
+    QCOMPARE(prefetcher.statistics().requestedParts, 4u);
+    QCOMPARE(prefetcher.statistics().hits, 1u);
+    QCOMPARE(prefetcher.statistics().lateHits, 1u);
+    QCOMPARE(prefetcher.statistics().misses, 1u);
+    cEmpty();
+    QVERIFY(errorSpy->isEmpty());
+}
+
+/** @short Neither the number of messages nor the amount of data exceed the configured limits */
+void ImapModelMessagePrefetcherTest::testPrefetchLimits()
+{
+    helperUnreadMessages(QVector<uint>() << 100 << 100 << 100 << 100 << 100 << 100);
+
+    MessagePrefetcher prefetcher(nullptr);
+    prefetcher.setLookahead(1);
+    prefetcher.messageOpened(msgListModel->index(0, 0));
+    waitForPrefetcher();
+    cClient(t.mk("UID FETCH 2 (BODY.PEEK[1])\r\n"));
+    cServer("* 2 FETCH (UID 2 BODY[1] \"second\")\r\n" + t.last("OK fetched\r\n"));
+
+    // Four more messages are wanted, but only two of them fit into the budget
+    prefetcher.setLookahead(4);
+    prefetcher.setByteBudget(250);
+    prefetcher.messageOpened(msgListModel->index(1, 0));
+    waitForPrefetcher();
+    cClient(t.mk("UID FETCH 3:4 (BODY.PEEK[1])\r\n"));
+    QCOMPARE(prefetcher.statistics().requestedParts, 3u);
+    QCOMPARE(prefetcher.statistics().requestedBytes, quint64(300));
+    cServer("* 3 FETCH (UID 3 BODY[1] \"third\")\r\n* 4 FETCH (UID 4 BODY[1] \"fourth\")\r\n" + t.last("OK fetched\r\n"));
+    cEmpty();
+    QVERIFY(errorSpy->isEmpty());
+}
+
+/** @short Parts which are in the cache already are not requested from the server */
+void ImapModelMessagePrefetcherTest::testPrefetchCachedParts()
+{
+    helperUnreadMessages(QVector<uint>() << 19 << 19 << 19 << 19);
+    model->cache()->setMsgPart(QStringLiteral("a"), 2, "1", "cached second");
+    model->cache()->setMsgPart(QStringLiteral("a"), 3, "1", "cached third");
+
+    MessagePrefetcher prefetcher(nullptr);
+    prefetcher.setLookahead(3);
+    prefetcher.messageOpened(msgListModel->index(0, 0));
+    waitForPrefetcher();
+    cClient(t.mk("UID FETCH 4 (BODY.PEEK[1])\r\n"));
+    QCOMPARE(msgListA.child(1, 0).child(0, 0).data(Imap::Mailbox::RolePartData).toByteArray(), QByteArray("cached second"));
+    QCOMPARE(msgListA.child(2, 0).child(0, 0).data(Imap::Mailbox::RolePartData).toByteArray(), QByteArray("cached third"));
+    cServer("* 4 FETCH (UID 4 BODY[1] \"fourth\")\r\n" + t.last("OK fetched\r\n"));
+
+    // Both of these count as a hit, no matter where the data came from
+    prefetcher.messageOpened(msgListModel->index(1, 0));
+    prefetcher.messageOpened(msgListModel->index(2, 0));
+    QCOMPARE(prefetcher.statistics().hits, 2u);
+    QCOMPARE(prefetcher.statistics().misses, 1u);
+
+    // Everything is available locally by now, so there is nothing left to ask for
+    waitForPrefetcher();
+    cEmpty();
+    QVERIFY(errorSpy->isEmpty());
+}
+
+QTEST_GUILESS_MAIN(ImapModelMessagePrefetcherTest)
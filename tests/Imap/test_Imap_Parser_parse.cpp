@@ -320,6 +320,9 @@ void ImapParserParseTest::testParseUntagged_data()
     QTest::newRow("search-messages")
         << QByteArray("* SEARCH 1 33 666\r\n")
         << QSharedPointer<AbstractResponse>(new Search(Imap::Uids() << 1 << 33 << 666));
+    QTest::newRow("search-modseq")
+        << QByteArray("* SEARCH 2 5 (MODSEQ 917162500)\r\n")
+        << QSharedPointer<AbstractResponse>(new Search(Imap::Uids() << 2 << 5, 917162500));
 
     ESearch::ListData_t esearchData;
     QTest::newRow("esearch-empty")
@@ -417,6 +420,12 @@ void ImapParserParseTest::testParseUntagged_data()
         << QByteArray("* ESEARCH FOO 6   BLaH 1,2:4,5   baz 33  \r\n")
         << QSharedPointer<AbstractResponse>(new ESearch(QByteArray(), ESearch::SEQUENCE, esearchData));
 
+    esearchData.clear();
+    esearchData.push_back(qMakePair<>(QByteArray("ALL"), Imap::Uids() << 1 << 3 << 4 << 5));
+    QTest::newRow("esearch-multisearch")
+        << QByteArray("* ESEARCH (TAG \"M1\" MAILBOX \"folder1\" UIDVALIDITY 1) UID ALL 1,3:5\r\n")
+        << QSharedPointer<AbstractResponse>(new ESearch("M1", QStringLiteral("folder1"), 1, ESearch::UIDS, esearchData));
+
     ESearch::IncrementalContextData_t incrementalEsearchData;
     incrementalEsearchData.push_back(ESearch::ContextIncrementalItem(ESearch::ContextIncrementalItem::ADDTO, 1, Imap::Uids() << 2733));
     incrementalEsearchData.push_back(ESearch::ContextIncrementalItem(ESearch::ContextIncrementalItem::ADDTO, 1, Imap::Uids() << 2731 << 2732));
@@ -2280,6 +2280,108 @@ void ImapModelObtainSynchronizedMailboxTest::testSpuriousESearch()
     }
 }
 
+/** @short Recently used mailboxes shall stay selected on their own connections */
+void ImapModelObtainSynchronizedMailboxTest::testWarmConnectionPool()
+{
+    model->setMaxConnections(2);
+
+    // The connection which was used for the initial LIST is free, so it gets used
+    helperSyncBNoMessages();
+    QPointer<Streams::FakeSocket> connB = SOCK;
+
+    // Mailbox A gets a connection of its own, B remains selected
+    model->switchToMailbox(idxA);
+    QVERIFY(SOCK != connB.data());
+    TagGenerator t2;
+    cClient(t2.mk("SELECT a\r\n"));
+    cServer(QByteArray("* 0 exists\r\n") + t2.last("ok completed\r\n"));
+    cEmpty();
+    QCOMPARE(connB->writtenStuff(), QByteArray());
+
+    // Going back to B is instant
+    model->switchToMailbox(idxB);
+    cEmpty();
+    QCOMPARE(connB->writtenStuff(), QByteArray());
+
+    // The limit is reached, so the connection which has been used least recently is reused
+    model->switchToMailbox(idxC);
+    cClient(t2.mk("SELECT c\r\n"));
+    cServer(QByteArray("* 0 exists\r\n") + t2.last("ok completed\r\n"));
+    cEmpty();
+    QCOMPARE(connB->writtenStuff(), QByteArray());
+    QVERIFY(errorSpy->isEmpty());
+}
+
+void ImapModelObtainSynchronizedMailboxTest::testWarmConnectionPoolUsage_data()
+{
+    QTest::addColumn<bool>("readPart");
+    QTest::newRow("metadata-only") << false;
+    QTest::newRow("part-data") << true;
+}
+
+/** @short Only reading the message parts counts as a use of the mailbox, prefetching the metadata does not */
+void ImapModelObtainSynchronizedMailboxTest::testWarmConnectionPoolUsage()
+{
+    QFETCH(bool, readPart);
+    model->setMaxConnections(2);
+
+    helperSyncBNoMessages();
+    QPointer<Streams::FakeSocket> connB = SOCK;
+
+    model->switchToMailbox(idxA);
+    QPointer<Streams::FakeSocket> connA = SOCK;
+    QVERIFY(connA.data() != connB.data());
+    TagGenerator t2;
+    cClient(t2.mk("SELECT a\r\n"));
+    cServer(QByteArray("* 1 EXISTS\r\n* OK [UIDVALIDITY 333] .\r\n* OK [UIDNEXT 16] .\r\n") + t2.last("OK selected\r\n"));
+    cClient(t2.mk("UID SEARCH ALL\r\n"));
+    cServer(QByteArray("* SEARCH 15\r\n") + t2.last("OK search\r\n"));
+    cClient(t2.mk("FETCH 1 (FLAGS)\r\n"));
+    cServer(QByteArray("* 1 FETCH (FLAGS ())\r\n") + t2.last("OK flags\r\n"));
+    cEmpty();
+    QCOMPARE(model->rowCount(msgListA), 1);
+
+    // B is now the most recently used mailbox
+    model->switchToMailbox(idxB);
+    cEmpty();
+    QCOMPARE(connB->writtenStuff(), QByteArray());
+
+    QModelIndex msg = msgListA.child(0, 0);
+    QVERIFY(msg.isValid());
+    QCOMPARE(msg.data(Imap::Mailbox::RoleMessageSubject), QVariant());
+    cClient(t2.mk("UID FETCH 15 (" FETCH_METADATA_ITEMS ")\r\n"));
+    cServer(helperCreateTrivialEnvelope(1, 15, QStringLiteral("blah")) + t2.last("OK fetched\r\n"));
+    QCOMPARE(msg.data(Imap::Mailbox::RoleMessageSubject).toString(), QStringLiteral("blah"));
+
+    if (readPart) {
+        QModelIndex part = msg.child(0, 0);
+        QVERIFY(part.isValid());
+        QCOMPARE(part.data(Imap::Mailbox::RolePartData).toByteArray(), QByteArray());
+        cClient(t2.mk("UID FETCH 15 (BODY.PEEK[1])\r\n"));
+        cServer(QByteArray("* 1 FETCH (UID 15 BODY[1] \"foo\")\r\n") + t2.last("OK fetched\r\n"));
+        QCOMPARE(part.data(Imap::Mailbox::RolePartData).toByteArray(), QByteArray("foo"));
+    }
+    cEmpty();
+    QCOMPARE(connB->writtenStuff(), QByteArray());
+
+    model->switchToMailbox(idxC);
+    if (readPart) {
+        // Reading the part made A more recent than B, so B's connection gets reused
+        cEmpty();
+        QCOMPARE(connB->writtenStuff(), t.mk("SELECT c\r\n"));
+        connB->fakeReading(QByteArray("* 0 exists\r\n") + t.last("ok completed\r\n"));
+        TROJITA_CLIENT_LOOP
+        QCOMPARE(connB->writtenStuff(), QByteArray());
+    } else {
+        // The envelope was only prefetched, so A is still the least recently used mailbox
+        cClient(t2.mk("SELECT c\r\n"));
+        cServer(QByteArray("* 0 exists\r\n") + t2.last("ok completed\r\n"));
+        cEmpty();
+        QCOMPARE(connB->writtenStuff(), QByteArray());
+    }
+    QVERIFY(errorSpy->isEmpty());
+}
+
 /** @short Mailbox synchronization without the UIDNEXT -- this is what Courier 4.5.0 is happy to return */
 void ImapModelObtainSynchronizedMailboxTest::testSyncNoUidnext()
 {
@@ -48,6 +48,9 @@ private slots:
     void testSyncWithMessages();
     void testSyncTwoLikeCyrus();
     void testSyncTwoInParallel();
+    void testWarmConnectionPool();
+    void testWarmConnectionPoolUsage();
+    void testWarmConnectionPoolUsage_data();
     void testSyncNoUidnext();
     void testResyncNoArrivals();
     void testResyncOneNew();
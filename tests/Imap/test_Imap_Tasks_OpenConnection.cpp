@@ -408,6 +408,100 @@ void ImapModelOpenConnectionTest::testCompressDeflateNo()
     QCOMPARE(model->imapAuthError(), QString());
 }
 
+/** @short Check that a well-known server is not asked for its capabilities again after LOGIN */
+void ImapModelOpenConnectionTest::testRememberedCapabilities()
+{
+    const QStringList preAuth = QStringList() << QStringLiteral("IMAP4REV1") << QStringLiteral("LITERAL+");
+    const QStringList postAuth = QStringList() << QStringLiteral("IMAP4REV1") << QStringLiteral("LITERAL+") << QStringLiteral("ID");
+    model->setRememberedCapabilities(preAuth, postAuth);
+    QSignalSpy rememberedSpy(model, SIGNAL(capabilitiesRemembered(QStringList,QStringList)));
+
+    cEmpty();
+    cServer("* OK [CAPABILITY IMAP4rev1 LITERAL+] hi there\r\n");
+    QVERIFY(completedSpy->isEmpty());
+    // The ID is only valid in the authenticated state, so it has to wait for the tagged OK
+    cClient(t.mk("LOGIN luzr sikrit\r\n"));
+    QCOMPARE(authSpy->size(), 1);
+    // No CAPABILITY is needed after the LOGIN
+    cServer(t.last("OK logged in\r\n"));
+    cClient(t.mk("ID (\"name\" \"Trojita\")\r\n"));
+    cServer("* ID nil\r\n" + t.last("OK you courious peer\r\n"));
+    cEmpty();
+    QCOMPARE(completedSpy->size(), 1);
+    QVERIFY(failedSpy->isEmpty());
+    QCOMPARE(model->capabilities(), postAuth);
+    QCoreApplication::processEvents();
+    QVERIFY(rememberedSpy.isEmpty());
+}
+
+/** @short Check that the remembered capabilities are dropped when the reply to LOGIN says otherwise */
+void ImapModelOpenConnectionTest::testRememberedCapabilitiesRespCodeDiffers()
+{
+    const QStringList preAuth = QStringList() << QStringLiteral("IMAP4REV1") << QStringLiteral("LITERAL+");
+    model->setRememberedCapabilities(preAuth,
+                                     QStringList() << QStringLiteral("IMAP4REV1") << QStringLiteral("LITERAL+") << QStringLiteral("ID"));
+    QSignalSpy rememberedSpy(model, SIGNAL(capabilitiesRemembered(QStringList,QStringList)));
+
+    cEmpty();
+    cServer("* OK [CAPABILITY IMAP4rev1 LITERAL+] hi there\r\n");
+    cClient(t.mk("LOGIN luzr sikrit\r\n"));
+    // The server no longer supports ID, so we shall not send it
+    cServer(t.last("OK [CAPABILITY IMAP4rev1 LITERAL+] logged in\r\n"));
+    cEmpty();
+    QCOMPARE(completedSpy->size(), 1);
+    QVERIFY(failedSpy->isEmpty());
+    QCoreApplication::processEvents();
+    QCOMPARE(rememberedSpy.size(), 1);
+    QCOMPARE(rememberedSpy[0][0].toStringList(), preAuth);
+    QCOMPARE(rememberedSpy[0][1].toStringList(), preAuth);
+}
+
+/** @short Make sure that a rejected LOGIN does not lead to the post-login commands being sent twice */
+void ImapModelOpenConnectionTest::testRememberedCapabilitiesAuthRetry()
+{
+    const QStringList preAuth = QStringList() << QStringLiteral("IMAP4REV1") << QStringLiteral("LITERAL+");
+    model->setRememberedCapabilities(preAuth,
+                                     QStringList() << QStringLiteral("IMAP4REV1") << QStringLiteral("LITERAL+") << QStringLiteral("ID"));
+
+    cEmpty();
+    cServer("* OK [CAPABILITY IMAP4rev1 LITERAL+] hi there\r\n");
+    cClient(t.mk("LOGIN luzr sikrit\r\n"));
+    cServer(t.last("NO [AUTHENTICATIONFAILED] try again\r\n"));
+    QCOMPARE(authSpy->size(), 2);
+    // Nothing but the LOGIN itself gets repeated
+    cClient(t.mk("LOGIN luzr sikrit\r\n"));
+    cServer(t.last("OK logged in\r\n"));
+    cClient(t.mk("ID (\"name\" \"Trojita\")\r\n"));
+    cServer("* ID nil\r\n" + t.last("OK you courious peer\r\n"));
+    cEmpty();
+    QCOMPARE(completedSpy->size(), 1);
+    QVERIFY(failedSpy->isEmpty());
+}
+
+/** @short Check that the fast path is not used when the server has changed, and that the new state gets remembered */
+void ImapModelOpenConnectionTest::testRememberedCapabilitiesChanged()
+{
+    model->setRememberedCapabilities(QStringList() << QStringLiteral("IMAP4REV1") << QStringLiteral("LITERAL+"),
+                                     QStringList() << QStringLiteral("IMAP4REV1") << QStringLiteral("LITERAL+") << QStringLiteral("ID"));
+    QSignalSpy rememberedSpy(model, SIGNAL(capabilitiesRemembered(QStringList,QStringList)));
+
+    cEmpty();
+    cServer("* OK [CAPABILITY IMAP4rev1 LITERAL+ XYZZY] hi there\r\n");
+    QVERIFY(completedSpy->isEmpty());
+    cClient(t.mk("LOGIN luzr sikrit\r\n"));
+    cServer(t.last("OK logged in\r\n"));
+    cClient(t.mk("CAPABILITY\r\n"));
+    cServer("* CAPABILITY IMAP4rev1 LITERAL+ XYZZY\r\n" + t.last("OK capability completed\r\n"));
+    cEmpty();
+    QCOMPARE(completedSpy->size(), 1);
+    QVERIFY(failedSpy->isEmpty());
+    QCoreApplication::processEvents();
+    QCOMPARE(rememberedSpy.size(), 1);
+    const QStringList expected = QStringList() << QStringLiteral("IMAP4REV1") << QStringLiteral("LITERAL+") << QStringLiteral("XYZZY");
+    QCOMPARE(rememberedSpy[0][0].toStringList(), expected);
+    QCOMPARE(rememberedSpy[0][1].toStringList(), expected);
+}
+
 /** @short Make sure that as long as the OpenConnectionTask has not finished its job, nothing else will get queued */
 void ImapModelOpenConnectionTest::testOpenConnectionShallBlock()
 {
@@ -56,6 +56,11 @@ private slots:
     void testCompressDeflateOk();
     void testCompressDeflateNo();
 
+    void testRememberedCapabilities();
+    void testRememberedCapabilitiesChanged();
+    void testRememberedCapabilitiesRespCodeDiffers();
+    void testRememberedCapabilitiesAuthRetry();
+
     void testOpenConnectionShallBlock();
 
     void testLoginDelaysOtherTasks();
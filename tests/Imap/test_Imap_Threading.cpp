@@ -21,9 +21,16 @@
 */
 
 #include <algorithm>
+#include <limits>
 #include <QtTest>
 #include "test_Imap_Threading.h"
+#include "Imap/Model/CrossMailboxSearchModel.h"
+#include "Imap/Model/ItemRoles.h"
+#include "Imap/Model/LocalSorting.h"
+#include "Imap/Model/LocalThreading.h"
 #include "Imap/Model/MsgListModel.h"
+#include "Imap/Model/PrettyMsgListModel.h"
+#include "Imap/Model/QuickFilter.h"
 #include "Imap/Model/ThreadingMsgListModel.h"
 #include "Streams/FakeSocket.h"
 #include "Utils/FakeCapabilitiesInjector.h"
@@ -35,6 +42,7 @@
 #endif
 
 Q_DECLARE_METATYPE(Mapping);
+Q_DECLARE_METATYPE(QVector<Imap::Mailbox::LocalThreadingMessage>);
 
 /** @short Test that the ThreadingMsgListModel can process a static THREAD response */
 void ImapModelThreadingTest::testStaticThreading()
@@ -1234,6 +1242,236 @@ void ImapModelThreadingTest::testDynamicSearch()
     justKeepTask();
 }
 
+/** @short Repeated searches are answered from the cache, or refreshed by looking at the changed messages only */
+void ImapModelThreadingTest::testCachedSearchResults()
+{
+    FakeCapabilitiesInjector injector(model);
+    injector.injectCapability(QStringLiteral("QRESYNC"));
+
+    threadingModel->setUserWantsThreading(false);
+
+    Imap::Mailbox::SyncState sync;
+    sync.setExists(3);
+    sync.setUidValidity(666);
+    sync.setUidNext(15);
+    sync.setHighestModSeq(33);
+    sync.setUnSeenCount(3);
+    sync.setRecent(0);
+    Imap::Uids uidMap;
+    uidMap << 6 << 9 << 10;
+    model->cache()->setMailboxSyncState(QStringLiteral("a"), sync);
+    model->cache()->setUidMapping(QStringLiteral("a"), uidMap);
+    model->cache()->setMsgFlags(QStringLiteral("a"), 6, QStringList() << QStringLiteral("x"));
+    model->cache()->setMsgFlags(QStringLiteral("a"), 9, QStringList() << QStringLiteral("y"));
+    model->cache()->setMsgFlags(QStringLiteral("a"), 10, QStringList() << QStringLiteral("z"));
+    msgListModel->setMailbox(QStringLiteral("a"));
+    cClient(t.mk("SELECT a (QRESYNC (666 33 (2 9)))\r\n"));
+    cServer("* 3 EXISTS\r\n"
+            "* OK [UIDVALIDITY 666] .\r\n"
+            "* OK [UIDNEXT 15] .\r\n"
+            "* OK [HIGHESTMODSEQ 33] .\r\n"
+            );
+    cServer(t.last("OK selected\r\n"));
+    cEmpty();
+    checkUidMapFromThreading(uidMap);
+
+    // The search is about the flags so that a change in MODSEQ can actually change its result
+    const QStringList conditions = QStringList() << QStringLiteral("KEYWORD") << QStringLiteral("z");
+    threadingModel->setUserSearchingSortingPreference(conditions, threadingModel->currentSortCriterium(),
+                                                      threadingModel->currentSortOrder());
+    cClient(t.mk("UID SEARCH CHARSET utf-8 KEYWORD z\r\n"));
+    cServer("* SEARCH 10\r\n" + t.last("OK searched\r\n"));
+    checkUidMapFromThreading(Imap::Uids() << 10);
+
+    threadingModel->setUserSearchingSortingPreference(QStringList(), threadingModel->currentSortCriterium(),
+                                                      threadingModel->currentSortOrder());
+    checkUidMapFromThreading(uidMap);
+
+    // Nothing has changed, so the server is not asked at all
+    threadingModel->setUserSearchingSortingPreference(conditions, threadingModel->currentSortCriterium(),
+                                                      threadingModel->currentSortOrder());
+    cEmpty();
+    checkUidMapFromThreading(Imap::Uids() << 10);
+
+    threadingModel->setUserSearchingSortingPreference(QStringList(), threadingModel->currentSortCriterium(),
+                                                      threadingModel->currentSortOrder());
+    checkUidMapFromThreading(uidMap);
+
+    // A message gets the keyword, which means that only that one has to be checked. The server only ever reports
+    // the modified message, so UID 10 can only come from the cached result.
+    cServer("* 2 FETCH (UID 9 FLAGS (y z) MODSEQ (34))\r\n");
+    cEmpty();
+    threadingModel->setUserSearchingSortingPreference(conditions, threadingModel->currentSortCriterium(),
+                                                      threadingModel->currentSortOrder());
+    cClient(t.mk("UID SEARCH OR UID 15:* MODSEQ 34\r\n"));
+    cServer("* SEARCH 9 (MODSEQ 35)\r\n" + t.last("OK searched\r\n"));
+    cClient(t.mk("UID SEARCH CHARSET utf-8 UID 9 KEYWORD z\r\n"));
+    cServer("* SEARCH 9\r\n" + t.last("OK searched\r\n"));
+    checkUidMapFromThreading(Imap::Uids() << 9 << 10);
+
+    const QString cacheKey = QStringLiteral("SORT () SEARCH KEYWORD\nz");
+    Imap::Mailbox::AbstractCache::SearchResult cached;
+    QVERIFY(model->cache()->searchResult(QStringLiteral("a"), cacheKey, cached));
+    QCOMPARE(cached.uids, Imap::Uids() << 9 << 10);
+    QCOMPARE(cached.highestModSeq, 34ull);
+    QCOMPARE(cached.uidNext, 15u);
+    QCOMPARE(cached.uidValidity, 666u);
+
+    // A different search is not answered from the cache
+    threadingModel->setUserSearchingSortingPreference(QStringList() << QStringLiteral("KEYWORD") << QStringLiteral("y"),
+                                                      threadingModel->currentSortCriterium(),
+                                                      threadingModel->currentSortOrder());
+    cClient(t.mk("UID SEARCH CHARSET utf-8 KEYWORD y\r\n"));
+    cServer("* SEARCH 9\r\n" + t.last("OK searched\r\n"));
+    checkUidMapFromThreading(Imap::Uids() << 9);
+
+    // The UIDs are worthless under another UIDVALIDITY
+    sync.setUidValidity(667);
+    model->cache()->setMailboxSyncState(QStringLiteral("a"), sync);
+    QVERIFY(!model->cache()->searchResult(QStringLiteral("a"), cacheKey, cached));
+
+    cEmpty();
+    justKeepTask();
+}
+
+/** @short Test searching through several mailboxes, both with MULTISEARCH and without it */
+void ImapModelThreadingTest::testCrossMailboxSearch()
+{
+    Imap::Mailbox::CrossMailboxSearchModel results(this, model);
+    QSignalSpy searchedSpy(&results, SIGNAL(mailboxSearched(QString,int)));
+    QSignalSpy finishedSpy(&results, SIGNAL(searchFinished(int,qint64)));
+    QSignalSpy failedSpy(&results, SIGNAL(searchFailed(QString)));
+    const QStringList conditions = QStringList() << QStringLiteral("SUBJECT") << QStringLiteral("foo");
+
+    // With MULTISEARCH, a single command is enough and the results are shown as they arrive
+    FakeCapabilitiesInjector injector(model);
+    injector.injectCapability(QStringLiteral("MULTISEARCH"));
+    results.search(QStringList() << QStringLiteral("a") << QStringLiteral("c"), conditions);
+    cClient(t.mk("ESEARCH IN (MAILBOXES (a c)) RETURN (ALL) CHARSET utf-8 SUBJECT foo\r\n"));
+    cServer("* ESEARCH (TAG \"" + t.last() + "\" MAILBOX \"a\" UIDVALIDITY 666) UID ALL 3,5:6\r\n");
+    QCOMPARE(searchedSpy.size(), 1);
+    QCOMPARE(results.rowCount(), 3);
+    QVERIFY(results.isSearching());
+    cServer("* ESEARCH (TAG \"" + t.last() + "\" MAILBOX \"c\" UIDVALIDITY 333) UID ALL 10\r\n"
+            + t.last("OK searched\r\n"));
+    QCOMPARE(searchedSpy.size(), 2);
+    QCOMPARE(results.rowCount(), 4);
+    QCOMPARE(results.index(0).data(Imap::Mailbox::RoleMailboxName).toString(), QStringLiteral("a"));
+    QCOMPARE(results.index(2).data(Imap::Mailbox::RoleMessageUid).toUInt(), 6u);
+    QCOMPARE(results.index(3).data(Imap::Mailbox::RoleMailboxName).toString(), QStringLiteral("c"));
+    QCOMPARE(results.index(3).data(Imap::Mailbox::RoleMailboxUidValidity).toUInt(), 333u);
+    QCOMPARE(results.index(3).data(Imap::Mailbox::RoleMessageUid).toUInt(), 10u);
+    // Mailbox "c" has never been synced, so the message is not known yet
+    QVERIFY(!results.messageIndex(3).isValid());
+    QCOMPARE(finishedSpy.size(), 1);
+    QCOMPARE(finishedSpy[0][0].toInt(), 1);
+    QVERIFY(!results.isSearching());
+    QVERIFY(failedSpy.isEmpty());
+    cEmpty();
+    searchedSpy.clear();
+    finishedSpy.clear();
+    injector.removeCapability(QStringLiteral("MULTISEARCH"));
+
+    // A mailbox which does not exist is reported right away, and no connection is opened for it
+    results.search(QStringList() << QStringLiteral("nonexistent"), conditions);
+    QCOMPARE(failedSpy.size(), 1);
+    QCOMPARE(failedSpy[0][0].toString(), QStringLiteral("nonexistent"));
+    QCOMPARE(finishedSpy.size(), 1);
+    QCOMPARE(finishedSpy[0][0].toInt(), 0);
+    failedSpy.clear();
+    finishedSpy.clear();
+    cEmpty();
+
+    // Without MULTISEARCH, the mailboxes are EXAMINEd one by one on a new connection, the existing one is left alone
+    QPointer<Streams::FakeSocket> mainConn = SOCK;
+    results.search(QStringList() << QStringLiteral("b") << QStringLiteral("c"), conditions);
+    QVERIFY(results.isSearching());
+    for (int i = 0; i < 5; ++i)
+        QCoreApplication::processEvents();
+    QVERIFY(SOCK != mainConn.data());
+    TagGenerator t2;
+    QByteArray c1 = t2.mk("EXAMINE b\r\n");
+    QByteArray r1 = t2.last("OK [READ-ONLY] examined\r\n");
+    QByteArray c2 = t2.mk("UID SEARCH CHARSET utf-8 SUBJECT foo\r\n");
+    QByteArray r2 = t2.last("OK searched\r\n");
+    QByteArray c3 = t2.mk("EXAMINE c\r\n");
+    QByteArray r3 = t2.last("NO no such mailbox\r\n");
+    QByteArray c4 = t2.mk("UID SEARCH CHARSET utf-8 SUBJECT foo\r\n");
+    QByteArray r4 = t2.last("BAD no mailbox selected\r\n");
+    cClient(c1 + c2 + c3 + c4);
+    cServer("* 7 EXISTS\r\n* 0 RECENT\r\n* OK [UIDVALIDITY 666] .\r\n" + r1 + "* SEARCH 5 2\r\n" + r2);
+    QCOMPARE(searchedSpy.size(), 1);
+    QCOMPARE(searchedSpy[0][0].toString(), QStringLiteral("b"));
+    QCOMPARE(searchedSpy[0][1].toInt(), 2);
+    QCOMPARE(results.rowCount(), 2);
+    QCOMPARE(results.index(0).data(Imap::Mailbox::RoleMailboxUidValidity).toUInt(), 666u);
+    QCOMPARE(results.index(0).data(Imap::Mailbox::RoleMessageUid).toUInt(), 2u);
+    QCOMPARE(results.index(1).data(Imap::Mailbox::RoleMessageUid).toUInt(), 5u);
+    QVERIFY(results.isSearching());
+    cServer(r3 + r4);
+    QCOMPARE(failedSpy.size(), 1);
+    QCOMPARE(failedSpy[0][0].toString(), QStringLiteral("c"));
+    QCOMPARE(finishedSpy.size(), 1);
+    QCOMPARE(finishedSpy[0][0].toInt(), 1);
+    QVERIFY(!results.isSearching());
+    // The connection is not needed anymore
+    cClient(t2.mk("LOGOUT\r\n"));
+    QCOMPARE(mainConn->writtenStuff(), QByteArray());
+    searchedSpy.clear();
+    finishedSpy.clear();
+    failedSpy.clear();
+
+    // With more connections allowed, the mailboxes are shared among them and searched in parallel
+    model->setMaxConnections(2);
+    const int previousSockets = factory->sockets().size();
+    results.search(QStringList() << QStringLiteral("a") << QStringLiteral("b") << QStringLiteral("c"), conditions);
+    for (int i = 0; i < 5; ++i)
+        QCoreApplication::processEvents();
+    QList<Streams::Socket *> sockets = factory->sockets();
+    QCOMPARE(sockets.size(), previousSockets + 2);
+    Streams::FakeSocket *conn1 = static_cast<Streams::FakeSocket *>(sockets[previousSockets]);
+    Streams::FakeSocket *conn2 = static_cast<Streams::FakeSocket *>(sockets[previousSockets + 1]);
+    TagGenerator t3, t4;
+    QByteArray e1 = t3.mk("EXAMINE a\r\n");
+    QByteArray re1 = t3.last("OK [READ-ONLY] examined\r\n");
+    QByteArray s1 = t3.mk("UID SEARCH CHARSET utf-8 SUBJECT foo\r\n");
+    QByteArray rs1 = t3.last("OK searched\r\n");
+    QByteArray e2 = t3.mk("EXAMINE c\r\n");
+    QByteArray re2 = t3.last("OK [READ-ONLY] examined\r\n");
+    QByteArray s2 = t3.mk("UID SEARCH CHARSET utf-8 SUBJECT foo\r\n");
+    QByteArray rs2 = t3.last("OK searched\r\n");
+    TROJITA_CLIENT_LOOP
+    QCOMPARE(conn1->writtenStuff(), e1 + s1 + e2 + s2);
+    QByteArray e3 = t4.mk("EXAMINE b\r\n");
+    QByteArray re3 = t4.last("OK [READ-ONLY] examined\r\n");
+    QByteArray s3 = t4.mk("UID SEARCH CHARSET utf-8 SUBJECT foo\r\n");
+    QByteArray rs3 = t4.last("OK searched\r\n");
+    QCOMPARE(conn2->writtenStuff(), e3 + s3);
+    // The second connection answers first
+    conn2->fakeReading("* OK [UIDVALIDITY 1] .\r\n" + re3 + "* SEARCH 1\r\n" + rs3);
+    for (int i = 0; i < 4; ++i)
+        QCoreApplication::processEvents();
+    QCOMPARE(searchedSpy.size(), 1);
+    QCOMPARE(searchedSpy[0][0].toString(), QStringLiteral("b"));
+    QVERIFY(results.isSearching());
+    conn1->fakeReading("* OK [UIDVALIDITY 2] .\r\n" + re1 + "* SEARCH\r\n" + rs1
+                       + "* OK [UIDVALIDITY 3] .\r\n" + re2 + "* SEARCH 4 8\r\n" + rs2);
+    for (int i = 0; i < 4; ++i)
+        QCoreApplication::processEvents();
+    QCOMPARE(searchedSpy.size(), 3);
+    QCOMPARE(searchedSpy[1][0].toString(), QStringLiteral("a"));
+    QCOMPARE(searchedSpy[2][0].toString(), QStringLiteral("c"));
+    QCOMPARE(results.rowCount(), 3);
+    QCOMPARE(finishedSpy.size(), 1);
+    QCOMPARE(finishedSpy[0][0].toInt(), 2);
+    QVERIFY(!results.isSearching());
+    QVERIFY(failedSpy.isEmpty());
+    TROJITA_CLIENT_LOOP
+    QCOMPARE(conn1->writtenStuff(), t3.mk("LOGOUT\r\n"));
+    QCOMPARE(conn2->writtenStuff(), t4.mk("LOGOUT\r\n"));
+    QCOMPARE(mainConn->writtenStuff(), QByteArray());
+}
+
 QByteArray ImapModelThreadingTest::prepareHugeUntaggedThread(const uint num)
 {
     QString sampleThread = QStringLiteral("(%1 (%2 %3 (%4)(%5 %6 %7))(%8 %9 %10))");
@@ -1287,6 +1525,11 @@ void ImapModelThreadingTest::testThreadingPerformance()
         QCoreApplication::processEvents();
         QCoreApplication::processEvents();
         QCoreApplication::processEvents();
+        if (threadingModel->isThreadingInProgress()) {
+            // Big mailboxes are threaded in the background
+            QSignalSpy threadingDone(threadingModel, SIGNAL(threadingInProgressChanged(bool)));
+            QVERIFY(threadingDone.wait(60000));
+        }
         model->cache()->setMessageThreading(QStringLiteral("a"), QVector<Imap::Responses::ThreadingNode>());
         threadingModel->wantThreading();
         QCoreApplication::processEvents();
@@ -1423,14 +1666,185 @@ void ImapModelThreadingTest::testIncrementalThreading()
 
     // Test the incremental threading
     cClient(t.mk("UID THREAD RETURN (INCTHREAD) REFS utf-8 INTHREAD REFS UID 11:*\r\n"));
+    QSignalSpy layoutChangedSpy(threadingModel, SIGNAL(layoutChanged()));
+    QSignalSpy rowsMovedSpy(threadingModel, SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)));
+    QPersistentModelIndex msg4 = findItem(QStringLiteral("2"));
+    QCOMPARE(msg4.data(Imap::Mailbox::RoleMessageUid).toUInt(), 4u);
     // Yes, it's a rather funky response
     cServer("* ESEARCH (TAG \"" + t.last() + "\") UID INCTHREAD 2 (7 (8 9 11)(10))\r\n");
     QCOMPARE(treeToThreading(QModelIndex()), QByteArray("(1)(2 3)(7 (8 9 11)(10))(4 (5)(6))"));
+    // The update shall be performed through moves of the affected messages, not through a reset of the whole layout
+    QCOMPARE(layoutChangedSpy.size(), 0);
+    QCOMPARE(rowsMovedSpy.size(), 4);
+    QVERIFY(msg4.isValid());
+    QCOMPARE(msg4.row(), 3);
     cServer(t.last("OK done\r\n"));
 
     cEmpty();
 }
 
+/** @short A new arrival is moved into its thread without a layout change */
+void ImapModelThreadingTest::testThreadingArrivalMoves()
+{
+    initialMessages(4);
+    cClient(t.mk("UID THREAD REFS utf-8 ALL\r\n"));
+    cServer("* THREAD (1 2)(3)(4)\r\n" + t.last("OK thread\r\n"));
+    QCOMPARE(treeToThreading(QModelIndex()), QByteArray("(1 2)(3)(4)"));
+    QPersistentModelIndex msg2 = findItem(QStringLiteral("0.0"));
+    QPersistentModelIndex msg3 = findItem(QStringLiteral("1"));
+    QPersistentModelIndex msg4 = findItem(QStringLiteral("2"));
+
+    cServer("* 5 EXISTS\r\n");
+    cClient(t.mk("UID FETCH 5:* (FLAGS)\r\n"));
+    cServer("* 5 FETCH (UID 5 FLAGS ())\r\n" + t.last("OK fetch\r\n"));
+    QCOMPARE(treeToThreading(QModelIndex()), QByteArray("(1 2)(3)(4)(5)"));
+
+    cClient(t.mk("UID THREAD REFS utf-8 ALL\r\n"));
+    QSignalSpy layoutChangedSpy(threadingModel, SIGNAL(layoutChanged()));
+    QSignalSpy rowsMovedSpy(threadingModel, SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)));
+    cServer("* THREAD (1 2)(3 5)(4)\r\n" + t.last("OK thread\r\n"));
+    QCOMPARE(treeToThreading(QModelIndex()), QByteArray("(1 2)(3 5)(4)"));
+    QCOMPARE(layoutChangedSpy.size(), 0);
+    QCOMPARE(rowsMovedSpy.size(), 1);
+    QCOMPARE(rowsMovedSpy[0][0].toModelIndex(), QModelIndex());
+    QCOMPARE(rowsMovedSpy[0][1].toInt(), 3);
+    QCOMPARE(rowsMovedSpy[0][3].toModelIndex(), QModelIndex(msg3));
+    QCOMPARE(rowsMovedSpy[0][4].toInt(), 0);
+    QCOMPARE(msg2.row(), 0);
+    QCOMPARE(msg3.row(), 1);
+    QCOMPARE(msg4.row(), 2);
+    QCOMPARE(threadingModel->rowCount(msg3), 1);
+
+    // The very same threading once again shall not change anything
+    rowsMovedSpy.clear();
+    threadingModel->wantThreading();
+    QCOMPARE(treeToThreading(QModelIndex()), QByteArray("(1 2)(3 5)(4)"));
+    QCOMPARE(layoutChangedSpy.size(), 0);
+    QCOMPARE(rowsMovedSpy.size(), 0);
+    cEmpty();
+}
+
+/** @short The per-thread counters follow the flag changes, arrivals and expunges */
+void ImapModelThreadingTest::testThreadAggregates()
+{
+    using namespace Imap::Mailbox;
+    initialMessages(4);
+    cClient(t.mk("UID THREAD REFS utf-8 ALL\r\n"));
+    cServer("* THREAD (1 2 3)(4)\r\n" + t.last("OK thread\r\n"));
+    cServer("* 1 FETCH (FLAGS (\\Seen))\r\n* 2 FETCH (FLAGS ())\r\n* 3 FETCH (FLAGS (\\Flagged foo))\r\n"
+            "* 4 FETCH (FLAGS (\\Seen))\r\n");
+    QCOMPARE(treeToThreading(QModelIndex()), QByteArray("(1 2 3)(4)"));
+    QPersistentModelIndex msg1 = findItem(QStringLiteral("0"));
+    QPersistentModelIndex msg2 = findItem(QStringLiteral("0.0"));
+    QPersistentModelIndex msg4 = findItem(QStringLiteral("1"));
+
+    QCOMPARE(msg1.data(RoleThreadMessageCount).toInt(), 3);
+    QCOMPARE(msg1.data(RoleThreadUnreadCount).toInt(), 2);
+    QCOMPARE(msg1.data(RoleThreadFlaggedCount).toInt(), 1);
+    QCOMPARE(msg1.data(RoleThreadRootWithUnreadMessages).toBool(), true);
+    QVERIFY(msg1.data(RoleThreadAggregatedFlags).toStringList().contains(QStringLiteral("foo")));
+    QCOMPARE(msg2.data(RoleThreadMessageCount).toInt(), 2);
+    QCOMPARE(msg2.data(RoleThreadUnreadCount).toInt(), 2);
+    QCOMPARE(msg4.data(RoleThreadMessageCount).toInt(), 1);
+    QCOMPARE(msg4.data(RoleThreadUnreadCount).toInt(), 0);
+    QCOMPARE(msg4.data(RoleThreadRootWithUnreadMessages).toBool(), false);
+
+    // A change of flags of a nested message has to propagate to all of its ancestors
+    QSignalSpy dataChangedSpy(threadingModel, SIGNAL(dataChanged(QModelIndex,QModelIndex)));
+    cServer("* 3 FETCH (FLAGS (\\Seen))\r\n");
+    bool rootRefreshed = false, parentRefreshed = false;
+    for (const auto &signal : dataChangedSpy) {
+        rootRefreshed |= signal[0].toModelIndex() == QModelIndex(msg1);
+        parentRefreshed |= signal[0].toModelIndex() == QModelIndex(msg2);
+    }
+    QVERIFY(rootRefreshed);
+    QVERIFY(parentRefreshed);
+    QCOMPARE(msg1.data(RoleThreadUnreadCount).toInt(), 1);
+    QCOMPARE(msg1.data(RoleThreadFlaggedCount).toInt(), 0);
+    QVERIFY(!msg1.data(RoleThreadAggregatedFlags).toStringList().contains(QStringLiteral("foo")));
+    QCOMPARE(msg2.data(RoleThreadUnreadCount).toInt(), 1);
+
+    // A new arrival is counted once it gets threaded into place
+    cServer("* 5 EXISTS\r\n");
+    cClient(t.mk("UID FETCH 5:* (FLAGS)\r\n"));
+    cServer("* 5 FETCH (UID 5 FLAGS (\\Flagged))\r\n" + t.last("OK fetch\r\n"));
+    cClient(t.mk("UID THREAD REFS utf-8 ALL\r\n"));
+    cServer("* THREAD (1 2 (3)(5))(4)\r\n" + t.last("OK thread\r\n"));
+    QCOMPARE(msg1.data(RoleThreadMessageCount).toInt(), 4);
+    QCOMPARE(msg1.data(RoleThreadUnreadCount).toInt(), 2);
+    QCOMPARE(msg1.data(RoleThreadFlaggedCount).toInt(), 1);
+    QCOMPARE(msg2.data(RoleThreadMessageCount).toInt(), 3);
+
+    // An expunged message no longer counts, even before the tree gets pruned
+    cServer("* 3 EXPUNGE\r\n");
+    QCOMPARE(msg1.data(RoleThreadMessageCount).toInt(), 3);
+    QCOMPARE(msg2.data(RoleThreadMessageCount).toInt(), 2);
+    QCOMPARE(msg2.data(RoleThreadUnreadCount).toInt(), 2);
+    cEmpty();
+}
+
+/** @short The thread tree of a big mailbox is built in the background while the flat list remains usable */
+void ImapModelThreadingTest::testBackgroundThreading()
+{
+    threadingModel->setBackgroundThreadingThreshold(1);
+    QSignalSpy inProgressSpy(threadingModel, SIGNAL(threadingInProgressChanged(bool)));
+    initialMessages(4);
+    QPersistentModelIndex msg2 = findItem(QStringLiteral("1"));
+    QCOMPARE(msg2.data(Imap::Mailbox::RoleMessageUid).toUInt(), 2u);
+    cClient(t.mk("UID THREAD REFS utf-8 ALL\r\n"));
+    cServer("* THREAD (1 2)(3 4)\r\n" + t.last("OK thread\r\n"));
+    QVERIFY(!inProgressSpy.isEmpty());
+    QCOMPARE(inProgressSpy[0][0].toBool(), true);
+    if (threadingModel->isThreadingInProgress()) {
+        // Nothing has changed yet
+        QCOMPARE(treeToThreading(QModelIndex()), QByteArray("(1)(2)(3)(4)"));
+        QVERIFY(inProgressSpy.wait());
+    }
+    QCOMPARE(inProgressSpy.size(), 2);
+    QCOMPARE(inProgressSpy[1][0].toBool(), false);
+    QCOMPARE(treeToThreading(QModelIndex()), QByteArray("(1 2)(3 4)"));
+    // The tree got swapped in through a layout change, so the persistent indexes were kept up to date
+    QVERIFY(msg2.isValid());
+    QCOMPARE(msg2.parent(), QModelIndex(findItem(QStringLiteral("0"))));
+    QCOMPARE(msg2.data(Imap::Mailbox::RoleMessageUid).toUInt(), 2u);
+    cEmpty();
+}
+
+/** @short Messages which arrive or vanish while the tree is being built in the background are merged into that tree */
+void ImapModelThreadingTest::testStaleBackgroundThreading()
+{
+    threadingModel->setBackgroundThreadingThreshold(1);
+    QSignalSpy inProgressSpy(threadingModel, SIGNAL(threadingInProgressChanged(bool)));
+    initialMessages(4);
+    cClient(t.mk("UID THREAD REFS utf-8 ALL\r\n"));
+    // The tree is only delivered through the event loop, so these changes are guaranteed to happen while it is being built
+    cServer("* THREAD (1 2)(3 4)\r\n" + t.last("OK thread\r\n") + "* 2 EXPUNGE\r\n* 4 EXISTS\r\n");
+    QVERIFY(!inProgressSpy.isEmpty());
+    QCOMPARE(inProgressSpy[0][0].toBool(), true);
+    cClient(t.mk("UID FETCH 5:* (FLAGS)\r\n"));
+    if (threadingModel->isThreadingInProgress()) {
+        QVERIFY(inProgressSpy.wait());
+    }
+    QCOMPARE(inProgressSpy.last()[0].toBool(), false);
+    // The tree was not thrown away: the threading is in place, the expunged message is gone and the new one is a new root
+    QCOMPARE(threadingModel->rowCount(QModelIndex()), 3);
+    QVERIFY(treeToThreading(QModelIndex()).startsWith("(1)(3 4)("));
+    QModelIndex msg3 = findItem(QStringLiteral("1"));
+    QCOMPARE(msg3.data(Imap::Mailbox::RoleMessageUid).toUInt(), 3u);
+    QCOMPARE(threadingModel->rowCount(msg3), 1);
+    QVERIFY(!findItem(QStringLiteral("2")).data(Imap::Mailbox::RoleMessageUid).toUInt());
+
+    // Once the UID is known, the new arrival gets threaded as usual
+    cServer("* 4 FETCH (UID 5 FLAGS ())\r\n" + t.last("OK fetched\r\n"));
+    cClient(t.mk("UID THREAD REFS utf-8 ALL\r\n"));
+    cServer("* THREAD (1)(3 (4)(5))\r\n" + t.last("OK thread\r\n"));
+    if (threadingModel->isThreadingInProgress()) {
+        QVERIFY(inProgressSpy.wait());
+    }
+    QCOMPARE(treeToThreading(QModelIndex()), QByteArray("(1)(3 (4)(5))"));
+    cEmpty();
+}
+
 /** Test what happens when a thread root ceases to exist while the THREAD response is in flight */
 void ImapModelThreadingTest::testRemovingRootWithThreadingInFlight()
 {
@@ -1647,4 +2061,506 @@ void ImapModelThreadingTest::testESearchResults()
     QCOMPARE(threadingModel->rowCount(), 0);
 }
 
+/** @short Format the threading in the same way as an IMAP server does in its THREAD response */
+static QByteArray threadingToString(const QVector<Imap::Responses::ThreadingNode> &mapping, const bool topLevel = true)
+{
+    QByteArray res;
+    for (const auto &node : mapping) {
+        QByteArray item = node.num ? QByteArray::number(node.num) : QByteArray();
+        if (node.children.size() == 1) {
+            item += ' ' + threadingToString(node.children, false);
+        } else if (!node.children.isEmpty()) {
+            if (node.num)
+                item += ' ';
+            for (const auto &child : node.children)
+                item += '(' + threadingToString(QVector<Imap::Responses::ThreadingNode>() << child, false) + ')';
+        }
+        res += topLevel ? '(' + item + ')' : item;
+    }
+    return res;
+}
+
+/** @short A FETCH response with the metadata of a @arg message, as the model asks for them */
+static QByteArray threadingMetadataResponse(const uint seq, const Imap::Mailbox::LocalThreadingMessage &message)
+{
+    QByteArray headers;
+    for (QByteArray id : message.references) {
+        if (id.startsWith('<'))
+            id = id.mid(1, id.size() - 2);
+        headers += (headers.isEmpty() ? "References: <" : " <") + id + '>';
+    }
+    if (!headers.isEmpty())
+        headers += "\r\n";
+    headers += "\r\n";
+    return "* " + QByteArray::number(seq) + " FETCH (UID " + QByteArray::number(message.uid) +
+            " RFC822.SIZE 89 INTERNALDATE \"01-Jan-2014 12:00:00 +0000\" ENVELOPE (\"" +
+            QLocale::c().toString(message.date, QStringLiteral("ddd, d MMM yyyy hh:mm:ss +0000")).toUtf8() + "\" \"" +
+            message.subject.toUtf8() + "\" NIL NIL NIL NIL NIL NIL NIL \"" + message.messageId + "\") "
+            "BODYSTRUCTURE (\"text\" \"plain\" () NIL NIL NIL 19 2 NIL NIL NIL NIL) "
+            "BODY[HEADER.FIELDS (References List-Post)] {" + QByteArray::number(headers.size()) + "}\r\n" + headers + ")\r\n";
+}
+
+/** @short Envelope of a made-up message which was sent on the @arg day of January 2014
+
+The sender is used as a display name unless it looks like an e-mail address.
+*/
+static Imap::Message::Envelope fakeEnvelope(const QString &subject, const int day, const QByteArray &messageId = QByteArray(),
+                                            const QString &from = QString(),
+                                            const QList<QByteArray> &inReplyTo = QList<QByteArray>())
+{
+    Imap::Message::Envelope envelope;
+    envelope.messageId = messageId;
+    envelope.subject = subject;
+    envelope.date = QDateTime(QDate(2014, 1, day), QTime(12, 0), Qt::UTC);
+    envelope.inReplyTo = inReplyTo;
+    if (!from.isEmpty()) {
+        Imap::Message::MailAddress address;
+        if (!from.contains(QLatin1Char('@'))) {
+            address.name = from;
+            address.mailbox = QStringLiteral("someone");
+            address.host = QStringLiteral("example.org");
+        } else {
+            address.mailbox = from.section(QLatin1Char('@'), 0, 0);
+            address.host = from.section(QLatin1Char('@'), 1);
+        }
+        envelope.from << address;
+        envelope.to << address;
+    }
+    return envelope;
+}
+
+/** @short The time of arrival of a made-up message, on the @arg day of February 2014 */
+static QDateTime arrival(const int day)
+{
+    return QDateTime(QDate(2014, 2, day), QTime(12, 0), Qt::UTC);
+}
+
+/** @short The client-side threading has to produce the same result as a server which implements THREAD=REFERENCES */
+void ImapModelThreadingTest::testLocalThreading()
+{
+    QFETCH(QVector<Imap::Mailbox::LocalThreadingMessage>, messages);
+    QFETCH(QByteArray, response);
+    QFETCH(QByteArray, shown);
+
+    Imap::Mailbox::LocalThreader threader;
+    threader.addMessages(messages);
+    QCOMPARE(threader.messageCount(), messages.size());
+    QCOMPARE(threadingToString(threader.threading()), response);
+
+    // The whole way through the model, with a server which cannot thread. The envelopes are not known at first, so the model
+    // has to fetch them before the messages get threaded.
+    FakeCapabilitiesInjector injector(model);
+    injector.removeCapability(QStringLiteral("THREAD=REFS"));
+    initialMessages(messages.size());
+    cClient(t.mk(QStringLiteral("UID FETCH 1:%1 (" FETCH_METADATA_ITEMS ")\r\n").arg(QString::number(messages.size())).toUtf8()));
+    QByteArray fetchResponse;
+    for (int i = 0; i < messages.size(); ++i) {
+        QCOMPARE(messages[i].uid, static_cast<uint>(i + 1));
+        fetchResponse += threadingMetadataResponse(i + 1, messages[i]);
+    }
+    cServer(fetchResponse + t.last("OK fetched\r\n"));
+    QTRY_COMPARE(treeToThreading(QModelIndex()), shown);
+    cEmpty();
+    QVERIFY(errorSpy->isEmpty());
+}
+
+void ImapModelThreadingTest::testLocalThreading_data()
+{
+    using Imap::Mailbox::LocalThreadingMessage;
+    typedef QVector<LocalThreadingMessage> Messages;
+    typedef QList<QByteArray> Ids;
+    QTest::addColumn<Messages>("messages");
+    // What RFC 5256 says that the THREAD=REFERENCES response shall be, worked out by hand
+    QTest::addColumn<QByteArray>("response");
+    // ...and how that looks like in the model, where the dummy nodes are replaced by their first child
+    QTest::addColumn<QByteArray>("shown");
+
+    QTest::newRow("replies")
+            << (Messages()
+                << LocalThreadingMessage(1, fakeEnvelope(QStringLiteral("Hello"), 1, "<a@x>"), Ids(), QDateTime())
+                << LocalThreadingMessage(2, fakeEnvelope(QStringLiteral("Re: Hello"), 2, "<b@x>"), Ids() << "a@x", QDateTime())
+                << LocalThreadingMessage(3, fakeEnvelope(QStringLiteral("Re: Hello"), 3, "<c@x>"), Ids() << "a@x" << "b@x", QDateTime())
+                << LocalThreadingMessage(4, fakeEnvelope(QStringLiteral("Other"), 4, "<d@x>"), Ids(), QDateTime())
+                << LocalThreadingMessage(5, fakeEnvelope(QStringLiteral("Re: Hello"), 5, "<e@x>"), Ids() << "a@x", QDateTime()))
+            << QByteArray("(1 (2 3)(5))(4)")
+            << QByteArray("(1 (2 3)(5))(4)");
+
+    QTest::newRow("missing-parent")
+            << (Messages()
+                << LocalThreadingMessage(1, fakeEnvelope(QStringLiteral("Topic"), 1, "<b@x>"), Ids() << "a@x", QDateTime())
+                << LocalThreadingMessage(2, fakeEnvelope(QStringLiteral("Re: Topic"), 2, "<c@x>"), Ids() << "a@x", QDateTime())
+                << LocalThreadingMessage(3, fakeEnvelope(QStringLiteral("Unrelated"), 3, "<z@x>"), Ids(), QDateTime()))
+            << QByteArray("((1)(2))(3)")
+            << QByteArray("(1 2)(3)");
+
+    QTest::newRow("in-reply-to")
+            << (Messages()
+                << LocalThreadingMessage(1, fakeEnvelope(QStringLiteral("Question"), 1, "<a@x>"), Ids(), QDateTime())
+                << LocalThreadingMessage(2, fakeEnvelope(QStringLiteral("Answer"), 2, "<b@x>", QString(), Ids() << "<a@x>"), Ids(), QDateTime()))
+            << QByteArray("(1 2)")
+            << QByteArray("(1 2)");
+
+    QTest::newRow("subject-reply")
+            << (Messages()
+                << LocalThreadingMessage(1, fakeEnvelope(QStringLiteral("Meeting"), 1, "<a@x>"), Ids(), QDateTime())
+                << LocalThreadingMessage(2, fakeEnvelope(QStringLiteral("Re: Meeting"), 2, "<b@x>"), Ids(), QDateTime())
+                << LocalThreadingMessage(3, fakeEnvelope(QStringLiteral("Lunch"), 3, "<c@x>"), Ids(), QDateTime()))
+            << QByteArray("(1 2)(3)")
+            << QByteArray("(1 2)(3)");
+
+    QTest::newRow("subject-same")
+            << (Messages()
+                << LocalThreadingMessage(1, fakeEnvelope(QStringLiteral("Status"), 1, "<a@x>"), Ids(), QDateTime())
+                << LocalThreadingMessage(2, fakeEnvelope(QStringLiteral("status"), 2, "<b@x>"), Ids(), QDateTime()))
+            << QByteArray("((1)(2))")
+            << QByteArray("(1 2)");
+
+    QTest::newRow("subject-blob")
+            << (Messages()
+                << LocalThreadingMessage(1, fakeEnvelope(QStringLiteral("[list] Announcement"), 1, "<a@x>"), Ids(), QDateTime())
+                << LocalThreadingMessage(2, fakeEnvelope(QStringLiteral("Re: [list] Announcement"), 2, "<b@x>"), Ids(), QDateTime()))
+            << QByteArray("(1 2)")
+            << QByteArray("(1 2)");
+
+    QTest::newRow("date-order")
+            << (Messages()
+                << LocalThreadingMessage(1, fakeEnvelope(QStringLiteral("Late"), 5, "<a@x>"), Ids(), QDateTime())
+                << LocalThreadingMessage(2, fakeEnvelope(QStringLiteral("Early"), 1, "<b@x>"), Ids(), QDateTime()))
+            << QByteArray("(2)(1)")
+            << QByteArray("(2)(1)");
+
+    QTest::newRow("duplicate-message-id")
+            << (Messages()
+                << LocalThreadingMessage(1, fakeEnvelope(QStringLiteral("One"), 1, "<a@x>"), Ids(), QDateTime())
+                << LocalThreadingMessage(2, fakeEnvelope(QStringLiteral("Two"), 2, "<a@x>"), Ids(), QDateTime())
+                << LocalThreadingMessage(3, fakeEnvelope(QStringLiteral("Re: One"), 3, "<c@x>"), Ids() << "a@x", QDateTime()))
+            << QByteArray("(1 3)(2)")
+            << QByteArray("(1 3)(2)");
+
+    QTest::newRow("reference-loop")
+            << (Messages()
+                << LocalThreadingMessage(1, fakeEnvelope(QStringLiteral("Loop"), 1, "<a@x>"), Ids() << "b@x", QDateTime())
+                << LocalThreadingMessage(2, fakeEnvelope(QStringLiteral("Re: Loop"), 2, "<b@x>"), Ids() << "a@x", QDateTime()))
+            << QByteArray("(2 1)")
+            << QByteArray("(2 1)");
+}
+
+/** @short Adding new arrivals to the client-side threading is the same as threading everything at once */
+void ImapModelThreadingTest::testLocalThreadingIncremental()
+{
+    using Imap::Mailbox::LocalThreadingMessage;
+    typedef QList<QByteArray> Ids;
+    QVector<LocalThreadingMessage> older, newer;
+    older << LocalThreadingMessage(1, fakeEnvelope(QStringLiteral("Hello"), 1, "<a@x>"), Ids(), QDateTime())
+          << LocalThreadingMessage(2, fakeEnvelope(QStringLiteral("Re: Hello"), 2, "<b@x>"), Ids() << "a@x", QDateTime())
+          << LocalThreadingMessage(4, fakeEnvelope(QStringLiteral("Other"), 4, "<d@x>"), Ids(), QDateTime());
+    // The first new arrival refers to a message which is not known yet
+    newer << LocalThreadingMessage(6, fakeEnvelope(QStringLiteral("Re: Hello"), 6, "<e@x>"), Ids() << "a@x" << "b@x" << "c@x",
+                                   QDateTime())
+          << LocalThreadingMessage(7, fakeEnvelope(QStringLiteral("Re: Hello"), 5, "<c@x>"), Ids() << "a@x" << "b@x", QDateTime());
+
+    Imap::Mailbox::LocalThreader threader;
+    threader.addMessages(older);
+    QCOMPARE(threadingToString(threader.threading()), QByteArray("(1 2)(4)"));
+    threader.addMessages(newer);
+    QCOMPARE(threadingToString(threader.threading()), QByteArray("(1 2 7 6)(4)"));
+
+    Imap::Mailbox::LocalThreader full;
+    full.addMessages(older + newer);
+    QCOMPARE(threadingToString(full.threading()), QByteArray("(1 2 7 6)(4)"));
+
+    // An expunged message still keeps its thread together
+    threader.retainMessages(Imap::Uids() << 1 << 4 << 6 << 7);
+    QCOMPARE(threader.messageCount(), 4);
+    QCOMPARE(threadingToString(threader.threading()), QByteArray("(1 7 6)(4)"));
+
+    // The same through the background thread; the result of the superseded request is not delivered, but its messages stay
+    Imap::Mailbox::LocalThreadingWorker worker;
+    QSignalSpy spy(&worker, SIGNAL(threadingAvailable(QVector<Imap::Responses::ThreadingNode>)));
+    worker.request(older, Imap::Uids() << 1 << 2 << 4, false);
+    worker.request(newer, Imap::Uids() << 1 << 2 << 4 << 6 << 7, true);
+    QVERIFY(spy.wait());
+    QCOMPARE(spy.size(), 1);
+    QCOMPARE(threadingToString(spy[0][0].value<QVector<Imap::Responses::ThreadingNode>>()), QByteArray("(1 2 7 6)(4)"));
+}
+
+/** @short A reply chain which is several thousand messages deep must not exhaust the stack */
+void ImapModelThreadingTest::testLocalThreadingDeep()
+{
+    using Imap::Mailbox::LocalThreadingMessage;
+    const int depth = 5000;
+    QVector<LocalThreadingMessage> messages;
+    messages.reserve(depth);
+    for (int i = 1; i <= depth; ++i) {
+        // The first message is a reply to something which is not in the mailbox, so there's a placeholder at the top
+        const QByteArray parent = QByteArray::number(i - 1) + "@x";
+        messages << LocalThreadingMessage(i, fakeEnvelope(QStringLiteral("Re: Deep"), 1, '<' + QByteArray::number(i) + "@x>"),
+                                          QList<QByteArray>() << parent, QDateTime());
+    }
+
+    Imap::Mailbox::LocalThreader threader;
+    threader.addMessages(messages);
+    QVector<Imap::Responses::ThreadingNode> mapping = threader.threading();
+
+    // Walk the result without recursing
+    QCOMPARE(mapping.size(), 1);
+    const Imap::Responses::ThreadingNode *node = &mapping[0];
+    for (int i = 1; i < depth; ++i) {
+        QCOMPARE(node->num, uint(i));
+        QCOMPARE(node->children.size(), 1);
+        node = &node->children[0];
+    }
+    QCOMPARE(node->num, uint(depth));
+    QVERIFY(node->children.isEmpty());
+}
+
+void ImapModelThreadingTest::testBaseSubject()
+{
+    QFETCH(QString, subject);
+    QFETCH(QString, base);
+    QFETCH(bool, isReplyOrForward);
+
+    bool replyOrForward;
+    QCOMPARE(Imap::Mailbox::baseSubject(subject, &replyOrForward), base);
+    QCOMPARE(replyOrForward, isReplyOrForward);
+}
+
+void ImapModelThreadingTest::testBaseSubject_data()
+{
+    QTest::addColumn<QString>("subject");
+    QTest::addColumn<QString>("base");
+    QTest::addColumn<bool>("isReplyOrForward");
+
+    QTest::newRow("plain") << QStringLiteral("hello") << QStringLiteral("hello") << false;
+    QTest::newRow("whitespace") << QStringLiteral("  hello \t  world ") << QStringLiteral("hello world") << false;
+    QTest::newRow("re") << QStringLiteral("Re: hello") << QStringLiteral("hello") << true;
+    QTest::newRow("nested") << QStringLiteral("RE: Fwd:  re: hello") << QStringLiteral("hello") << true;
+    QTest::newRow("trailer") << QStringLiteral("hello (fwd)") << QStringLiteral("hello") << true;
+    QTest::newRow("blob-in-refwd") << QStringLiteral("Fw[2]: hello") << QStringLiteral("hello") << true;
+    QTest::newRow("blob-prefix") << QStringLiteral("[list] hello") << QStringLiteral("hello") << false;
+    QTest::newRow("blob-only") << QStringLiteral("[list]") << QStringLiteral("[list]") << false;
+    QTest::newRow("fwd-header") << QStringLiteral("[Fwd: Re: hello]") << QStringLiteral("hello") << true;
+    QTest::newRow("not-a-prefix") << QStringLiteral("Regarding: hello") << QStringLiteral("Regarding: hello") << false;
+}
+
+/** @short The client-side sorting by all criteria, including incremental updates */
+void ImapModelThreadingTest::testLocalSorting()
+{
+    using namespace Imap::Mailbox;
+    QVector<LocalSortingMessage> messages;
+    messages << LocalSortingMessage(1, fakeEnvelope(QStringLiteral("Re: apples"), 3, QByteArray(), QStringLiteral("Zoe")),
+                                    arrival(1), 300)
+             << LocalSortingMessage(2, fakeEnvelope(QStringLiteral("Cherries"), 1, QByteArray(), QStringLiteral("adam@example.org")),
+                                    arrival(2), 100)
+             << LocalSortingMessage(3, fakeEnvelope(QStringLiteral("[list] Bananas"), 2, QByteArray(), QStringLiteral("bob")),
+                                    arrival(4), 200)
+             << LocalSortingMessage(4, fakeEnvelope(QStringLiteral("apples"), 2, QByteArray(), QStringLiteral("Adam")),
+                                    arrival(3), 100);
+
+    LocalSorter sorter;
+    sorter.addMessages(messages);
+    QCOMPARE(sorter.messageCount(), 4);
+    QCOMPARE(sorter.sorted(ThreadingMsgListModel::SORT_ARRIVAL), Imap::Uids() << 1 << 2 << 4 << 3);
+    QCOMPARE(sorter.sorted(ThreadingMsgListModel::SORT_DATE), Imap::Uids() << 2 << 3 << 4 << 1);
+    QCOMPARE(sorter.sorted(ThreadingMsgListModel::SORT_SIZE), Imap::Uids() << 2 << 4 << 3 << 1);
+    // The display name is used when there is any, and the comparison is case-insensitive
+    QCOMPARE(sorter.sorted(ThreadingMsgListModel::SORT_FROM), Imap::Uids() << 4 << 2 << 3 << 1);
+    QCOMPARE(sorter.sorted(ThreadingMsgListModel::SORT_TO), Imap::Uids() << 4 << 2 << 3 << 1);
+    // Nobody has any Cc, so this is just the order by UID
+    QCOMPARE(sorter.sorted(ThreadingMsgListModel::SORT_CC), Imap::Uids() << 1 << 2 << 3 << 4);
+    QCOMPARE(sorter.sorted(ThreadingMsgListModel::SORT_SUBJECT), Imap::Uids() << 1 << 4 << 3 << 2);
+
+    // New arrivals get merged into the current order, expunged messages disappear
+    sorter.addMessages(QVector<LocalSortingMessage>()
+                       << LocalSortingMessage(5, fakeEnvelope(QStringLiteral("Fwd: Bananas"), 4, QByteArray(), QStringLiteral("x")),
+                                              arrival(5), 50));
+    QCOMPARE(sorter.sorted(ThreadingMsgListModel::SORT_SUBJECT), Imap::Uids() << 1 << 4 << 3 << 5 << 2);
+    sorter.retainMessages(Imap::Uids() << 2 << 3 << 5);
+    QCOMPARE(sorter.sorted(ThreadingMsgListModel::SORT_SUBJECT), Imap::Uids() << 3 << 5 << 2);
+    QCOMPARE(sorter.sorted(ThreadingMsgListModel::SORT_SIZE), Imap::Uids() << 5 << 2 << 3);
+
+    // The same through the background thread
+    LocalSortingWorker worker;
+    QSignalSpy spy(&worker, SIGNAL(sortingAvailable(Imap::Uids)));
+    worker.request(ThreadingMsgListModel::SORT_DATE, messages, Imap::Uids() << 1 << 2 << 3 << 4, false);
+    QVERIFY(spy.wait());
+    QCOMPARE(spy[0][0].value<Imap::Uids>(), Imap::Uids() << 2 << 3 << 4 << 1);
+    worker.request(ThreadingMsgListModel::SORT_SIZE, QVector<LocalSortingMessage>(), Imap::Uids() << 1 << 3 << 4, true);
+    QVERIFY(spy.wait());
+    QCOMPARE(spy[1][0].value<Imap::Uids>(), Imap::Uids() << 4 << 3 << 1);
+}
+
+/** @short Switching between the columns of a big mailbox has to be fast */
+void ImapModelThreadingTest::testLocalSortingPerformance()
+{
+    using namespace Imap::Mailbox;
+#ifdef ASAN_BUILD
+    const int num = 30000;
+#else
+    const int num = 300000;
+#endif
+    QVector<LocalSortingMessage> messages;
+    messages.reserve(num);
+    for (int i = 0; i < num; ++i) {
+        messages << LocalSortingMessage(i + 1, fakeEnvelope(QStringLiteral("Re: Subject %1").arg((i * 104729) % num), 1 + (i * 31) % 28,
+                                                            QByteArray(), QStringLiteral("Sender %1").arg((i * 7919) % 1000)),
+                                        arrival(1 + i % 28), (i * 4057) % 100000);
+    }
+
+    LocalSorter sorter;
+    sorter.addMessages(messages);
+    sorter.sorted(ThreadingMsgListModel::SORT_DATE);
+
+    // A click on a column header is supposed to be answered within 100 ms. The best of a few runs is used so that an unrelated
+    // hiccup of the machine does not fail the test, and the limit is only enforced in optimized builds.
+    qint64 best = std::numeric_limits<qint64>::max();
+    for (int i = 0; i < 3; ++i) {
+        QElapsedTimer timer;
+        timer.start();
+        sorter.sorted(i % 2 ? ThreadingMsgListModel::SORT_SUBJECT : ThreadingMsgListModel::SORT_FROM);
+        best = qMin(best, timer.elapsed());
+    }
+#if defined(QT_NO_DEBUG) && !defined(ASAN_BUILD)
+    QVERIFY2(best < 100, qPrintable(QStringLiteral("Sorting %1 messages took %2 ms").arg(QString::number(num), QString::number(best))));
+#else
+    Q_UNUSED(best);
+#endif
+
+    bool flag = false;
+    QBENCHMARK {
+        sorter.sorted(flag ? ThreadingMsgListModel::SORT_SUBJECT : ThreadingMsgListModel::SORT_FROM);
+        flag = !flag;
+    }
+}
+
+static QString quickFilterBits(const QBitArray &bits)
+{
+    QString res;
+    for (int i = 0; i < bits.size(); ++i)
+        res += bits.testBit(i) ? QLatin1Char('1') : QLatin1Char('0');
+    return res;
+}
+
+/** @short The local preview of the search while the user is still typing */
+void ImapModelThreadingTest::testQuickFilter()
+{
+    using namespace Imap::Mailbox;
+
+    QCOMPARE(foldForQuickFilter(QStringLiteral("Úterý")), QStringLiteral("utery"));
+    QCOMPARE(foldForQuickFilter(QStringLiteral("STRASSE")), foldForQuickFilter(QStringLiteral("straße")));
+
+    QVector<QuickFilterMessage> messages;
+    messages << QuickFilterMessage(1, fakeEnvelope(QStringLiteral("Lunch"), 1, QByteArray(), QStringLiteral("Jiří Novák")))
+             << QuickFilterMessage(2, fakeEnvelope(QStringLiteral("Re: lunch plans"), 1, QByteArray(), QStringLiteral("bob@example.org")))
+             << QuickFilterMessage(3, fakeEnvelope(QStringLiteral("Meeting"), 1, QByteArray(), QStringLiteral("Alice")));
+
+    QuickFilterIndex index;
+    index.addMessages(messages);
+    QCOMPARE(index.messageCount(), 3);
+    QCOMPARE(quickFilterBits(index.matches(QString())), QStringLiteral("111"));
+    QCOMPARE(quickFilterBits(index.matches(QStringLiteral("lunch"))), QStringLiteral("110"));
+    QCOMPARE(quickFilterBits(index.matches(foldForQuickFilter(QStringLiteral("NOVAK")))), QStringLiteral("100"));
+    QCOMPARE(quickFilterBits(index.matches(QStringLiteral("example.org"))), QStringLiteral("111"));
+    // A match cannot span two fields or two messages
+    QCOMPARE(quickFilterBits(index.matches(QStringLiteral("lunchjiri"))), QStringLiteral("000"));
+    QCOMPARE(quickFilterBits(index.matches(QStringLiteral("meeting"))), QStringLiteral("001"));
+
+    // The worker remembers what it got in the previous requests until it is told to start over
+    QuickFilterWorker worker;
+    QSignalSpy spy(&worker, SIGNAL(matchesAvailable(QBitArray)));
+    worker.request(true, messages.mid(0, 2), QStringLiteral("lunch"));
+    QVERIFY(spy.wait());
+    QCOMPARE(quickFilterBits(spy[0][0].toBitArray()), QStringLiteral("11"));
+    // Nobody is interested in the answer anymore, but the messages are still remembered
+    worker.request(false, messages.mid(2), QStringLiteral("meeting"));
+    worker.invalidate();
+    worker.request(false, QVector<QuickFilterMessage>(), QStringLiteral("alice"));
+    QVERIFY(spy.wait());
+    QCOMPARE(spy.size(), 2);
+    QCOMPARE(quickFilterBits(spy[1][0].toBitArray()), QStringLiteral("001"));
+    worker.request(true, messages.mid(2), QStringLiteral("alice"));
+    QVERIFY(spy.wait());
+    QCOMPARE(quickFilterBits(spy[2][0].toBitArray()), QStringLiteral("1"));
+}
+
+/** @short The quick filter keeps the threads of matching messages visible, and follows the threading when it changes */
+void ImapModelThreadingTest::testQuickFilterAncestors()
+{
+    using namespace Imap::Mailbox;
+
+    initialMessages(4);
+    cClient(t.mk("UID THREAD REFS utf-8 ALL\r\n"));
+    cServer("* THREAD (1 2 3)(4)\r\n" + t.last("OK thread\r\n"));
+    cServer(helperCreateTrivialEnvelope(1, 1, QStringLiteral("first"))
+            + helperCreateTrivialEnvelope(2, 2, QStringLiteral("second"))
+            + helperCreateTrivialEnvelope(3, 3, QStringLiteral("needle"))
+            + helperCreateTrivialEnvelope(4, 4, QStringLiteral("needle too")));
+
+    PrettyMsgListModel pretty;
+    pretty.setSourceModel(threadingModel);
+    QCOMPARE(pretty.rowCount(), 2);
+
+    pretty.setQuickFilter(QStringLiteral("needle"));
+    QTRY_COMPARE(pretty.rowCount(), 2);
+    pretty.setQuickFilter(QStringLiteral("needle too"));
+    QTRY_COMPARE(pretty.rowCount(), 1);
+    QCOMPARE(pretty.index(0, 0).data(RoleMessageUid).toUInt(), 4u);
+
+    // The messages above the deepest match stay visible even though they do not match on their own
+    pretty.setQuickFilter(QStringLiteral("needle"));
+    QTRY_COMPARE(pretty.rowCount(), 2);
+    QModelIndex first = pretty.index(0, 0);
+    QCOMPARE(first.data(RoleMessageUid).toUInt(), 1u);
+    QCOMPARE(pretty.rowCount(first), 1);
+    QModelIndex second = pretty.index(0, 0, first);
+    QCOMPARE(second.data(RoleMessageUid).toUInt(), 2u);
+    QCOMPARE(pretty.rowCount(second), 1);
+    QCOMPARE(pretty.index(0, 0, second).data(RoleMessageUid).toUInt(), 3u);
+
+    // Once the filter is gone, everything is back
+    pretty.setQuickFilter(QString());
+    QCOMPARE(pretty.rowCount(), 2);
+    QCOMPARE(pretty.rowCount(first), 1);
+    QVERIFY(errorSpy->isEmpty());
+}
+
+/** @short When a matching message is moved into another thread, its new ancestors become visible */
+void ImapModelThreadingTest::testQuickFilterMoves()
+{
+    using namespace Imap::Mailbox;
+
+    initialMessages(4);
+    cClient(t.mk("UID THREAD REFS utf-8 ALL\r\n"));
+    cServer("* THREAD (1 2)(3)(4)\r\n" + t.last("OK thread\r\n"));
+    cServer(helperCreateTrivialEnvelope(1, 1, QStringLiteral("first"))
+            + helperCreateTrivialEnvelope(2, 2, QStringLiteral("second"))
+            + helperCreateTrivialEnvelope(3, 3, QStringLiteral("third"))
+            + helperCreateTrivialEnvelope(4, 4, QStringLiteral("needle")));
+
+    PrettyMsgListModel pretty;
+    pretty.setSourceModel(threadingModel);
+    pretty.setQuickFilter(QStringLiteral("needle"));
+    QTRY_COMPARE(pretty.rowCount(), 1);
+    QCOMPARE(pretty.index(0, 0).data(RoleMessageUid).toUInt(), 4u);
+
+    // A new arrival makes the server put the matching message below another one
+    cServer("* 5 EXISTS\r\n");
+    cClient(t.mk("UID FETCH 5:* (FLAGS)\r\n"));
+    cServer("* 5 FETCH (UID 5 FLAGS ())\r\n" + t.last("OK fetch\r\n"));
+    cClient(t.mk("UID THREAD REFS utf-8 ALL\r\n"));
+    QSignalSpy rowsMovedSpy(threadingModel, SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)));
+    cServer("* THREAD (1 2)(3 4)(5)\r\n" + t.last("OK thread\r\n"));
+    QCOMPARE(treeToThreading(QModelIndex()), QByteArray("(1 2)(3 4)(5)"));
+    QVERIFY(!rowsMovedSpy.isEmpty());
+
+    // No new search was needed for that, the matches are still the same
+    QCOMPARE(pretty.rowCount(), 1);
+    QModelIndex third = pretty.index(0, 0);
+    QCOMPARE(third.data(RoleMessageUid).toUInt(), 3u);
+    QCOMPARE(pretty.rowCount(third), 1);
+    QCOMPARE(pretty.index(0, 0, third).data(RoleMessageUid).toUInt(), 4u);
+    cEmpty();
+    QVERIFY(errorSpy->isEmpty());
+}
+
 QTEST_GUILESS_MAIN( ImapModelThreadingTest )
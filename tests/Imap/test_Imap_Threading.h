@@ -41,7 +41,13 @@ private slots:
     void testDynamicSorting();
     void testDynamicSortingContext();
     void testDynamicSearch();
+    void testCachedSearchResults();
+    void testCrossMailboxSearch();
     void testIncrementalThreading();
+    void testThreadingArrivalMoves();
+    void testThreadAggregates();
+    void testBackgroundThreading();
+    void testStaleBackgroundThreading();
     void testRemovingRootWithThreadingInFlight();
     void testMultipleExpunges();
     void testVanishedHierarchyReplacement();
@@ -51,6 +57,17 @@ private slots:
     void testSearchingPerformance();
     void testFlatThreadDeletionPerformance();
     void testESearchResults();
+    void testLocalThreading();
+    void testLocalThreading_data();
+    void testLocalThreadingIncremental();
+    void testLocalThreadingDeep();
+    void testBaseSubject();
+    void testBaseSubject_data();
+    void testLocalSorting();
+    void testLocalSortingPerformance();
+    void testQuickFilter();
+    void testQuickFilterAncestors();
+    void testQuickFilterMoves();
 
     void helper_multipleExpunges();
 protected slots:
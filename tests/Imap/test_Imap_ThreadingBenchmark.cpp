@@ -0,0 +1,294 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <functional>
+#include <QtTest>
+#include "test_Imap_ThreadingBenchmark.h"
+#include "Imap/Model/ItemRoles.h"
+#include "Imap/Model/MsgListModel.h"
+#include "Imap/Model/PrettyMsgListModel.h"
+#include "Imap/Model/ThreadingMsgListModel.h"
+#include "Streams/FakeSocket.h"
+#include "Utils/FakeCapabilitiesInjector.h"
+
+#if defined(__has_feature)
+#  if  __has_feature(address_sanitizer)
+#    define ASAN_BUILD
+#  endif
+#endif
+
+using namespace Imap::Mailbox;
+
+namespace {
+
+/** @short Spin the event loop until the condition holds, or until it's clear that it never will */
+bool processEventsUntil(const std::function<bool()> &condition, const uint rounds)
+{
+    for (uint i = 0; i < rounds; ++i) {
+        if (condition())
+            return true;
+        QCoreApplication::processEvents();
+    }
+    return condition();
+}
+
+/** @short The Model handles a hundred responses per iteration of the event loop */
+uint roundsFor(const uint responses)
+{
+    return responses / 100 + 20;
+}
+
+}
+
+void ImapThreadingBenchmark::init()
+{
+    LibMailboxSync::init();
+
+    FakeCapabilitiesInjector injector(model);
+    injector.injectCapability(QStringLiteral("THREAD=REFS"));
+    // The default timeout of two minutes is too short for the biggest mailboxes
+    model->setProperty("trojita-imap-noop-period", 24 * 60 * 60 * 1000);
+
+    threadingModel->setUserWantsThreading(true);
+    prettyModel = new PrettyMsgListModel(this);
+    prettyModel->setSourceModel(threadingModel);
+    prettyModel->setObjectName(QStringLiteral("prettyModel"));
+}
+
+void ImapThreadingBenchmark::cleanup()
+{
+    delete prettyModel;
+    prettyModel = 0;
+    LibMailboxSync::cleanup();
+}
+
+uint ImapThreadingBenchmark::benchmarkSize()
+{
+    bool ok;
+    uint num = qgetenv("TROJITA_BENCHMARK_MESSAGES").toUInt(&ok);
+    if (!ok) {
+#ifdef ASAN_BUILD
+        num = 6660;
+#else
+        num = 20000;
+#endif
+    }
+    return qBound(100u, num, 2000000u);
+}
+
+void ImapThreadingBenchmark::profiles()
+{
+    QTest::addColumn<double>("replyRatio");
+    QTest::addColumn<double>("chainRatio");
+    QTest::addColumn<uint>("maxDepth");
+    QTest::addColumn<double>("damagedRatio");
+    QTest::addColumn<double>("subjectVariationRatio");
+
+    // Busy lists have long discussions with deep nesting
+    QTest::newRow("mailing-list") << 0.75 << 0.6 << 60u << 0.02 << 0.15;
+    // A personal INBOX is mostly made of standalone messages and short exchanges
+    QTest::newRow("personal") << 0.3 << 0.8 << 10u << 0.01 << 0.05;
+    // Broken clients which drop the References: many orphans and subjects which are all over the place
+    QTest::newRow("damaged") << 0.6 << 0.5 << 40u << 0.3 << 0.4;
+}
+
+SyntheticMailboxProfile ImapThreadingBenchmark::currentProfile(const uint messages)
+{
+    QFETCH(double, replyRatio);
+    QFETCH(double, chainRatio);
+    QFETCH(uint, maxDepth);
+    QFETCH(double, damagedRatio);
+    QFETCH(double, subjectVariationRatio);
+
+    SyntheticMailboxProfile profile;
+    profile.messages = messages;
+    profile.replyRatio = replyRatio;
+    profile.chainRatio = chainRatio;
+    profile.maxDepth = maxDepth;
+    profile.damagedRatio = damagedRatio;
+    profile.subjectVariationRatio = subjectVariationRatio;
+    return profile;
+}
+
+/** @short Report the measurement through QTest and append it to the log file, if any */
+void ImapThreadingBenchmark::recordResult(const char *phase, const uint messages, const qint64 msecs)
+{
+    QTest::setBenchmarkResult(msecs, QTest::WalltimeMilliseconds);
+
+    const QString fileName = QString::fromLocal8Bit(qgetenv("TROJITA_BENCHMARK_LOG"));
+    if (fileName.isEmpty())
+        return;
+    QFile log(fileName);
+    QVERIFY2(log.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text), qPrintable(log.errorString()));
+    log.write(QStringLiteral("%1,%2,%3,%4,%5\n").arg(QDateTime::currentDateTimeUtc().toString(Qt::ISODate),
+                                                   QLatin1String(phase), QLatin1String(QTest::currentDataTag()),
+                                                   QString::number(messages), QString::number(msecs)).toUtf8());
+}
+
+/** @short Sync the first @arg exists messages of the mailbox, including their envelopes */
+void ImapThreadingBenchmark::prepareMailbox(const SyntheticMailbox &mailbox, const uint exists, const bool threaded)
+{
+    if (!threaded)
+        threadingModel->setUserWantsThreading(false);
+    initialMessages(exists);
+    if (threaded)
+        cClient(t.mk("UID THREAD REFS utf-8 ALL\r\n"));
+
+    // Unsolicited FETCHes are fine; they give the PrettyMsgListModel and the cache some real subjects
+    QByteArray envelopes;
+    for (uint uid = 1; uid <= exists; ++uid)
+        envelopes += helperCreateTrivialEnvelope(uid, uid, mailbox.subject(uid));
+    SOCK->fakeReading(envelopes);
+    processEventsUntil([]() { return false; }, roundsFor(exists));
+}
+
+/** @short Answer the pending THREAD command and wait for the proxies to settle */
+void ImapThreadingBenchmark::applyThreading(const SyntheticMailbox &mailbox, const uint exists)
+{
+    const int threads = mailbox.threadCount(exists);
+    SOCK->fakeReading(mailbox.threadResponse(exists) + t.last("OK thread\r\n"));
+    QVERIFY(processEventsUntil([this, threads]() {
+        return threadingModel->rowCount() == threads || threadingModel->isThreadingInProgress();
+    }, roundsFor(exists)));
+    if (threadingModel->isThreadingInProgress()) {
+        // Big mailboxes are threaded in the background
+        QSignalSpy threadingDone(threadingModel, SIGNAL(threadingInProgressChanged(bool)));
+        QVERIFY(threadingDone.wait(60000));
+    }
+    QCOMPARE(threadingModel->rowCount(), threads);
+    QCOMPARE(prettyModel->rowCount(), threads);
+}
+
+void ImapThreadingBenchmark::benchInitialThreading()
+{
+    const uint num = benchmarkSize();
+    SyntheticMailbox mailbox(currentProfile(num));
+    prepareMailbox(mailbox, num, true);
+
+    QElapsedTimer timer;
+    timer.start();
+    applyThreading(mailbox, num);
+    recordResult("initial-threading", num, timer.elapsed());
+    cEmpty();
+}
+
+void ImapThreadingBenchmark::benchInitialThreading_data()
+{
+    profiles();
+}
+
+void ImapThreadingBenchmark::benchIncrementalArrival()
+{
+    const uint num = benchmarkSize();
+    const uint arrivals = qMax(1u, num / 100);
+    SyntheticMailbox mailbox(currentProfile(num + arrivals));
+    prepareMailbox(mailbox, num, true);
+    applyThreading(mailbox, num);
+    cEmpty();
+
+    cServer(QByteArray("* ") + QByteArray::number(num + arrivals) + " EXISTS\r\n");
+    cClient(t.mk("UID FETCH ") + QByteArray::number(num + 1) + ":* (FLAGS)\r\n");
+    QByteArray uids;
+    for (uint uid = num + 1; uid <= num + arrivals; ++uid)
+        uids += "* " + QByteArray::number(uid) + " FETCH (UID " + QByteArray::number(uid) + " FLAGS (\\Recent))\r\n";
+    uids += t.last("OK fetched\r\n");
+
+    QElapsedTimer timer;
+    timer.start();
+    SOCK->fakeReading(uids);
+    QVERIFY(processEventsUntil([this]() { return !SOCK->writtenStuff().isEmpty(); }, roundsFor(arrivals)));
+    // Once the UIDs are known, the whole mailbox is threaded again
+    QCOMPARE(QString::fromUtf8(SOCK->writtenStuff()), QString::fromUtf8(t.mk("UID THREAD REFS utf-8 ALL\r\n")));
+    applyThreading(mailbox, num + arrivals);
+    recordResult("incremental-arrival", num + arrivals, timer.elapsed());
+    QCOMPARE(threadingModel->rowCount(), static_cast<int>(mailbox.threadCount(num + arrivals)));
+    cEmpty();
+}
+
+void ImapThreadingBenchmark::benchIncrementalArrival_data()
+{
+    profiles();
+}
+
+void ImapThreadingBenchmark::benchSortSwitch()
+{
+    const uint num = benchmarkSize();
+    SyntheticMailbox mailbox(currentProfile(num));
+    FakeCapabilitiesInjector injector(model);
+    injector.injectCapability(QStringLiteral("SORT"));
+    prepareMailbox(mailbox, num, false);
+    QCOMPARE(prettyModel->rowCount(), static_cast<int>(num));
+
+    const QByteArray sortResponse = mailbox.sortBySubjectResponse(num);
+    const uint firstUid = sortResponse.mid(7, sortResponse.indexOf(' ', 7) - 7).toUInt();
+
+    QElapsedTimer timer;
+    timer.start();
+    prettyModel->sort(MsgListModel::SUBJECT, Qt::AscendingOrder);
+    cClient(t.mk("UID SORT (SUBJECT) utf-8 ALL\r\n"));
+    cServer(sortResponse + t.last("OK sorted\r\n"));
+    QVERIFY(processEventsUntil([this, firstUid]() {
+        return prettyModel->index(0, 0).data(RoleMessageUid).toUInt() == firstUid;
+    }, roundsFor(num)));
+    // Going back to the order of arrival is handled locally
+    prettyModel->sort(-1, Qt::AscendingOrder);
+    recordResult("sort-switch", num, timer.elapsed());
+    QCOMPARE(prettyModel->rowCount(), static_cast<int>(num));
+}
+
+void ImapThreadingBenchmark::benchSortSwitch_data()
+{
+    profiles();
+}
+
+void ImapThreadingBenchmark::benchExpunge()
+{
+    const uint num = benchmarkSize();
+    SyntheticMailbox mailbox(currentProfile(num));
+    prepareMailbox(mailbox, num, true);
+    applyThreading(mailbox, num);
+    cEmpty();
+
+    // Removing messages from the middle of a mailbox hits threads of all shapes and ages
+    const uint deletes = qMax(1u, num / 10);
+    const QByteArray expunges = QByteArray("* " + QByteArray::number(num / 2) + " EXPUNGE\r\n").repeated(deletes);
+    const int remaining = num - deletes;
+
+    QElapsedTimer timer;
+    timer.start();
+    SOCK->fakeReading(expunges);
+    QVERIFY(processEventsUntil([this, remaining]() {
+        return msgListModel->rowCount() == remaining;
+    }, roundsFor(deletes)));
+    // Process the delayed updates of the threading as well
+    for (int i = 0; i < 4; ++i)
+        QCoreApplication::processEvents();
+    recordResult("expunge", num, timer.elapsed());
+    QCOMPARE(model->rowCount(msgListA), remaining);
+}
+
+void ImapThreadingBenchmark::benchExpunge_data()
+{
+    profiles();
+}
+
+QTEST_GUILESS_MAIN(ImapThreadingBenchmark)
@@ -0,0 +1,73 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TEST_IMAP_THREADINGBENCHMARK
+#define TEST_IMAP_THREADINGBENCHMARK
+
+#include "Utils/LibMailboxSync.h"
+#include "Utils/SyntheticMailbox.h"
+
+namespace Imap {
+namespace Mailbox {
+class PrettyMsgListModel;
+}
+}
+
+/** @short Benchmarks of the whole message list stack on big generated mailboxes
+
+The Model, MsgListModel, ThreadingMsgListModel and PrettyMsgListModel are driven through the fake IMAP server just like
+in the GUI. The mailboxes come from the SyntheticMailbox generator.
+
+The size of the mailbox is set via the TROJITA_BENCHMARK_MESSAGES environment variable. It defaults to a value which
+keeps a run reasonably fast, and it can go up to two million messages. The results are reported as the usual QTest
+benchmark results. If TROJITA_BENCHMARK_LOG names a file, one CSV line is appended to it for each measurement. That
+makes it possible to watch for regressions over time. CTest only runs this when configured with WITH_BENCHMARKS.
+*/
+class ImapThreadingBenchmark : public LibMailboxSync
+{
+    Q_OBJECT
+private slots:
+    void benchInitialThreading();
+    void benchInitialThreading_data();
+    void benchIncrementalArrival();
+    void benchIncrementalArrival_data();
+    void benchSortSwitch();
+    void benchSortSwitch_data();
+    void benchExpunge();
+    void benchExpunge_data();
+
+protected slots:
+    virtual void init();
+    virtual void cleanup();
+
+private:
+    static void profiles();
+    static SyntheticMailboxProfile currentProfile(const uint messages);
+    static uint benchmarkSize();
+    void prepareMailbox(const SyntheticMailbox &mailbox, const uint exists, const bool threaded);
+    void applyThreading(const SyntheticMailbox &mailbox, const uint exists);
+    void recordResult(const char *phase, const uint messages, const qint64 msecs);
+
+    Imap::Mailbox::PrettyMsgListModel *prettyModel;
+};
+
+#endif
@@ -0,0 +1,174 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QDataStream>
+#include <QTest>
+#include "test_BlobCodec.h"
+#include "Imap/Model/BlobCodec.h"
+#include "Imap/Parser/Message.h"
+
+using namespace Imap::Mailbox;
+
+Q_DECLARE_METATYPE(Imap::Mailbox::BlobCodec)
+
+namespace {
+
+/** @short Something which looks like the serialized envelopes of a real mailbox */
+QVector<QByteArray> envelopes(const int count)
+{
+    const QStringList senders = QStringList() << QStringLiteral("Joe Random") << QStringLiteral("Jane Doe")
+                                              << QStringLiteral("Build Bot") << QStringLiteral("Mailing List");
+    QVector<QByteArray> res;
+    for (int i = 0; i < count; ++i) {
+        const QString &name = senders[i % senders.size()];
+        Imap::Message::Envelope envelope;
+        envelope.date = QDateTime(QDate(2017, 1, 1).addDays(i / 50), QTime(i % 24, i % 60));
+        envelope.subject = QStringLiteral("Re: [project] Status report #%1 for the week").arg(i / 3);
+        envelope.from << Imap::Message::MailAddress(name, QString(), name.toLower().replace(QLatin1Char(' '), QLatin1Char('.')),
+                                                    QStringLiteral("example.org"));
+        envelope.sender = envelope.from;
+        envelope.replyTo = envelope.from;
+        envelope.to << Imap::Message::MailAddress(QStringLiteral("Project List"), QString(), QStringLiteral("project"),
+                                                  QStringLiteral("lists.example.org"));
+        envelope.messageId = QStringLiteral("<%1.%2@mail.example.org>").arg(i * 7919).arg(i).toUtf8();
+        QByteArray buf;
+        QDataStream stream(&buf, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_4_6);
+        stream << envelope << envelope.date << quint64(1000 + i);
+        res << buf;
+    }
+    return res;
+}
+
+}
+
+void TestBlobCodec::testRoundTrip_data()
+{
+    QTest::addColumn<BlobCodec>("codec");
+    QTest::addColumn<QByteArray>("data");
+
+    QByteArray big;
+    for (int i = 0; i < 10000; ++i)
+        big += QByteArray::number(i);
+
+    QTest::newRow("none") << BlobCodec::NONE << big;
+    QTest::newRow("zlib") << BlobCodec::ZLIB << big;
+    QTest::newRow("zstd") << BlobCodec::ZSTD << big;
+    QTest::newRow("zstd-empty") << BlobCodec::ZSTD << QByteArray();
+    QTest::newRow("dictionary-without-one") << BlobCodec::ZSTD_DICTIONARY << big;
+}
+
+/** @short Whatever goes in has to come out, even when this build lacks some codecs */
+void TestBlobCodec::testRoundTrip()
+{
+    QFETCH(BlobCodec, codec);
+    QFETCH(QByteArray, data);
+
+    const QByteArray blob = encodeBlob(data, codec);
+    QCOMPARE(decodeBlob(blob), data);
+    QVERIFY(blobCodec(blob) != BlobCodec::ZSTD_DICTIONARY);
+    if (codec == BlobCodec::NONE || codec == BlobCodec::ZLIB) {
+        QCOMPARE(blobCodec(blob), codec);
+    }
+}
+
+/** @short Blobs from older versions do not have any header */
+void TestBlobCodec::testLegacyBlobs()
+{
+    const QByteArray data("some old data which were compressed by qCompress()");
+    QCOMPARE(blobCodec(qCompress(data)), BlobCodec::ZLIB);
+    QCOMPARE(decodeBlob(qCompress(data)), data);
+    QCOMPARE(decodeBlob(qCompress(QByteArray())), QByteArray());
+    QVERIFY(decodeBlob(QByteArray()).isNull());
+}
+
+/** @short Blobs compressed with a dictionary need that very dictionary for decoding */
+void TestBlobCodec::testDictionary()
+{
+    auto samples = envelopes(2000);
+    auto dictionary = BlobDictionary::train(1, samples);
+    if (!dictionary) {
+        QSKIP("Built without zstd");
+    }
+    QCOMPARE(dictionary->id(), 1u);
+
+    const QByteArray blob = encodeBlob(samples[0], *dictionary);
+    QCOMPARE(blobCodec(blob), BlobCodec::ZSTD_DICTIONARY);
+    QCOMPARE(decodeBlob(blob, dictionary.get()), samples[0]);
+    QVERIFY(blob.size() < encodeBlob(samples[0], BlobCodec::ZSTD).size());
+
+    // Without the dictionary, or with a wrong one, there is no way to get the data back
+    QVERIFY(decodeBlob(blob).isNull());
+    auto other = BlobDictionary::load(2, dictionary->data());
+    QVERIFY(other);
+    QVERIFY(decodeBlob(blob, other.get()).isNull());
+
+    // A dictionary which was saved and loaded again works just as well
+    auto reloaded = BlobDictionary::load(1, dictionary->data());
+    QVERIFY(reloaded);
+    QCOMPARE(decodeBlob(blob, reloaded.get()), samples[0]);
+    QCOMPARE(decodeBlob(encodeBlob(samples[1], *reloaded), dictionary.get()), samples[1]);
+}
+
+void TestBlobCodec::benchmarkEnvelopes_data()
+{
+    QTest::addColumn<BlobCodec>("codec");
+    QTest::newRow("zlib") << BlobCodec::ZLIB;
+    QTest::newRow("zstd") << BlobCodec::ZSTD;
+    QTest::newRow("zstd-dictionary") << BlobCodec::ZSTD_DICTIONARY;
+}
+
+/** @short The time needed for decoding the envelopes */
+void TestBlobCodec::benchmarkEnvelopes()
+{
+    QFETCH(BlobCodec, codec);
+
+    const auto samples = envelopes(3000);
+    std::shared_ptr<BlobDictionary> dictionary;
+    if (codec == BlobCodec::ZSTD_DICTIONARY) {
+        dictionary = BlobDictionary::train(1, samples.mid(0, 2000));
+        if (!dictionary) {
+            QSKIP("Built without zstd");
+        }
+    }
+
+    // Only measure the envelopes which the dictionary has not seen
+    QVector<QByteArray> blobs;
+    qint64 rawBytes = 0, storedBytes = 0;
+    for (int i = 2000; i < samples.size(); ++i) {
+        blobs << (dictionary ? encodeBlob(samples[i], *dictionary) : encodeBlob(samples[i], codec));
+        rawBytes += samples[i].size();
+        storedBytes += blobs.last().size();
+    }
+    if (dictionary) {
+        // Small blobs like these are exactly what the dictionary is for
+        QVERIFY(storedBytes < rawBytes);
+    }
+
+    QBENCHMARK {
+        for (const QByteArray &blob : blobs) {
+            QVERIFY(!decodeBlob(blob, dictionary.get()).isEmpty());
+        }
+    }
+}
+
+QTEST_GUILESS_MAIN(TestBlobCodec)
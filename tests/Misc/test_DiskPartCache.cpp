@@ -0,0 +1,182 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QDir>
+#include <QFile>
+#include <QTemporaryDir>
+#include <QTest>
+#include "test_DiskPartCache.h"
+#include "Imap/Model/DiskPartCache.h"
+
+using namespace Imap::Mailbox;
+
+/** @short The same data stored under several names occupy the disk just once, and they go away with the last reference */
+void TestDiskPartCache::testDeduplication()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    std::vector<QString> errorLog;
+    DiskPartCache cache(dir.path());
+    cache.setErrorHandler([&errorLog](const QString &e) { errorLog.push_back(e); });
+
+    QByteArray attachment;
+    for (int i = 0; i < 100000; ++i)
+        attachment += QByteArray::number(i);
+    const QByteArray other("something else");
+
+    cache.setMsgPart(QStringLiteral("INBOX"), 1, "2", attachment);
+    cache.setMsgPart(QStringLiteral("INBOX"), 5, "2", attachment);
+    cache.setMsgPart(QStringLiteral("Archive"), 3, "1.2", attachment);
+    cache.setMsgPart(QStringLiteral("Archive"), 4, "1", other);
+    QCOMPARE(cache.messagePart(QStringLiteral("INBOX"), 1, "2"), attachment);
+    QCOMPARE(cache.messagePart(QStringLiteral("INBOX"), 5, "2"), attachment);
+    QCOMPARE(cache.messagePart(QStringLiteral("Archive"), 3, "1.2"), attachment);
+    QCOMPARE(cache.messagePart(QStringLiteral("Archive"), 4, "1"), other);
+
+    auto stats = cache.deduplicationStatistics();
+    QCOMPARE(stats.blobs, quint64(2));
+    QCOMPARE(stats.references, quint64(4));
+    const quint64 blobSize = attachment.size();
+    QCOMPARE(stats.savedBytes, 2 * blobSize);
+    QCOMPARE(stats.storedBytes, blobSize + other.size());
+
+    // Storing the same data once again must not count another reference
+    cache.setMsgPart(QStringLiteral("INBOX"), 1, "2", attachment);
+    QCOMPARE(cache.deduplicationStatistics().references, quint64(4));
+
+    // Only the last reference frees the blob
+    QVERIFY(cache.clearMessage(QStringLiteral("INBOX"), 1) < blobSize);
+    QCOMPARE(cache.messagePart(QStringLiteral("INBOX"), 1, "2"), QByteArray());
+    QCOMPARE(cache.messagePart(QStringLiteral("INBOX"), 5, "2"), attachment);
+    cache.forgetMessagePart(QStringLiteral("Archive"), 3, "1.2");
+    QCOMPARE(cache.deduplicationStatistics().references, quint64(2));
+    QVERIFY(cache.clearMessage(QStringLiteral("INBOX"), 5) >= blobSize);
+    stats = cache.deduplicationStatistics();
+    QCOMPARE(stats.blobs, quint64(1));
+    QCOMPARE(stats.savedBytes, quint64(0));
+
+    // Replacing data of a part releases the old blob
+    cache.setMsgPart(QStringLiteral("Archive"), 4, "1", attachment);
+    QCOMPARE(cache.messagePart(QStringLiteral("Archive"), 4, "1"), attachment);
+    QCOMPARE(cache.deduplicationStatistics().blobs, quint64(1));
+
+    cache.clearAllMessages(QStringLiteral("Archive"));
+    QCOMPARE(cache.messagePart(QStringLiteral("Archive"), 4, "1"), QByteArray());
+    QCOMPARE(cache.deduplicationStatistics().blobs, quint64(0));
+    QCOMPARE(cache.totalSize(), quint64(0));
+    QVERIFY(errorLog.empty());
+}
+
+/** @short Parts saved by older versions are still readable, and they get replaced on the next write */
+void TestDiskPartCache::testLegacyFiles()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    std::vector<QString> errorLog;
+    DiskPartCache cache(dir.path());
+    cache.setErrorHandler([&errorLog](const QString &e) { errorLog.push_back(e); });
+
+    const QString mailboxDir = dir.path() + QLatin1Char('/') + QString::fromUtf8(QByteArray("INBOX").toBase64());
+    QVERIFY(QDir().mkpath(mailboxDir));
+    QFile legacy(mailboxDir + QLatin1String("/7_1.cache"));
+    QVERIFY(legacy.open(QIODevice::WriteOnly));
+    legacy.write(qCompress(QByteArray("old data")));
+    legacy.close();
+
+    QCOMPARE(cache.messagePart(QStringLiteral("INBOX"), 7, "1"), QByteArray("old data"));
+    cache.setMsgPart(QStringLiteral("INBOX"), 7, "1", "new data");
+    QVERIFY(!legacy.exists());
+    QCOMPARE(cache.messagePart(QStringLiteral("INBOX"), 7, "1"), QByteArray("new data"));
+    QVERIFY(cache.clearMessage(QStringLiteral("INBOX"), 7) > 0);
+    QCOMPARE(cache.messagePart(QStringLiteral("INBOX"), 7, "1"), QByteArray());
+    QVERIFY(errorLog.empty());
+}
+
+/** @short Parts can be accessed through a memory mapping which outlives the removal from the cache */
+void TestDiskPartCache::testMapping()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    std::vector<QString> errorLog;
+    DiskPartCache cache(dir.path());
+    cache.setErrorHandler([&errorLog](const QString &e) { errorLog.push_back(e); });
+
+    QByteArray attachment(3 * 1024 * 1024, 'x');
+    attachment[12345] = 'y';
+    cache.setMsgPart(QStringLiteral("INBOX"), 1, "2", attachment);
+    auto mapped = cache.mappedMessagePart(QStringLiteral("INBOX"), 1, "2");
+    QVERIFY(mapped);
+    QCOMPARE(mapped->data(), attachment);
+    QVERIFY(!cache.mappedMessagePart(QStringLiteral("INBOX"), 1, "3"));
+
+#ifndef Q_OS_WIN
+    // POSIX keeps the mapped data around even after the file is gone
+    cache.clearMessage(QStringLiteral("INBOX"), 1);
+    QVERIFY(errorLog.empty());
+    QCOMPARE(mapped->data(), attachment);
+#endif
+    mapped.reset();
+}
+
+/** @short The running total of the used space matches what a full scan of the directory says */
+void TestDiskPartCache::testTotalSize()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    std::vector<QString> errorLog;
+    DiskPartCache cache(dir.path());
+    cache.setErrorHandler([&errorLog](const QString &e) { errorLog.push_back(e); });
+
+#define CHECK_TOTAL_SIZE QCOMPARE(cache.totalSize(), DiskPartCache(dir.path()).totalSize())
+
+    QCOMPARE(cache.totalSize(), quint64(0));
+    const QByteArray attachment(100000, 'a');
+    cache.setMsgPart(QStringLiteral("INBOX"), 1, "2", attachment);
+    QVERIFY(cache.totalSize() >= quint64(attachment.size()));
+    CHECK_TOTAL_SIZE;
+    cache.setMsgPart(QStringLiteral("INBOX"), 2, "2", attachment);
+    cache.setMsgPart(QStringLiteral("INBOX"), 3, "1", QByteArray(50000, 'b'));
+    cache.setMsgPart(QStringLiteral("INBOX"), 13, "1", QByteArray(50000, 'c'));
+    CHECK_TOTAL_SIZE;
+
+    cache.setMsgPartChunk(QStringLiteral("INBOX"), 4, "1", 1, 1000, QByteArray(1000, 'd'));
+    CHECK_TOTAL_SIZE;
+    cache.setMsgPartChunk(QStringLiteral("INBOX"), 4, "1", 0, 1000, QByteArray(1000, 'e'));
+    CHECK_TOTAL_SIZE;
+    cache.forgetPartialMessagePart(QStringLiteral("INBOX"), 4, "1");
+    CHECK_TOTAL_SIZE;
+
+    cache.forgetMessagePart(QStringLiteral("INBOX"), 3, "1");
+    CHECK_TOTAL_SIZE;
+    // A message whose UID is a prefix of another one's must not take the other one's data along
+    QVERIFY(cache.clearMessages(QStringLiteral("INBOX"), Imap::Uids() << 1 << 3) < quint64(attachment.size()));
+    CHECK_TOTAL_SIZE;
+    QCOMPARE(cache.messagePart(QStringLiteral("INBOX"), 13, "1"), QByteArray(50000, 'c'));
+    QVERIFY(cache.clearMessages(QStringLiteral("INBOX"), Imap::Uids() << 2 << 13) >= quint64(attachment.size()));
+    CHECK_TOTAL_SIZE;
+    QCOMPARE(cache.totalSize(), quint64(0));
+
+#undef CHECK_TOTAL_SIZE
+    QVERIFY(errorLog.empty());
+}
+
+QTEST_GUILESS_MAIN(TestDiskPartCache)
@@ -0,0 +1,147 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QTest>
+#include "test_MemoryCache.h"
+#include "Imap/Model/MemoryCache.h"
+
+using namespace Imap::Mailbox;
+
+/** @short Messages of different mailboxes do not get mixed up, and they go away with the mailbox */
+void TestMemoryCache::testMessages()
+{
+    MemoryCache cache;
+    const QString inbox = QStringLiteral("INBOX");
+    const QString other = QStringLiteral("other");
+    const QStringList seen = QStringList() << QStringLiteral("\\Seen");
+
+    AbstractCache::MessageDataBundle bundle;
+    bundle.uid = 1;
+    bundle.size = 10;
+    cache.setMessageMetadata(inbox, 1, bundle);
+    cache.setMsgFlags(inbox, 1, seen);
+    cache.setMsgPart(inbox, 1, "1", "inbox 1");
+    cache.setMsgPart(inbox, 1, "2", "inbox 1.2");
+    cache.setMsgPart(inbox, 2, "1", "inbox 2");
+    cache.setMsgPart(other, 1, "1", "other 1");
+    cache.setMsgPartChunk(inbox, 3, "1", 0, 4, "abcd");
+    cache.setMsgPartChunk(inbox, 3, "1", 1, 4, "ef");
+    cache.setMsgPartChunk(other, 3, "1", 0, 4, "wxyz");
+    AbstractCache::SearchResult searchResult;
+    searchResult.uids << 1;
+    searchResult.uidValidity = 666;
+    cache.setSearchResult(inbox, QStringLiteral("UNSEEN"), searchResult);
+    cache.setSearchResult(other, QStringLiteral("UNSEEN"), searchResult);
+
+    QCOMPARE(cache.messageMetadata(inbox, 1), bundle);
+    QCOMPARE(cache.messageMetadata(other, 1).uid, 0u);
+    QCOMPARE(cache.messageMetadata(QStringLiteral("nonexistent"), 1).uid, 0u);
+    QCOMPARE(cache.msgFlags(inbox, 1), seen);
+    QCOMPARE(cache.msgFlagsBatch(inbox, Imap::Uids() << 1 << 2).keys(), QList<uint>() << 1);
+    QCOMPARE(cache.messagePart(inbox, 1, "2"), QByteArray("inbox 1.2"));
+    QCOMPARE(cache.messagePart(other, 1, "1"), QByteArray("other 1"));
+    QCOMPARE(cache.messagePart(other, 2, "1"), QByteArray());
+    QCOMPARE(cache.partialMessagePart(inbox, 3, "1", 4), QByteArray("abcdef"));
+    QCOMPARE(cache.partialMessagePart(inbox, 3, "1", 8), QByteArray());
+
+    auto statistics = cache.statistics();
+    QCOMPARE(statistics.messages, 1);
+    QCOMPARE(statistics.parts, 4);
+    QCOMPARE(statistics.partBytes, quint64(7 + 9 + 7 + 7));
+    QCOMPARE(statistics.partialBytes, quint64(6 + 4));
+
+    cache.forgetMessagePart(inbox, 1, "2");
+    cache.clearMessage(inbox, 2);
+    QCOMPARE(cache.messagePart(inbox, 1, "2"), QByteArray());
+    QCOMPARE(cache.messagePart(inbox, 2, "1"), QByteArray());
+    QCOMPARE(cache.messagePart(inbox, 1, "1"), QByteArray("inbox 1"));
+    QCOMPARE(cache.statistics().partBytes, quint64(7 + 7));
+
+    // The partially downloaded parts go away with their message
+    cache.clearMessage(inbox, 3);
+    QCOMPARE(cache.partialMessagePart(inbox, 3, "1", 4), QByteArray());
+    QCOMPARE(cache.partialMessagePart(other, 3, "1", 4), QByteArray("wxyz"));
+    QCOMPARE(cache.statistics().partialBytes, quint64(4));
+
+    cache.clearAllMessages(inbox);
+    QCOMPARE(cache.messageMetadata(inbox, 1).uid, 0u);
+    QCOMPARE(cache.msgFlags(inbox, 1), QStringList());
+    QCOMPARE(cache.messagePart(inbox, 1, "1"), QByteArray());
+    QCOMPARE(cache.partialMessagePart(inbox, 3, "1", 4), QByteArray());
+    QCOMPARE(cache.messagePart(other, 1, "1"), QByteArray("other 1"));
+    AbstractCache::SearchResult cachedResult;
+    QVERIFY(!cache.searchResult(inbox, QStringLiteral("UNSEEN"), cachedResult));
+    QVERIFY(cache.searchResult(other, QStringLiteral("UNSEEN"), cachedResult));
+    QCOMPARE(cachedResult.uids, searchResult.uids);
+    statistics = cache.statistics();
+    QCOMPARE(statistics.messages, 0);
+    QCOMPARE(statistics.parts, 1);
+    QCOMPARE(statistics.partBytes, quint64(7));
+    QCOMPARE(statistics.partialBytes, quint64(4));
+}
+
+/** @short The least recently used parts are dropped once the budget is exceeded */
+void TestMemoryCache::testPartBudget()
+{
+    MemoryCache cache;
+    const QString mailbox = QStringLiteral("INBOX");
+    const QByteArray data(100, 'x');
+
+    cache.setPartBudget(350);
+    cache.setMsgPart(mailbox, 1, "1", data);
+    cache.setMsgPart(mailbox, 2, "1", data);
+    cache.setMsgPart(mailbox, 3, "1", data);
+    // This makes the first part the most recently used one
+    QCOMPARE(cache.messagePart(mailbox, 1, "1"), data);
+    cache.setMsgPart(mailbox, 4, "1", data);
+
+    QCOMPARE(cache.messagePart(mailbox, 2, "1"), QByteArray());
+    QCOMPARE(cache.messagePart(mailbox, 1, "1"), data);
+    QCOMPARE(cache.messagePart(mailbox, 3, "1"), data);
+    QCOMPARE(cache.messagePart(mailbox, 4, "1"), data);
+    auto statistics = cache.statistics();
+    QCOMPARE(statistics.parts, 3);
+    QCOMPARE(statistics.partBytes, quint64(300));
+    QCOMPARE(statistics.evictedParts, quint64(1));
+    QCOMPARE(statistics.evictedBytes, quint64(100));
+
+    // Too big to be cached at all
+    cache.setMsgPart(mailbox, 5, "1", QByteArray(351, 'y'));
+    QCOMPARE(cache.messagePart(mailbox, 5, "1"), QByteArray());
+    QCOMPARE(cache.statistics().parts, 3);
+
+    // Shrinking the budget throws away the oldest data, which is the order in which the parts were read above
+    cache.setPartBudget(150);
+    QCOMPARE(cache.messagePart(mailbox, 1, "1"), QByteArray());
+    QCOMPARE(cache.messagePart(mailbox, 3, "1"), QByteArray());
+    QCOMPARE(cache.messagePart(mailbox, 4, "1"), data);
+    statistics = cache.statistics();
+    QCOMPARE(statistics.parts, 1);
+    QCOMPARE(statistics.evictedParts, quint64(3));
+
+    // The bookkeeping of the evicted parts is gone, too
+    cache.clearMessage(mailbox, 1);
+    cache.clearAllMessages(mailbox);
+    QCOMPARE(cache.statistics().partBytes, quint64(0));
+}
+
+QTEST_GUILESS_MAIN(TestMemoryCache)
@@ -20,9 +20,15 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <QFileInfo>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QTemporaryDir>
 #include <QTest>
 #include "test_SqlCache.h"
 #include "Imap/Model/SQLCache.h"
+#include "Imap/Model/SQLCacheLog.h"
+#include "Imap/Model/SQLCacheWriter.h"
 
 Q_DECLARE_METATYPE(QList<Imap::Mailbox::MailboxMetadata>)
 
@@ -88,4 +94,643 @@ void TestSqlCache::testMailboxOperation()
     QVERIFY(errorLog.empty());
 }
 
+/** @short Check that the garbage collection removes what it should, and nothing else */
+void TestSqlCache::testExpiration()
+{
+    using namespace Imap::Mailbox;
+
+    AbstractCache::MessageDataBundle bundle;
+    bundle.uid = 1;
+    bundle.size = 666;
+    cache->setMessageMetadata(QStringLiteral("a"), 1, bundle);
+    bundle.uid = 2;
+    cache->setMessageMetadata(QStringLiteral("a"), 2, bundle);
+    bundle.uid = 3;
+    cache->setMessageMetadata(QStringLiteral("b"), 3, bundle);
+    cache->setMsgPart(QStringLiteral("a"), 1, "1", QByteArray(1000, 'x'));
+    cache->setMsgFlags(QStringLiteral("a"), 1, QStringList() << QStringLiteral("\\Seen"));
+    CHECK_CACHE_ERRORS;
+
+    quint64 usedBefore = cache->usedSize();
+    QVERIFY(usedBefore > 0);
+
+    // Everything was accessed today
+    auto result = std::make_shared<ExpiredMessages>();
+    QVERIFY(cache->isCommitted(cache->expireMessages(0, 10, result)));
+    CHECK_CACHE_ERRORS;
+    QVERIFY(result->messages.isEmpty());
+    QCOMPARE(result->reclaimed, 0ull);
+    QCOMPARE(cache->messageMetadata(QStringLiteral("a"), 1).uid, 1u);
+
+    // The size-based expiry respects the limit
+    QVERIFY(cache->isCommitted(cache->expireMessages(-1, 1, result)));
+    CHECK_CACHE_ERRORS;
+    QCOMPARE(result->messages.size(), 1);
+    const auto victim = result->messages.first();
+    QVERIFY(result->reclaimed > 0);
+    QVERIFY(cache->usedSize() < usedBefore);
+    QCOMPARE(cache->messageMetadata(victim.first, victim.second).uid, 0u);
+    QCOMPARE(cache->messagePart(victim.first, victim.second, "1"), QByteArray());
+    // Flags are needed for syncing, so they are kept
+    QCOMPARE(cache->msgFlags(QStringLiteral("a"), 1), QStringList() << QStringLiteral("\\Seen"));
+
+    QVERIFY(cache->isCommitted(cache->expireMessages(-1, 10, result)));
+    CHECK_CACHE_ERRORS;
+    QCOMPARE(result->messages.size(), 2);
+    QVERIFY(!result->messages.contains(victim));
+    QCOMPARE(cache->messageMetadata(QStringLiteral("a"), 2).uid, 0u);
+    QCOMPARE(cache->messageMetadata(QStringLiteral("b"), 3).uid, 0u);
+    QVERIFY(cache->isCommitted(cache->expireMessages(-1, 10, result)));
+    QVERIFY(result->messages.isEmpty());
+
+    // Nothing breaks when there's nothing to give back
+    cache->reclaimFreeSpace();
+    CHECK_CACHE_ERRORS;
+
+    QVERIFY(errorLog.empty());
+}
+
+/** @short Make sure that the batch readers return the same data as the per-message ones */
+void TestSqlCache::testBatchRead()
+{
+    using namespace Imap::Mailbox;
+
+    const QString mailbox = QStringLiteral("batch");
+    AbstractCache::MessageDataBundle bundle;
+    bundle.serializedBodyStructure = "dummy";
+    // Two clusters of UIDs which are too far apart to share a single range
+    Imap::Uids stored;
+    stored << 1 << 2 << 3 << 5 << 1000 << 1001;
+    Q_FOREACH(const uint uid, stored) {
+        bundle.uid = uid;
+        bundle.size = uid * 10;
+        cache->setMessageMetadata(mailbox, uid, bundle);
+        cache->setMsgFlags(mailbox, uid, QStringList() << QString::number(uid));
+    }
+    CHECK_CACHE_ERRORS;
+
+    Imap::Uids wanted;
+    wanted << 1001 << 2 << 4 << 5 << 1000 << 666;
+    auto metadata = cache->messageMetadataBatch(mailbox, wanted);
+    auto flags = cache->msgFlagsBatch(mailbox, wanted);
+    CHECK_CACHE_ERRORS;
+    QCOMPARE(metadata.keys(), QList<uint>() << 2 << 5 << 1000 << 1001);
+    QCOMPARE(flags.keys(), metadata.keys());
+    Q_FOREACH(const uint uid, metadata.keys()) {
+        QCOMPARE(metadata[uid], cache->messageMetadata(mailbox, uid));
+        QCOMPARE(flags[uid], cache->msgFlags(mailbox, uid));
+    }
+
+    QVERIFY(cache->messageMetadataBatch(mailbox, Imap::Uids()).isEmpty());
+    QVERIFY(cache->msgFlagsBatch(QStringLiteral("nonexistent"), wanted).isEmpty());
+    QVERIFY(errorLog.empty());
+}
+
+void TestSqlCache::benchmarkBatchRead_data()
+{
+    QTest::addColumn<bool>("batch");
+    QTest::newRow("per-message") << false;
+    QTest::newRow("batch") << true;
+}
+
+/** @short Compare the speed of loading a mailbox-worth of envelopes and flags one by one and at once */
+void TestSqlCache::benchmarkBatchRead()
+{
+    using namespace Imap::Mailbox;
+    QFETCH(bool, batch);
+
+    const QString mailbox = QStringLiteral("benchmark");
+    const uint num = 5000;
+    Imap::Uids uids;
+    for (uint uid = 1; uid <= num; ++uid) {
+        uids << uid;
+    }
+    if (cache->messageMetadata(mailbox, 1).uid == 0) {
+        AbstractCache::MessageDataBundle bundle;
+        bundle.serializedBodyStructure = QByteArray(200, 'x');
+        bundle.envelope.subject = QStringLiteral("A subject which is long enough to be a realistic one");
+        Q_FOREACH(const uint uid, uids) {
+            bundle.uid = uid;
+            cache->setMessageMetadata(mailbox, uid, bundle);
+            cache->setMsgFlags(mailbox, uid, QStringList() << QStringLiteral("\\Seen"));
+        }
+    }
+
+    QBENCHMARK {
+        if (batch) {
+            QCOMPARE(static_cast<uint>(cache->messageMetadataBatch(mailbox, uids).size()), num);
+            QCOMPARE(static_cast<uint>(cache->msgFlagsBatch(mailbox, uids).size()), num);
+        } else {
+            Q_FOREACH(const uint uid, uids) {
+                QCOMPARE(cache->messageMetadata(mailbox, uid).uid, uid);
+                QVERIFY(!cache->msgFlags(mailbox, uid).isEmpty());
+            }
+        }
+    }
+    QVERIFY(errorLog.empty());
+}
+
+/** @short Data handed over to the writer thread have to be visible right away, and they have to reach the disk */
+void TestSqlCache::testWriteBehind()
+{
+    using namespace Imap::Mailbox;
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString fileName = dir.path() + QLatin1String("/imap.cache.sqlite");
+    const QString mailbox = QStringLiteral("writeBehind");
+    const QStringList seen = QStringList() << QStringLiteral("\\Seen");
+    const Imap::Uids uidMap = Imap::Uids() << 1 << 2;
+
+    {
+        SQLCache writer;
+        writer.setErrorHandler([this](const QString &e) { this->errorLog.push_back(e); });
+        QVERIFY(writer.open(QStringLiteral("writeBehind"), fileName));
+
+        AbstractCache::MessageDataBundle bundle;
+        bundle.uid = 1;
+        bundle.size = 123;
+        writer.setMessageMetadata(mailbox, 1, bundle);
+        writer.setMsgFlags(mailbox, 1, seen);
+        writer.setMsgPart(mailbox, 1, "1", "data");
+        writer.setUidMapping(mailbox, uidMap);
+        QCOMPARE(writer.messageMetadata(mailbox, 1), bundle);
+        QCOMPARE(writer.msgFlags(mailbox, 1), seen);
+        QCOMPARE(writer.messagePart(mailbox, 1, "1"), QByteArray("data"));
+        QCOMPARE(writer.uidMapping(mailbox), uidMap);
+
+        writer.clearMessage(mailbox, 1);
+        writer.setMsgFlags(mailbox, 2, seen);
+        QCOMPARE(writer.messageMetadata(mailbox, 1).uid, 0u);
+        QCOMPARE(writer.msgFlags(mailbox, 1), QStringList());
+        QCOMPARE(writer.messagePart(mailbox, 1, "1"), QByteArray());
+        QCOMPARE(writer.msgFlagsBatch(mailbox, uidMap).keys(), QList<uint>() << 2);
+
+        writer.waitForPendingWrites();
+        // Let the overlay forget about the committed data
+        QCoreApplication::processEvents();
+        QCOMPARE(writer.messageMetadata(mailbox, 1).uid, 0u);
+        QCOMPARE(writer.msgFlags(mailbox, 2), seen);
+        QCOMPARE(writer.uidMapping(mailbox), uidMap);
+
+        auto statistics = writer.writeQueueStatistics();
+        QCOMPARE(statistics.queueDepth, 0);
+        QCOMPARE(statistics.jobs, quint64(7));
+        QVERIFY(statistics.commits > 0);
+        QVERIFY(statistics.maxQueueDepth > 0);
+    }
+
+    SQLCache reader;
+    reader.setErrorHandler([this](const QString &e) { this->errorLog.push_back(e); });
+    QVERIFY(reader.open(QStringLiteral("writeBehindCheck"), fileName));
+    QCOMPARE(reader.uidMapping(mailbox), uidMap);
+    QCOMPARE(reader.msgFlags(mailbox, 1), QStringList());
+    QCOMPARE(reader.msgFlags(mailbox, 2), seen);
+    QCOMPARE(reader.messageMetadata(mailbox, 1).uid, 0u);
+    QCOMPARE(reader.messagePart(mailbox, 1, "1"), QByteArray());
+    CHECK_CACHE_ERRORS;
+}
+
+/** @short A writer which cannot commit must neither block the callers nor keep retrying forever */
+void TestSqlCache::testCommitFailure()
+{
+    using namespace Imap::Mailbox;
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    SQLCacheWriter writer(QStringLiteral("commitFailure"), dir.path() + QLatin1String("/imap.cache.sqlite"));
+    QStringList errors;
+    QObject::connect(&writer, &SQLCacheWriter::error, &writer, [&errors](const QString &message) { errors << message; });
+    QVERIFY(writer.startWriting());
+
+    // Ending the transaction behind the writer's back makes its own COMMIT fail, each time it is retried
+    writer.enqueue(1, [](SqlWriteContext &ctx) { ctx.prepared(QStringLiteral("COMMIT")).exec(); });
+    writer.flush();
+    QVERIFY(writer.statistics().failedCommits > 0);
+
+    // Way more than the queue limit, which would block the GUI otherwise
+    const quint64 jobs = 20000;
+    for (quint64 sequence = 2; sequence <= jobs; ++sequence) {
+        writer.enqueue(sequence, [](SqlWriteContext &) {});
+    }
+
+    // The writer gives up eventually, throws away everything and tells the owner about it
+    QTRY_COMPARE_WITH_TIMEOUT(writer.statistics().droppedJobs, jobs, 10000);
+    QTRY_VERIFY(!errors.isEmpty() && errors.last().contains(QLatin1String("Giving up")));
+    writer.enqueue(jobs + 1, [](SqlWriteContext &) {});
+    writer.flush();
+    auto statistics = writer.statistics();
+    QCOMPARE(statistics.queueDepth, 0);
+    QCOMPARE(statistics.droppedJobs, jobs + 1);
+    QCOMPARE(statistics.commits, quint64(0));
+    QCOMPARE(statistics.failedCommits, quint64(3));
+}
+
+/** @short A cache from an older version which used full mailbox names as keys has to be upgraded without losing data */
+void TestSqlCache::testMigrationToMailboxIds()
+{
+    using namespace Imap::Mailbox;
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString fileName = dir.path() + QLatin1String("/imap.cache.sqlite");
+    const QString mailbox = QStringLiteral("Archive/2014/a folder with a rather long name");
+    const QStringList seen = QStringList() << QStringLiteral("\\Seen");
+    const int messageCount = 2000;
+    Imap::Uids uidMap;
+
+    {
+        // Build the v7 layout by hand
+        QSqlDatabase db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("v7"));
+        db.setDatabaseName(fileName);
+        QVERIFY(db.open());
+        QSqlQuery q(db);
+        QVERIFY(q.exec(QStringLiteral("CREATE TABLE trojita (version STRING NOT NULL)")));
+        QVERIFY(q.exec(QStringLiteral("INSERT INTO trojita (version) VALUES (7)")));
+        QVERIFY(q.exec(QStringLiteral("CREATE TABLE child_mailboxes (mailbox STRING NOT NULL PRIMARY KEY, parent STRING NOT NULL, "
+                                      "separator STRING, flags BINARY)")));
+        QVERIFY(q.exec(QStringLiteral("CREATE TABLE uid_mapping (mailbox STRING NOT NULL PRIMARY KEY, mapping BINARY)")));
+        QVERIFY(q.exec(QStringLiteral("CREATE TABLE msg_metadata (mailbox STRING NOT NULL, uid INT NOT NULL, data BINARY, "
+                                      "lastAccessDate INT, PRIMARY KEY (mailbox, uid))")));
+        QVERIFY(q.exec(QStringLiteral("CREATE TABLE flags (mailbox STRING NOT NULL, uid INT NOT NULL, flags BINARY, "
+                                      "PRIMARY KEY (mailbox, uid))")));
+        QVERIFY(q.exec(QStringLiteral("CREATE TABLE parts (mailbox STRING NOT NULL, uid INT NOT NULL, part_id BINARY, data BINARY, "
+                                      "PRIMARY KEY (mailbox, uid, part_id))")));
+        QVERIFY(q.exec(QStringLiteral("CREATE TABLE msg_threading (mailbox STRING NOT NULL PRIMARY KEY, threading BINARY)")));
+        QVERIFY(q.exec(QStringLiteral("CREATE TABLE mailbox_sync_state (mailbox STRING NOT NULL PRIMARY KEY, sync_state BINARY)")));
+
+        QByteArray flagsBuf;
+        {
+            QDataStream stream(&flagsBuf, QIODevice::WriteOnly);
+            stream.setVersion(QDataStream::Qt_4_6);
+            stream << seen;
+        }
+        QVERIFY(db.transaction());
+        QVERIFY(q.prepare(QStringLiteral("INSERT INTO flags (mailbox, uid, flags) VALUES (?, ?, ?)")));
+        for (int i = 1; i <= messageCount; ++i) {
+            uidMap << i;
+            q.bindValue(0, mailbox);
+            q.bindValue(1, i);
+            q.bindValue(2, flagsBuf);
+            QVERIFY(q.exec());
+        }
+        QVERIFY(q.prepare(QStringLiteral("INSERT INTO parts (mailbox, uid, part_id, data) VALUES (?, ?, ?, ?)")));
+        q.bindValue(0, mailbox);
+        q.bindValue(1, 1);
+        q.bindValue(2, QByteArray("1"));
+        q.bindValue(3, qCompress(QByteArray("data")));
+        QVERIFY(q.exec());
+        QByteArray mappingBuf;
+        {
+            QDataStream stream(&mappingBuf, QIODevice::WriteOnly);
+            stream.setVersion(QDataStream::Qt_4_6);
+            stream << uidMap;
+        }
+        QVERIFY(q.prepare(QStringLiteral("INSERT INTO uid_mapping (mailbox, mapping) VALUES (?, ?)")));
+        q.bindValue(0, mailbox);
+        q.bindValue(1, qCompress(mappingBuf));
+        QVERIFY(q.exec());
+        QVERIFY(db.commit());
+        q.clear();
+        db.close();
+    }
+    QSqlDatabase::removeDatabase(QStringLiteral("v7"));
+
+    {
+        SQLCache migrated;
+        migrated.setErrorHandler([this](const QString &e) { this->errorLog.push_back(e); });
+        QVERIFY(migrated.open(QStringLiteral("migrated"), fileName));
+        CHECK_CACHE_ERRORS;
+        QCOMPARE(migrated.uidMapping(mailbox), uidMap);
+        QCOMPARE(migrated.msgFlags(mailbox, 1), seen);
+        QCOMPARE(migrated.msgFlags(mailbox, messageCount), seen);
+        QCOMPARE(migrated.msgFlagsBatch(mailbox, uidMap).size(), messageCount);
+        QCOMPARE(migrated.messagePart(mailbox, 1, "1"), QByteArray("data"));
+    }
+
+    {
+        // The rows refer to the mailbox by its ID, the old tables are gone, and the lookups go through the primary keys
+        QSqlDatabase db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("inspect"));
+        db.setDatabaseName(fileName);
+        QVERIFY(db.open());
+        QSqlQuery q(db);
+        QVERIFY(q.exec(QStringLiteral("SELECT COUNT(*) FROM mailboxes")));
+        QVERIFY(q.first());
+        QCOMPARE(q.value(0).toInt(), 1);
+        QVERIFY(q.exec(QStringLiteral("SELECT COUNT(*), MIN(uid), MAX(uid) FROM flags "
+                                      "JOIN mailboxes ON mailboxes.id = flags.mailbox_id WHERE mailboxes.name = '%1'").arg(mailbox)));
+        QVERIFY(q.first());
+        QCOMPARE(q.value(0).toInt(), messageCount);
+        QCOMPARE(q.value(1).toInt(), 1);
+        QCOMPARE(q.value(2).toInt(), messageCount);
+        QVERIFY(q.exec(QStringLiteral("SELECT COUNT(*) FROM parts WHERE uid = 1 AND part_id = '1'")));
+        QVERIFY(q.first());
+        QCOMPARE(q.value(0).toInt(), 1);
+        QVERIFY(q.exec(QStringLiteral("SELECT COUNT(*) FROM sqlite_master WHERE name LIKE '%_v7'")));
+        QVERIFY(q.first());
+        QCOMPARE(q.value(0).toInt(), 0);
+        Q_FOREACH(const QString &table, QStringList() << QStringLiteral("msg_metadata") << QStringLiteral("flags")
+                  << QStringLiteral("parts") << QStringLiteral("uid_mapping") << QStringLiteral("msg_threading")) {
+            QVERIFY(q.exec(QStringLiteral("PRAGMA table_info(%1)").arg(table)));
+            QStringList columns;
+            while (q.next())
+                columns << q.value(1).toString();
+            QVERIFY2(columns.contains(QStringLiteral("mailbox_id")) && !columns.contains(QStringLiteral("mailbox")),
+                     qPrintable(table + QLatin1String(": ") + columns.join(QStringLiteral(", "))));
+        }
+
+        auto queryPlan = [&q](const QString &sql) {
+            QString plan;
+            if (!q.exec(QStringLiteral("EXPLAIN QUERY PLAN ") + sql))
+                return plan;
+            while (q.next())
+                plan += q.value(3).toString() + QLatin1Char('\n');
+            return plan;
+        };
+        QString plan = queryPlan(QStringLiteral("SELECT flags FROM flags WHERE mailbox_id = 1 AND uid = 1"));
+        QVERIFY2(plan.contains(QLatin1String("USING PRIMARY KEY (mailbox_id=? AND uid=?)")), qPrintable(plan));
+        // The envelopes are too big for the B-tree of the primary key, so they live in a rowid table with a separate index
+        plan = queryPlan(QStringLiteral("SELECT data FROM msg_metadata WHERE mailbox_id = 1 AND uid = 1"));
+        QVERIFY2(plan.contains(QLatin1String("USING INDEX msg_metadata_uid (mailbox_id=? AND uid=?)")), qPrintable(plan));
+        QVERIFY(q.exec(QStringLiteral("SELECT sql FROM sqlite_master WHERE type = 'table' AND name = 'msg_metadata'")));
+        QVERIFY(q.first());
+        QVERIFY2(!q.value(0).toString().contains(QLatin1String("WITHOUT ROWID")), qPrintable(q.value(0).toString()));
+        plan = queryPlan(QStringLiteral("SELECT data FROM parts WHERE mailbox_id = 1 AND uid = 1 AND part_id = '1'"));
+        QVERIFY2(plan.contains(QLatin1String("INDEX")) && plan.contains(QLatin1String("mailbox_id=? AND uid=? AND part_id=?")),
+                 qPrintable(plan));
+        plan = queryPlan(QStringLiteral("SELECT id FROM mailboxes WHERE name = 'INBOX'"));
+        QVERIFY2(plan.contains(QLatin1String("INDEX")) && plan.contains(QLatin1String("name=?")), qPrintable(plan));
+        q.clear();
+        db.close();
+    }
+    QSqlDatabase::removeDatabase(QStringLiteral("inspect"));
+
+    {
+        // New mailboxes must not reuse the IDs of the migrated ones
+        SQLCache migrated;
+        migrated.setErrorHandler([this](const QString &e) { this->errorLog.push_back(e); });
+        QVERIFY(migrated.open(QStringLiteral("migrated"), fileName));
+        migrated.setMsgFlags(QStringLiteral("INBOX"), 1, QStringList());
+        migrated.clearAllMessages(mailbox);
+        migrated.waitForPendingWrites();
+        QCoreApplication::processEvents();
+        QCOMPARE(migrated.msgFlags(mailbox, 1), QStringList());
+        QCOMPARE(migrated.msgFlags(QStringLiteral("INBOX"), 1), QStringList());
+        CHECK_CACHE_ERRORS;
+    }
+
+    SQLCache reopened;
+    reopened.setErrorHandler([this](const QString &e) { this->errorLog.push_back(e); });
+    QVERIFY(reopened.open(QStringLiteral("reopened"), fileName));
+    QCOMPARE(reopened.msgFlags(mailbox, 1), QStringList());
+    QCOMPARE(reopened.uidMapping(mailbox), uidMap);
+    CHECK_CACHE_ERRORS;
+}
+
+/** @short Applying the difference of two vectors has to turn the first one into the second one */
+void TestSqlCache::testAppendLogDiff()
+{
+    using namespace Imap::Mailbox::AppendLog;
+
+    Imap::Uids before;
+    for (uint i = 1; i <= 100; ++i)
+        before << i * 2;
+
+    QVector<Imap::Uids> afters;
+    afters << before;
+    afters << (Imap::Uids(before) << 500 << 501);
+    Imap::Uids expunged = before;
+    expunged.remove(0);
+    expunged.remove(10, 5);
+    expunged.remove(50);
+    afters << expunged;
+    afters << (Imap::Uids(expunged) << 1000);
+    afters << Imap::Uids();
+    afters << (Imap::Uids() << 1 << 3 << 5);
+    // Unknown UIDs break the ordering
+    Imap::Uids unsorted = before;
+    unsorted[20] = 0;
+    unsorted << 0 << 0;
+    afters << unsorted;
+
+    Q_FOREACH(const Imap::Uids &after, afters) {
+        const auto splices = diff(before, after);
+        if (after == before) {
+            QVERIFY(splices.isEmpty());
+        }
+        Imap::Uids patched;
+        QVERIFY(decodeSnapshot(encodeSnapshot(before), patched));
+        QCOMPARE(patched, before);
+        QVERIFY(applyDelta(encodeDelta(splices), patched));
+        QCOMPARE(patched, after);
+    }
+
+    // An arrival and an expunge at two different places should not rewrite everything in between
+    const auto splices = diff(before, afters[3]);
+    int touched = 0;
+    Q_FOREACH(const auto &splice, splices) {
+        touched += splice.removed + splice.inserted.size();
+    }
+    QCOMPARE(touched, before.size() - afters[3].size() + 2);
+
+    // Large snapshots are split into chunks
+    Imap::Uids big;
+    for (int i = 1; i <= 3 * snapshotChunkSize + 7; ++i)
+        big << uint(i);
+    Imap::Uids decoded;
+    QVERIFY(decodeSnapshot(encodeSnapshot(big), decoded));
+    QCOMPARE(decoded, big);
+}
+
+/** @short The UID map has to survive many small updates which are stored as a log */
+void TestSqlCache::testUidMapLog()
+{
+    const QString mailbox = QStringLiteral("uidMapLog");
+    Imap::Uids uids;
+    for (uint i = 1; i <= 1000; ++i)
+        uids << i;
+    cache->setUidMapping(mailbox, uids);
+    QCOMPARE(cache->uidMapping(mailbox), uids);
+
+    uint nextUid = 1001;
+    for (int round = 0; round < 200; ++round) {
+        // A new arrival, and every now and then, an expunge
+        uids << nextUid++;
+        if (round % 3 == 0)
+            uids.remove((round * 7) % uids.size());
+        cache->setUidMapping(mailbox, uids);
+        QCOMPARE(cache->uidMapping(mailbox), uids);
+    }
+
+    cache->clearUidMapping(mailbox);
+    QCOMPARE(cache->uidMapping(mailbox), Imap::Uids());
+    cache->setUidMapping(mailbox, Imap::Uids() << 5);
+    QCOMPARE(cache->uidMapping(mailbox), Imap::Uids() << 5);
+    // The writer must not log this against what it had stored before the mapping got cleared
+    cache->setUidMapping(mailbox, Imap::Uids() << 5 << 6);
+    QCOMPARE(cache->uidMapping(mailbox), Imap::Uids() << 5 << 6);
+    CHECK_CACHE_ERRORS;
+}
+
+/** @short The search results are forgotten when the UIDVALIDITY changes, and only the recently used ones are kept */
+void TestSqlCache::testSearchResults()
+{
+    using namespace Imap::Mailbox;
+    const QString mailbox = QStringLiteral("searchResults");
+    SyncState sync;
+    sync.setUidValidity(10);
+    cache->setMailboxSyncState(mailbox, sync);
+
+    AbstractCache::SearchResult result;
+    result.uids << 3 << 1 << 2;
+    result.highestModSeq = 33;
+    result.uidNext = 4;
+    result.uidValidity = 10;
+    cache->setSearchResult(mailbox, QStringLiteral("first"), result);
+    AbstractCache::SearchResult cached;
+    QVERIFY(cache->searchResult(mailbox, QStringLiteral("first"), cached));
+    QCOMPARE(cached.uids, result.uids);
+    QCOMPARE(cached.highestModSeq, 33ull);
+    QCOMPARE(cached.uidNext, 4u);
+    QCOMPARE(cached.uidValidity, 10u);
+
+    // The same UIDVALIDITY keeps the result around
+    sync.setUidNext(5);
+    cache->setMailboxSyncState(mailbox, sync);
+    QVERIFY(cache->searchResult(mailbox, QStringLiteral("first"), cached));
+    sync.setUidValidity(11);
+    cache->setMailboxSyncState(mailbox, sync);
+    QVERIFY(!cache->searchResult(mailbox, QStringLiteral("first"), cached));
+    CHECK_CACHE_ERRORS;
+
+    result.uidValidity = 11;
+    cache->setSearchResult(mailbox, QStringLiteral("first"), result);
+    cache->setSearchResult(mailbox, QStringLiteral("second"), result);
+    for (int i = 0; i < 98; ++i)
+        cache->setSearchResult(mailbox, QStringLiteral("filler %1").arg(i), result);
+    // Using the oldest result makes it the most recently used one
+    QVERIFY(cache->searchResult(mailbox, QStringLiteral("first"), cached));
+    cache->setSearchResult(mailbox, QStringLiteral("one too many"), result);
+    QVERIFY(cache->searchResult(mailbox, QStringLiteral("first"), cached));
+    QVERIFY(!cache->searchResult(mailbox, QStringLiteral("second"), cached));
+    QVERIFY(cache->searchResult(mailbox, QStringLiteral("filler 0"), cached));
+    QVERIFY(cache->searchResult(mailbox, QStringLiteral("one too many"), cached));
+    CHECK_CACHE_ERRORS;
+}
+
+/** @short The quick search conditions are answered from the full-text index */
+void TestSqlCache::testFullTextSearch()
+{
+    using namespace Imap::Mailbox;
+
+    const QString mailbox = QStringLiteral("fulltext");
+    const QStringList subjectOrBody = QStringList() << QStringLiteral("OR")
+                                                    << QStringLiteral("SUBJECT") << QStringLiteral("kangaroo")
+                                                    << QStringLiteral("BODY") << QStringLiteral("kangaroo");
+    Imap::Uids uids;
+    if (!cache->searchMessages(mailbox, subjectOrBody, uids)) {
+        QSKIP("The sqlite library was built without FTS5");
+    }
+    QCOMPARE(uids, Imap::Uids());
+
+    AbstractCache::MessageDataBundle bundle;
+    bundle.uid = 10;
+    bundle.envelope.subject = QStringLiteral("Kangaroos are jumping");
+    bundle.envelope.from << Imap::Message::MailAddress(QStringLiteral("Joe Random"), QString(),
+                                                       QStringLiteral("joe"), QStringLiteral("example.org"));
+    cache->setMessageMetadata(mailbox, 10, bundle);
+    bundle.uid = 11;
+    bundle.envelope.subject = QStringLiteral("Lunch");
+    bundle.envelope.to = bundle.envelope.from;
+    bundle.envelope.from.clear();
+    cache->setMessageMetadata(mailbox, 11, bundle);
+    cache->setMessageText(mailbox, 11, "1", QStringLiteral("There is a kangaroo in the garden"));
+    // All text parts are indexed, but each of them only once
+    cache->setMessageText(mailbox, 11, "2", QStringLiteral("And a wombat"));
+    cache->setMessageText(mailbox, 11, "1", QStringLiteral("Platypus"));
+    // The body might arrive before the envelope
+    cache->setMessageText(mailbox, 12, "1", QStringLiteral("Nothing interesting"));
+    bundle.uid = 12;
+    bundle.envelope.subject = QStringLiteral("Kangaroo, take two");
+    cache->setMessageMetadata(mailbox, 12, bundle);
+    cache->setMessageMetadata(QStringLiteral("elsewhere"), 11, bundle);
+    CHECK_CACHE_ERRORS;
+
+    QVERIFY(cache->searchMessages(mailbox, subjectOrBody, uids));
+    QCOMPARE(uids, Imap::Uids() << 10 << 11 << 12);
+    QVERIFY(cache->searchMessages(mailbox, QStringList() << QStringLiteral("FUZZY") << QStringLiteral("BODY")
+                                  << QStringLiteral("nothing"), uids));
+    QCOMPARE(uids, Imap::Uids() << 12);
+    QVERIFY(cache->searchMessages(mailbox, QStringList() << QStringLiteral("BODY") << QStringLiteral("wombat"), uids));
+    QCOMPARE(uids, Imap::Uids() << 11);
+    QVERIFY(cache->searchMessages(mailbox, QStringList() << QStringLiteral("BODY") << QStringLiteral("platypus"), uids));
+    QCOMPARE(uids, Imap::Uids());
+    QVERIFY(cache->searchMessages(mailbox, QStringList() << QStringLiteral("FROM") << QStringLiteral("joe@example"), uids));
+    QCOMPARE(uids, Imap::Uids() << 10);
+    QVERIFY(cache->searchMessages(mailbox, QStringList() << QStringLiteral("OR") << QStringLiteral("TO") << QStringLiteral("random")
+                                  << QStringLiteral("SUBJECT") << QStringLiteral("\"lunch"), uids));
+    QCOMPARE(uids, Imap::Uids() << 11 << 12);
+    CHECK_CACHE_ERRORS;
+
+    // Stuff which the index cannot answer
+    QVERIFY(!cache->searchMessages(mailbox, QStringList() << QStringLiteral("UNSEEN"), uids));
+    QVERIFY(!cache->searchMessages(mailbox, QStringList() << QStringLiteral("SUBJECT"), uids));
+    QVERIFY(!cache->searchMessages(mailbox, QStringList() << QStringLiteral("SUBJECT") << QStringLiteral("!!"), uids));
+    QVERIFY(!cache->searchMessages(mailbox, QStringList() << QStringLiteral("SUBJECT") << QStringLiteral("a")
+                                   << QStringLiteral("UNSEEN"), uids));
+
+    // Expunges are reflected, but the expiration of cached data is not
+    cache->clearMessage(mailbox, 12);
+    cache->expireMessages(-1, 100, std::make_shared<ExpiredMessages>());
+    QVERIFY(cache->searchMessages(mailbox, subjectOrBody, uids));
+    QCOMPARE(uids, Imap::Uids() << 10 << 11);
+    // A message which reappears under the same UID gets its parts indexed from scratch
+    cache->setMessageText(mailbox, 12, "1", QStringLiteral("Echidna"));
+    QVERIFY(cache->searchMessages(mailbox, QStringList() << QStringLiteral("BODY") << QStringLiteral("echidna"), uids));
+    QCOMPARE(uids, Imap::Uids() << 12);
+    cache->clearAllMessages(mailbox);
+    QVERIFY(cache->searchMessages(mailbox, subjectOrBody, uids));
+    QCOMPARE(uids, Imap::Uids());
+    QVERIFY(cache->searchMessages(QStringLiteral("elsewhere"), subjectOrBody, uids));
+    QCOMPARE(uids, Imap::Uids() << 11);
+    CHECK_CACHE_ERRORS;
+}
+
+/** @short Latency of the local search in a big mailbox
+
+Raise the number of messages to half a million for measurements; the default keeps the test suite fast.
+*/
+void TestSqlCache::benchmarkFullTextSearch()
+{
+    using namespace Imap::Mailbox;
+
+    const QString mailbox = QStringLiteral("fulltextBenchmark");
+    const uint num = 20000;
+    const QStringList words = QStringList() << QStringLiteral("meeting") << QStringLiteral("report") << QStringLiteral("invoice")
+                                            << QStringLiteral("holiday") << QStringLiteral("release") << QStringLiteral("build")
+                                            << QStringLiteral("review") << QStringLiteral("question");
+    const QStringList conditions = QStringList() << QStringLiteral("OR") << QStringLiteral("SUBJECT") << QStringLiteral("invoice 12")
+                                                 << QStringLiteral("BODY") << QStringLiteral("invoice 12");
+    Imap::Uids uids;
+    if (!cache->searchMessages(mailbox, conditions, uids)) {
+        QSKIP("The sqlite library was built without FTS5");
+    }
+
+    AbstractCache::MessageDataBundle bundle;
+    for (uint uid = 1; uid <= num; ++uid) {
+        bundle.uid = uid;
+        bundle.envelope.subject = QStringLiteral("%1 %2").arg(words[uid % words.size()], QString::number(uid % 1000));
+        cache->setMessageMetadata(mailbox, uid, bundle);
+        cache->setMessageText(mailbox, uid, "1", QStringLiteral("Hello, this is about the %1 number %2 from the %3.")
+                              .arg(words[(uid / 7) % words.size()], QString::number(uid % 997), words[(uid / 3) % words.size()]));
+    }
+    CHECK_CACHE_ERRORS;
+
+    QBENCHMARK {
+        QVERIFY(cache->searchMessages(mailbox, conditions, uids));
+    }
+    QVERIFY(!uids.isEmpty());
+    QVERIFY(errorLog.empty());
+}
+
 QTEST_GUILESS_MAIN(TestSqlCache)
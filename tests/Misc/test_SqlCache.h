@@ -39,6 +39,18 @@ private Q_SLOTS:
     void initTestCase();
     void cleanupTestCase();
     void testMailboxOperation();
+    void testExpiration();
+    void testBatchRead();
+    void benchmarkBatchRead_data();
+    void benchmarkBatchRead();
+    void testWriteBehind();
+    void testCommitFailure();
+    void testMigrationToMailboxIds();
+    void testAppendLogDiff();
+    void testUidMapLog();
+    void testSearchResults();
+    void testFullTextSearch();
+    void benchmarkFullTextSearch();
 
 private:
     std::shared_ptr<Imap::Mailbox::SQLCache> cache;
@@ -0,0 +1,205 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QTest>
+#include "test_ThreadNodeArena.h"
+#include "Imap/Model/ThreadNodeArena.h"
+
+using namespace Imap::Mailbox;
+
+namespace {
+
+/** @short Node IDs in the order of the iteration */
+QList<uint> iteratedIds(const ThreadNodeArena &arena)
+{
+    QList<uint> res;
+    for (ThreadNodeArena::const_iterator it = arena.constBegin(); it != arena.constEnd(); ++it) {
+        Q_ASSERT(it->internalId == it.key());
+        res << it.key();
+    }
+    return res;
+}
+
+void addNode(ThreadNodeArena &arena, const uint id, const uint parent)
+{
+    ThreadNodeInfo &node = arena[id];
+    node.internalId = id;
+    node.uid = id * 10;
+    node.parent = parent;
+    arena[parent].children << id;
+}
+
+}
+
+void TestThreadNodeArena::testInsert()
+{
+    ThreadNodeArena arena;
+    QVERIFY(arena.isEmpty());
+    QVERIFY(!arena.contains(0));
+    QVERIFY(arena.find(3) == arena.end());
+
+    // The slots in between are not present just because the storage had to grow
+    arena[3].uid = 30;
+    QCOMPARE(arena.size(), 1);
+    QVERIFY(!arena.isEmpty());
+    QVERIFY(arena.contains(3));
+    QVERIFY(!arena.contains(0));
+    QVERIFY(!arena.contains(2));
+    QVERIFY(!arena.contains(4));
+    QCOMPARE(arena.value(3).uid, 30u);
+    QCOMPARE(arena.value(2).uid, 0u);
+    QVERIFY(!arena.contains(2));
+
+    // Accessing a present node does not reset it
+    arena[3].children << 5;
+    QCOMPARE(arena[3].uid, 30u);
+    QCOMPARE(arena[3].children, QList<uint>() << 5);
+    QCOMPARE(arena.size(), 1);
+
+    arena[0].uid = 1;
+    QCOMPARE(arena.size(), 2);
+    QVERIFY(arena.find(0) == arena.begin());
+    QCOMPARE(arena.find(3)->uid, 30u);
+
+    arena.clear();
+    QVERIFY(arena.isEmpty());
+    QVERIFY(!arena.contains(3));
+    QVERIFY(arena.begin() == arena.end());
+}
+
+void TestThreadNodeArena::testErase()
+{
+    ThreadNodeArena arena;
+    for (uint id = 0; id < 6; ++id) {
+        arena[id].internalId = id;
+        arena[id].uid = id;
+    }
+
+    ThreadNodeArena::iterator it = arena.erase(arena.find(2));
+    QCOMPARE(it.key(), 3u);
+    QCOMPARE(arena.size(), 5);
+    QVERIFY(!arena.contains(2));
+    QVERIFY(arena.find(2) == arena.end());
+
+    // Erasing the last node leads to the end
+    it = arena.erase(arena.find(5));
+    QVERIFY(it == arena.end());
+    QCOMPARE(arena.size(), 4);
+
+    // A node which was erased is created afresh
+    arena[2].internalId = 2;
+    arena[2].uid = 20;
+    QCOMPARE(arena.size(), 5);
+    QCOMPARE(arena.value(2).uid, 20u);
+    QVERIFY(arena.value(2).children.isEmpty());
+
+    // Erasing while iterating
+    for (it = arena.begin(); it != arena.end(); ) {
+        if (it->uid % 2)
+            it = arena.erase(it);
+        else
+            ++it;
+    }
+    QCOMPARE(iteratedIds(arena), QList<uint>() << 0 << 2 << 4);
+    QCOMPARE(arena.keys(), QList<uint>() << 0 << 2 << 4);
+}
+
+void TestThreadNodeArena::testIteration()
+{
+    ThreadNodeArena arena;
+    QVERIFY(arena.constBegin() == arena.constEnd());
+    QVERIFY(iteratedIds(arena).isEmpty());
+
+    // The nodes come in the order of their IDs, no matter in which order they were created
+    Q_FOREACH(const uint id, QList<uint>() << 7 << 1 << 4 << 9) {
+        arena[id].internalId = id;
+    }
+    QCOMPARE(iteratedIds(arena), QList<uint>() << 1 << 4 << 7 << 9);
+    QCOMPARE(arena.keys(), QList<uint>() << 1 << 4 << 7 << 9);
+
+    // The mutable iterator converts to the const one
+    ThreadNodeArena::iterator mutableIt = arena.find(4);
+    ThreadNodeArena::const_iterator constIt = mutableIt;
+    QCOMPARE(constIt.key(), 4u);
+    mutableIt->uid = 40;
+    QCOMPARE(constIt->uid, 40u);
+    QCOMPARE((*constIt).uid, 40u);
+
+    ThreadNodeArena::const_iterator old = constIt++;
+    QCOMPARE(old.key(), 4u);
+    QCOMPARE(constIt.key(), 7u);
+    ++constIt;
+    ++constIt;
+    QVERIFY(constIt == arena.constEnd());
+}
+
+void TestThreadNodeArena::testCompact()
+{
+    ThreadNodeArena arena;
+    arena[0].internalId = 0;
+    for (uint id = 1; id <= 100; ++id)
+        addNode(arena, id, id % 10 == 1 ? 0 : id - 1);
+    QVERIFY(!arena.isFragmented());
+
+    // Erase all but the nodes with the IDs 1, 11, 21... which hang directly below the root
+    for (ThreadNodeArena::iterator it = arena.begin(); it != arena.end(); ) {
+        if (it.key() % 10 != 1 && it.key() != 0) {
+            it = arena.erase(it);
+        } else {
+            if (it.key() != 0)
+                it->children.clear();
+            ++it;
+        }
+    }
+    // One node gets a child back, so that there's a link to update which does not lead to the root
+    addNode(arena, 101, 51);
+    QCOMPARE(arena.size(), 12);
+    QVERIFY(arena.isFragmented());
+
+    const std::vector<uint> renumbered = arena.compact();
+    QVERIFY(!arena.isFragmented());
+    QCOMPARE(arena.size(), 12);
+    QCOMPARE(renumbered.size(), std::vector<uint>::size_type(102));
+    QCOMPARE(renumbered[0], 0u);
+    QCOMPARE(renumbered[2], 0u);
+    QCOMPARE(renumbered[11], 2u);
+    QCOMPARE(renumbered[51], 6u);
+    QCOMPARE(renumbered[101], 11u);
+
+    QList<uint> expected;
+    for (uint id = 0; id < 12; ++id)
+        expected << id;
+    QCOMPARE(iteratedIds(arena), expected);
+    QCOMPARE(arena[0].children, QList<uint>() << 1 << 2 << 3 << 4 << 5 << 6 << 7 << 8 << 9 << 10);
+    QCOMPARE(arena[6].uid, 510u);
+    QCOMPARE(arena[6].children, QList<uint>() << 11);
+    QCOMPARE(arena[11].parent, 6u);
+    QCOMPARE(arena[11].uid, 1010u);
+    QCOMPARE(arena[3].parent, 0u);
+
+    // New IDs continue right after the compacted ones
+    arena[12].internalId = 12;
+    QCOMPARE(arena.size(), 13);
+    QCOMPARE(iteratedIds(arena).size(), 13);
+}
+
+QTEST_GUILESS_MAIN(TestThreadNodeArena)
@@ -0,0 +1,138 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <QSslConfiguration>
+#include <QTest>
+#include "test_TlsSessionCache.h"
+#include "Streams/TlsSessionCache.h"
+
+using namespace Streams;
+
+namespace {
+
+/** @short Simulate the configuration of a socket which has just finished the handshake and got the @arg ticket */
+QSslConfiguration handshakeResult(const QByteArray &ticket)
+{
+    QSslConfiguration conf;
+    conf.setSessionTicket(ticket);
+    return conf;
+}
+
+}
+
+/** @short A second connection to the same server offers the session of the first one */
+void TestTlsSessionCache::testResumption()
+{
+    TlsSessionCache cache;
+    const QString host = QStringLiteral("imap.example.org");
+
+    QSslConfiguration conf;
+    QByteArray offered = cache.prepareConfiguration(conf, host, 993);
+    QVERIFY(offered.isEmpty());
+    QVERIFY(conf.sessionTicket().isEmpty());
+    QVERIFY(!conf.testSslOption(QSsl::SslOptionDisableSessionPersistence));
+    QCOMPARE(cache.sessionEstablished(handshakeResult("ticket-1"), host, 993, offered),
+             QStringLiteral("TLS session: full handshake, no session to resume (0 of 0 attempts resumed, 1 handshakes in total)"));
+
+    conf = QSslConfiguration();
+    offered = cache.prepareConfiguration(conf, host, 993);
+    QCOMPARE(offered, QByteArray("ticket-1"));
+    QCOMPARE(conf.sessionTicket(), QByteArray("ticket-1"));
+    QCOMPARE(cache.sessionEstablished(handshakeResult("ticket-1"), host, 993, offered),
+             QStringLiteral("TLS session: resumed (1 of 1 attempts resumed, 2 handshakes in total)"));
+
+    conf = QSslConfiguration();
+    offered = cache.prepareConfiguration(conf, host, 993);
+    QCOMPARE(offered, QByteArray("ticket-1"));
+    QCOMPARE(cache.sessionEstablished(handshakeResult("ticket-1"), host, 993, offered),
+             QStringLiteral("TLS session: resumed (2 of 2 attempts resumed, 3 handshakes in total)"));
+}
+
+/** @short A server which hands out a fresh ticket is counted as a miss, and the new ticket is offered next time */
+void TestTlsSessionCache::testRotatedTicket()
+{
+    TlsSessionCache cache;
+    const QString host = QStringLiteral("imap.example.org");
+
+    QSslConfiguration conf;
+    QByteArray offered = cache.prepareConfiguration(conf, host, 993);
+    cache.sessionEstablished(handshakeResult("ticket-1"), host, 993, offered);
+
+    conf = QSslConfiguration();
+    offered = cache.prepareConfiguration(conf, host, 993);
+    QCOMPARE(cache.sessionEstablished(handshakeResult("ticket-2"), host, 993, offered),
+             QStringLiteral("TLS session: not resumed (0 of 1 attempts resumed, 2 handshakes in total)"));
+
+    conf = QSslConfiguration();
+    offered = cache.prepareConfiguration(conf, host, 993);
+    QCOMPARE(offered, QByteArray("ticket-2"));
+    QCOMPARE(conf.sessionTicket(), QByteArray("ticket-2"));
+}
+
+/** @short Sessions are shared across differently capitalized host names, but not across ports */
+void TestTlsSessionCache::testKeying()
+{
+    TlsSessionCache cache;
+
+    QSslConfiguration conf;
+    QByteArray offered = cache.prepareConfiguration(conf, QStringLiteral("Mail.Example.org"), 993);
+    cache.sessionEstablished(handshakeResult("imap-ticket"), QStringLiteral("Mail.Example.org"), 993, offered);
+
+    conf = QSslConfiguration();
+    QCOMPARE(cache.prepareConfiguration(conf, QStringLiteral("mail.example.org"), 993), QByteArray("imap-ticket"));
+
+    conf = QSslConfiguration();
+    offered = cache.prepareConfiguration(conf, QStringLiteral("mail.example.org"), 587);
+    QVERIFY(offered.isEmpty());
+    QVERIFY(conf.sessionTicket().isEmpty());
+    cache.sessionEstablished(handshakeResult("smtp-ticket"), QStringLiteral("mail.example.org"), 587, offered);
+
+    conf = QSslConfiguration();
+    QCOMPARE(cache.prepareConfiguration(conf, QStringLiteral("mail.example.org"), 993), QByteArray("imap-ticket"));
+    conf = QSslConfiguration();
+    QCOMPARE(cache.prepareConfiguration(conf, QStringLiteral("mail.example.org"), 587), QByteArray("smtp-ticket"));
+
+    conf = QSslConfiguration();
+    QVERIFY(cache.prepareConfiguration(conf, QStringLiteral("other.example.org"), 993).isEmpty());
+}
+
+/** @short A connection without any session data makes the cache forget the stale ticket */
+void TestTlsSessionCache::testForgetting()
+{
+    TlsSessionCache cache;
+    const QString host = QStringLiteral("imap.example.org");
+
+    QSslConfiguration conf;
+    QByteArray offered = cache.prepareConfiguration(conf, host, 993);
+    cache.sessionEstablished(handshakeResult("ticket-1"), host, 993, offered);
+
+    conf = QSslConfiguration();
+    offered = cache.prepareConfiguration(conf, host, 993);
+    QCOMPARE(cache.sessionEstablished(handshakeResult(QByteArray()), host, 993, offered),
+             QStringLiteral("TLS session: not resumed (0 of 1 attempts resumed, 2 handshakes in total)"));
+
+    conf = QSslConfiguration();
+    QVERIFY(cache.prepareConfiguration(conf, host, 993).isEmpty());
+    QVERIFY(conf.sessionTicket().isEmpty());
+}
+
+QTEST_GUILESS_MAIN(TestTlsSessionCache)
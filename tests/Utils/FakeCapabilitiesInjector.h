@@ -47,6 +47,18 @@ public:
             model->updateCapabilities(it.key(), existingCaps);
         }
     }
+
+    /** @short Pretend that the server does not support the specified capability */
+    void removeCapability(const QString& cap)
+    {
+        Q_ASSERT(!model->m_parsers.isEmpty());
+        for (auto it = model->m_parsers.begin(); it != model->m_parsers.end(); ++it) {
+            auto existingCaps = it->capabilities;
+            existingCaps.removeAll(cap);
+            existingCaps.removeAll(cap.toUpper());
+            model->updateCapabilities(it.key(), existingCaps);
+        }
+    }
 private:
     Imap::Mailbox::Model *model;
 };
@@ -0,0 +1,227 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include "SyntheticMailbox.h"
+
+namespace {
+
+/** @short Prefixes of the replies, the first one is the usual one */
+const char * const replyPrefixes[] = {
+    "Re: ", "RE: ", "Re: Re: ", "Fwd: ", "[trojita] Re: ", "Re[2]: ", "AW: ", "Re:  ",
+};
+const uint numReplyPrefixes = sizeof(replyPrefixes) / sizeof(replyPrefixes[0]);
+
+struct ActiveThread
+{
+    uint root;
+    /** @short A few recent messages of the thread which might get a reply */
+    QVector<uint> recent;
+};
+
+}
+
+SyntheticMailboxProfile::SyntheticMailboxProfile():
+    messages(10000), replyRatio(0.6), chainRatio(0.5), maxDepth(40), damagedRatio(0.02), subjectVariationRatio(0.1),
+    activeThreads(200), seed(1)
+{
+}
+
+SyntheticMailbox::SyntheticMailbox(const SyntheticMailboxProfile &profile):
+    m_random(profile.seed)
+{
+    const uint num = profile.messages;
+    m_parents.resize(num);
+    m_depths.resize(num);
+    m_topics.resize(num);
+    m_subjectVariants.resize(num);
+    m_firstChild.fill(0, num);
+    m_lastChild.fill(0, num);
+    m_nextSibling.fill(0, num);
+
+    QVector<ActiveThread> active;
+    active.reserve(profile.activeThreads);
+    uint topics = 0;
+
+    for (uint uid = 1; uid <= num; ++uid) {
+        const uint i = uid - 1;
+        const bool isReply = !active.isEmpty() && randomUnit() < profile.replyRatio;
+        if (!isReply) {
+            m_parents[i] = 0;
+            m_depths[i] = 0;
+            m_topics[i] = topics++;
+            m_subjectVariants[i] = 0;
+            ActiveThread thread;
+            thread.root = uid;
+            thread.recent << uid;
+            if (static_cast<uint>(active.size()) < profile.activeThreads) {
+                active << thread;
+            } else {
+                active[randomBelow(active.size())] = thread;
+            }
+            continue;
+        }
+
+        ActiveThread &thread = active[randomBelow(active.size())];
+        uint parent = randomUnit() < profile.chainRatio ?
+                    thread.recent.last() : thread.recent[randomBelow(thread.recent.size())];
+        if (m_depths[parent - 1] + 1 > profile.maxDepth)
+            parent = thread.root;
+
+        m_topics[i] = m_topics[parent - 1];
+        m_subjectVariants[i] = 1 + (randomUnit() < profile.subjectVariationRatio ? 1 + randomBelow(numReplyPrefixes - 1) : 0);
+        thread.recent << uid;
+        if (thread.recent.size() > 32)
+            thread.recent.remove(0);
+
+        if (randomUnit() < profile.damagedRatio) {
+            // The message still looks like a reply, but nothing links it to its thread
+            m_parents[i] = 0;
+            m_depths[i] = 0;
+            continue;
+        }
+
+        m_parents[i] = parent;
+        m_depths[i] = m_depths[parent - 1] + 1;
+        if (m_lastChild[parent - 1]) {
+            m_nextSibling[m_lastChild[parent - 1] - 1] = uid;
+        } else {
+            m_firstChild[parent - 1] = uid;
+        }
+        m_lastChild[parent - 1] = uid;
+    }
+}
+
+/** @short The raw output of the Mersenne twister is the same everywhere, unlike the std:: distributions */
+quint32 SyntheticMailbox::nextRandom()
+{
+    return static_cast<quint32>(m_random());
+}
+
+double SyntheticMailbox::randomUnit()
+{
+    return nextRandom() / 4294967296.0;
+}
+
+uint SyntheticMailbox::randomBelow(const uint bound)
+{
+    return nextRandom() % bound;
+}
+
+uint SyntheticMailbox::size() const
+{
+    return m_parents.size();
+}
+
+uint SyntheticMailbox::parent(const uint uid) const
+{
+    return m_parents[uid - 1];
+}
+
+uint SyntheticMailbox::depth(const uint uid) const
+{
+    return m_depths[uid - 1];
+}
+
+QString SyntheticMailbox::subject(const uint uid) const
+{
+    QString base = QStringLiteral("Synthetic topic %1").arg(m_topics[uid - 1]);
+    const quint8 variant = m_subjectVariants[uid - 1];
+    // Damaged replies are roots of their own threads, but they keep their "Re:"
+    return variant ? QString::fromUtf8(replyPrefixes[variant - 1]) + base : base;
+}
+
+uint SyntheticMailbox::threadCount(const uint limit) const
+{
+    return static_cast<uint>(std::count(m_parents.constBegin(), m_parents.constBegin() + std::min(limit, size()), 0u));
+}
+
+uint SyntheticMailbox::maxThreadDepth(const uint limit) const
+{
+    const uint num = std::min(limit, size());
+    return num ? *std::max_element(m_depths.constBegin(), m_depths.constBegin() + num) : 0;
+}
+
+QByteArray SyntheticMailbox::threadResponse(const uint limit) const
+{
+    const uint num = std::min(limit, size());
+    QByteArray res;
+    res.reserve(num * 9 + 32);
+    res += "* THREAD ";
+    for (uint uid = 1; uid <= num; ++uid) {
+        if (m_parents[uid - 1])
+            continue;
+        res += '(';
+        writeThread(res, uid, num);
+        res += ')';
+    }
+    res += "\r\n";
+    return res;
+}
+
+/** @short Append a message and its replies; recursion only happens where the thread branches */
+void SyntheticMailbox::writeThread(QByteArray &out, const uint uid, const uint limit) const
+{
+    uint current = uid;
+    out += QByteArray::number(current);
+    while (true) {
+        uint children = 0;
+        for (uint child = m_firstChild[current - 1]; child && child <= limit; child = m_nextSibling[child - 1])
+            ++children;
+        if (children == 0) {
+            return;
+        } else if (children == 1) {
+            current = m_firstChild[current - 1];
+            out += ' ';
+            out += QByteArray::number(current);
+        } else {
+            out += ' ';
+            for (uint child = m_firstChild[current - 1]; child && child <= limit; child = m_nextSibling[child - 1]) {
+                out += '(';
+                writeThread(out, child, limit);
+                out += ')';
+            }
+            return;
+        }
+    }
+}
+
+QByteArray SyntheticMailbox::sortBySubjectResponse(const uint limit) const
+{
+    const uint num = std::min(limit, size());
+    // The base subject is given by the topic, and the ties are broken by the UID because the messages arrive in order
+    QVector<QPair<QString, uint>> order;
+    order.reserve(num);
+    for (uint uid = 1; uid <= num; ++uid)
+        order << qMakePair(QStringLiteral("synthetic topic %1").arg(m_topics[uid - 1]), uid);
+    std::sort(order.begin(), order.end());
+
+    QByteArray res;
+    res.reserve(num * 8 + 16);
+    res += "* SORT";
+    for (const auto &item : order) {
+        res += ' ';
+        res += QByteArray::number(item.second);
+    }
+    res += "\r\n";
+    return res;
+}
@@ -0,0 +1,96 @@
+/* Copyright (C) 2006 - 2017 Jan Kundrát <jkt@kde.org>
+
+   This file is part of the Trojita Qt IMAP e-mail client,
+   http://trojita.flaska.net/
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License or (at your option) version 3 or any later version
+   accepted by the membership of KDE e.V. (or its successor approved
+   by the membership of KDE e.V.), which shall act as a proxy
+   defined in Section 14 of version 3 of the license.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TEST_SYNTHETIC_MAILBOX
+#define TEST_SYNTHETIC_MAILBOX
+
+#include <random>
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+/** @short Shape of a generated mailbox */
+struct SyntheticMailboxProfile
+{
+    /** @short Number of messages, their UIDs are 1..messages */
+    uint messages;
+    /** @short Fraction of messages which reply to an earlier one */
+    double replyRatio;
+    /** @short Fraction of replies which continue the newest message in the thread rather than a random one */
+    double chainRatio;
+    /** @short Replies are never nested deeper than this */
+    uint maxDepth;
+    /** @short Fraction of replies whose References got lost, which makes them start a thread of their own */
+    double damagedRatio;
+    /** @short Fraction of replies with an unusual subject prefix, like "AW:" or "[list] Re:" */
+    double subjectVariationRatio;
+    /** @short How many threads receive replies at the same time */
+    uint activeThreads;
+    quint32 seed;
+
+    SyntheticMailboxProfile();
+};
+
+/** @short Generator of a reproducible mailbox which looks like a real one
+
+The same profile always produces the same mailbox, no matter the platform, so that the benchmarks using it can be
+compared over time. Replies always come after their parents, which means that the first N messages form a valid
+mailbox on their own; that's what all the "limit" arguments are for.
+*/
+class SyntheticMailbox
+{
+public:
+    explicit SyntheticMailbox(const SyntheticMailboxProfile &profile);
+
+    uint size() const;
+    uint parent(const uint uid) const;
+    uint depth(const uint uid) const;
+    QString subject(const uint uid) const;
+
+    /** @short Number of threads among the first @arg limit messages */
+    uint threadCount(const uint limit) const;
+    /** @short The deepest nesting among the first @arg limit messages */
+    uint maxThreadDepth(const uint limit) const;
+
+    /** @short An untagged THREAD response as the REFS algorithm would produce it */
+    QByteArray threadResponse(const uint limit) const;
+    /** @short An untagged SORT response for the SUBJECT criterion */
+    QByteArray sortBySubjectResponse(const uint limit) const;
+
+private:
+    quint32 nextRandom();
+    double randomUnit();
+    uint randomBelow(const uint bound);
+    void writeThread(QByteArray &out, const uint uid, const uint limit) const;
+
+    std::mt19937 m_random;
+    /** @short Parent UID for each message, zero for thread roots; indexed by UID - 1 */
+    QVector<uint> m_parents;
+    QVector<uint> m_depths;
+    QVector<uint> m_topics;
+    /** @short Zero for thread starters, otherwise one plus the index of the reply prefix */
+    QVector<quint8> m_subjectVariants;
+    /** @short Children of each message in the order of their arrival, as a linked list indexed by UID - 1 */
+    QVector<uint> m_firstChild, m_lastChild, m_nextSibling;
+};
+
+#endif